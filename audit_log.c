@@ -0,0 +1,928 @@
+/**
+ * audit_log.c - Append-only signature audit log with group commit
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "audit_log.h"
+
+#define AUDIT_ALIGN(x)                  (((x) + 7) & ~(size_t)7)
+#define AUDIT_RECORD_MAX                AUDIT_ALIGN(sizeof(struct audit_record_hdr) + \
+                                                    AUDIT_DIGEST_MAX + AUDIT_SIG_MAX)
+#define AUDIT_CRC_OFFSET                (offsetof(struct audit_record_hdr, crc) + \
+                                         sizeof(uint32_t))
+
+static inline uint64_t audit_digest_key(const uint8_t *digest, uint16_t len)
+{
+        uint64_t key = 0;
+
+        memcpy(&key, digest, len < sizeof(key) ? len : sizeof(key));
+
+        return key;
+}
+
+static inline uint64_t audit_index_slot(uint64_t key, uint64_t capacity)
+{
+        key *= 0x9e3779b97f4a7c15UL;
+
+        return (key ^ (key >> 32)) & (capacity - 1);
+}
+
+static inline struct audit_index_entry *audit_index_entries(struct audit_index_hdr *idx)
+{
+        return (struct audit_index_entry *)(idx + 1);
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+        const uint8_t *p = buf;
+        ssize_t n;
+
+        while (len) {
+                n = pwrite(fd, p, len, off);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                p += n;
+                len -= (size_t)n;
+                off += n;
+        }
+
+        return 0;
+}
+
+/**
+ * audit_index_map() - (re)map index file with given capacity, empty
+ *
+ * @param log: pointer to log
+ * @param capacity: entries, power of 2
+ * @return 0 on success
+ */
+static int audit_index_map(struct audit_log *log, uint64_t capacity)
+{
+        size_t size = sizeof(struct audit_index_hdr) +
+                      capacity * sizeof(struct audit_index_entry);
+        void *p;
+
+        if (log->idx) {
+                munmap(log->idx, log->idx_size);
+                log->idx = NULL;
+        }
+
+        /* drop old content, new pages read as zero */
+        if (ftruncate(log->idx_fd, 0) || ftruncate(log->idx_fd, (off_t)size))
+                return -errno;
+
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, log->idx_fd, 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        log->idx = p;
+        log->idx_size = size;
+        log->idx->magic = AUDIT_INDEX_MAGIC;
+        log->idx->capacity = capacity;
+
+        return 0;
+}
+
+static void audit_index_put(struct audit_index_hdr *idx, uint64_t key, uint64_t off1)
+{
+        struct audit_index_entry *e = audit_index_entries(idx);
+        uint64_t i = audit_index_slot(key, idx->capacity);
+
+        while (e[i].off1)
+                i = (i + 1) & (idx->capacity - 1);
+
+        e[i].key = key;
+        e[i].off1 = off1;
+        idx->count++;
+}
+
+/**
+ * audit_index_insert() - add record offset to index, grows at half load
+ *
+ * Caller holds idx_lock
+ */
+static int audit_index_insert(struct audit_log *log, uint64_t key, uint64_t off)
+{
+        struct audit_index_entry *old;
+        uint64_t capacity = log->idx->capacity;
+        uint64_t log_size = log->idx->log_size;
+        int ret;
+
+        if ((log->idx->count + 1) * 2 > capacity) {
+                old = malloc(capacity * sizeof(*old));
+                if (!old)
+                        return -ENOMEM;
+
+                memcpy(old, audit_index_entries(log->idx), capacity * sizeof(*old));
+
+                ret = audit_index_map(log, capacity * 2);
+                if (ret) {
+                        free(old);
+                        return ret;
+                }
+
+                for (uint64_t i = 0; i < capacity; ++i)
+                        if (old[i].off1)
+                                audit_index_put(log->idx, old[i].key, old[i].off1);
+
+                log->idx->log_size = log_size;
+                free(old);
+        }
+
+        audit_index_put(log->idx, key, off + 1);
+
+        return 0;
+}
+
+/**
+ * audit_record_read() - read and validate record at @off
+ *
+ * @return record length, 0 on torn or corrupted record, -errno on failure
+ */
+static ssize_t audit_record_read(int fd, uint64_t off, uint8_t *buf)
+{
+        struct audit_record_hdr *hdr = (struct audit_record_hdr *)buf;
+        ssize_t n;
+
+        n = pread(fd, buf, sizeof(*hdr), (off_t)off);
+        if (n < 0)
+                return -errno;
+
+        if ((size_t)n < sizeof(*hdr) || hdr->magic != AUDIT_RECORD_MAGIC ||
+            hdr->digest_len > AUDIT_DIGEST_MAX || hdr->sig_len > AUDIT_SIG_MAX ||
+            hdr->len != AUDIT_ALIGN(sizeof(*hdr) + hdr->digest_len + hdr->sig_len))
+                return 0;
+
+        n = pread(fd, buf + sizeof(*hdr), hdr->len - sizeof(*hdr),
+                  (off_t)(off + sizeof(*hdr)));
+        if (n < 0)
+                return -errno;
+
+        if ((size_t)n != hdr->len - sizeof(*hdr))
+                return 0;
+
+        if (hdr->crc != crc32_update(0, buf + AUDIT_CRC_OFFSET,
+                                     hdr->len - AUDIT_CRC_OFFSET))
+                return 0;
+
+        return hdr->len;
+}
+
+/**
+ * audit_index_find() - whether the index holds record at @off
+ *
+ * @param idx: pointer to index
+ * @param key: digest key of record
+ * @param off: record offset
+ * @return 1 if found
+ */
+static int audit_index_find(struct audit_index_hdr *idx, uint64_t key, uint64_t off)
+{
+        struct audit_index_entry *e = audit_index_entries(idx);
+        uint64_t i = audit_index_slot(key, idx->capacity);
+
+        for (; e[i].off1; i = (i + 1) & (idx->capacity - 1))
+                if (e[i].key == key && e[i].off1 == off + 1)
+                        return 1;
+
+        return 0;
+}
+
+/**
+ * audit_commit_read() - read and validate commit record at @off
+ *
+ * @return 1 if valid, 0 if not, -errno on failure
+ */
+static int audit_commit_read(int fd, uint64_t off, struct audit_commit *c)
+{
+        ssize_t n;
+
+        n = pread(fd, c, sizeof(*c), (off_t)off);
+        if (n < 0)
+                return -errno;
+
+        if ((size_t)n < sizeof(*c) || c->magic != AUDIT_COMMIT_MAGIC ||
+            c->len != sizeof(*c) || !c->batch_len ||
+            c->crc != crc32_update(0, (uint8_t *)c + AUDIT_CRC_OFFSET,
+                                   sizeof(*c) - AUDIT_CRC_OFFSET))
+                return 0;
+
+        return 1;
+}
+
+/**
+ * audit_log_committed_after() - whether a committed batch follows @off
+ *
+ * Only the batch in flight at a crash, the last one, can lack its
+ * commit record. A valid commit record further on means records that
+ * were acknowledged are damaged.
+ *
+ * @param log: pointer to log
+ * @param off: end of last intact batch
+ * @param size: log file size
+ * @param buf: AUDIT_RECORD_MAX octets
+ * @return 1 if found, 0 if not, -errno on failure
+ */
+static int audit_log_committed_after(struct audit_log *log, uint64_t off,
+                                     uint64_t size, uint8_t *buf)
+{
+        struct audit_commit c;
+        uint64_t pos, chunk;
+        uint32_t crc;
+        ssize_t n;
+        int ret;
+
+        /* records and commit records are 8 octets aligned */
+        for (uint64_t m = off; m + sizeof(c) <= size; m += 8) {
+                ret = audit_commit_read(log->fd, m, &c);
+                if (ret <= 0) {
+                        if (ret < 0)
+                                return ret;
+                        continue;
+                }
+
+                if (c.batch_len > m - off)
+                        continue;
+
+                crc = 0;
+                for (pos = m - c.batch_len; pos < m; pos += chunk) {
+                        chunk = m - pos < AUDIT_RECORD_MAX ? m - pos : AUDIT_RECORD_MAX;
+
+                        n = pread(log->fd, buf, chunk, (off_t)pos);
+                        if (n < 0)
+                                return -errno;
+
+                        if ((uint64_t)n != chunk)
+                                break;
+
+                        crc = crc32_update(crc, buf, chunk);
+                }
+
+                if (pos == m && crc == c.batch_crc)
+                        return 1;
+        }
+
+        return 0;
+}
+
+/**
+ * audit_log_scan() - walk the log, drop torn batch, check or rebuild index
+ *
+ * Records count only once the commit record of their batch checks out.
+ * An index reused by its log_size is checked to hold every committed
+ * record, its header may have been written back without its entries.
+ * It is rebuilt if not.
+ *
+ * @param log: pointer to log
+ * @param reindex: insert every record into the (empty) index
+ * @param size: log file size
+ * @return 0 on success, -EBADMSG if committed records are damaged
+ */
+static int audit_log_scan(struct audit_log *log, int reindex, uint64_t size)
+{
+        struct audit_index_entry *batch = NULL;         /* since last commit */
+        struct audit_index_entry *p;
+        struct audit_record_hdr *hdr;
+        struct audit_commit c;
+        uint8_t *buf;
+        uint64_t off, start, records;
+        size_t n, cap = 0;
+        uint32_t crc;
+        ssize_t len;
+        int ret = 0;
+
+        buf = malloc(AUDIT_RECORD_MAX);
+        if (!buf)
+                return -ENOMEM;
+
+        hdr = (struct audit_record_hdr *)buf;
+
+rescan:
+        off = start = 0;
+        records = 0;
+        crc = 0;
+        n = 0;
+
+        while (off < size) {
+                len = audit_record_read(log->fd, off, buf);
+                if (len < 0) {
+                        ret = (int)len;
+                        goto free_buf;
+                }
+
+                if (len > 0) {
+                        if (n == cap) {
+                                cap = cap ? cap * 2 : 64;
+                                p = realloc(batch, cap * sizeof(*batch));
+                                if (!p) {
+                                        ret = -ENOMEM;
+                                        goto free_buf;
+                                }
+                                batch = p;
+                        }
+
+                        batch[n].key = audit_digest_key(buf + sizeof(*hdr),
+                                                        hdr->digest_len);
+                        batch[n].off1 = off + 1;
+                        n++;
+
+                        crc = crc32_update(crc, buf, (size_t)len);
+                        off += (uint64_t)len;
+                        continue;
+                }
+
+                ret = audit_commit_read(log->fd, off, &c);
+                if (ret < 0)
+                        goto free_buf;
+
+                if (!ret || !n || c.batch_len != off - start || c.batch_crc != crc)
+                        break;
+
+                for (size_t i = 0; i < n; ++i) {
+                        if (reindex) {
+                                ret = audit_index_insert(log, batch[i].key,
+                                                         batch[i].off1 - 1);
+                                if (ret)
+                                        goto free_buf;
+                        } else if (!audit_index_find(log->idx, batch[i].key,
+                                                     batch[i].off1 - 1)) {
+                                goto reindex;
+                        }
+                }
+
+                log->next_seq = c.seq;
+                records += n;
+                off += sizeof(c);
+                start = off;
+                crc = 0;
+                n = 0;
+        }
+
+        ret = 0;
+
+        if (!reindex && records != log->idx->count)
+                goto reindex;
+
+        if (start != size) {
+                ret = audit_log_committed_after(log, start, size, buf);
+                if (ret) {
+                        ret = ret < 0 ? ret : -EBADMSG;
+                        goto free_buf;
+                }
+
+                /* a crash during write leaves a partial batch behind */
+                if (ftruncate(log->fd, (off_t)start)) {
+                        ret = -errno;
+                        goto free_buf;
+                }
+        }
+
+        log->end = start;
+        log->durable_seq = log->next_seq;
+
+free_buf:
+        free(batch);
+        free(buf);
+
+        return ret;
+
+reindex:
+        ret = audit_index_map(log, AUDIT_INDEX_CAPACITY_MIN);
+        if (ret)
+                goto free_buf;
+
+        reindex = 1;
+        goto rescan;
+}
+
+/**
+ * audit_log_commit_index() - index records of a committed batch
+ */
+static void audit_log_commit_index(struct audit_log *log, const uint8_t *buf,
+                                   size_t len, uint64_t base)
+{
+        const struct audit_record_hdr *hdr;
+
+        pthread_mutex_lock(&log->idx_lock);
+
+        for (size_t pos = 0; pos < len; pos += hdr->len) {
+                hdr = (const struct audit_record_hdr *)(buf + pos);
+
+                /* index is a cache, on failure it is rebuilt at next open */
+                if (audit_index_insert(log, audit_digest_key((const uint8_t *)(hdr + 1),
+                                                             hdr->digest_len),
+                                       base + pos)) {
+                        log->idx->log_size = 0;
+                        pthread_mutex_unlock(&log->idx_lock);
+                        return;
+                }
+        }
+
+        log->idx->log_size = base + len + sizeof(struct audit_commit);
+
+        pthread_mutex_unlock(&log->idx_lock);
+}
+
+static void timespec_from_ns(struct timespec *ts, uint64_t ns)
+{
+        ts->tv_sec = (time_t)(ns / 1000000000UL);
+        ts->tv_nsec = (long)(ns % 1000000000UL);
+}
+
+/**
+ * audit_log_committer() - group commit thread
+ *
+ * Waits up to budget_us after the first pending record (or until
+ * batch_bytes is pending), writes the whole batch and its commit
+ * record, then fdatasync() once and releases every appender covered
+ * by it. Records appended during the sync go to the other buffer and
+ * form the next group. After a failed commit nothing is written any
+ * more, a later batch must not follow a torn one.
+ */
+static void *audit_log_committer(void *data)
+{
+        struct audit_log *log = data;
+        struct audit_commit *c;
+        struct timespec ts;
+        uint64_t deadline;
+        uint64_t last_seq;
+        uint64_t base;
+        uint8_t *buf;
+        size_t len, cap;
+        int ret;
+
+        pthread_mutex_lock(&log->lock);
+
+        while (1) {
+                while (!log->pending_len && !log->stop)
+                        pthread_cond_wait(&log->pending_cv, &log->lock);
+
+                if (!log->pending_len && log->stop)
+                        break;
+
+                /* appenders of these records already got log->err */
+                if (log->err) {
+                        log->pending_len = 0;
+                        continue;
+                }
+
+                deadline = log->pending_since + log->opts.budget_us * 1000UL;
+                timespec_from_ns(&ts, deadline);
+
+                while (log->pending_len < log->opts.batch_bytes && !log->stop &&
+                       clock_ns() < deadline) {
+                        if (pthread_cond_timedwait(&log->pending_cv,
+                                                   &log->lock, &ts) == ETIMEDOUT)
+                                break;
+                }
+
+                /* swap buffers, appenders keep going while we sync */
+                buf = log->pending;
+                len = log->pending_len;
+                cap = log->pending_cap;
+
+                log->pending = log->spare;
+                log->pending_cap = log->spare_cap;
+                log->pending_len = 0;
+                log->spare = buf;
+                log->spare_cap = cap;
+
+                last_seq = log->next_seq;
+                base = log->end;
+
+                pthread_mutex_unlock(&log->lock);
+
+                /* appenders leave room for it */
+                c = (struct audit_commit *)(buf + len);
+                memset(c, 0x00, sizeof(*c));
+                c->magic = AUDIT_COMMIT_MAGIC;
+                c->len = sizeof(*c);
+                c->batch_crc = crc32_update(0, buf, len);
+                c->batch_len = len;
+                c->seq = last_seq;
+                c->crc = crc32_update(0, (uint8_t *)c + AUDIT_CRC_OFFSET,
+                                      sizeof(*c) - AUDIT_CRC_OFFSET);
+
+                ret = pwrite_all(log->fd, buf, len + sizeof(*c), (off_t)base);
+                if (!ret && fdatasync(log->fd))
+                        ret = -errno;
+
+                if (!ret)
+                        audit_log_commit_index(log, buf, len, base);
+
+                pthread_mutex_lock(&log->lock);
+
+                if (ret) {
+                        log->err = ret;
+                } else {
+                        log->durable_seq = last_seq;
+                        log->end = base + len + sizeof(*c);
+                }
+
+                log->commits++;
+                pthread_cond_broadcast(&log->durable_cv);
+        }
+
+        pthread_mutex_unlock(&log->lock);
+
+        return NULL;
+}
+
+/**
+ * audit_index_reuse() - map existing index if it covers @log_size
+ *
+ * @return 0 if mapped, otherwise index has to be rebuilt
+ */
+static int audit_index_reuse(struct audit_log *log, uint64_t log_size)
+{
+        struct audit_index_hdr hdr;
+        void *p;
+
+        if (pread(log->idx_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+                return -ENODATA;
+
+        if (hdr.magic != AUDIT_INDEX_MAGIC || hdr.log_size != log_size ||
+            hdr.capacity < AUDIT_INDEX_CAPACITY_MIN ||
+            (hdr.capacity & (hdr.capacity - 1)))
+                return -ESTALE;
+
+        log->idx_size = sizeof(hdr) + hdr.capacity * sizeof(struct audit_index_entry);
+
+        p = mmap(NULL, log->idx_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 log->idx_fd, 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        log->idx = p;
+
+        return 0;
+}
+
+/**
+ * audit_log_open() - open or create log and its index, start committer
+ *
+ * @param log: pointer to log struct
+ * @param path: log file path, index goes to <path>.idx
+ * @param opts: commit options, NULL for defaults
+ * @return 0 on success, -EBADMSG if committed records are damaged
+ */
+int audit_log_open(struct audit_log *log, const char *path,
+                   const struct audit_log_opts *opts)
+{
+        pthread_condattr_t cattr;
+        struct stat st;
+        char *idx_path;
+        int reindex;
+        int ret;
+
+        if (!log || !path)
+                return -EINVAL;
+
+        memset(log, 0x00, sizeof(struct audit_log));
+        log->fd = -1;
+        log->idx_fd = -1;
+
+        log->opts.budget_us = opts ? opts->budget_us : AUDIT_BUDGET_US_DEFAULT;
+        log->opts.batch_bytes = opts && opts->batch_bytes ?
+                                opts->batch_bytes : AUDIT_BATCH_BYTES_DEFAULT;
+
+        if (asprintf(&idx_path, "%s.idx", path) < 0)
+                return -ENOMEM;
+
+        log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        log->idx_fd = open(idx_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        free(idx_path);
+
+        if (log->fd < 0 || log->idx_fd < 0) {
+                ret = -errno;
+                goto close_fd;
+        }
+
+        if (fstat(log->fd, &st)) {
+                ret = -errno;
+                goto close_fd;
+        }
+
+        pthread_mutex_init(&log->idx_lock, NULL);
+
+        /* reuse the index only if it covers exactly this log */
+        reindex = audit_index_reuse(log, (uint64_t)st.st_size) ? 1 : 0;
+
+        if (reindex) {
+                ret = audit_index_map(log, AUDIT_INDEX_CAPACITY_MIN);
+                if (ret)
+                        goto unmap_idx;
+        }
+
+        ret = audit_log_scan(log, reindex, (uint64_t)st.st_size);
+        if (ret)
+                goto unmap_idx;
+
+        log->idx->log_size = log->end;
+
+        log->pending_cap = log->spare_cap = log->opts.batch_bytes + AUDIT_RECORD_MAX +
+                                            sizeof(struct audit_commit);
+        log->pending = malloc(log->pending_cap);
+        log->spare = malloc(log->spare_cap);
+        if (!log->pending || !log->spare) {
+                ret = -ENOMEM;
+                goto free_buf;
+        }
+
+        pthread_mutex_init(&log->lock, NULL);
+        pthread_cond_init(&log->durable_cv, NULL);
+
+        /* deadlines come from clock_ns(), CLOCK_MONOTONIC */
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+        pthread_cond_init(&log->pending_cv, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        ret = -pthread_create(&log->committer, NULL, audit_log_committer, log);
+        if (ret)
+                goto destroy_sync;
+
+        return 0;
+
+destroy_sync:
+        pthread_cond_destroy(&log->pending_cv);
+        pthread_cond_destroy(&log->durable_cv);
+        pthread_mutex_destroy(&log->lock);
+free_buf:
+        free(log->pending);
+        free(log->spare);
+unmap_idx:
+        if (log->idx)
+                munmap(log->idx, log->idx_size);
+        pthread_mutex_destroy(&log->idx_lock);
+close_fd:
+        if (log->fd >= 0)
+                close(log->fd);
+        if (log->idx_fd >= 0)
+                close(log->idx_fd);
+
+        return ret;
+}
+
+/**
+ * audit_log_close() - flush pending records, stop committer, close files
+ *
+ * @param log: pointer to log
+ * @return 0 on success, first commit error otherwise
+ */
+int audit_log_close(struct audit_log *log)
+{
+        int ret;
+
+        if (!log)
+                return -EINVAL;
+
+        pthread_mutex_lock(&log->lock);
+        log->stop = 1;
+        pthread_cond_signal(&log->pending_cv);
+        pthread_mutex_unlock(&log->lock);
+
+        pthread_join(log->committer, NULL);
+
+        ret = log->err;
+
+        munmap(log->idx, log->idx_size);
+        close(log->idx_fd);
+        close(log->fd);
+
+        free(log->pending);
+        free(log->spare);
+
+        pthread_cond_destroy(&log->pending_cv);
+        pthread_cond_destroy(&log->durable_cv);
+        pthread_mutex_destroy(&log->lock);
+        pthread_mutex_destroy(&log->idx_lock);
+
+        return ret;
+}
+
+/**
+ * audit_log_append() - append a record, return once it is durable
+ *
+ * @param log: pointer to log
+ * @param key_id: id of signing key
+ * @param digest: message digest
+ * @param digest_len: digest length in octets
+ * @param sig: signature octets
+ * @param sig_len: signature length in octets
+ * @param seq: returns record sequence, may be NULL
+ * @return 0 on success
+ */
+int audit_log_append(struct audit_log *log, uint32_t key_id,
+                     const void *digest, uint16_t digest_len,
+                     const void *sig, uint16_t sig_len, uint64_t *seq)
+{
+        struct audit_record_hdr *hdr;
+        struct timespec now;
+        size_t len;
+        uint64_t my_seq;
+        uint8_t *p;
+        int ret;
+
+        if (!log || !digest || !sig)
+                return -EINVAL;
+
+        if (digest_len > AUDIT_DIGEST_MAX || sig_len > AUDIT_SIG_MAX)
+                return -E2BIG;
+
+        len = AUDIT_ALIGN(sizeof(*hdr) + digest_len + sig_len);
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        pthread_mutex_lock(&log->lock);
+
+        if (log->err || log->stop) {
+                ret = log->err ? log->err : -EPIPE;
+                pthread_mutex_unlock(&log->lock);
+                return ret;
+        }
+
+        /*
+         * committer swaps at batch_bytes, buffer can still fill up
+         * meanwhile; keep room for the commit record
+         */
+        while (log->pending_len + len + sizeof(struct audit_commit) > log->pending_cap) {
+                p = realloc(log->pending, log->pending_cap * 2);
+                if (!p) {
+                        pthread_mutex_unlock(&log->lock);
+                        return -ENOMEM;
+                }
+
+                log->pending = p;
+                log->pending_cap *= 2;
+        }
+
+        p = log->pending + log->pending_len;
+        hdr = (struct audit_record_hdr *)p;
+
+        memset(p, 0x00, len);
+        hdr->magic = AUDIT_RECORD_MAGIC;
+        hdr->len = (uint32_t)len;
+        hdr->key_id = key_id;
+        hdr->seq = my_seq = ++log->next_seq;
+        hdr->timestamp = (uint64_t)now.tv_sec * 1000000000UL + (uint64_t)now.tv_nsec;
+        hdr->digest_len = digest_len;
+        hdr->sig_len = sig_len;
+        memcpy(p + sizeof(*hdr), digest, digest_len);
+        memcpy(p + sizeof(*hdr) + digest_len, sig, sig_len);
+        hdr->crc = crc32_update(0, p + AUDIT_CRC_OFFSET, len - AUDIT_CRC_OFFSET);
+
+        if (!log->pending_len)
+                log->pending_since = clock_ns();
+
+        log->pending_len += len;
+        log->records++;
+
+        if (log->pending_len == len || log->pending_len >= log->opts.batch_bytes)
+                pthread_cond_signal(&log->pending_cv);
+
+        while (log->durable_seq < my_seq && !log->err)
+                pthread_cond_wait(&log->durable_cv, &log->lock);
+
+        ret = log->durable_seq >= my_seq ? 0 : log->err;
+
+        pthread_mutex_unlock(&log->lock);
+
+        if (seq)
+                *seq = my_seq;
+
+        return ret;
+}
+
+/**
+ * audit_log_lookup() - find durable record of a digest
+ *
+ * @param log: pointer to log
+ * @param digest: message digest
+ * @param digest_len: digest length in octets
+ * @param rec: record to write
+ * @return 0 on success, -ENOENT if not logged
+ */
+int audit_log_lookup(struct audit_log *log, const void *digest,
+                     uint16_t digest_len, struct audit_record *rec)
+{
+        struct audit_index_entry *e;
+        uint64_t key, i, cap;
+        uint8_t *buf;
+        ssize_t len;
+        int ret = -ENOENT;
+
+        if (!log || !digest || !rec || digest_len > AUDIT_DIGEST_MAX)
+                return -EINVAL;
+
+        buf = malloc(AUDIT_RECORD_MAX);
+        if (!buf)
+                return -ENOMEM;
+
+        key = audit_digest_key(digest, digest_len);
+
+        pthread_mutex_lock(&log->idx_lock);
+
+        e = audit_index_entries(log->idx);
+        cap = log->idx->capacity;
+
+        for (i = audit_index_slot(key, cap); e[i].off1; i = (i + 1) & (cap - 1)) {
+                const struct audit_record_hdr *hdr = (void *)buf;
+
+                if (e[i].key != key)
+                        continue;
+
+                /* same prefix, compare whole digest */
+                len = audit_record_read(log->fd, e[i].off1 - 1, buf);
+                if (len <= 0)
+                        continue;
+
+                if (hdr->digest_len != digest_len ||
+                    memcmp(buf + sizeof(*hdr), digest, digest_len))
+                        continue;
+
+                memcpy(&rec->hdr, hdr, sizeof(*hdr));
+                rec->offset = e[i].off1 - 1;
+                memcpy(rec->digest, buf + sizeof(*hdr), hdr->digest_len);
+                memcpy(rec->sig, buf + sizeof(*hdr) + hdr->digest_len, hdr->sig_len);
+                ret = 0;
+                break;
+        }
+
+        pthread_mutex_unlock(&log->idx_lock);
+
+        free(buf);
+
+        return ret;
+}
+
+/**
+ * audit_log_sign() - sign digest, return once the signature is logged
+ *
+ * @param log: pointer to log
+ * @param key: signing key
+ * @param key_id: id of signing key recorded in log
+ * @param digest: message digest
+ * @param digest_len: digest length in octets
+ * @param s: signature to write
+ * @return 0 on success, signature must not be released otherwise
+ */
+int audit_log_sign(struct audit_log *log, struct rsa_private *key,
+                   uint32_t key_id, const void *digest, uint16_t digest_len,
+                   mpz_t s)
+{
+        uint8_t sig[AUDIT_SIG_MAX];
+        size_t k, count;
+        int ret;
+
+        if (!log || !key)
+                return -EINVAL;
+
+        k = (key->key_len + 7) / 8;
+        if (k > sizeof(sig))
+                return -E2BIG;
+
+        ret = rsa_private_key_sign(key, s, digest, digest_len);
+        if (ret)
+                return ret;
+
+        count = (mpz_sizeinbase(s, 2) + 7) / 8;
+        if (count > k)
+                return -ERANGE;
+
+        memset(sig, 0x00, k - count);
+        mpz_export(&sig[k - count], NULL, 1, 1, 1, 0, s);
+
+        return audit_log_append(log, key_id, digest, digest_len,
+                                sig, (uint16_t)k, NULL);
+}
@@ -0,0 +1,145 @@
+/**
+ * audit_log.h - Append-only signature audit log with group commit
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_AUDIT_LOG_H
+#define SIMPLERSADIGEST_AUDIT_LOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rsa.h"
+
+/**
+ * Structure of log record, host byte order, 8 octets aligned
+ *
+ *    hdr || digest || signature || pad
+ *
+ * Appenders return once the record is covered by fdatasync(). One
+ * committer thread syncs everything appended within the latency
+ * budget with a single fdatasync() (group commit).
+ *
+ * Every batch is followed by a commit record holding its length and
+ * crc32, written with the batch. A batch without a matching commit
+ * record was never acknowledged: recovery truncates the log there,
+ * however much of the batch made it to disk.
+ *
+ * <path>.idx is an mmap'd open addressing table from digest to record
+ * offset. It is a cache: rebuilt from the log whenever it is stale.
+ */
+struct audit_record_hdr {
+        uint32_t        magic;
+        uint32_t        crc;            /* crc32 of all octets after this */
+        uint32_t        len;            /* whole record length */
+        uint32_t        key_id;
+        uint64_t        seq;
+        uint64_t        timestamp;      /* CLOCK_REALTIME in ns */
+        uint16_t        digest_len;
+        uint16_t        sig_len;
+        uint32_t        reserved;
+};
+
+struct audit_commit {
+        uint32_t        magic;
+        uint32_t        crc;            /* crc32 of all octets after this */
+        uint32_t        len;            /* sizeof(struct audit_commit) */
+        uint32_t        batch_crc;      /* crc32 of the batch records */
+        uint64_t        batch_len;      /* octets of records before this */
+        uint64_t        seq;            /* last sequence of the batch */
+};
+
+#define AUDIT_RECORD_MAGIC              (0x4c415352U)   /* "RSAL" */
+#define AUDIT_COMMIT_MAGIC              (0x43415352U)   /* "RSAC" */
+#define AUDIT_INDEX_MAGIC               (0x49415352U)   /* "RSAI" */
+
+#define AUDIT_DIGEST_MAX                (64)
+#define AUDIT_SIG_MAX                   (1024)
+
+#define AUDIT_BUDGET_US_DEFAULT         (200)
+#define AUDIT_BATCH_BYTES_DEFAULT       (1 << 20)
+#define AUDIT_INDEX_CAPACITY_MIN        (1 << 12)
+
+struct audit_record {
+        struct audit_record_hdr hdr;
+        uint64_t                offset;         /* in log file */
+        uint8_t                 digest[AUDIT_DIGEST_MAX];
+        uint8_t                 sig[AUDIT_SIG_MAX];
+};
+
+struct audit_log_opts {
+        uint32_t        budget_us;      /* max wait to gather a batch */
+        uint32_t        batch_bytes;    /* commit early once this much is pending */
+};
+
+struct audit_index_hdr {
+        uint32_t        magic;
+        uint32_t        reserved;
+        uint64_t        capacity;       /* entries, power of 2 */
+        uint64_t        count;
+        uint64_t        log_size;       /* log size the index covers */
+};
+
+struct audit_index_entry {
+        uint64_t        key;            /* first 8 digest octets */
+        uint64_t        off1;           /* record offset + 1, 0 if empty */
+};
+
+struct audit_log {
+        int                     fd;
+        int                     idx_fd;
+        struct audit_index_hdr  *idx;
+        size_t                  idx_size;
+        pthread_mutex_t         idx_lock;
+
+        pthread_mutex_t         lock;
+        pthread_cond_t          pending_cv;     /* committer waits */
+        pthread_cond_t          durable_cv;     /* appenders wait */
+        pthread_t               committer;
+
+        uint8_t                 *pending;       /* records not written yet */
+        size_t                  pending_len;
+        size_t                  pending_cap;
+        uint8_t                 *spare;         /* buffer being committed */
+        size_t                  spare_cap;
+        uint64_t                pending_since;  /* clock_ns() of first record */
+
+        uint64_t                next_seq;       /* last assigned sequence */
+        uint64_t                durable_seq;    /* last durable sequence */
+        uint64_t                end;            /* log size, next batch goes here */
+
+        uint64_t                commits;        /* fdatasync() calls */
+        uint64_t                records;
+        int                     err;
+        int                     stop;
+
+        struct audit_log_opts   opts;
+};
+
+int audit_log_open(struct audit_log *log, const char *path,
+                   const struct audit_log_opts *opts);
+int audit_log_close(struct audit_log *log);
+
+int audit_log_append(struct audit_log *log, uint32_t key_id,
+                     const void *digest, uint16_t digest_len,
+                     const void *sig, uint16_t sig_len, uint64_t *seq);
+int audit_log_lookup(struct audit_log *log, const void *digest,
+                     uint16_t digest_len, struct audit_record *rec);
+
+int audit_log_sign(struct audit_log *log, struct rsa_private *key,
+                   uint32_t key_id, const void *digest, uint16_t digest_len,
+                   mpz_t s);
+
+#endif //SIMPLERSADIGEST_AUDIT_LOG_H
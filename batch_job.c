@@ -0,0 +1,1102 @@
+/**
+ * batch_job.c - Journaled, resumable hash and sign runs over file lists
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "batch_job.h"
+#include "sha512.h"
+#include "metrics.h"
+#include "cas.h"
+
+#define BATCH_READ_BUF_SIZE             (64 * 1024)
+#define BATCH_JOURNAL_BUF_RECS          (256)   /* records per write() */
+#define BATCH_CRC_OFFSET                (offsetof(struct batch_journal_rec, idx))
+
+enum {
+        BATCH_ITEM_FREE = 0,
+        BATCH_ITEM_RUNNING,
+        BATCH_ITEM_DONE,
+};
+
+struct batch_job;
+
+struct batch_item {
+        struct thread_pool_work work;
+        struct batch_job        *job;
+        struct batch_item       *next_done;
+        char                    *path;
+        size_t                  path_cap;
+        uint64_t                idx;
+        uint64_t                dev;
+        uint64_t                ino;
+        uint64_t                size;
+        uint64_t                mtime_ns;
+        uint32_t                path_crc;
+        int                     state;
+        int                     ret;
+        int                     retry;          /* failed in an earlier run */
+        uint8_t                 digest[BATCH_JOB_DIGEST_LEN];
+};
+
+struct batch_job {
+        const struct batch_job_opts     *opts;
+        struct batch_job_stats          *stats;
+        struct thread_pool              *pool;
+        struct rsa_public               pub;
+        uint32_t                        sig_len;
+        uint32_t                        window;
+
+        FILE                            *list;
+        FILE                            *out;
+        int                             sig_fd;
+        int                             jnl_fd;
+
+        struct batch_item               *ring;          /* window slots, idx % window */
+
+        pthread_mutex_t                 lock;
+        pthread_cond_t                  cv;
+        struct batch_item               *done;          /* finished by workers */
+        uint32_t                        inflight;       /* queued, not collected */
+
+        /* journaled past last checkpoint, sorted by idx after load */
+        struct batch_journal_rec        *kept;
+        uint64_t                        n_kept;
+        uint64_t                        kept_cap;
+
+        /* failed below last checkpoint, sorted by idx */
+        struct batch_journal_rec        *failed;
+        uint64_t                        n_failed;
+        uint64_t                        failed_cap;
+
+        uint8_t                         *zero;          /* slot of a failed item */
+        struct batch_journal_rec        *jbuf;          /* not written yet */
+        uint32_t                        jlen;
+
+        uint64_t                        next_out;       /* items in manifest */
+        uint64_t                        out_off;        /* manifest octets */
+        uint64_t                        since_ckpt;
+        uint64_t                        ckpt_ns;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+        const uint8_t *p = buf;
+        ssize_t n;
+
+        while (len) {
+                n = write(fd, p, len);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                p += n;
+                len -= (size_t)n;
+        }
+
+        return 0;
+}
+
+static inline uint64_t stat_mtime_ns(const struct stat *st)
+{
+        return (uint64_t)st->st_mtim.tv_sec * 1000000000UL +
+               (uint64_t)st->st_mtim.tv_nsec;
+}
+
+static uint32_t batch_rec_crc(const struct batch_journal_rec *rec)
+{
+        return crc32_update(0, (const uint8_t *)rec + BATCH_CRC_OFFSET,
+                            sizeof(*rec) - BATCH_CRC_OFFSET);
+}
+
+/**
+ * batch_item_hash() - hash item file, identity taken from the same fd
+ *
+ * @return 0 on success
+ */
+static int batch_item_hash(struct batch_item *item, uint8_t *buf)
+{
+        struct sha512_ctx ctx;
+        struct stat st;
+        ssize_t n;
+        int fd, ret = 0;
+
+        fd = open(item->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st)) {
+                ret = -errno;
+                goto close_fd;
+        }
+
+        item->dev = (uint64_t)st.st_dev;
+        item->ino = (uint64_t)st.st_ino;
+        item->size = (uint64_t)st.st_size;
+        item->mtime_ns = stat_mtime_ns(&st);
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        sha512_ctx_init(&ctx);
+
+        while (1) {
+                n = read(fd, buf, BATCH_READ_BUF_SIZE);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        ret = -errno;
+                        goto close_fd;
+                }
+
+                if (!n)
+                        break;
+
+                sha512_ctx_update(&ctx, buf, (size_t)n);
+        }
+
+        sha512_ctx_conclude(&ctx);
+        sha512_ctx_digest(&ctx, item->digest);
+
+close_fd:
+        close(fd);
+
+        return ret;
+}
+
+/* hand finished item back to the submitting thread */
+static void batch_item_done(struct batch_job *job, struct batch_item *item)
+{
+        pthread_mutex_lock(&job->lock);
+        item->next_done = job->done;
+        job->done = item;
+        pthread_cond_signal(&job->cv);
+        pthread_mutex_unlock(&job->lock);
+}
+
+/**
+ * batch_item_run() - hash, sign and store signature of one item
+ *
+ * Runs on a pool worker, hands the item back through job->done
+ */
+static void batch_item_run(struct thread_pool_work *work)
+{
+        struct batch_item *item = (struct batch_item *)work;
+        struct batch_job *job = item->job;
+        uint32_t k = job->sig_len;
+        uint64_t t0 = metrics_start();
+        uint8_t *buf;
+        size_t count;
+        mpz_t s;
+        int ret;
+
+        buf = malloc(BATCH_READ_BUF_SIZE);
+        if (!buf) {
+                ret = -ENOMEM;
+                goto done;
+        }
+
+        ret = batch_item_hash(item, buf);
+        metrics_record(METRIC_HASH, t0, NULL, item->size, ret);
+        if (ret)
+                goto free_buf;
+
+        mpz_init(s);
+
+        ret = rsa_private_key_sign(job->opts->key, s, item->digest,
+                                   BATCH_JOB_DIGEST_LEN);
+        if (!ret) {
+                /* left padded to modulus length, fixed slot per item */
+                count = (mpz_sizeinbase(s, 2) + 7) / 8;
+                if (count > k) {
+                        ret = -ERANGE;
+                } else {
+                        memset(buf, 0x00, k - count);
+                        mpz_export(&buf[k - count], NULL, 1, 1, 1, 0, s);
+
+                        if (pwrite(job->sig_fd, buf, k, (off_t)(item->idx * k)) != (ssize_t)k)
+                                ret = -EIO;
+                }
+        }
+
+        mpz_clear(s);
+free_buf:
+        free(buf);
+done:
+        item->ret = ret;
+        batch_item_done(job, item);
+}
+
+/**
+ * batch_item_queue() - hand item to the pool
+ *
+ * A pool that is shutting down fails the item, it is handed back like
+ * any other so job->inflight drains
+ */
+static void batch_item_queue(struct batch_job *job, struct batch_item *item)
+{
+        int ret;
+
+        item->state = BATCH_ITEM_RUNNING;
+        job->inflight++;
+
+        ret = thread_pool_queue(job->pool, &item->work);
+        if (ret) {
+                item->ret = ret;
+                batch_item_done(job, item);
+        }
+}
+
+static int batch_sig_zero(struct batch_job *job, uint64_t idx)
+{
+        if (pwrite(job->sig_fd, job->zero, job->sig_len,
+                   (off_t)(idx * job->sig_len)) != (ssize_t)job->sig_len)
+                return -EIO;
+
+        return 0;
+}
+
+static int batch_journal_flush(struct batch_job *job)
+{
+        int ret;
+
+        if (!job->jlen)
+                return 0;
+
+        ret = write_all(job->jnl_fd, job->jbuf, job->jlen * sizeof(*job->jbuf));
+        job->jlen = 0;
+
+        return ret;
+}
+
+static int batch_journal_append(struct batch_job *job,
+                                const struct batch_journal_rec *rec)
+{
+        struct batch_journal_rec *r;
+
+        if (job->opts->flags & BATCH_JOB_NO_JOURNAL)
+                return 0;
+
+        r = &job->jbuf[job->jlen++];
+        *r = *rec;
+        r->crc = batch_rec_crc(r);
+
+        if (job->jlen == BATCH_JOURNAL_BUF_RECS)
+                return batch_journal_flush(job);
+
+        return 0;
+}
+
+/**
+ * batch_job_checkpoint() - make everything in manifest durable
+ *
+ * Manifest and signatures first, so a checkpoint record on disk never
+ * points past data that did not make it
+ */
+static int batch_job_checkpoint(struct batch_job *job)
+{
+        struct batch_journal_rec rec = { 0 };
+        int ret;
+
+        job->since_ckpt = 0;
+        job->ckpt_ns = clock_ns();
+
+        if (job->opts->flags & BATCH_JOB_NO_JOURNAL)
+                return fflush(job->out) ? -errno : 0;
+
+        if (fflush(job->out) || fdatasync(fileno(job->out)) || fdatasync(job->sig_fd))
+                return -errno;
+
+        rec.type = BATCH_REC_CKPT;
+        rec.idx = job->next_out;
+        rec.size = job->out_off;
+
+        ret = batch_journal_append(job, &rec);
+        if (!ret)
+                ret = batch_journal_flush(job);
+
+        if (!ret && fdatasync(job->jnl_fd))
+                ret = -errno;
+
+        if (!ret)
+                job->stats->checkpoints++;
+
+        return ret;
+}
+
+static int batch_kept_add(struct batch_job *job, const struct batch_journal_rec *rec)
+{
+        if (job->n_kept == job->kept_cap) {
+                uint64_t cap = job->kept_cap ? job->kept_cap * 2 : 1024;
+                struct batch_journal_rec *k;
+
+                k = realloc(job->kept, cap * sizeof(*k));
+                if (!k)
+                        return -ENOMEM;
+
+                job->kept = k;
+                job->kept_cap = cap;
+        }
+
+        job->kept[job->n_kept++] = *rec;
+
+        return 0;
+}
+
+/* drop records a checkpoint made redundant */
+static void batch_kept_prune(struct batch_job *job)
+{
+        uint64_t n = 0;
+
+        for (uint64_t i = 0; i < job->n_kept; ++i)
+                if (job->kept[i].idx >= job->next_out)
+                        job->kept[n++] = job->kept[i];
+
+        job->n_kept = n;
+}
+
+/* first failed record with idx >= @idx */
+static uint64_t batch_failed_find(const struct batch_job *job, uint64_t idx)
+{
+        uint64_t lo = 0, hi = job->n_failed, mid;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (job->failed[mid].idx < idx)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+static int batch_failed_set(struct batch_job *job, const struct batch_journal_rec *rec)
+{
+        uint64_t i = batch_failed_find(job, rec->idx);
+
+        if (i < job->n_failed && job->failed[i].idx == rec->idx) {
+                job->failed[i] = *rec;
+                return 0;
+        }
+
+        if (job->n_failed == job->failed_cap) {
+                uint64_t cap = job->failed_cap ? job->failed_cap * 2 : 64;
+                struct batch_journal_rec *f;
+
+                f = realloc(job->failed, cap * sizeof(*f));
+                if (!f)
+                        return -ENOMEM;
+
+                job->failed = f;
+                job->failed_cap = cap;
+        }
+
+        memmove(&job->failed[i + 1], &job->failed[i],
+                (job->n_failed - i) * sizeof(*job->failed));
+        job->failed[i] = *rec;
+        job->n_failed++;
+
+        return 0;
+}
+
+/* a later record of the item says it went through */
+static void batch_failed_clear(struct batch_job *job, uint64_t idx)
+{
+        uint64_t i = batch_failed_find(job, idx);
+
+        if (i == job->n_failed || job->failed[i].idx != idx)
+                return;
+
+        memmove(&job->failed[i], &job->failed[i + 1],
+                (job->n_failed - i - 1) * sizeof(*job->failed));
+        job->n_failed--;
+}
+
+static int batch_rec_cmp(const void *a, const void *b)
+{
+        const struct batch_journal_rec *x = a;
+        const struct batch_journal_rec *y = b;
+
+        return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+/**
+ * batch_journal_load() - replay journal, drop torn tail
+ *
+ * @param job: pointer to job
+ * @param hdr: header this run would write
+ * @return 0 on success, -ESTALE if journal is of another key or list
+ */
+static int batch_journal_load(struct batch_job *job, const struct batch_journal_hdr *hdr)
+{
+        struct batch_journal_hdr old;
+        struct batch_journal_rec *recs;
+        struct stat st;
+        uint64_t off = sizeof(old);
+        ssize_t n;
+        int ret = 0;
+
+        if (fstat(job->jnl_fd, &st))
+                return -errno;
+
+        if (st.st_size == 0)
+                return write_all(job->jnl_fd, hdr, sizeof(*hdr));
+
+        if (pread(job->jnl_fd, &old, sizeof(old), 0) != sizeof(old) ||
+            old.magic != BATCH_JOURNAL_MAGIC || old.version != BATCH_JOURNAL_VERSION)
+                return -EPROTO;
+
+        if (old.sig_len != hdr->sig_len || old.key_id != hdr->key_id ||
+            old.list_size != hdr->list_size)
+                return -ESTALE;
+
+        recs = malloc(BATCH_JOURNAL_BUF_RECS * sizeof(*recs));
+        if (!recs)
+                return -ENOMEM;
+
+        while (1) {
+                uint32_t i, cnt;
+
+                n = pread(job->jnl_fd, recs, BATCH_JOURNAL_BUF_RECS * sizeof(*recs),
+                          (off_t)off);
+                if (n < 0) {
+                        ret = -errno;
+                        goto free_recs;
+                }
+
+                cnt = (uint32_t)((size_t)n / sizeof(*recs));
+
+                for (i = 0; i < cnt; ++i) {
+                        struct batch_journal_rec *rec = &recs[i];
+
+                        if (rec->crc != batch_rec_crc(rec))
+                                break;
+
+                        if (rec->type == BATCH_REC_CKPT) {
+                                job->next_out = rec->idx;
+                                job->out_off = rec->size;
+                                batch_kept_prune(job);
+                        } else if (rec->type == BATCH_REC_ITEM) {
+                                batch_failed_clear(job, rec->idx);
+                                if (rec->idx < job->next_out)
+                                        continue;
+
+                                ret = batch_kept_add(job, rec);
+                                if (ret)
+                                        goto free_recs;
+                        } else if (rec->type == BATCH_REC_FAIL) {
+                                ret = batch_failed_set(job, rec);
+                                if (ret)
+                                        goto free_recs;
+                        } else {
+                                break;
+                        }
+                }
+
+                off += (uint64_t)i * sizeof(*recs);
+
+                if (i < cnt || cnt < BATCH_JOURNAL_BUF_RECS)
+                        break;
+        }
+
+        /* a crash during write leaves a partial record behind */
+        if (off != (uint64_t)st.st_size && ftruncate(job->jnl_fd, (off_t)off)) {
+                ret = -errno;
+                goto free_recs;
+        }
+
+        if (lseek(job->jnl_fd, (off_t)off, SEEK_SET) < 0) {
+                ret = -errno;
+                goto free_recs;
+        }
+
+        qsort(job->kept, job->n_kept, sizeof(*job->kept), batch_rec_cmp);
+
+        /* past the checkpoint they run again anyway */
+        job->n_failed = batch_failed_find(job, job->next_out);
+
+free_recs:
+        free(recs);
+
+        return ret;
+}
+
+/**
+ * batch_item_resume() - take over item journaled past last checkpoint
+ *
+ * Its signature was written but maybe not synced: only trusted if the
+ * file is unchanged and the signature on disk verifies
+ *
+ * @return 1 if item is done, 0 to run it again
+ */
+static int batch_item_resume(struct batch_job *job, struct batch_item *item)
+{
+        struct batch_journal_rec key = { .idx = item->idx };
+        struct batch_journal_rec *rec;
+        struct stat st;
+        uint8_t *sig = NULL;
+        mpz_t s;
+        int ok = 0;
+
+        if (!job->n_kept)
+                return 0;
+
+        rec = bsearch(&key, job->kept, job->n_kept, sizeof(*rec), batch_rec_cmp);
+        if (!rec)
+                return 0;
+
+        /* a redone item has more than one record, any valid one will do */
+        if (rec->path_crc != item->path_crc || stat(item->path, &st) ||
+            rec->dev != (uint64_t)st.st_dev || rec->ino != (uint64_t)st.st_ino ||
+            rec->size != (uint64_t)st.st_size || rec->mtime_ns != stat_mtime_ns(&st))
+                goto out;
+
+        sig = malloc(job->sig_len);
+        if (!sig)
+                goto out;
+
+        if (pread(job->sig_fd, sig, job->sig_len, (off_t)rec->sig_off) == (ssize_t)job->sig_len) {
+                mpz_init(s);
+                mpz_import(s, job->sig_len, 1, 1, 1, 0, sig);
+                ok = !rsa_public_key_verify(&job->pub, s, rec->digest,
+                                            BATCH_JOB_DIGEST_LEN);
+                mpz_clear(s);
+        }
+
+out:
+        free(sig);
+
+        if (!ok) {
+                job->stats->redone++;
+                return 0;
+        }
+
+        job->stats->resumed++;
+        memcpy(item->digest, rec->digest, BATCH_JOB_DIGEST_LEN);
+        item->ret = 0;
+
+        return 1;
+}
+
+/**
+ * batch_job_fill() - read list entries into free window slots
+ *
+ * @return 1 at end of list, 0 if window is full, -errno on failure
+ */
+static int batch_job_fill(struct batch_job *job, uint64_t *next_in)
+{
+        struct batch_item *item;
+        ssize_t len;
+
+        while (*next_in - job->next_out < job->window) {
+                item = &job->ring[*next_in % job->window];
+
+                len = getline(&item->path, &item->path_cap, job->list);
+                if (len < 0)
+                        return ferror(job->list) ? -EIO : 1;
+
+                if (len && item->path[len - 1] == '\n')
+                        item->path[--len] = '\0';
+
+                item->idx = (*next_in)++;
+                item->path_crc = crc32_update(0, item->path, (size_t)len);
+                item->ret = 0;
+                item->retry = 0;
+                job->stats->items++;
+
+                if (batch_item_resume(job, item)) {
+                        item->state = BATCH_ITEM_DONE;
+                        continue;
+                }
+
+                batch_item_queue(job, item);
+        }
+
+        return 0;
+}
+
+static int batch_item_journal(struct batch_job *job, const struct batch_item *item)
+{
+        struct batch_journal_rec rec = { 0 };
+
+        rec.type = BATCH_REC_ITEM;
+        rec.idx = item->idx;
+        rec.dev = item->dev;
+        rec.ino = item->ino;
+        rec.size = item->size;
+        rec.mtime_ns = item->mtime_ns;
+        rec.sig_off = item->idx * job->sig_len;
+        rec.path_crc = item->path_crc;
+        memcpy(rec.digest, item->digest, BATCH_JOB_DIGEST_LEN);
+
+        return batch_journal_append(job, &rec);
+}
+
+/**
+ * batch_item_fail() - zero signature slot of a failed item, journal it
+ *
+ * @param off: manifest offset of its line
+ */
+static int batch_item_fail(struct batch_job *job, const struct batch_item *item,
+                           uint64_t off)
+{
+        struct batch_journal_rec rec = { 0 };
+        int ret;
+
+        /* a redone item may have left a signature of an earlier run */
+        ret = batch_sig_zero(job, item->idx);
+        if (ret)
+                return ret;
+
+        rec.type = BATCH_REC_FAIL;
+        rec.idx = item->idx;
+        rec.size = off;
+        rec.sig_off = item->idx * job->sig_len;
+        rec.path_crc = item->path_crc;
+
+        return batch_journal_append(job, &rec);
+}
+
+/**
+ * batch_job_collect() - journal items workers finished
+ *
+ * @param wait: block until at least one finished, if any is in flight
+ */
+static int batch_job_collect(struct batch_job *job, int wait)
+{
+        struct batch_item *item, *next;
+        int ret = 0;
+
+        pthread_mutex_lock(&job->lock);
+        while (wait && !job->done && job->inflight)
+                pthread_cond_wait(&job->cv, &job->lock);
+
+        item = job->done;
+        job->done = NULL;
+        pthread_mutex_unlock(&job->lock);
+
+        for (; item; item = next) {
+                next = item->next_done;
+                item->state = BATCH_ITEM_DONE;
+                job->inflight--;
+
+                if (item->ret) {
+                        job->stats->failed++;
+                        continue;
+                }
+
+                job->stats->hashed++;
+                job->stats->bytes += item->size;
+
+                /* journaled once its line is patched, batch_job_retry() */
+                if (!ret && !item->retry)
+                        ret = batch_item_journal(job, item);
+        }
+
+        return ret;
+}
+
+/**
+ * batch_job_emit() - write manifest lines of finished items in order
+ */
+static int batch_job_emit(struct batch_job *job, uint64_t next_in)
+{
+        char hex[CAS_HEX_LEN + 1];
+        struct batch_item *item;
+        int len, ret;
+
+        while (job->next_out < next_in) {
+                item = &job->ring[job->next_out % job->window];
+                if (item->state != BATCH_ITEM_DONE)
+                        break;
+
+                if (item->ret) {
+                        fprintf(stderr, "%s: %s\n", item->path, strerror(-item->ret));
+
+                        ret = batch_item_fail(job, item, job->out_off);
+                        if (ret)
+                                return ret;
+
+                        /* keeps line n at item n, retried by the next run */
+                        memset(hex, '0', CAS_HEX_LEN);
+                        hex[CAS_HEX_LEN] = '\0';
+                } else {
+                        cas_digest_hex(item->digest, hex);
+                }
+
+                len = fprintf(job->out, "%s  %s\n", hex, item->path);
+                if (len < 0)
+                        return -EIO;
+
+                job->out_off += (uint64_t)len;
+
+                item->state = BATCH_ITEM_FREE;
+                job->next_out++;
+                job->since_ckpt++;
+
+                if (job->since_ckpt >= job->opts->ckpt_items ||
+                    clock_ns() - job->ckpt_ns >= job->opts->ckpt_ms * 1000000UL) {
+                        ret = batch_job_checkpoint(job);
+                        if (ret)
+                                return ret;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * batch_job_retry() - run again @n items that failed in an earlier run
+ *
+ * Items are in ring[0..n), their failure records at @fail. A line that
+ * comes out right overwrites its placeholder, which is as long. Data is
+ * synced before an item is journaled, until then it stays failed.
+ */
+static int batch_job_retry(struct batch_job *job, uint32_t n,
+                           const struct batch_journal_rec *fail)
+{
+        char hex[CAS_HEX_LEN + 1];
+        struct batch_item *item;
+        char *line;
+        int len, ret = 0;
+
+        job->stats->retried += n;
+
+        for (uint32_t i = 0; i < n; ++i)
+                batch_item_queue(job, &job->ring[i]);
+
+        while (job->inflight)
+                batch_job_collect(job, 1);
+
+        for (uint32_t i = 0; i < n && !ret; ++i) {
+                item = &job->ring[i];
+                item->state = BATCH_ITEM_FREE;
+
+                if (item->ret) {
+                        fprintf(stderr, "%s: %s\n", item->path, strerror(-item->ret));
+                        ret = batch_sig_zero(job, item->idx);
+                        continue;
+                }
+
+                cas_digest_hex(item->digest, hex);
+
+                len = asprintf(&line, "%s  %s\n", hex, item->path);
+                if (len < 0)
+                        return -ENOMEM;
+
+                if (pwrite(fileno(job->out), line, (size_t)len, (off_t)fail[i].size) != len)
+                        ret = -EIO;
+
+                free(line);
+        }
+
+        if (ret)
+                return ret;
+
+        if (fdatasync(fileno(job->out)) || fdatasync(job->sig_fd))
+                return -errno;
+
+        for (uint32_t i = 0; i < n && !ret; ++i)
+                if (!job->ring[i].ret)
+                        ret = batch_item_journal(job, &job->ring[i]);
+
+        return ret;
+}
+
+/**
+ * batch_job_skip() - skip list entries already in manifest
+ *
+ * Entries of items that failed are read and retried, a window at a time
+ */
+static int batch_job_skip(struct batch_job *job)
+{
+        const struct batch_journal_rec *fail = job->failed;
+        struct batch_item *item;
+        uint64_t n = 0, f = 0;
+        uint32_t queued = 0;
+        ssize_t len;
+        int c, ret;
+
+        while (n < job->next_out) {
+                if (f == job->n_failed || fail[f].idx != n) {
+                        c = getc_unlocked(job->list);
+                        if (c == EOF)
+                                break;
+
+                        if (c == '\n')
+                                n++;
+
+                        continue;
+                }
+
+                item = &job->ring[queued++];
+
+                len = getline(&item->path, &item->path_cap, job->list);
+                if (len <= 0)
+                        break;
+
+                if (item->path[len - 1] == '\n')
+                        item->path[--len] = '\0';
+
+                item->idx = n++;
+                item->path_crc = crc32_update(0, item->path, (size_t)len);
+                item->ret = 0;
+                item->retry = 1;
+
+                if (item->path_crc != fail[f++].path_crc)
+                        return -ESTALE;
+
+                if (queued == job->window || f == job->n_failed) {
+                        ret = batch_job_retry(job, queued, &fail[f - queued]);
+                        if (ret)
+                                return ret;
+
+                        queued = 0;
+                }
+        }
+
+        if (n < job->next_out)
+                return -ESTALE;
+
+        job->stats->items += n;
+        job->stats->resumed += n - job->n_failed;
+
+        return 0;
+}
+
+/**
+ * batch_job_open() - open list and outputs, load journal
+ */
+static int batch_job_open(struct batch_job *job)
+{
+        const struct batch_job_opts *opts = job->opts;
+        struct batch_journal_hdr hdr = { 0 };
+        int trunc = (opts->flags & BATCH_JOB_FRESH) ? O_TRUNC : 0;
+        struct stat st;
+        char *path;
+        int fd, ret;
+
+        job->list = fopen(opts->list, "r");
+        if (!job->list)
+                return -errno;
+
+        if (fstat(fileno(job->list), &st))
+                return -errno;
+
+        hdr.magic = BATCH_JOURNAL_MAGIC;
+        hdr.version = BATCH_JOURNAL_VERSION;
+        hdr.sig_len = job->sig_len;
+        hdr.key_id = (uint64_t)mpz_getlimbn(opts->key->n, 0);
+        hdr.list_size = (uint64_t)st.st_size;
+
+        if (asprintf(&path, "%s.sig", opts->out) < 0)
+                return -ENOMEM;
+
+        job->sig_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | trunc, 0644);
+        free(path);
+        if (job->sig_fd < 0)
+                return -errno;
+
+        if (!(opts->flags & BATCH_JOB_NO_JOURNAL)) {
+                if (asprintf(&path, "%s.journal", opts->out) < 0)
+                        return -ENOMEM;
+
+                job->jnl_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | trunc, 0644);
+                free(path);
+                if (job->jnl_fd < 0)
+                        return -errno;
+
+                ret = batch_journal_load(job, &hdr);
+                if (ret)
+                        return ret;
+        }
+
+        fd = open(opts->out, O_WRONLY | O_CREAT | O_CLOEXEC | trunc, 0644);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st)) {
+                ret = -errno;
+                close(fd);
+                return ret;
+        }
+
+        /* synced before the checkpoint was written, must be there */
+        if ((uint64_t)st.st_size < job->out_off) {
+                close(fd);
+                return -EIO;
+        }
+
+        /* manifest past last checkpoint is rewritten in the same order */
+        if (ftruncate(fd, (off_t)job->out_off) ||
+            lseek(fd, (off_t)job->out_off, SEEK_SET) < 0) {
+                ret = -errno;
+                close(fd);
+                return ret;
+        }
+
+        job->out = fdopen(fd, "w");
+        if (!job->out) {
+                close(fd);
+                return -errno;
+        }
+
+        return batch_job_skip(job);
+}
+
+static void batch_job_close(struct batch_job *job)
+{
+        if (job->out)
+                fclose(job->out);
+
+        if (job->jnl_fd >= 0)
+                close(job->jnl_fd);
+
+        if (job->sig_fd >= 0)
+                close(job->sig_fd);
+
+        if (job->list)
+                fclose(job->list);
+}
+
+/**
+ * batch_job_run() - hash and sign every file of a list, resumable
+ *
+ * Picks up where a previous run with the same list, key and output
+ * stopped, unless BATCH_JOB_FRESH. The manifest comes out byte for
+ * byte the same as an uninterrupted run.
+ *
+ * Journaling stays off the workers: they only hash, sign and pwrite()
+ * the signature, the submitting thread batches journal records into
+ * one write() per BATCH_JOURNAL_BUF_RECS items and syncs only at
+ * checkpoints.
+ *
+ * @param opts: job options
+ * @param stats: counters, filled in on return
+ * @return 0 if every item was processed (failed items included),
+ *         -errno if the job itself failed
+ */
+int batch_job_run(const struct batch_job_opts *opts, struct batch_job_stats *stats)
+{
+        struct batch_job job;
+        uint64_t next_in;
+        int ret, eof = 0;
+
+        if (!opts || !stats || !opts->list || !opts->out || !opts->key)
+                return -EINVAL;
+
+        memset(stats, 0x00, sizeof(*stats));
+        memset(&job, 0x00, sizeof(job));
+        job.opts = opts;
+        job.stats = stats;
+        job.sig_fd = job.jnl_fd = -1;
+        job.sig_len = (uint32_t)((opts->key->key_len + 7) / 8);
+        job.window = opts->window ? opts->window : BATCH_JOB_WINDOW_DEFAULT;
+        job.pool = opts->pool ? opts->pool : thread_pool_shared();
+        job.ckpt_ns = clock_ns();
+
+        if (!job.pool)
+                return -EAGAIN;
+
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_cond_init(&job.cv, NULL);
+        rsa_public_key_init(&job.pub);
+
+        ret = rsa_public_key_generate(&job.pub, opts->key);
+        if (ret)
+                goto clean;
+
+        job.ring = calloc(job.window, sizeof(*job.ring));
+        job.jbuf = calloc(BATCH_JOURNAL_BUF_RECS, sizeof(*job.jbuf));
+        job.zero = calloc(1, job.sig_len);
+        if (!job.ring || !job.jbuf || !job.zero) {
+                ret = -ENOMEM;
+                goto clean;
+        }
+
+        for (uint32_t i = 0; i < job.window; ++i) {
+                job.ring[i].job = &job;
+                job.ring[i].work.fn = batch_item_run;
+        }
+
+        ret = batch_job_open(&job);
+        if (ret)
+                goto close;
+
+        next_in = job.next_out;
+
+        while (!ret) {
+                if (!eof) {
+                        ret = batch_job_fill(&job, &next_in);
+                        if (ret < 0)
+                                break;
+
+                        eof = ret;
+                        ret = 0;
+                }
+
+                ret = batch_job_emit(&job, next_in);
+                if (ret || (eof && job.next_out == next_in))
+                        break;
+
+                /* window drained by items taken over from the journal, refill */
+                if (job.next_out == next_in)
+                        continue;
+
+                /* head of window is still running, wait for any to finish */
+                ret = batch_job_collect(&job, job.ring[job.next_out % job.window].state !=
+                                              BATCH_ITEM_DONE);
+        }
+
+        /* on failure workers may still own items that point at job */
+        while (job.inflight)
+                batch_job_collect(&job, 1);
+
+        if (!ret)
+                ret = batch_job_checkpoint(&job);
+
+close:
+        batch_job_close(&job);
+clean:
+        for (uint32_t i = 0; job.ring && i < job.window; ++i)
+                free(job.ring[i].path);
+
+        free(job.ring);
+        free(job.jbuf);
+        free(job.zero);
+        free(job.kept);
+        free(job.failed);
+        rsa_public_key_clean(&job.pub);
+        pthread_cond_destroy(&job.cv);
+        pthread_mutex_destroy(&job.lock);
+
+        return ret;
+}
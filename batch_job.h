@@ -0,0 +1,118 @@
+/**
+ * batch_job.h - Journaled, resumable hash and sign runs over file lists
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_BATCH_JOB_H
+#define SIMPLERSADIGEST_BATCH_JOB_H
+
+#include <stdint.h>
+
+#include "rsa.h"
+#include "thread_pool.h"
+
+/**
+ * Every line of the list is one item, numbered from 0. Items are
+ * hashed and signed on a thread pool in any order, outputs stay in
+ * list order:
+ *
+ *    <out>           sha512sum style manifest, "<hex digest>  <path>"
+ *    <out>.sig       signature of item i at i * sig_len
+ *    <out>.journal   struct batch_journal_hdr, then records
+ *
+ * A finished item appends a record (path identity, digest, signature
+ * offset) to the journal, buffered, no sync. A checkpoint syncs the
+ * manifest and signatures, then appends a record saying how many items
+ * and manifest octets are durable and syncs the journal.
+ *
+ * A restart truncates the manifest to the last checkpoint and skips
+ * its items without reading the list entries. Items journaled past it
+ * are taken over if the file is unchanged (dev, inode, size, mtime)
+ * and the signature on disk verifies, everything else runs again.
+ *
+ * An item that fails is reported on stderr and still gets its line,
+ * with an all-zero digest, and an all-zero signature slot, so line n is
+ * always item n. It is journaled as failed: a later run retries failed
+ * items below the checkpoint before anything else and patches their
+ * line in place, digest lines of one path are all the same length.
+ */
+
+#define BATCH_JOURNAL_MAGIC             (0x4a424452U)   /* "RDBJ" */
+#define BATCH_JOURNAL_VERSION           (2)
+
+#define BATCH_JOB_WINDOW_DEFAULT        (4096)          /* items in flight */
+#define BATCH_JOB_CKPT_ITEMS_DEFAULT    (65536)
+#define BATCH_JOB_CKPT_MS_DEFAULT       (5000)
+#define BATCH_JOB_DIGEST_LEN            (64)
+
+enum {
+        BATCH_REC_ITEM = 1,
+        BATCH_REC_CKPT,
+        BATCH_REC_FAIL,
+};
+
+enum {
+        BATCH_JOB_FRESH         = (1 << 0),     /* ignore and overwrite journal */
+        BATCH_JOB_NO_JOURNAL    = (1 << 1),     /* no journal, no checkpoints */
+};
+
+struct batch_journal_hdr {
+        uint32_t        magic;
+        uint32_t        version;
+        uint32_t        sig_len;
+        uint32_t        reserved;
+        uint64_t        key_id;         /* low limb of modulus */
+        uint64_t        list_size;      /* list file the job is about */
+};
+
+struct batch_journal_rec {
+        uint32_t        type;           /* BATCH_REC_* */
+        uint32_t        crc;            /* crc32 of all octets after this */
+        uint64_t        idx;            /* item, ckpt: items in manifest */
+        uint64_t        dev;
+        uint64_t        ino;
+        uint64_t        size;           /* ckpt: manifest octets, fail: line offset */
+        uint64_t        mtime_ns;
+        uint64_t        sig_off;        /* in <out>.sig */
+        uint32_t        path_crc;       /* crc32 of list entry */
+        uint32_t        reserved;
+        uint8_t         digest[BATCH_JOB_DIGEST_LEN];
+};
+
+struct batch_job_opts {
+        const char              *list;          /* one path per line */
+        const char              *out;           /* manifest path, prefix of others */
+        struct rsa_private      *key;
+        struct thread_pool      *pool;          /* NULL for thread_pool_shared() */
+        uint32_t                window;         /* items in flight */
+        uint64_t                ckpt_items;     /* checkpoint after so many items */
+        uint32_t                ckpt_ms;        /* or after so long */
+        uint32_t                flags;          /* BATCH_JOB_* */
+};
+
+struct batch_job_stats {
+        uint64_t        items;          /* in list */
+        uint64_t        resumed;        /* done by an earlier run */
+        uint64_t        hashed;         /* hashed and signed by this run */
+        uint64_t        redone;         /* journaled, but changed or unverified */
+        uint64_t        retried;        /* failed in an earlier run, tried again */
+        uint64_t        failed;
+        uint64_t        bytes;          /* hashed by this run */
+        uint64_t        checkpoints;
+};
+
+int batch_job_run(const struct batch_job_opts *opts, struct batch_job_stats *stats);
+
+#endif //SIMPLERSADIGEST_BATCH_JOB_H
@@ -0,0 +1,164 @@
+/**
+ * batch_tool.c - Resumable hash and sign run over a list of files
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "batch_job.h"
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s -k priv.key -l list -o manifest [options]\n"
+                "  -k file      key to sign with\n"
+                "  -l list      files to hash and sign, one path per line\n"
+                "  -o file      sha512sum style manifest, signatures go to\n"
+                "               <file>.sig, progress to <file>.journal\n"
+                "  -j threads   worker threads (default online CPUs)\n"
+                "  -w items     items in flight (default %u)\n"
+                "  -c items     checkpoint every so many items (default %u)\n"
+                "  -C ms        or every so many ms (default %u)\n"
+                "  -f           start over, ignore journal of an earlier run\n"
+                "  -J           no journal, not resumable (to measure its cost)\n"
+                "rerunning the same command resumes an interrupted run\n",
+                prog, BATCH_JOB_WINDOW_DEFAULT, BATCH_JOB_CKPT_ITEMS_DEFAULT,
+                BATCH_JOB_CKPT_MS_DEFAULT);
+}
+
+int main(int argc, char *argv[])
+{
+        struct batch_job_opts opts = {
+                .window         = BATCH_JOB_WINDOW_DEFAULT,
+                .ckpt_items     = BATCH_JOB_CKPT_ITEMS_DEFAULT,
+                .ckpt_ms        = BATCH_JOB_CKPT_MS_DEFAULT,
+        };
+        struct batch_job_stats stats;
+        struct thread_pool own;
+        struct rsa_private key;
+        const char *key_file = NULL;
+        uint32_t threads = 0;
+        uint64_t t0, ns;
+        FILE *f;
+        int ret, c;
+
+        while ((c = getopt(argc, argv, "k:l:o:j:w:c:C:fJh")) != -1) {
+                switch (c) {
+                        case 'k':
+                                key_file = optarg;
+                                break;
+
+                        case 'l':
+                                opts.list = optarg;
+                                break;
+
+                        case 'o':
+                                opts.out = optarg;
+                                break;
+
+                        case 'j':
+                                threads = (uint32_t)strtoul(optarg, NULL, 0);
+                                break;
+
+                        case 'w':
+                                opts.window = (uint32_t)strtoul(optarg, NULL, 0);
+                                break;
+
+                        case 'c':
+                                opts.ckpt_items = strtoull(optarg, NULL, 0);
+                                break;
+
+                        case 'C':
+                                opts.ckpt_ms = (uint32_t)strtoul(optarg, NULL, 0);
+                                break;
+
+                        case 'f':
+                                opts.flags |= BATCH_JOB_FRESH;
+                                break;
+
+                        case 'J':
+                                opts.flags |= BATCH_JOB_NO_JOURNAL | BATCH_JOB_FRESH;
+                                break;
+
+                        default:
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
+                }
+        }
+
+        if (!key_file || !opts.list || !opts.out || !opts.window || !opts.ckpt_items) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        rsa_private_key_init(&key);
+
+        f = fopen(key_file, "r");
+        if (!f) {
+                fprintf(stderr, "failed to open %s: %s\n", key_file, strerror(errno));
+                ret = -errno;
+                goto clean_key;
+        }
+
+        ret = rsa_private_key_load(&key, f);
+        fclose(f);
+        if (ret) {
+                fprintf(stderr, "failed to load %s\n", key_file);
+                goto clean_key;
+        }
+
+        opts.key = &key;
+
+        if (threads) {
+                ret = thread_pool_init(&own, threads);
+                if (ret) {
+                        fprintf(stderr, "failed to start threads: %s\n", strerror(-ret));
+                        goto clean_key;
+                }
+
+                opts.pool = &own;
+        }
+
+        t0 = clock_ns();
+        ret = batch_job_run(&opts, &stats);
+        ns = clock_ns() - t0;
+
+        if (ret == -ESTALE)
+                fprintf(stderr, "journal of %s is for another list or key, "
+                                "use -f to start over\n", opts.out);
+        else if (ret)
+                fprintf(stderr, "batch failed: %s\n", strerror(-ret));
+
+        fprintf(stderr, "%lu items: %lu resumed, %lu hashed (%lu redone, %lu retried), "
+                        "%lu failed, %.1f MB in %.2f s, %.0f items/s, %lu checkpoints\n",
+                stats.items, stats.resumed, stats.hashed, stats.redone, stats.retried,
+                stats.failed,
+                stats.bytes / 1e6, ns / 1e9, stats.hashed / (ns / 1e9),
+                stats.checkpoints);
+
+        if (threads)
+                thread_pool_exit(&own);
+
+clean_key:
+        rsa_private_key_clean(&key);
+
+        return ret || stats.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1823 @@
+/**
+ * bench.c - Throughput and latency benchmarks of RSA and SHA-512
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
+
+#include "rsa.h"
+#include "sha512.h"
+#include "histogram.h"
+#include "audit_log.h"
+#include "secure_mem.h"
+#include "key_sched.h"
+#include "digest_index.h"
+#include "cas.h"
+
+#define BENCH_KEY_LENGTH_DEFAULT        (2048)
+#define BENCH_DURATION_DEFAULT          (2)
+#define BENCH_PAYLOAD_DEFAULT           (4096)
+#define BENCH_CACHELINE                 (64)
+#define BENCH_AUDIT_PATH_DEFAULT        "audit.log"
+#define BENCH_KEYGEN_RANDOM             (1000)  /* random odd candidates */
+#define BENCH_KEYGEN_PRIMES             (32)    /* known primes */
+#define BENCH_KEYGEN_REF_REPS           (50)    /* mpz_probab_prime_p() reps */
+#define BENCH_AFFINITY_KEYS_DEFAULT     (256)
+#define BENCH_AFFINITY_INFLIGHT         (256)   /* requests outstanding */
+#define BENCH_INDEX_ENTRIES_DEFAULT     (1 << 20)
+#define BENCH_INDEX_PATH                "bench.idx"
+#define BENCH_INDEX_LOOKUPS             (1 << 20)
+
+enum {
+        BENCH_OP_SIGN = 0,
+        BENCH_OP_VERIFY,
+        BENCH_OP_HASH,
+        NUM_BENCH_OPS,
+};
+
+static const char *bench_op_name[NUM_BENCH_OPS] = {
+        [BENCH_OP_SIGN]   = "sign",
+        [BENCH_OP_VERIFY] = "verify",
+        [BENCH_OP_HASH]   = "hash",
+};
+
+struct bench_opts {
+        uint32_t        threads;        /* max thread count */
+        uint32_t        duration;       /* seconds per step */
+        uint64_t        key_len;
+        uint64_t        payload;        /* hash payload bytes */
+        uint32_t        mix[NUM_BENCH_OPS];
+        const char      *path;          /* audit log */
+        uint32_t        budget_us;      /* audit log commit budget */
+        int             locked;         /* latency-critical memory */
+        uint64_t        exp_bits;       /* rebalanced CRT exponent length */
+        uint32_t        keys;           /* distinct keys of affinity mode */
+        double          zipf;           /* key popularity exponent */
+        uint64_t        entries;        /* digest index size */
+};
+
+/*
+ * Everything a worker writes lives in its own cache line aligned
+ * struct, so the benchmark itself does not add false sharing
+ */
+struct bench_worker {
+        pthread_t               tid;
+        uint64_t                rng;
+        uint8_t                 *payload;
+        uint8_t                 digest[SHA512_HASH_BITS / 8];
+        mpz_t                   sig;            /* signature of digest */
+        mpz_t                   out;            /* scratch signature */
+        uint64_t                ops[NUM_BENCH_OPS];
+        uint64_t                errors;
+        struct lat_hist         hist[NUM_BENCH_OPS];
+} __attribute__((aligned(BENCH_CACHELINE)));
+
+struct bench_shared {
+        struct rsa_private      *priv;
+        struct rsa_public       *pub;
+        const struct bench_opts *opts;
+        struct audit_log        *log;
+        pthread_barrier_t       start;
+        atomic_int              stop;
+        uint32_t                mix_total;
+};
+
+struct bench_arg {
+        struct bench_shared     *shared;
+        struct bench_worker     *worker;
+};
+
+/* xorshift64*, per worker, no shared RNG state on the hot path */
+static inline uint64_t bench_rand(uint64_t *s)
+{
+        *s ^= *s >> 12;
+        *s ^= *s << 25;
+        *s ^= *s >> 27;
+
+        return *s * 0x2545F4914F6CDD1DUL;
+}
+
+static int bench_pick_op(struct bench_shared *sh, uint64_t *rng)
+{
+        uint32_t r = (uint32_t)(bench_rand(rng) % sh->mix_total);
+
+        for (int op = 0; op < NUM_BENCH_OPS; ++op) {
+                if (r < sh->opts->mix[op])
+                        return op;
+
+                r -= sh->opts->mix[op];
+        }
+
+        return BENCH_OP_HASH;
+}
+
+static void *bench_worker_run(void *data)
+{
+        struct bench_arg *arg = data;
+        struct bench_shared *sh = arg->shared;
+        struct bench_worker *w = arg->worker;
+        uint8_t digest[SHA512_HASH_BITS / 8];
+        uint64_t t0, t1;
+        int op, ret;
+
+        pthread_barrier_wait(&sh->start);
+
+        while (!atomic_load_explicit(&sh->stop, memory_order_relaxed)) {
+                op = bench_pick_op(sh, &w->rng);
+
+                t0 = clock_ns();
+
+                switch (op) {
+                        case BENCH_OP_SIGN:
+                                ret = rsa_private_key_sign(sh->priv, w->out,
+                                                           w->digest,
+                                                           sizeof(w->digest));
+                                break;
+
+                        case BENCH_OP_VERIFY:
+                                ret = rsa_public_key_verify(sh->pub, w->sig,
+                                                            w->digest,
+                                                            sizeof(w->digest));
+                                break;
+
+                        case BENCH_OP_HASH:
+                        default:
+                                ret = sha512_buffer_process(w->payload,
+                                                            sh->opts->payload,
+                                                            digest);
+                                break;
+                }
+
+                t1 = clock_ns();
+
+                if (ret)
+                        w->errors++;
+
+                w->ops[op]++;
+                hist_record(&w->hist[op], t1 - t0);
+        }
+
+        return NULL;
+}
+
+static int bench_worker_init(struct bench_worker *w, struct bench_shared *sh,
+                             uint32_t idx)
+{
+        memset(w, 0x00, sizeof(struct bench_worker));
+
+        w->rng = urandom_read() | 1;
+        mpz_inits(w->sig, w->out, NULL);
+
+        w->payload = malloc(sh->opts->payload ? sh->opts->payload : 1);
+        if (!w->payload)
+                return -ENOMEM;
+
+        for (uint64_t i = 0; i < sh->opts->payload; ++i)
+                w->payload[i] = (uint8_t)(i * 131 + idx);
+
+        sha512_buffer_process(w->payload, sh->opts->payload, w->digest);
+
+        return rsa_private_key_sign(sh->priv, w->sig, w->digest,
+                                    sizeof(w->digest));
+}
+
+static void bench_worker_free(struct bench_worker *w)
+{
+        mpz_clears(w->sig, w->out, NULL);
+        free(w->payload);
+}
+
+/**
+ * bench_run_threads() - run @fn on @n initialized workers for duration
+ *
+ * @return  elapsed seconds
+ */
+static double bench_run_threads(struct bench_shared *sh,
+                                struct bench_worker *workers,
+                                struct bench_arg *args, uint32_t n,
+                                void *(*fn)(void *))
+{
+        uint64_t t_start, t_end;
+
+        pthread_barrier_init(&sh->start, NULL, n + 1);
+        atomic_store(&sh->stop, 0);
+
+        for (uint32_t i = 0; i < n; ++i) {
+                args[i].shared = sh;
+                args[i].worker = &workers[i];
+                pthread_create(&workers[i].tid, NULL, fn, &args[i]);
+        }
+
+        pthread_barrier_wait(&sh->start);
+        t_start = clock_ns();
+        sleep(sh->opts->duration);
+        atomic_store(&sh->stop, 1);
+
+        for (uint32_t i = 0; i < n; ++i)
+                pthread_join(workers[i].tid, NULL);
+
+        t_end = clock_ns();
+        pthread_barrier_destroy(&sh->start);
+
+        return (double)(t_end - t_start) / 1e9;
+}
+
+/**
+ * bench_scaling_step() - run closed loop load with @n threads
+ *
+ * @return  0 on success
+ */
+static int bench_scaling_step(struct bench_shared *sh, uint32_t n,
+                              double *base_tput)
+{
+        struct bench_worker *workers;
+        struct bench_arg *args;
+        struct lat_hist *total;
+        uint64_t ops[NUM_BENCH_OPS] = { 0 };
+        uint64_t ops_all = 0, errors = 0;
+        double secs, tput, eff;
+        int ret = 0;
+
+        workers = aligned_alloc(BENCH_CACHELINE, sizeof(*workers) * n);
+        args = calloc(n, sizeof(*args));
+        total = calloc(NUM_BENCH_OPS, sizeof(*total));
+        if (!workers || !args || !total) {
+                ret = -ENOMEM;
+                goto free_mem;
+        }
+
+        for (uint32_t i = 0; i < n; ++i) {
+                ret = bench_worker_init(&workers[i], sh, i);
+                if (ret) {
+                        fprintf(stderr, "worker %u init failed: %d\n", i, ret);
+                        n = i + 1;
+                        goto free_workers;
+                }
+        }
+
+        secs = bench_run_threads(sh, workers, args, n, bench_worker_run);
+
+        for (uint32_t i = 0; i < n; ++i) {
+                for (int op = 0; op < NUM_BENCH_OPS; ++op) {
+                        ops[op] += workers[i].ops[op];
+                        hist_merge(&total[op], &workers[i].hist[op]);
+                }
+
+                errors += workers[i].errors;
+        }
+
+        for (int op = 0; op < NUM_BENCH_OPS; ++op)
+                ops_all += ops[op];
+
+        tput = (double)ops_all / secs;
+
+        if (n == 1)
+                *base_tput = tput;
+
+        eff = *base_tput > 0 ? tput / (*base_tput * n) : 0;
+
+        fprintf(stdout, "%7u %12.0f %12.0f %6.1f%%",
+                n, tput, tput / n, eff * 100.0);
+
+        for (int op = 0; op < NUM_BENCH_OPS; ++op) {
+                fprintf(stdout, "  %8.1f %8.1f %8.1f",
+                        hist_percentile(&total[op], 50.0) / 1e3,
+                        hist_percentile(&total[op], 99.0) / 1e3,
+                        hist_percentile(&total[op], 99.9) / 1e3);
+        }
+
+        if (errors)
+                fprintf(stdout, "  errors=%lu", errors);
+
+        fprintf(stdout, "\n");
+        fflush(stdout);
+
+free_workers:
+        for (uint32_t i = 0; i < n; ++i)
+                bench_worker_free(&workers[i]);
+free_mem:
+        free(total);
+        free(args);
+        free(workers);
+
+        return ret;
+}
+
+/**
+ * bench_scaling() - mixed sign/verify/hash load on 1..N threads
+ *
+ * Throughput that stops growing with thread count points at
+ * contention inside the library or GMP allocator
+ *
+ * @param   opts: benchmark options
+ * @return  0 on success
+ */
+static int bench_scaling(const struct bench_opts *opts)
+{
+        struct rsa_private priv;
+        struct rsa_public pub;
+        struct bench_shared sh;
+        double base_tput = 0;
+        int ret = 0;
+
+        memset(&sh, 0x00, sizeof(sh));
+        sh.opts = opts;
+        sh.priv = &priv;
+        sh.pub = &pub;
+
+        for (int op = 0; op < NUM_BENCH_OPS; ++op)
+                sh.mix_total += opts->mix[op];
+
+        if (!sh.mix_total)
+                return -EINVAL;
+
+        rsa_private_key_init(&priv);
+        rsa_public_key_init(&pub);
+
+        fprintf(stdout, "generating %lu-bit RSA key pair...\n", opts->key_len);
+
+        if (rsa_private_key_generate(&priv, opts->key_len) ||
+            rsa_public_key_generate(&pub, &priv)) {
+                ret = -EFAULT;
+                goto clean_keys;
+        }
+
+        fprintf(stdout, "mix sign:verify:hash = %u:%u:%u, payload %lu bytes, "
+                        "%us per step\n",
+                opts->mix[BENCH_OP_SIGN], opts->mix[BENCH_OP_VERIFY],
+                opts->mix[BENCH_OP_HASH], opts->payload, opts->duration);
+
+        fprintf(stdout, "%7s %12s %12s %7s", "threads", "ops/s", "ops/s/core", "eff");
+        for (int op = 0; op < NUM_BENCH_OPS; ++op)
+                fprintf(stdout, "  %6s p50/p99/p99.9 us", bench_op_name[op]);
+        fprintf(stdout, "\n");
+
+        for (uint32_t n = 1; n <= opts->threads; ++n) {
+                ret = bench_scaling_step(&sh, n, &base_tput);
+                if (ret)
+                        break;
+        }
+
+clean_keys:
+        rsa_public_key_clean(&pub);
+        rsa_private_key_clean(&priv);
+
+        return ret;
+}
+
+/**
+ * bench_audit_run() - sign random digests through the audit log
+ */
+static void *bench_audit_run(void *data)
+{
+        struct bench_arg *arg = data;
+        struct bench_shared *sh = arg->shared;
+        struct bench_worker *w = arg->worker;
+        uint64_t t0, t1, v;
+        int ret;
+
+        pthread_barrier_wait(&sh->start);
+
+        while (!atomic_load_explicit(&sh->stop, memory_order_relaxed)) {
+                v = bench_rand(&w->rng);
+                sha512_buffer_process(&v, sizeof(v), w->digest);
+
+                t0 = clock_ns();
+                ret = audit_log_sign(sh->log, sh->priv, 0, w->digest,
+                                     sizeof(w->digest), w->out);
+                t1 = clock_ns();
+
+                if (ret)
+                        w->errors++;
+
+                w->ops[BENCH_OP_SIGN]++;
+                hist_record(&w->hist[BENCH_OP_SIGN], t1 - t0);
+        }
+
+        return NULL;
+}
+
+static int bench_audit_step(struct bench_shared *sh, uint32_t n)
+{
+        struct bench_worker *workers;
+        struct bench_arg *args;
+        struct lat_hist *total;
+        struct audit_record *rec;
+        uint64_t ops = 0, errors = 0;
+        uint64_t records, commits, t0;
+        double secs;
+        int ret = 0;
+
+        workers = aligned_alloc(BENCH_CACHELINE, sizeof(*workers) * n);
+        args = calloc(n, sizeof(*args));
+        total = calloc(1, sizeof(*total));
+        rec = malloc(sizeof(*rec));
+        if (!workers || !args || !total || !rec) {
+                ret = -ENOMEM;
+                goto free_mem;
+        }
+
+        for (uint32_t i = 0; i < n; ++i) {
+                ret = bench_worker_init(&workers[i], sh, i);
+                if (ret) {
+                        n = i + 1;
+                        goto free_workers;
+                }
+        }
+
+        pthread_mutex_lock(&sh->log->lock);
+        records = sh->log->records;
+        commits = sh->log->commits;
+        pthread_mutex_unlock(&sh->log->lock);
+
+        secs = bench_run_threads(sh, workers, args, n, bench_audit_run);
+
+        pthread_mutex_lock(&sh->log->lock);
+        records = sh->log->records - records;
+        commits = sh->log->commits - commits;
+        pthread_mutex_unlock(&sh->log->lock);
+
+        for (uint32_t i = 0; i < n; ++i) {
+                ops += workers[i].ops[BENCH_OP_SIGN];
+                errors += workers[i].errors;
+                hist_merge(total, &workers[i].hist[BENCH_OP_SIGN]);
+        }
+
+        /* every signature returned must be findable */
+        t0 = clock_ns();
+        ret = audit_log_lookup(sh->log, workers[0].digest,
+                               sizeof(workers[0].digest), rec);
+
+        fprintf(stdout, "%7u %12.0f %10.1f %10.1f %10.1f %14.1f %10.1f%s",
+                n, (double)ops / secs,
+                hist_percentile(total, 50.0) / 1e3,
+                hist_percentile(total, 99.0) / 1e3,
+                hist_percentile(total, 99.9) / 1e3,
+                commits ? (double)records / (double)commits : 0.0,
+                (clock_ns() - t0) / 1e3,
+                ret ? "  lookup failed" : "");
+
+        if (errors)
+                fprintf(stdout, "  errors=%lu", errors);
+
+        fprintf(stdout, "\n");
+        fflush(stdout);
+
+free_workers:
+        for (uint32_t i = 0; i < n; ++i)
+                bench_worker_free(&workers[i]);
+free_mem:
+        free(rec);
+        free(total);
+        free(args);
+        free(workers);
+
+        return ret;
+}
+
+/**
+ * bench_audit() - durable signing throughput with group commit
+ *
+ * @param   opts: benchmark options
+ * @return  0 on success
+ */
+static int bench_audit(const struct bench_opts *opts)
+{
+        struct audit_log_opts log_opts = {
+                .budget_us = opts->budget_us,
+        };
+        struct audit_log log;
+        struct rsa_private priv;
+        struct rsa_public pub;
+        struct bench_shared sh;
+        int ret;
+
+        memset(&sh, 0x00, sizeof(sh));
+        sh.opts = opts;
+        sh.priv = &priv;
+        sh.pub = &pub;
+        sh.log = &log;
+
+        rsa_private_key_init(&priv);
+        rsa_public_key_init(&pub);
+
+        fprintf(stdout, "generating %lu-bit RSA key pair...\n", opts->key_len);
+
+        if (rsa_private_key_generate(&priv, opts->key_len) ||
+            rsa_public_key_generate(&pub, &priv)) {
+                ret = -EFAULT;
+                goto clean_keys;
+        }
+
+        ret = audit_log_open(&log, opts->path, &log_opts);
+        if (ret) {
+                fprintf(stderr, "failed to open %s: %s\n", opts->path, strerror(-ret));
+                goto clean_keys;
+        }
+
+        fprintf(stdout, "audit log %s, commit budget %uus, %us per step\n",
+                opts->path, opts->budget_us, opts->duration);
+        fprintf(stdout, "%7s %12s %10s %10s %10s %14s %10s\n", "threads", "signs/s",
+                "p50 us", "p99 us", "p99.9 us", "records/sync", "lookup us");
+
+        for (uint32_t n = 1; n <= opts->threads; ++n) {
+                ret = bench_audit_step(&sh, n);
+                if (ret)
+                        break;
+        }
+
+        if (audit_log_close(&log) && !ret)
+                ret = -EIO;
+
+clean_keys:
+        rsa_public_key_clean(&pub);
+        rsa_private_key_clean(&priv);
+
+        return ret;
+}
+
+/*
+ * Composites built to fool weaker tests: Carmichael numbers, strong
+ * pseudoprimes to base 2 (some to every base up to 37), strong Lucas
+ * pseudoprimes
+ */
+static const char *bench_keygen_hard[] = {
+        "561", "1105", "1729", "2465", "2821", "6601", "8911",
+        "2047", "3277", "4033", "4681", "8321", "15841", "29341",
+        "5459", "5777", "10877", "16109", "18971",
+        "3215031751",
+        "3825123056546413051",
+        "318665857834031151167461",
+        "3317044064679887385961981",
+};
+
+struct bench_prime_mode {
+        const char      *name;
+        int             mode;           /* PRIMALITY_*, -1 if not selectable */
+        int             (*test)(const mpz_t n);
+};
+
+static int bench_prime_ss(const mpz_t n)
+{
+        return primality_test(n, PRIMALITY_TEST_ACCURACY);
+}
+
+static int bench_prime_gmp(const mpz_t n)
+{
+        return mpz_probab_prime_p(n, BENCH_KEYGEN_REF_REPS) != 0;
+}
+
+static const struct bench_prime_mode bench_prime_modes[] = {
+        { "solovay-strassen",   PRIMALITY_SOLOVAY_STRASSEN, bench_prime_ss      },
+        { "baillie-psw",        PRIMALITY_BAILLIE_PSW,      primality_test_bpsw },
+        { "gmp reference",      -1,                         bench_prime_gmp     },
+};
+
+/**
+ * bench_keygen_mode() - run one primality mode over candidate set
+ *
+ * Every verdict is checked against mpz_probab_prime_p() computed up
+ * front; for the hard composites the reference must say composite too.
+ */
+static void bench_keygen_mode(const struct bench_opts *opts,
+                              const struct bench_prime_mode *m,
+                              mpz_t *cand, const int *ref,
+                              uint32_t n_random, uint32_t n)
+{
+        struct rsa_private priv;
+        uint64_t t_rand = 0, t_prime = 0, primes = 0;
+        uint64_t false_pos = 0, false_neg = 0;
+        uint64_t t0, t1, keys = 0, t_keys = 0;
+        int v;
+
+        for (uint32_t i = 0; i < n; ++i) {
+                t0 = clock_ns();
+                v = m->test(cand[i]);
+                t1 = clock_ns();
+
+                if (i < n_random)
+                        t_rand += t1 - t0;
+
+                if (ref[i]) {
+                        t_prime += t1 - t0;
+                        primes++;
+                }
+
+                false_pos += v && !ref[i];
+                false_neg += !v && ref[i];
+        }
+
+        fprintf(stdout, "%-18s %12.1f %12.1f %8lu %8lu",
+                m->name, (double)t_rand / n_random / 1e3,
+                primes ? (double)t_prime / primes / 1e3 : 0.0,
+                false_pos, false_neg);
+
+        if (m->mode < 0) {
+                fprintf(stdout, " %12s\n", "-");
+                return;
+        }
+
+        /* whole key pairs within duration, at least one */
+        primality_mode_set(m->mode);
+
+        do {
+                rsa_private_key_init(&priv);
+
+                t0 = clock_ns();
+                rsa_private_key_generate(&priv, opts->key_len);
+                t_keys += clock_ns() - t0;
+                keys++;
+
+                rsa_private_key_clean(&priv);
+        } while (t_keys < (uint64_t)opts->duration * 1000000000UL);
+
+        primality_mode_set(PRIMALITY_SOLOVAY_STRASSEN);
+
+        fprintf(stdout, " %12.1f\n", (double)t_keys / keys / 1e6);
+        fflush(stdout);
+}
+
+/**
+ * bench_keygen() - accuracy and cost of the primality modes
+ *
+ * Candidates are random odd numbers of half key length (what key
+ * generation feeds the test), known primes of the same length, and
+ * composites known to pass weaker tests
+ *
+ * @param   opts: benchmark options
+ * @return  0 on success
+ */
+static int bench_keygen(const struct bench_opts *opts)
+{
+        uint32_t n_hard = ARRAY_SIZE(bench_keygen_hard);
+        uint32_t n = BENCH_KEYGEN_RANDOM + BENCH_KEYGEN_PRIMES + n_hard;
+        uint64_t bits = opts->key_len / 2;
+        uint32_t i;
+        mpz_t *cand;
+        int *ref;
+        int ret = 0;
+
+        cand = calloc(n, sizeof(*cand));
+        ref = calloc(n, sizeof(*ref));
+        if (!cand || !ref) {
+                ret = -ENOMEM;
+                goto free_mem;
+        }
+
+        for (i = 0; i < n; ++i)
+                mpz_init(cand[i]);
+
+        for (i = 0; i < BENCH_KEYGEN_RANDOM; ++i) {
+                mpz_rand_bitlen(cand[i], bits);
+                mpz_setbit(cand[i], 0);
+        }
+
+        for (; i < BENCH_KEYGEN_RANDOM + BENCH_KEYGEN_PRIMES; ++i) {
+                mpz_rand_bitlen(cand[i], bits);
+                mpz_nextprime(cand[i], cand[i]);
+        }
+
+        for (uint32_t j = 0; j < n_hard; ++j, ++i)
+                mpz_set_str(cand[i], bench_keygen_hard[j], 10);
+
+        for (i = 0; i < n; ++i)
+                ref[i] = bench_prime_gmp(cand[i]);
+
+        for (i = BENCH_KEYGEN_RANDOM + BENCH_KEYGEN_PRIMES; i < n; ++i) {
+                if (ref[i]) {
+                        fprintf(stderr, "hard composite %u reported prime\n", i);
+                        ret = -EFAULT;
+                        goto clean_cand;
+                }
+        }
+
+        fprintf(stdout, "%u random odd + %u prime %lu-bit candidates, "
+                        "%u hard composites, %lu-bit keys for %us\n",
+                BENCH_KEYGEN_RANDOM, BENCH_KEYGEN_PRIMES, bits, n_hard,
+                opts->key_len, opts->duration);
+        fprintf(stdout, "%-18s %12s %12s %8s %8s %12s\n", "mode", "cand us",
+                "prime us", "false+", "false-", "keygen ms");
+
+        for (i = 0; i < ARRAY_SIZE(bench_prime_modes); ++i)
+                bench_keygen_mode(opts, &bench_prime_modes[i], cand, ref,
+                                  BENCH_KEYGEN_RANDOM, n);
+
+clean_cand:
+        for (i = 0; i < n; ++i)
+                mpz_clear(cand[i]);
+free_mem:
+        free(ref);
+        free(cand);
+
+        return ret;
+}
+
+/**
+ * bench_rebalanced_op() - single thread sign or verify loop for duration
+ *
+ * @return  ops per second
+ */
+static double bench_rebalanced_op(const struct bench_opts *opts,
+                                  struct rsa_private *priv, struct rsa_public *pub,
+                                  int op, struct lat_hist *hist,
+                                  uint64_t *errors)
+{
+        uint8_t digest[SHA512_HASH_BITS / 8];
+        uint64_t t0, t1, t_start, ops = 0;
+        int ret;
+        uint64_t deadline = (uint64_t)opts->duration * 1000000000UL;
+        mpz_t s, out;
+
+        mpz_inits(s, out, NULL);
+        hist_reset(hist);
+
+        sha512_buffer_process(&ops, sizeof(ops), digest);
+        rsa_private_key_sign(priv, s, digest, sizeof(digest));
+
+        t_start = clock_ns();
+
+        do {
+                t0 = clock_ns();
+
+                if (op == BENCH_OP_SIGN)
+                        ret = rsa_private_key_sign(priv, out, digest, sizeof(digest));
+                else
+                        ret = rsa_public_key_verify(pub, s, digest, sizeof(digest));
+
+                t1 = clock_ns();
+
+                if (ret)
+                        (*errors)++;
+
+                hist_record(hist, t1 - t0);
+                ops++;
+        } while (t1 - t_start < deadline);
+
+        mpz_clears(s, out, NULL);
+
+        return (double)ops / ((double)(t1 - t_start) / 1e9);
+}
+
+/**
+ * bench_rebalanced() - private vs public cost of rebalanced keys
+ *
+ * Same key length, e = 65537 against short CRT exponents: signing
+ * should get cheaper by about half length / exp_bits, verification
+ * dearer by about key length / 17
+ *
+ * @param   opts: benchmark options
+ * @return  0 on success
+ */
+static int bench_rebalanced(const struct bench_opts *opts)
+{
+        struct lat_hist *hist;
+        struct rsa_private priv;
+        struct rsa_public pub;
+        double keygen_ms, sign_tput, verify_tput;
+        uint64_t t0, errors;
+        int ret = 0;
+
+        if (opts->exp_bits < rsa_rebalanced_exp_bits_min(opts->key_len)) {
+                fprintf(stderr, "CRT exponents under %lu bits are unsafe for %lu-bit keys\n",
+                        rsa_rebalanced_exp_bits_min(opts->key_len), opts->key_len);
+                return -EINVAL;
+        }
+
+        hist = calloc(NUM_BENCH_OPS, sizeof(*hist));
+        if (!hist)
+                return -ENOMEM;
+
+        fprintf(stdout, "%lu-bit keys, %us per op\n", opts->key_len, opts->duration);
+        fprintf(stdout, "%-12s %6s %6s %10s %10s %18s %10s %18s\n",
+                "key", "exp", "e", "keygen ms", "signs/s", "sign p50/p99 us",
+                "verifies/s", "verify p50/p99 us");
+
+        for (int rebalanced = 0; rebalanced < 2; ++rebalanced) {
+                rsa_private_key_init(&priv);
+                rsa_public_key_init(&pub);
+
+                t0 = clock_ns();
+
+                if (rebalanced)
+                        ret = rsa_private_key_generate_rebalanced(&priv, opts->key_len,
+                                                                  opts->exp_bits);
+                else
+                        ret = rsa_private_key_generate(&priv, opts->key_len);
+
+                keygen_ms = (clock_ns() - t0) / 1e6;
+
+                if (!ret)
+                        ret = rsa_public_key_generate(&pub, &priv);
+
+                if (ret) {
+                        fprintf(stderr, "key generation failed: %d\n", ret);
+                        goto clean_keys;
+                }
+
+                errors = 0;
+                sign_tput = bench_rebalanced_op(opts, &priv, &pub, BENCH_OP_SIGN,
+                                                &hist[BENCH_OP_SIGN], &errors);
+                verify_tput = bench_rebalanced_op(opts, &priv, &pub, BENCH_OP_VERIFY,
+                                                  &hist[BENCH_OP_VERIFY], &errors);
+
+                fprintf(stdout, "%-12s %6zu %6zu %10.1f %10.0f %8.1f %9.1f %10.0f %8.1f %9.1f",
+                        rebalanced ? "rebalanced" : "standard",
+                        mpz_sizeinbase(priv.exp1, 2), mpz_sizeinbase(priv.e, 2),
+                        keygen_ms, sign_tput,
+                        hist_percentile(&hist[BENCH_OP_SIGN], 50.0) / 1e3,
+                        hist_percentile(&hist[BENCH_OP_SIGN], 99.0) / 1e3,
+                        verify_tput,
+                        hist_percentile(&hist[BENCH_OP_VERIFY], 50.0) / 1e3,
+                        hist_percentile(&hist[BENCH_OP_VERIFY], 99.0) / 1e3);
+
+                if (errors)
+                        fprintf(stdout, "  errors=%lu", errors);
+
+                fprintf(stdout, "\n");
+                fflush(stdout);
+
+clean_keys:
+                rsa_public_key_clean(&pub);
+                rsa_private_key_clean(&priv);
+
+                if (ret)
+                        break;
+        }
+
+        free(hist);
+
+        return ret;
+}
+
+struct bench_oaep {
+        struct rsa_private      *priv;
+        struct rsa_public       *pub;
+        int                     bits;
+        uint64_t                k;
+        uint8_t                 *seed;          /* db_len octets */
+        uint8_t                 *mask;          /* db_len octets */
+        uint8_t                 msg[64];
+        mpz_t                   c;
+        uint64_t                errors;
+};
+
+/* MGF1 the straightforward way: whole Z re-hashed for every counter */
+static void bench_mgf1_naive(const uint8_t *z, size_t z_len, uint8_t *mask,
+                             size_t mask_len, int bits)
+{
+        uint8_t md[SHA512_HASH_BITS / 8];
+        size_t hlen = bits / 8;
+        struct sha512_ctx ctx;
+        uint8_t C[4];
+
+        for (uint32_t i = 0; (size_t)i * hlen < mask_len; ++i) {
+                C[0] = (uint8_t)(i >> 24);
+                C[1] = (uint8_t)(i >> 16);
+                C[2] = (uint8_t)(i >> 8);
+                C[3] = (uint8_t)i;
+
+                if (bits == SHA384_HASH_BITS)
+                        sha384_ctx_init(&ctx);
+                else
+                        sha512_ctx_init(&ctx);
+
+                sha512_ctx_update(&ctx, z, z_len);
+                sha512_ctx_update(&ctx, C, sizeof(C));
+                sha512_ctx_conclude(&ctx);
+                sha512_ctx_digest(&ctx, md);
+
+                memcpy(mask + i * hlen, md,
+                       mask_len - i * hlen < hlen ? mask_len - i * hlen : hlen);
+        }
+}
+
+/* both masks of one OAEP operation: dbMask from seed, seedMask from maskedDB */
+static void bench_oaep_mgf1_naive(struct bench_oaep *o)
+{
+        uint64_t hlen = o->bits / 8, db_len = o->k - hlen - 1;
+
+        bench_mgf1_naive(o->seed, hlen, o->mask, db_len, o->bits);
+        bench_mgf1_naive(o->seed, db_len, o->mask, hlen, o->bits);
+}
+
+static void bench_oaep_mgf1(struct bench_oaep *o)
+{
+        uint64_t hlen = o->bits / 8, db_len = o->k - hlen - 1;
+
+        if (o->bits == SHA384_HASH_BITS) {
+                sha384_mgf1(o->seed, hlen, o->mask, db_len);
+                sha384_mgf1(o->seed, db_len, o->mask, hlen);
+        } else {
+                sha512_mgf1(o->seed, hlen, o->mask, db_len);
+                sha512_mgf1(o->seed, db_len, o->mask, hlen);
+        }
+}
+
+static void bench_oaep_encrypt(struct bench_oaep *o)
+{
+        if (rsa_public_key_encrypt_oaep(o->pub, o->c, o->msg, sizeof(o->msg),
+                                        NULL, 0, o->bits))
+                o->errors++;
+}
+
+static void bench_oaep_decrypt(struct bench_oaep *o)
+{
+        uint8_t msg[sizeof(o->msg)];
+        uint64_t len = sizeof(msg);
+
+        if (rsa_private_key_decrypt_oaep(o->priv, msg, &len, o->c, NULL, 0,
+                                         o->bits) || len != sizeof(msg))
+                o->errors++;
+}
+
+/**
+ * bench_oaep_time() - mean microseconds of @fn over @ns nanoseconds
+ */
+static double bench_oaep_time(void (*fn)(struct bench_oaep *),
+                              struct bench_oaep *o, uint64_t ns)
+{
+        uint64_t t0 = clock_ns(), t1, n = 0;
+
+        do {
+                fn(o);
+                n++;
+                t1 = clock_ns();
+        } while (t1 - t0 < ns);
+
+        return (double)(t1 - t0) / n / 1e3;
+}
+
+/**
+ * bench_oaep() - OAEP padding cost against the exponentiation
+ *
+ * MGF1 time covers both masks of one operation, once re-hashing the
+ * whole seed per counter and once with midstate and lanes
+ *
+ * @param   opts: benchmark options
+ * @return  0 on success
+ */
+static int bench_oaep(const struct bench_opts *opts)
+{
+        static const int hash_bits[] = { SHA384_HASH_BITS, SHA512_HASH_BITS };
+        uint64_t ns = (uint64_t)opts->duration * 1000000000UL / 4;
+        struct rsa_private priv;
+        struct rsa_public pub;
+        struct bench_oaep o;
+        double naive, lanes, enc, dec;
+        int ret = 0;
+
+        memset(&o, 0x00, sizeof(o));
+        o.priv = &priv;
+        o.pub = &pub;
+        o.k = (opts->key_len + 7) / 8;
+
+        o.seed = calloc(1, o.k);
+        o.mask = calloc(1, o.k);
+        if (!o.seed || !o.mask) {
+                ret = -ENOMEM;
+                goto free_mem;
+        }
+
+        mpz_init(o.c);
+        rsa_private_key_init(&priv);
+        rsa_public_key_init(&pub);
+
+        fprintf(stdout, "generating %lu-bit RSA key pair...\n", opts->key_len);
+
+        if (rsa_private_key_generate(&priv, opts->key_len) ||
+            rsa_public_key_generate(&pub, &priv)) {
+                ret = -EFAULT;
+                goto clean_keys;
+        }
+
+        fprintf(stdout, "%lu octets message, %.2fs per measurement\n",
+                sizeof(o.msg), (double)ns / 1e9);
+        fprintf(stdout, "%-8s %12s %12s %12s %12s %8s\n", "hash", "mgf1 naive",
+                "mgf1 lanes", "encrypt us", "decrypt us", "mgf1 %");
+
+        for (uint32_t i = 0; i < ARRAY_SIZE(hash_bits); ++i) {
+                o.bits = hash_bits[i];
+                o.errors = 0;
+
+                if (o.k < 2 * (uint64_t)o.bits / 8 + 2 + sizeof(o.msg)) {
+                        fprintf(stdout, "SHA-%-4d key too short\n", o.bits);
+                        continue;
+                }
+
+                naive = bench_oaep_time(bench_oaep_mgf1_naive, &o, ns);
+                lanes = bench_oaep_time(bench_oaep_mgf1, &o, ns);
+                enc = bench_oaep_time(bench_oaep_encrypt, &o, ns);
+                dec = bench_oaep_time(bench_oaep_decrypt, &o, ns);
+
+                /* encrypt and decrypt run MGF1 twice each */
+                fprintf(stdout, "SHA-%-4d %12.2f %12.2f %12.1f %12.1f %7.2f%%",
+                        o.bits, naive, lanes, enc, dec,
+                        lanes * 2 / (enc + dec) * 100.0);
+
+                if (o.errors)
+                        fprintf(stdout, "  errors=%lu", o.errors);
+
+                fprintf(stdout, "\n");
+        }
+
+clean_keys:
+        rsa_public_key_clean(&pub);
+        rsa_private_key_clean(&priv);
+        mpz_clear(o.c);
+free_mem:
+        free(o.mask);
+        free(o.seed);
+
+        return ret;
+}
+
+struct bench_aff_key {
+        struct rsa_private      priv;
+        struct rsa_public       pub;
+        uint8_t                 digest[SHA512_HASH_BITS / 8];
+        mpz_t                   sig;            /* signature of digest */
+};
+
+struct bench_aff_req {
+        struct key_sched_req    req;            /* first, done() casts back */
+        struct bench_affinity   *ba;
+        uint64_t                t0;
+        mpz_t                   out;
+        struct bench_aff_req    *next_free;
+};
+
+struct bench_affinity {
+        struct bench_aff_key    *keys;
+        uint32_t                n_keys;
+        double                  *cdf;           /* zipf, by key index */
+
+        pthread_mutex_t         lock;
+        pthread_cond_t          cv;
+        struct bench_aff_req    *free;
+        struct lat_hist         hist;
+        uint64_t                done;
+        uint64_t                errors;
+};
+
+static void bench_affinity_done(struct key_sched_req *req)
+{
+        struct bench_aff_req *r = (struct bench_aff_req *)req;
+        struct bench_affinity *ba = r->ba;
+        uint64_t t1 = clock_ns();
+
+        pthread_mutex_lock(&ba->lock);
+
+        hist_record(&ba->hist, t1 - r->t0);
+        ba->done++;
+        ba->errors += req->ret != 0;
+
+        r->next_free = ba->free;
+        ba->free = r;
+        pthread_cond_signal(&ba->cv);
+
+        pthread_mutex_unlock(&ba->lock);
+}
+
+/* key index of uniform @u, first cdf entry >= u */
+static uint32_t bench_affinity_pick(const struct bench_affinity *ba, double u)
+{
+        uint32_t lo = 0, hi = ba->n_keys - 1;
+
+        while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+
+                if (ba->cdf[mid] < u)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+/**
+ * bench_affinity_keys() - n keys out of pairs of a small prime pool
+ *
+ * Distinct moduli is all the scheduler cares about, so m primes give
+ * m * (m - 1) / 2 keys instead of generating 2n primes
+ */
+static int bench_affinity_keys(struct bench_affinity *ba, uint64_t key_len)
+{
+        uint64_t bits = key_len / 2;
+        uint32_t m = 2, i, j, k = 0;
+        mpz_t *primes;
+        int ret = 0;
+
+        while (m * (m - 1) / 2 < ba->n_keys)
+                m++;
+
+        primes = calloc(m, sizeof(*primes));
+        if (!primes)
+                return -ENOMEM;
+
+        for (i = 0; i < m; ++i) {
+                mpz_init(primes[i]);
+
+                /* top two bits set, product is exactly key_len bits */
+                do {
+                        mpz_rand_bitlen(primes[i], bits);
+                        mpz_setbit(primes[i], bits - 1);
+                        mpz_setbit(primes[i], bits - 2);
+                        mpz_nextprime(primes[i], primes[i]);
+                } while (mpz_sizeinbase(primes[i], 2) != bits);
+        }
+
+        for (i = 0; i < m && k < ba->n_keys; ++i) {
+                for (j = i + 1; j < m && k < ba->n_keys; ++j) {
+                        struct bench_aff_key *key = &ba->keys[k];
+
+                        if (rsa_private_key_from_primes(&key->priv, primes[i], primes[j]))
+                                continue;
+
+                        ret = rsa_public_key_generate(&key->pub, &key->priv);
+                        if (ret)
+                                goto clean_primes;
+
+                        sha512_buffer_process(&k, sizeof(k), key->digest);
+
+                        ret = rsa_private_key_sign(&key->priv, key->sig, key->digest,
+                                                   sizeof(key->digest));
+                        if (ret)
+                                goto clean_primes;
+
+                        k++;
+                }
+        }
+
+        if (k < ba->n_keys)
+                ret = -EAGAIN;
+
+clean_primes:
+        for (i = 0; i < m; ++i)
+                mpz_clear(primes[i]);
+
+        free(primes);
+
+        return ret;
+}
+
+/**
+ * bench_affinity_run() - closed loop of BENCH_AFFINITY_INFLIGHT requests
+ *
+ * @return  requests per second
+ */
+static double bench_affinity_run(const struct bench_opts *opts,
+                                 struct bench_affinity *ba,
+                                 const struct key_sched_opts *so,
+                                 struct key_sched_stats *stats)
+{
+        uint64_t deadline = (uint64_t)opts->duration * 1000000000UL;
+        uint32_t mix = opts->mix[BENCH_OP_SIGN] + opts->mix[BENCH_OP_VERIFY];
+        uint64_t rng = 0x9e3779b97f4a7c15UL;
+        struct bench_aff_req *reqs, *r;
+        struct bench_aff_key *key;
+        struct key_sched sched;
+        uint64_t t_start, t_end, submitted = 0;
+        uint32_t i;
+
+        memset(stats, 0x00, sizeof(*stats));
+
+        reqs = calloc(BENCH_AFFINITY_INFLIGHT, sizeof(*reqs));
+        if (!reqs)
+                return 0.0;
+
+        ba->free = NULL;
+        for (i = 0; i < BENCH_AFFINITY_INFLIGHT; ++i) {
+                mpz_init(reqs[i].out);
+                reqs[i].ba = ba;
+                reqs[i].next_free = ba->free;
+                ba->free = &reqs[i];
+        }
+
+        hist_reset(&ba->hist);
+        ba->done = 0;
+        ba->errors = 0;
+
+        if (key_sched_init(&sched, so)) {
+                t_end = t_start = 0;
+                goto clean_reqs;
+        }
+
+        t_start = clock_ns();
+
+        while (clock_ns() - t_start < deadline) {
+                pthread_mutex_lock(&ba->lock);
+                while (!ba->free)
+                        pthread_cond_wait(&ba->cv, &ba->lock);
+
+                r = ba->free;
+                ba->free = r->next_free;
+                pthread_mutex_unlock(&ba->lock);
+
+                i = bench_affinity_pick(ba, (double)(bench_rand(&rng) >> 11) * 0x1.0p-53);
+                key = &ba->keys[i];
+
+                memset(&r->req, 0x00, sizeof(r->req));
+                r->req.key_id = i;
+                r->req.digest = key->digest;
+                r->req.len = sizeof(key->digest);
+                r->req.done = bench_affinity_done;
+
+                if (bench_rand(&rng) % mix < opts->mix[BENCH_OP_SIGN]) {
+                        r->req.op = KEY_SCHED_SIGN;
+                        r->req.priv = &key->priv;
+                        r->req.sig = r->out;
+                } else {
+                        r->req.op = KEY_SCHED_VERIFY;
+                        r->req.pub = &key->pub;
+                        r->req.sig = key->sig;
+                }
+
+                r->t0 = clock_ns();
+
+                submitted++;
+
+                if (key_sched_submit(&sched, &r->req)) {
+                        r->req.ret = -ESHUTDOWN;
+                        bench_affinity_done(&r->req);
+                }
+        }
+
+        /* let the in-flight requests finish before reading counters */
+        pthread_mutex_lock(&ba->lock);
+        while (ba->done < submitted)
+                pthread_cond_wait(&ba->cv, &ba->lock);
+        pthread_mutex_unlock(&ba->lock);
+
+        t_end = clock_ns();
+
+        key_sched_stats(&sched, stats);
+        key_sched_exit(&sched);
+
+clean_reqs:
+        for (i = 0; i < BENCH_AFFINITY_INFLIGHT; ++i)
+                mpz_clear(reqs[i].out);
+
+        free(reqs);
+
+        if (t_end == t_start)
+                return 0.0;
+
+        return (double)ba->done / ((double)(t_end - t_start) / 1e9);
+}
+
+/**
+ * bench_affinity() - FIFO pool against key affinity scheduler
+ *
+ * Requests for opts->keys keys, zipf distributed, sign:verify as in
+ * the mix. Both configs run opts->threads workers; the FIFO one hands
+ * every request to the next worker at once, the affinity one gathers
+ * per key owner and runs buckets back to back
+ *
+ * @param   opts: benchmark options
+ * @return  0 on success
+ */
+static int bench_affinity(const struct bench_opts *opts)
+{
+        const struct {
+                const char              *name;
+                struct key_sched_opts   so;
+        } configs[] = {
+                { "fifo",     { opts->threads, 0, 1, 0, 0 } },
+                { "affinity", { opts->threads, KEY_SCHED_WINDOW_US_DEFAULT, 0, 0,
+                                KEY_SCHED_AFFINITY | KEY_SCHED_PIN } },
+        };
+        struct key_sched_stats stats;
+        struct bench_affinity ba;
+        double sum = 0.0, tput;
+        uint32_t i;
+        int ret = 0;
+
+        if (!opts->mix[BENCH_OP_SIGN] && !opts->mix[BENCH_OP_VERIFY])
+                return -EINVAL;
+
+        memset(&ba, 0x00, sizeof(ba));
+        pthread_mutex_init(&ba.lock, NULL);
+        pthread_cond_init(&ba.cv, NULL);
+        ba.n_keys = opts->keys;
+
+        ba.keys = calloc(ba.n_keys, sizeof(*ba.keys));
+        ba.cdf = calloc(ba.n_keys, sizeof(*ba.cdf));
+        if (!ba.keys || !ba.cdf) {
+                ret = -ENOMEM;
+                goto free_mem;
+        }
+
+        for (i = 0; i < ba.n_keys; ++i) {
+                rsa_private_key_init(&ba.keys[i].priv);
+                rsa_public_key_init(&ba.keys[i].pub);
+                mpz_init(ba.keys[i].sig);
+
+                /* P(rank r) ~ 1 / r^s */
+                sum += 1.0 / pow(i + 1, opts->zipf);
+                ba.cdf[i] = sum;
+        }
+
+        for (i = 0; i < ba.n_keys; ++i)
+                ba.cdf[i] /= sum;
+
+        fprintf(stdout, "generating %u %lu-bit keys...\n", ba.n_keys, opts->key_len);
+
+        ret = bench_affinity_keys(&ba, opts->key_len);
+        if (ret) {
+                fprintf(stderr, "key generation failed: %d\n", ret);
+                goto clean_keys;
+        }
+
+        fprintf(stdout, "%u keys zipf s=%.2f, sign:verify %u:%u, %u workers, "
+                        "%u in flight, %us per config\n",
+                ba.n_keys, opts->zipf, opts->mix[BENCH_OP_SIGN],
+                opts->mix[BENCH_OP_VERIFY], opts->threads,
+                BENCH_AFFINITY_INFLIGHT, opts->duration);
+        fprintf(stdout, "%-10s %10s %10s %10s %10s %10s %8s %8s\n", "sched",
+                "ops/s", "p50 us", "p99 us", "p99.9 us", "req/batch",
+                "warm %", "errors");
+
+        for (i = 0; i < ARRAY_SIZE(configs); ++i) {
+                tput = bench_affinity_run(opts, &ba, &configs[i].so, &stats);
+                if (!stats.buckets) {
+                        ret = -EFAULT;
+                        break;
+                }
+
+                fprintf(stdout, "%-10s %10.0f %10.1f %10.1f %10.1f %10.2f %7.1f%% %8lu\n",
+                        configs[i].name, tput,
+                        hist_percentile(&ba.hist, 50.0) / 1e3,
+                        hist_percentile(&ba.hist, 99.0) / 1e3,
+                        hist_percentile(&ba.hist, 99.9) / 1e3,
+                        (double)stats.requests / stats.buckets,
+                        (double)stats.warm / stats.buckets * 100.0, ba.errors);
+                fflush(stdout);
+        }
+
+clean_keys:
+        for (i = 0; i < ba.n_keys; ++i) {
+                mpz_clear(ba.keys[i].sig);
+                rsa_public_key_clean(&ba.keys[i].pub);
+                rsa_private_key_clean(&ba.keys[i].priv);
+        }
+free_mem:
+        free(ba.cdf);
+        free(ba.keys);
+        pthread_cond_destroy(&ba.cv);
+        pthread_mutex_destroy(&ba.lock);
+
+        return ret;
+}
+
+/**
+ * bench_index_queries() - odd ones present, even ones random
+ */
+static uint8_t *bench_index_queries(const uint8_t *digests, uint64_t entries,
+                                    uint64_t n, uint64_t *rng)
+{
+        uint8_t *q = malloc(n * DIGEST_INDEX_DIGEST_LEN);
+        uint8_t *d;
+
+        if (!q)
+                return NULL;
+
+        for (uint64_t i = 0; i < n; ++i) {
+                d = q + i * DIGEST_INDEX_DIGEST_LEN;
+
+                if (i & 1) {
+                        memcpy(d, digests + (bench_rand(rng) % entries) *
+                                            DIGEST_INDEX_DIGEST_LEN,
+                               DIGEST_INDEX_DIGEST_LEN);
+                } else {
+                        for (int j = 0; j < DIGEST_INDEX_DIGEST_LEN; j += 8) {
+                                uint64_t r = bench_rand(rng);
+
+                                memcpy(d + j, &r, sizeof(r));
+                        }
+                }
+        }
+
+        return q;
+}
+
+/**
+ * bench_index() - build, open and lookup cost of signed digest index
+ *
+ * opts->entries random digests go through a sha512sum style list,
+ * lookups are a random mix of present and absent digests
+ *
+ * @param   opts: benchmark options
+ * @return  0 on success
+ */
+static int bench_index(const struct bench_opts *opts)
+{
+        uint64_t entries = opts->entries, rng = 0x2545F4914F6CDD1DUL;
+        char hex[CAS_HEX_LEN + 1];
+        struct digest_index idx;
+        struct rsa_private priv;
+        struct rsa_public pub;
+        struct lat_hist hist;
+        uint8_t *digests, *q = NULL, *found = NULL;
+        uint64_t i, t0, t1, hits = 0, hits_batch = 0;
+        double t_build, t_verify, t_open, t_batch;
+        FILE *list;
+        int ret = 0;
+
+        digests = malloc(entries * DIGEST_INDEX_DIGEST_LEN);
+        list = tmpfile();
+        if (!digests || !list) {
+                ret = -ENOMEM;
+                goto free_mem;
+        }
+
+        for (i = 0; i < entries * DIGEST_INDEX_DIGEST_LEN; i += 8) {
+                uint64_t r = bench_rand(&rng);
+
+                memcpy(digests + i, &r, sizeof(r));
+        }
+
+        for (i = 0; i < entries; ++i) {
+                cas_digest_hex(digests + i * DIGEST_INDEX_DIGEST_LEN, hex);
+                fprintf(list, "%s  file%lu\n", hex, i);
+        }
+
+        rewind(list);
+
+        rsa_private_key_init(&priv);
+        rsa_public_key_init(&pub);
+
+        fprintf(stdout, "generating %lu-bit RSA key pair...\n", opts->key_len);
+
+        if (rsa_private_key_generate(&priv, opts->key_len) ||
+            rsa_public_key_generate(&pub, &priv)) {
+                ret = -EFAULT;
+                goto clean_keys;
+        }
+
+        t0 = clock_ns();
+        ret = digest_index_build(list, BENCH_INDEX_PATH, &priv, NULL);
+        t_build = (clock_ns() - t0) / 1e6;
+        if (ret) {
+                fprintf(stderr, "failed to build index: %s\n", strerror(-ret));
+                goto clean_keys;
+        }
+
+        t0 = clock_ns();
+        ret = digest_index_open(&idx, BENCH_INDEX_PATH, &pub);
+        t_verify = (clock_ns() - t0) / 1e6;
+        if (ret) {
+                fprintf(stderr, "failed to open index: %s\n", strerror(-ret));
+                goto unlink_idx;
+        }
+
+        digest_index_close(&idx);
+
+        t0 = clock_ns();
+        ret = digest_index_open(&idx, BENCH_INDEX_PATH, NULL);
+        t_open = (clock_ns() - t0) / 1e6;
+        if (ret)
+                goto unlink_idx;
+
+        q = bench_index_queries(digests, entries, BENCH_INDEX_LOOKUPS, &rng);
+        found = malloc(BENCH_INDEX_LOOKUPS);
+        if (!q || !found) {
+                ret = -ENOMEM;
+                goto close_idx;
+        }
+
+        /* fault every page in, measure warm lookups */
+        digest_index_lookup_batch(&idx, q, BENCH_INDEX_LOOKUPS, found);
+
+        hist_reset(&hist);
+
+        for (i = 0; i < BENCH_INDEX_LOOKUPS; ++i) {
+                t0 = clock_ns();
+                hits += (uint64_t)digest_index_lookup(&idx, q + i * DIGEST_INDEX_DIGEST_LEN);
+                t1 = clock_ns();
+
+                hist_record(&hist, t1 - t0);
+        }
+
+        t0 = clock_ns();
+        digest_index_lookup_batch(&idx, q, BENCH_INDEX_LOOKUPS, found);
+        t_batch = (double)(clock_ns() - t0) / BENCH_INDEX_LOOKUPS;
+
+        for (i = 0; i < BENCH_INDEX_LOOKUPS; ++i)
+                hits_batch += found[i];
+
+        fprintf(stdout, "%lu digests, %u-bit buckets, %.1f MiB file\n", idx.count,
+                idx.hdr->bucket_bits, idx.map_size / 1048576.0);
+        fprintf(stdout, "build %.1f ms, open + verify %.1f ms, open %.3f ms\n",
+                t_build, t_verify, t_open);
+        fprintf(stdout, "%-10s %10s %10s %10s %10s\n", "lookup", "mean ns",
+                "p50 ns", "p99 ns", "hits");
+        fprintf(stdout, "%-10s %10lu %10lu %10lu %10lu\n", "single", hist_mean(&hist),
+                hist_percentile(&hist, 50.0), hist_percentile(&hist, 99.0), hits);
+        fprintf(stdout, "%-10s %10.0f %10s %10s %10lu\n", "batch", t_batch, "-", "-",
+                hits_batch);
+
+        /* odd queries are present, even ones present only by chance */
+        if (hits != hits_batch || hits < BENCH_INDEX_LOOKUPS / 2) {
+                fprintf(stderr, "lookup mismatch\n");
+                ret = -EFAULT;
+        }
+
+close_idx:
+        digest_index_close(&idx);
+unlink_idx:
+        unlink(BENCH_INDEX_PATH);
+clean_keys:
+        rsa_public_key_clean(&pub);
+        rsa_private_key_clean(&priv);
+free_mem:
+        free(found);
+        free(q);
+        if (list)
+                fclose(list);
+        free(digests);
+
+        return ret;
+}
+
+/**
+ * bench_midstate() - signer cost of full payload against midstate
+ *
+ * Shipping the payload, the signer hashes all of it before signing.
+ * With a midstate it concludes at most two blocks, whatever the size.
+ *
+ * @param   opts: benchmark options
+ * @return  0 on success
+ */
+static int bench_midstate(const struct bench_opts *opts)
+{
+        static const uint64_t sizes[] = { 64, 4 << 10, 64 << 10, 1 << 20, 16 << 20 };
+        uint64_t ns = (uint64_t)opts->duration * 1000000000UL / ARRAY_SIZE(sizes) / 2;
+        uint8_t digest[SHA512_HASH_BITS / 8];
+        struct sha512_midstate ms;
+        struct sha512_ctx ctx;
+        struct rsa_private priv;
+        struct rsa_public pub;
+        uint64_t t0, t1, n;
+        double full, mid, client;
+        uint8_t *payload;
+        int ret = 0;
+        mpz_t s;
+
+        payload = calloc(1, sizes[ARRAY_SIZE(sizes) - 1]);
+        if (!payload)
+                return -ENOMEM;
+
+        mpz_init(s);
+        rsa_private_key_init(&priv);
+        rsa_public_key_init(&pub);
+
+        fprintf(stdout, "generating %lu-bit RSA key pair...\n", opts->key_len);
+
+        if (rsa_private_key_generate(&priv, opts->key_len) ||
+            rsa_public_key_generate(&pub, &priv)) {
+                ret = -EFAULT;
+                goto clean_keys;
+        }
+
+        fprintf(stdout, "%-12s %14s %14s %14s\n", "payload", "signer full us",
+                "signer mid us", "client hash us");
+
+        for (uint32_t i = 0; i < ARRAY_SIZE(sizes); ++i) {
+                t0 = clock_ns();
+                n = 0;
+                do {
+                        sha512_ctx_init(&ctx);
+                        sha512_ctx_update(&ctx, payload, sizes[i]);
+                        sha512_ctx_conclude(&ctx);
+                        sha512_ctx_digest(&ctx, digest);
+                        rsa_private_key_sign(&priv, s, digest, sizeof(digest));
+                        n++;
+                        t1 = clock_ns();
+                } while (t1 - t0 < ns);
+
+                full = (double)(t1 - t0) / n / 1e3;
+
+                /* client side, once per request wherever it runs */
+                t0 = clock_ns();
+                sha512_ctx_init(&ctx);
+                sha512_ctx_update(&ctx, payload, sizes[i]);
+                sha512_ctx_export(&ctx, &ms);
+                client = (clock_ns() - t0) / 1e3;
+
+                t0 = clock_ns();
+                n = 0;
+                do {
+                        ret = rsa_private_key_sign_midstate(&priv, s, &ms,
+                                                            SHA512_HASH_BITS, digest);
+                        if (ret)
+                                goto clean_keys;
+
+                        n++;
+                        t1 = clock_ns();
+                } while (t1 - t0 < ns);
+
+                mid = (double)(t1 - t0) / n / 1e3;
+
+                ret = rsa_public_key_verify(&pub, s, digest, sizeof(digest));
+                if (ret) {
+                        fprintf(stderr, "midstate signature does not verify\n");
+                        goto clean_keys;
+                }
+
+                fprintf(stdout, "%-12lu %14.1f %14.1f %14.1f\n", sizes[i], full, mid,
+                        client);
+                fflush(stdout);
+        }
+
+clean_keys:
+        rsa_public_key_clean(&pub);
+        rsa_private_key_clean(&priv);
+        mpz_clear(s);
+        free(payload);
+
+        return ret;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [options]\n"
+                "  -m mode      scaling (default), audit, keygen, rebalanced, oaep,\n"
+                "               affinity, index, midstate\n"
+                "  -t threads   max thread count (default: online CPUs)\n"
+                "  -d seconds   duration per step (default %d)\n"
+                "  -k bits      RSA key length (default %d)\n"
+                "  -s bytes     hash payload size (default %d)\n"
+                "  -x S:V:H     sign:verify:hash mix weights (default 1:4:4)\n"
+                "  -o path      audit log path (default %s)\n"
+                "  -b usec      audit log group commit budget (default %d)\n"
+                "  -e bits      rebalanced CRT exponent length (default: shortest\n"
+                "               allowed for the key length)\n"
+                "  -K keys      distinct keys of affinity mode (default %d)\n"
+                "  -z s         zipf exponent of key popularity (default 1.0)\n"
+                "  -N entries   digests in index mode (default %d)\n"
+                "  -L           run from locked, prefaulted, huge page memory\n",
+                prog, BENCH_DURATION_DEFAULT, BENCH_KEY_LENGTH_DEFAULT,
+                BENCH_PAYLOAD_DEFAULT, BENCH_AUDIT_PATH_DEFAULT,
+                AUDIT_BUDGET_US_DEFAULT,
+                BENCH_AFFINITY_KEYS_DEFAULT, BENCH_INDEX_ENTRIES_DEFAULT);
+}
+
+int main(int argc, char *argv[])
+{
+        struct bench_opts opts = {
+                .threads  = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN),
+                .duration = BENCH_DURATION_DEFAULT,
+                .key_len  = BENCH_KEY_LENGTH_DEFAULT,
+                .payload  = BENCH_PAYLOAD_DEFAULT,
+                .mix      = { 1, 4, 4 },
+                .path     = BENCH_AUDIT_PATH_DEFAULT,
+                .budget_us = AUDIT_BUDGET_US_DEFAULT,
+                .keys     = BENCH_AFFINITY_KEYS_DEFAULT,
+                .zipf     = 1.0,
+                .entries  = BENCH_INDEX_ENTRIES_DEFAULT,
+        };
+        struct secure_mem_stats stats;
+        const char *mode = "scaling";
+        int ret;
+        int c;
+
+        while ((c = getopt(argc, argv, "m:t:d:k:s:x:o:b:e:K:z:N:Lh")) != -1) {
+                switch (c) {
+                        case 'm':
+                                mode = optarg;
+                                break;
+
+                        case 't':
+                                opts.threads = (uint32_t)strtoul(optarg, NULL, 0);
+                                break;
+
+                        case 'd':
+                                opts.duration = (uint32_t)strtoul(optarg, NULL, 0);
+                                break;
+
+                        case 'k':
+                                opts.key_len = strtoull(optarg, NULL, 0);
+                                break;
+
+                        case 's':
+                                opts.payload = strtoull(optarg, NULL, 0);
+                                break;
+
+                        case 'x':
+                                if (sscanf(optarg, "%u:%u:%u",
+                                           &opts.mix[BENCH_OP_SIGN],
+                                           &opts.mix[BENCH_OP_VERIFY],
+                                           &opts.mix[BENCH_OP_HASH]) != 3) {
+                                        usage(argv[0]);
+                                        return EXIT_FAILURE;
+                                }
+                                break;
+
+                        case 'o':
+                                opts.path = optarg;
+                                break;
+
+                        case 'e':
+                                opts.exp_bits = strtoull(optarg, NULL, 0);
+                                break;
+
+                        case 'K':
+                                opts.keys = (uint32_t)strtoul(optarg, NULL, 0);
+                                break;
+
+                        case 'z':
+                                opts.zipf = strtod(optarg, NULL);
+                                break;
+
+                        case 'N':
+                                opts.entries = strtoull(optarg, NULL, 0);
+                                break;
+
+                        case 'L':
+                                opts.locked = 1;
+                                break;
+
+                        case 'b':
+                                opts.budget_us = (uint32_t)strtoul(optarg, NULL, 0);
+                                break;
+
+                        default:
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
+                }
+        }
+
+        if (!opts.threads)
+                opts.threads = 1;
+
+        if (opts.key_len % 16 || !opts.duration || !opts.keys || !opts.entries) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (!opts.exp_bits)
+                opts.exp_bits = rsa_rebalanced_exp_bits_min(opts.key_len);
+
+        if (opts.locked) {
+                ret = secure_mem_init(SECURE_MEM_SIZE_DEFAULT,
+                                      SECURE_MEM_HUGEPAGE | SECURE_MEM_GMP);
+                if (ret) {
+                        fprintf(stderr, "failed to lock memory: %s\n", strerror(-ret));
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (!strcmp(mode, "scaling"))
+                ret = bench_scaling(&opts);
+        else if (!strcmp(mode, "audit"))
+                ret = bench_audit(&opts);
+        else if (!strcmp(mode, "keygen"))
+                ret = bench_keygen(&opts);
+        else if (!strcmp(mode, "rebalanced"))
+                ret = bench_rebalanced(&opts);
+        else if (!strcmp(mode, "oaep"))
+                ret = bench_oaep(&opts);
+        else if (!strcmp(mode, "affinity"))
+                ret = bench_affinity(&opts);
+        else if (!strcmp(mode, "index"))
+                ret = bench_index(&opts);
+        else if (!strcmp(mode, "midstate"))
+                ret = bench_midstate(&opts);
+        else
+                ret = -EINVAL;
+
+        if (opts.locked) {
+                secure_mem_stats(&stats);
+                fprintf(stdout, "locked region: %zu KiB carved, %lu fallback allocations\n",
+                        stats.used >> 10, stats.fallback);
+                secure_mem_exit();
+        }
+
+        if (ret == -EINVAL)
+                usage(argv[0]);
+
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
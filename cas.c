@@ -0,0 +1,680 @@
+/**
+ * cas.c - Content-addressable blob store keyed by SHA-512
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "cas.h"
+#include "misc_helper.h"
+
+/* "ab/cd/" + rest + NUL */
+#define CAS_OBJECT_PATH_LEN             (CAS_HEX_LEN + CAS_SHARD_LEVELS + 1)
+
+static _Atomic uint64_t cas_tmp_seq;
+
+void cas_digest_hex(const uint8_t *digest, char *hex)
+{
+        static const char xdigit[] = "0123456789abcdef";
+
+        for (uint32_t i = 0; i < CAS_DIGEST_LEN; ++i) {
+                hex[i * 2] = xdigit[digest[i] >> 4];
+                hex[i * 2 + 1] = xdigit[digest[i] & 0x0f];
+        }
+
+        hex[CAS_HEX_LEN] = '\0';
+}
+
+static int hex_nibble(char c)
+{
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+
+        return -1;
+}
+
+/**
+ * cas_hex_digest() - parse CAS_HEX_LEN hex digits
+ *
+ * @param hex: hex string, need not be terminated after the digits
+ * @param digest: CAS_DIGEST_LEN octets out
+ * @return 0 on success, -EINVAL on malformed input
+ */
+int cas_hex_digest(const char *hex, uint8_t *digest)
+{
+        int hi, lo;
+
+        for (uint32_t i = 0; i < CAS_DIGEST_LEN; ++i) {
+                hi = hex_nibble(hex[i * 2]);
+                if (hi < 0)
+                        return -EINVAL;
+
+                lo = hex_nibble(hex[i * 2 + 1]);
+                if (lo < 0)
+                        return -EINVAL;
+
+                digest[i] = (uint8_t)(hi << 4 | lo);
+        }
+
+        return 0;
+}
+
+/* objects/ relative path: ab/cd/<rest> */
+static void cas_object_path(const uint8_t *digest, char *path)
+{
+        char hex[CAS_HEX_LEN + 1];
+        char *p = path;
+
+        cas_digest_hex(digest, hex);
+
+        for (uint32_t i = 0; i < CAS_SHARD_LEVELS; ++i) {
+                memcpy(p, hex + i * CAS_SHARD_HEX, CAS_SHARD_HEX);
+                p += CAS_SHARD_HEX;
+                *p++ = '/';
+        }
+
+        strcpy(p, hex + CAS_SHARD_LEVELS * CAS_SHARD_HEX);
+}
+
+static int cas_mkdir_shards(struct cas *cas, const char *path)
+{
+        char dir[CAS_OBJECT_PATH_LEN];
+        size_t len = 0;
+
+        for (uint32_t i = 0; i < CAS_SHARD_LEVELS; ++i) {
+                len += CAS_SHARD_HEX + 1;
+                memcpy(dir, path, len - 1);
+                dir[len - 1] = '\0';
+
+                if (mkdirat(cas->objects_fd, dir, 0755) && errno != EEXIST)
+                        return -errno;
+        }
+
+        return 0;
+}
+
+/**
+ * cas_sync_dirs() - make the entries leading to an object durable
+ *
+ * fsync() shard directories bottom up and objects/ itself, a rename
+ * or mkdir is only durable once the directory holding it is synced.
+ *
+ * @param cas: pointer to store
+ * @param path: objects/ relative path of the object
+ * @return 0 on success
+ */
+static int cas_sync_dirs(struct cas *cas, const char *path)
+{
+        char dir[CAS_OBJECT_PATH_LEN];
+        size_t len;
+        int fd, ret = 0;
+
+        for (uint32_t i = CAS_SHARD_LEVELS; i > 0 && !ret; --i) {
+                len = i * (CAS_SHARD_HEX + 1) - 1;
+                memcpy(dir, path, len);
+                dir[len] = '\0';
+
+                fd = openat(cas->objects_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd < 0)
+                        return -errno;
+
+                if (fsync(fd))
+                        ret = -errno;
+
+                close(fd);
+        }
+
+        if (!ret && fsync(cas->objects_fd))
+                ret = -errno;
+
+        return ret;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+        const uint8_t *p = buf;
+        ssize_t n;
+
+        while (len) {
+                n = write(fd, p, len);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                p += n;
+                len -= (size_t)n;
+        }
+
+        return 0;
+}
+
+/**
+ * cas_copy_hashed() - copy @src to @dst (if >= 0) and hash on the way
+ *
+ * @return 0 on success, bytes in @size
+ */
+static int cas_copy_hashed(int src, int dst, uint8_t *buf, uint8_t *digest,
+                           uint64_t *size)
+{
+        struct sha512_ctx ctx;
+        ssize_t n;
+        int ret = 0;
+
+        sha512_ctx_init(&ctx);
+        *size = 0;
+
+        while (1) {
+                n = read(src, buf, CAS_COPY_BUF_SIZE);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        ret = -errno;
+                        break;
+                }
+
+                if (!n)
+                        break;
+
+                sha512_ctx_update(&ctx, buf, (size_t)n);
+                *size += (uint64_t)n;
+
+                if (dst >= 0) {
+                        ret = write_all(dst, buf, (size_t)n);
+                        if (ret)
+                                break;
+                }
+        }
+
+        sha512_ctx_conclude(&ctx);
+        sha512_ctx_digest(&ctx, digest);
+
+        return ret;
+}
+
+/**
+ * cas_copy_kernel() - copy whole @src into empty @dst without user buffer
+ *
+ * @return CAS_PUT_CLONED or CAS_PUT_RANGE, -EOPNOTSUPP if neither works
+ *         on these files, other -errno on failure
+ */
+static int cas_copy_kernel(int src, int dst, uint64_t size)
+{
+        uint64_t done = 0;
+        ssize_t n;
+
+        if (!ioctl(dst, FICLONE, src))
+                return CAS_PUT_CLONED;
+
+        while (done < size) {
+                n = copy_file_range(src, NULL, dst, NULL, size - done, 0);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        /* cross fs on old kernels, special files, ... */
+                        if (!done && (errno == EXDEV || errno == EINVAL ||
+                                      errno == ENOSYS || errno == EOPNOTSUPP))
+                                return -EOPNOTSUPP;
+
+                        return -errno;
+                }
+
+                /* source shrank under us */
+                if (!n)
+                        return -EIO;
+
+                done += (uint64_t)n;
+        }
+
+        return CAS_PUT_RANGE;
+}
+
+static int cas_tmp_open(struct cas *cas, char *name, size_t len)
+{
+        int fd;
+
+        snprintf(name, len, "%d.%lu", getpid(),
+                 atomic_fetch_add_explicit(&cas_tmp_seq, 1, memory_order_relaxed));
+
+        fd = openat(cas->tmp_fd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+        if (fd < 0)
+                return -errno;
+
+        return fd;
+}
+
+/**
+ * cas_commit() - move finished tmp blob to its object path
+ *
+ * With CAS_SYNC the blob and every directory entry leading to it are
+ * durable once this returns.
+ *
+ * @return 0 if stored, 1 if the object appeared meanwhile (tmp dropped)
+ */
+static int cas_commit(struct cas *cas, int fd, const char *tmp,
+                      const uint8_t *digest)
+{
+        char path[CAS_OBJECT_PATH_LEN];
+        int ret;
+
+        if ((cas->flags & CAS_SYNC) && fsync(fd))
+                return -errno;
+
+        cas_object_path(digest, path);
+
+        ret = cas_mkdir_shards(cas, path);
+        if (ret)
+                return ret;
+
+        if (!renameat2(cas->tmp_fd, tmp, cas->objects_fd, path, RENAME_NOREPLACE))
+                goto sync_dirs;
+
+        if (errno == EEXIST) {
+                unlinkat(cas->tmp_fd, tmp, 0);
+                return 1;
+        }
+
+        if (errno != EINVAL && errno != ENOSYS)
+                return -errno;
+
+        /* no RENAME_NOREPLACE here, same content anyway */
+        ret = cas_has(cas, digest);
+        if (ret < 0)
+                return ret;
+
+        if (ret) {
+                unlinkat(cas->tmp_fd, tmp, 0);
+                return 1;
+        }
+
+        if (renameat(cas->tmp_fd, tmp, cas->objects_fd, path))
+                return -errno;
+
+sync_dirs:
+        if (cas->flags & CAS_SYNC)
+                return cas_sync_dirs(cas, path);
+
+        return 0;
+}
+
+/**
+ * cas_tmp_clean() - remove blobs of writers that died before commit
+ *
+ * tmp/ names start with the writer pid, those of live processes are
+ * left alone.
+ *
+ * @param cas: pointer to store
+ */
+static void cas_tmp_clean(struct cas *cas)
+{
+        struct dirent *de;
+        DIR *dir;
+        char *end;
+        long pid;
+        int fd;
+
+        fd = dup(cas->tmp_fd);
+        if (fd < 0)
+                return;
+
+        dir = fdopendir(fd);
+        if (!dir) {
+                close(fd);
+                return;
+        }
+
+        while ((de = readdir(dir))) {
+                if (de->d_name[0] == '.')
+                        continue;
+
+                pid = strtol(de->d_name, &end, 10);
+                if (*end != '.' || pid == getpid() || pid_alive(pid))
+                        continue;
+
+                unlinkat(cas->tmp_fd, de->d_name, 0);
+        }
+
+        closedir(dir);
+}
+
+/**
+ * cas_open() - open store, create layout if missing
+ *
+ * @param cas: pointer to store
+ * @param root: store directory
+ * @param flags: CAS_SYNC, CAS_TRUST
+ * @return 0 on success
+ */
+int cas_open(struct cas *cas, const char *root, uint32_t flags)
+{
+        int ret;
+
+        if (!cas || !root)
+                return -EINVAL;
+
+        memset(cas, 0x00, sizeof(struct cas));
+        cas->objects_fd = -1;
+        cas->tmp_fd = -1;
+        cas->flags = flags;
+
+        if (mkdir(root, 0755) && errno != EEXIST)
+                return -errno;
+
+        cas->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cas->root_fd < 0)
+                return -errno;
+
+        if ((mkdirat(cas->root_fd, "objects", 0755) && errno != EEXIST) ||
+            (mkdirat(cas->root_fd, "tmp", 0700) && errno != EEXIST)) {
+                ret = -errno;
+                goto close_fd;
+        }
+
+        cas->objects_fd = openat(cas->root_fd, "objects",
+                                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        cas->tmp_fd = openat(cas->root_fd, "tmp", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cas->objects_fd < 0 || cas->tmp_fd < 0) {
+                ret = -errno;
+                goto close_fd;
+        }
+
+        cas_tmp_clean(cas);
+
+        return 0;
+
+close_fd:
+        cas_close(cas);
+
+        return ret;
+}
+
+void cas_close(struct cas *cas)
+{
+        if (!cas)
+                return;
+
+        if (cas->tmp_fd >= 0)
+                close(cas->tmp_fd);
+        if (cas->objects_fd >= 0)
+                close(cas->objects_fd);
+        if (cas->root_fd >= 0)
+                close(cas->root_fd);
+
+        cas->tmp_fd = cas->objects_fd = cas->root_fd = -1;
+}
+
+static int cas_stat(struct cas *cas, const uint8_t *digest, uint64_t *size)
+{
+        char path[CAS_OBJECT_PATH_LEN];
+        struct stat st;
+
+        cas_object_path(digest, path);
+
+        if (fstatat(cas->objects_fd, path, &st, 0))
+                return errno == ENOENT ? 0 : -errno;
+
+        if (size)
+                *size = (uint64_t)st.st_size;
+
+        return 1;
+}
+
+/**
+ * cas_has() - whether blob of @digest is stored
+ *
+ * @return 1 if stored, 0 if not, -errno on failure
+ */
+int cas_has(struct cas *cas, const uint8_t *digest)
+{
+        return cas_stat(cas, digest, NULL);
+}
+
+/**
+ * cas_open_blob() - open stored blob for reading
+ *
+ * @return file descriptor, -ENOENT if not stored
+ */
+int cas_open_blob(struct cas *cas, const uint8_t *digest)
+{
+        char path[CAS_OBJECT_PATH_LEN];
+        int fd;
+
+        cas_object_path(digest, path);
+
+        fd = openat(cas->objects_fd, path, O_RDONLY | O_CLOEXEC);
+
+        return fd < 0 ? -errno : fd;
+}
+
+/* known digest: skip if stored, else copy in kernel where possible */
+static int cas_put_known(struct cas *cas, struct cas_put *put, int src,
+                         int dst, uint8_t *buf)
+{
+        uint8_t digest[CAS_DIGEST_LEN];
+        struct stat st;
+        uint64_t size;
+        int ret;
+
+        if (fstat(src, &st))
+                return -errno;
+
+        put->size = (uint64_t)st.st_size;
+
+        ret = S_ISREG(st.st_mode) ? cas_copy_kernel(src, dst, put->size) : -EOPNOTSUPP;
+        if (ret >= 0) {
+                put->method = ret;
+
+                if (cas->flags & CAS_TRUST)
+                        return 0;
+
+                if (lseek(dst, 0, SEEK_SET) < 0)
+                        return -errno;
+
+                /* re-read what landed in the store, not the source */
+                ret = cas_copy_hashed(dst, -1, buf, digest, &size);
+        } else if (ret == -EOPNOTSUPP) {
+                /* user space copy reads it all anyway, verify for free */
+                put->method = CAS_PUT_COPIED;
+                ret = cas_copy_hashed(src, dst, buf, digest, &size);
+                put->size = size;
+        }
+
+        if (ret)
+                return ret;
+
+        return memcmp(digest, put->digest, CAS_DIGEST_LEN) ? -EBADMSG : 0;
+}
+
+/**
+ * cas_put() - store one file
+ *
+ * @param cas: pointer to store
+ * @param put: source and optional known digest, results
+ * @return 0 if stored or duplicate, -EBADMSG if known digest does not
+ *         match the content, -errno otherwise (also in put->ret)
+ */
+int cas_put(struct cas *cas, struct cas_put *put)
+{
+        char tmp[64];
+        uint8_t *buf = NULL;
+        struct stat st;
+        int src, dst = -1;
+        int ret;
+
+        put->size = 0;
+        put->method = CAS_PUT_DUPLICATE;
+
+        /* duplicate before the source is even opened */
+        if (put->known) {
+                ret = cas_stat(cas, put->digest, &put->size);
+                if (ret)
+                        return put->ret = ret < 0 ? ret : 0;
+        }
+
+        src = open(put->path, O_RDONLY | O_CLOEXEC);
+        if (src < 0)
+                return put->ret = -errno;
+
+        if (fstat(src, &st)) {
+                ret = -errno;
+                goto close_src;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+                ret = -EISDIR;
+                goto close_src;
+        }
+
+        posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        buf = malloc(CAS_COPY_BUF_SIZE);
+        if (!buf) {
+                ret = -ENOMEM;
+                goto close_src;
+        }
+
+        dst = cas_tmp_open(cas, tmp, sizeof(tmp));
+        if (dst < 0) {
+                ret = dst;
+                goto free_buf;
+        }
+
+        if (put->known) {
+                ret = cas_put_known(cas, put, src, dst, buf);
+        } else {
+                put->method = CAS_PUT_HASHED;
+                ret = cas_copy_hashed(src, dst, buf, put->digest, &put->size);
+        }
+
+        if (ret)
+                goto unlink_tmp;
+
+        ret = cas_commit(cas, dst, tmp, put->digest);
+        if (ret < 0)
+                goto unlink_tmp;
+
+        if (ret)
+                put->method = CAS_PUT_DUPLICATE;
+
+        ret = 0;
+        goto close_dst;
+
+unlink_tmp:
+        unlinkat(cas->tmp_fd, tmp, 0);
+close_dst:
+        close(dst);
+free_buf:
+        free(buf);
+close_src:
+        close(src);
+
+        return put->ret = ret;
+}
+
+struct cas_job {
+        struct thread_pool_work         work;   /* first, fn() casts back */
+        struct cas                      *cas;
+        struct cas_put                  *put;
+        struct thread_pool_group        *group;
+};
+
+static void cas_job_run(struct thread_pool_work *work)
+{
+        struct cas_job *job = (struct cas_job *)work;
+
+        cas_put(job->cas, job->put);
+        thread_pool_group_done(job->group);
+}
+
+/**
+ * cas_ingest() - store @n files in parallel
+ *
+ * @param cas: pointer to store
+ * @param puts: @n sources, per file results
+ * @param n: file count
+ * @param pool: pool to run on, NULL for thread_pool_shared()
+ * @return 0 if all stored or duplicate, first failure otherwise
+ */
+int cas_ingest(struct cas *cas, struct cas_put *puts, uint64_t n,
+               struct thread_pool *pool)
+{
+        struct thread_pool_group group;
+        struct cas_job *jobs;
+        uint64_t i;
+        int ret = 0;
+
+        if (!cas || (!puts && n))
+                return -EINVAL;
+
+        if (!pool)
+                pool = thread_pool_shared();
+
+        jobs = pool ? calloc(n, sizeof(*jobs)) : NULL;
+
+        /* no threads to spare, still do the work */
+        if (!jobs) {
+                for (i = 0; i < n; ++i)
+                        cas_put(cas, &puts[i]);
+
+                goto out;
+        }
+
+        thread_pool_group_init(&group);
+
+        for (i = 0; i < n; ++i) {
+                jobs[i].work.fn = cas_job_run;
+                jobs[i].cas = cas;
+                jobs[i].put = &puts[i];
+                jobs[i].group = &group;
+
+                thread_pool_group_add(&group);
+
+                if (thread_pool_queue(pool, &jobs[i].work)) {
+                        thread_pool_group_done(&group);
+                        cas_put(cas, &puts[i]);
+                }
+        }
+
+        thread_pool_group_wait(&group);
+        thread_pool_group_clean(&group);
+        free(jobs);
+
+out:
+        for (i = 0; i < n && !ret; ++i)
+                ret = puts[i].ret;
+
+        return ret;
+}
@@ -0,0 +1,98 @@
+/**
+ * cas.h - Content-addressable blob store keyed by SHA-512
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_CAS_H
+#define SIMPLERSADIGEST_CAS_H
+
+#include <stdint.h>
+
+#include "sha512.h"
+#include "thread_pool.h"
+
+/**
+ * Layout under root, digest as lower case hex of standard SHA-512
+ * octets (what sha512sum prints):
+ *
+ *    objects/ab/cd/<remaining 124 hex digits>
+ *    tmp/<writer pid>.<seq>
+ *
+ * Blobs are written to tmp/ and renamed into place, so an object path
+ * either does not exist or holds the complete blob. cas_open() removes
+ * what writers that died left in tmp/. Objects are read
+ * only, never rewritten: a digest that exists is a duplicate and the
+ * copy is skipped.
+ *
+ * With an unknown digest, the source is hashed while it is copied, in
+ * one pass. With a known digest (e.g. from a sha512sum list) existing
+ * blobs are skipped before touching the source, new ones are copied
+ * in kernel: reflink (FICLONE) where the filesystem shares extents,
+ * copy_file_range() otherwise. The copy is re-hashed from the store
+ * and dropped with -EBADMSG if it does not match, unless CAS_TRUST.
+ */
+
+#define CAS_DIGEST_LEN                  (SHA512_HASH_BITS / 8)
+#define CAS_HEX_LEN                     (CAS_DIGEST_LEN * 2)
+#define CAS_SHARD_HEX                   (2)     /* hex digits per level */
+#define CAS_SHARD_LEVELS                (2)
+#define CAS_COPY_BUF_SIZE               (1 << 20)
+
+enum {
+        CAS_SYNC                = (1 << 0),     /* fsync blob and its directories */
+        CAS_TRUST               = (1 << 1),     /* known digest copies unchecked */
+};
+
+enum {
+        CAS_PUT_DUPLICATE = 0,  /* already stored, nothing copied */
+        CAS_PUT_HASHED,         /* hashed while copying */
+        CAS_PUT_CLONED,         /* FICLONE, extents shared */
+        CAS_PUT_RANGE,          /* copy_file_range() */
+        CAS_PUT_COPIED,         /* read/write, known digest */
+        NUM_CAS_PUT_METHODS,
+};
+
+struct cas {
+        int             root_fd;
+        int             objects_fd;
+        int             tmp_fd;
+        uint32_t        flags;          /* CAS_* */
+};
+
+struct cas_put {
+        const char      *path;          /* in: source file */
+        int             known;          /* in: digest is given */
+        uint8_t         digest[CAS_DIGEST_LEN];
+
+        /* out */
+        int             ret;
+        int             method;         /* CAS_PUT_* */
+        uint64_t        size;
+};
+
+int cas_open(struct cas *cas, const char *root, uint32_t flags);
+void cas_close(struct cas *cas);
+
+int cas_put(struct cas *cas, struct cas_put *put);
+int cas_ingest(struct cas *cas, struct cas_put *puts, uint64_t n,
+               struct thread_pool *pool);
+
+int cas_has(struct cas *cas, const uint8_t *digest);
+int cas_open_blob(struct cas *cas, const uint8_t *digest);
+
+void cas_digest_hex(const uint8_t *digest, char *hex);
+int cas_hex_digest(const char *hex, uint8_t *digest);
+
+#endif //SIMPLERSADIGEST_CAS_H
@@ -0,0 +1,340 @@
+/**
+ * cas_tool.c - Command line front end of the SHA-512 blob store
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "cas.h"
+#include "misc_helper.h"
+
+#define CAS_ROOT_DEFAULT                "cas"
+
+static const char *cas_put_method_name[NUM_CAS_PUT_METHODS] = {
+        [CAS_PUT_DUPLICATE]     = "dup",
+        [CAS_PUT_HASHED]        = "hashed",
+        [CAS_PUT_CLONED]        = "cloned",
+        [CAS_PUT_RANGE]         = "range",
+        [CAS_PUT_COPIED]        = "copied",
+};
+
+/**
+ * cas_list_load() - read sha512sum output, "<hex>  <path>" per line
+ *
+ * @return entries in @puts, -errno on failure
+ */
+static int64_t cas_list_load(const char *list, struct cas_put **puts)
+{
+        struct cas_put *p = NULL, *tmp;
+        uint64_t n = 0, cap = 0;
+        char *line = NULL, *path;
+        size_t line_cap = 0;
+        ssize_t len;
+        FILE *f;
+        int ret = 0;
+
+        f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+        if (!f)
+                return -errno;
+
+        while ((len = getline(&line, &line_cap, f)) > 0) {
+                if (line[len - 1] == '\n')
+                        line[--len] = '\0';
+
+                /* binary mode marker is '*' instead of second space */
+                if (len < CAS_HEX_LEN + 3 || line[CAS_HEX_LEN] != ' ' ||
+                    (line[CAS_HEX_LEN + 1] != ' ' && line[CAS_HEX_LEN + 1] != '*')) {
+                        ret = -EINVAL;
+                        break;
+                }
+
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 1024;
+                        tmp = realloc(p, cap * sizeof(*p));
+                        if (!tmp) {
+                                ret = -ENOMEM;
+                                break;
+                        }
+
+                        p = tmp;
+                }
+
+                path = strdup(line + CAS_HEX_LEN + 2);
+                if (!path) {
+                        ret = -ENOMEM;
+                        break;
+                }
+
+                memset(&p[n], 0x00, sizeof(*p));
+                p[n].path = path;
+                p[n].known = 1;
+
+                ret = cas_hex_digest(line, p[n].digest);
+                if (ret) {
+                        free(path);
+                        break;
+                }
+
+                n++;
+        }
+
+        free(line);
+        if (f != stdin)
+                fclose(f);
+
+        if (ret) {
+                for (uint64_t i = 0; i < n; ++i)
+                        free((char *)p[i].path);
+
+                free(p);
+                return ret;
+        }
+
+        *puts = p;
+
+        return (int64_t)n;
+}
+
+static int cas_cmd_put(struct cas *cas, struct thread_pool *pool, const char *list,
+                       char **files, int nfiles, int verbose)
+{
+        uint64_t count[NUM_CAS_PUT_METHODS] = { 0 };
+        uint64_t bytes = 0, copied = 0, errors = 0;
+        char hex[CAS_HEX_LEN + 1];
+        struct cas_put *puts = NULL;
+        uint64_t n, t0, t1;
+        int64_t ret;
+
+        if (list) {
+                ret = cas_list_load(list, &puts);
+                if (ret < 0) {
+                        fprintf(stderr, "failed to load %s: %s\n", list, strerror((int)-ret));
+                        return (int)ret;
+                }
+
+                n = (uint64_t)ret;
+        } else {
+                n = (uint64_t)nfiles;
+                puts = calloc(n ? n : 1, sizeof(*puts));
+                if (!puts)
+                        return -ENOMEM;
+
+                for (uint64_t i = 0; i < n; ++i)
+                        puts[i].path = strdup(files[i]);
+        }
+
+        t0 = clock_ns();
+        cas_ingest(cas, puts, n, pool);
+        t1 = clock_ns();
+
+        for (uint64_t i = 0; i < n; ++i) {
+                if (puts[i].ret) {
+                        fprintf(stderr, "%s: %s\n", puts[i].path, strerror(-puts[i].ret));
+                        errors++;
+                        continue;
+                }
+
+                count[puts[i].method]++;
+                bytes += puts[i].size;
+                if (puts[i].method != CAS_PUT_DUPLICATE)
+                        copied += puts[i].size;
+
+                if (verbose) {
+                        cas_digest_hex(puts[i].digest, hex);
+                        fprintf(stdout, "%-6s %s  %s\n",
+                                cas_put_method_name[puts[i].method], hex, puts[i].path);
+                }
+        }
+
+        fprintf(stdout, "%lu files, %lu bytes (%lu new) in %.3fs, %.1f MiB/s\n",
+                n, bytes, copied, (t1 - t0) / 1e9,
+                (double)bytes / (1 << 20) / ((t1 - t0) / 1e9));
+
+        for (int m = 0; m < NUM_CAS_PUT_METHODS; ++m)
+                fprintf(stdout, "  %-6s %lu\n", cas_put_method_name[m], count[m]);
+
+        if (errors)
+                fprintf(stdout, "  %-6s %lu\n", "failed", errors);
+
+        for (uint64_t i = 0; i < n; ++i)
+                free((char *)puts[i].path);
+
+        free(puts);
+
+        return errors ? -EIO : 0;
+}
+
+static int cas_cmd_get(struct cas *cas, const char *hex)
+{
+        uint8_t digest[CAS_DIGEST_LEN];
+        char buf[1 << 16];
+        ssize_t n;
+        int fd, ret = 0;
+
+        if (strlen(hex) != CAS_HEX_LEN || cas_hex_digest(hex, digest))
+                return -EINVAL;
+
+        fd = cas_open_blob(cas, digest);
+        if (fd < 0)
+                return fd;
+
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                if (fwrite(buf, 1, (size_t)n, stdout) != (size_t)n) {
+                        ret = -EIO;
+                        break;
+                }
+        }
+
+        if (n < 0)
+                ret = -errno;
+
+        close(fd);
+
+        return ret;
+}
+
+static int cas_cmd_has(struct cas *cas, char **hexes, int n)
+{
+        uint8_t digest[CAS_DIGEST_LEN];
+        int missing = 0, ret;
+
+        for (int i = 0; i < n; ++i) {
+                if (strlen(hexes[i]) != CAS_HEX_LEN || cas_hex_digest(hexes[i], digest))
+                        return -EINVAL;
+
+                ret = cas_has(cas, digest);
+                if (ret < 0)
+                        return ret;
+
+                if (!ret) {
+                        fprintf(stdout, "%s missing\n", hexes[i]);
+                        missing++;
+                }
+        }
+
+        return missing ? -ENOENT : 0;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [options] put file...\n"
+                "       %s [options] put -l list\n"
+                "       %s [options] get digest > file\n"
+                "       %s [options] has digest...\n"
+                "  -r dir       store root (default %s)\n"
+                "  -j threads   ingest threads (default: shared pool, online CPUs)\n"
+                "  -l list      sha512sum output to ingest, digests are trusted\n"
+                "               for dedupe, new blobs are copied in kernel and\n"
+                "               re-hashed, - for stdin\n"
+                "  -T           trust the list, store in-kernel copies unchecked\n"
+                "  -S           fsync every blob and its directories when stored\n"
+                "  -v           print method and digest of every file\n",
+                prog, prog, prog, prog, CAS_ROOT_DEFAULT);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *root = CAS_ROOT_DEFAULT;
+        const char *list = NULL;
+        struct thread_pool own, *pool = NULL;
+        uint32_t threads = 0, flags = 0;
+        struct cas cas;
+        const char *cmd;
+        int verbose = 0;
+        int ret, c;
+
+        while ((c = getopt(argc, argv, "r:j:l:TSvh")) != -1) {
+                switch (c) {
+                        case 'r':
+                                root = optarg;
+                                break;
+
+                        case 'j':
+                                threads = (uint32_t)strtoul(optarg, NULL, 0);
+                                break;
+
+                        case 'l':
+                                list = optarg;
+                                break;
+
+                        case 'T':
+                                flags |= CAS_TRUST;
+                                break;
+
+                        case 'S':
+                                flags |= CAS_SYNC;
+                                break;
+
+                        case 'v':
+                                verbose = 1;
+                                break;
+
+                        default:
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
+                }
+        }
+
+        if (optind >= argc) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        cmd = argv[optind++];
+
+        ret = cas_open(&cas, root, flags);
+        if (ret) {
+                fprintf(stderr, "failed to open %s: %s\n", root, strerror(-ret));
+                return EXIT_FAILURE;
+        }
+
+        if (threads) {
+                ret = thread_pool_init(&own, threads);
+                if (ret) {
+                        fprintf(stderr, "failed to start threads: %s\n", strerror(-ret));
+                        goto close_cas;
+                }
+
+                pool = &own;
+        }
+
+        if (!strcmp(cmd, "put") && (list || optind < argc))
+                ret = cas_cmd_put(&cas, pool, list, argv + optind, argc - optind, verbose);
+        else if (!strcmp(cmd, "get") && optind + 1 == argc)
+                ret = cas_cmd_get(&cas, argv[optind]);
+        else if (!strcmp(cmd, "has") && optind < argc)
+                ret = cas_cmd_has(&cas, argv + optind, argc - optind);
+        else
+                ret = -EINVAL;
+
+        if (ret == -EINVAL)
+                usage(argv[0]);
+        else if (ret && ret != -EIO && ret != -ENOENT)
+                fprintf(stderr, "%s failed: %s\n", cmd, strerror(-ret));
+
+        if (pool)
+                thread_pool_exit(pool);
+close_cas:
+        cas_close(&cas);
+
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,586 @@
+/**
+ * digest_index.c - Signed, mmap'd SHA-512 digest set for membership checks
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "digest_index.h"
+#include "cas.h"
+
+/* batch lookups: prefetch bucket this far ahead, keys and digest half of it */
+#define DIGEST_INDEX_PREFETCH           (16)
+
+struct digest_index_writer {
+        FILE                    *f;
+        struct sha512_ctx       ctx;    /* everything before the signature */
+        uint64_t                off;
+        int                     err;
+};
+
+static inline uint64_t digest_key(const uint8_t *digest)
+{
+        uint64_t v;
+
+        memcpy(&v, digest, sizeof(v));
+
+        return __builtin_bswap64(v);
+}
+
+static inline uint64_t align_up(uint64_t v, uint64_t a)
+{
+        return (v + a - 1) & ~(a - 1);
+}
+
+static int digest_cmp(const void *a, const void *b)
+{
+        return memcmp(a, b, DIGEST_INDEX_DIGEST_LEN);
+}
+
+static void digest_index_emit(struct digest_index_writer *w, const void *buf,
+                              size_t len)
+{
+        if (w->err || !len)
+                return;
+
+        if (fwrite(buf, 1, len, w->f) != len) {
+                w->err = -EIO;
+                return;
+        }
+
+        sha512_ctx_update(&w->ctx, buf, len);
+        w->off += len;
+}
+
+/* zero fill up to @off */
+static void digest_index_pad(struct digest_index_writer *w, uint64_t off)
+{
+        static const uint8_t zero[DIGEST_INDEX_ALIGN];
+
+        while (w->off < off && !w->err)
+                digest_index_emit(w, zero, off - w->off < sizeof(zero) ?
+                                           off - w->off : sizeof(zero));
+}
+
+/**
+ * digest_index_list_read() - digests of a sha512sum style list
+ *
+ * Lines are "<hex>  <path>", "<hex> *<path>" or just "<hex>"
+ *
+ * @return digest count, -errno on failure
+ */
+static int64_t digest_index_list_read(FILE *list, uint8_t **digests)
+{
+        uint8_t *d = NULL, *tmp;
+        uint64_t n = 0, cap = 0;
+        char *line = NULL;
+        size_t line_cap = 0;
+        ssize_t len;
+        int ret = 0;
+
+        while ((len = getline(&line, &line_cap, list)) > 0) {
+                while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                        line[--len] = '\0';
+
+                if (!len)
+                        continue;
+
+                if (len < CAS_HEX_LEN || (len > CAS_HEX_LEN && line[CAS_HEX_LEN] != ' ')) {
+                        ret = -EINVAL;
+                        break;
+                }
+
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 1 << 16;
+                        tmp = realloc(d, cap * DIGEST_INDEX_DIGEST_LEN);
+                        if (!tmp) {
+                                ret = -ENOMEM;
+                                break;
+                        }
+
+                        d = tmp;
+                }
+
+                ret = cas_hex_digest(line, d + n * DIGEST_INDEX_DIGEST_LEN);
+                if (ret)
+                        break;
+
+                n++;
+        }
+
+        free(line);
+
+        if (!ret && ferror(list))
+                ret = -EIO;
+
+        if (ret) {
+                free(d);
+                return ret;
+        }
+
+        *digests = d;
+
+        return (int64_t)n;
+}
+
+/* about 2 to 4 digests per bucket */
+static uint32_t digest_index_bucket_bits(uint64_t count)
+{
+        uint32_t bits;
+
+        if (count < 8)
+                return 1;
+
+        bits = 63 - __builtin_clzll(count) - 1;
+
+        return bits > 30 ? 30 : bits;
+}
+
+/**
+ * digest_index_build() - sort, dedupe and sign digests into index file
+ *
+ * Written to <path>.tmp and renamed into place.
+ *
+ * @param list: sha512sum style list
+ * @param path: index file to write
+ * @param key: private key to sign with
+ * @param count: optional, unique digests written
+ * @return 0 on success
+ */
+int digest_index_build(FILE *list, const char *path, struct rsa_private *key,
+                       uint64_t *count)
+{
+        uint8_t md[DIGEST_INDEX_DIGEST_LEN];
+        struct digest_index_writer w;
+        struct digest_index_hdr hdr;
+        uint32_t *buckets = NULL;
+        uint8_t *digests = NULL, *sig = NULL;
+        uint64_t n, u, nb, i;
+        char *tmp_path;
+        size_t sig_cnt;
+        int64_t ret;
+        mpz_t s;
+
+        if (!list || !path || !key || key->key_len / 8 < DIGEST_INDEX_DIGEST_LEN + 11)
+                return -EINVAL;
+
+        ret = digest_index_list_read(list, &digests);
+        if (ret < 0)
+                return (int)ret;
+
+        n = (uint64_t)ret;
+
+        qsort(digests, n, DIGEST_INDEX_DIGEST_LEN, digest_cmp);
+
+        for (i = 0, u = 0; i < n; ++i) {
+                if (u && !digest_cmp(digests + (u - 1) * DIGEST_INDEX_DIGEST_LEN,
+                                     digests + i * DIGEST_INDEX_DIGEST_LEN))
+                        continue;
+
+                memmove(digests + u * DIGEST_INDEX_DIGEST_LEN,
+                        digests + i * DIGEST_INDEX_DIGEST_LEN, DIGEST_INDEX_DIGEST_LEN);
+                u++;
+        }
+
+        if (u > DIGEST_INDEX_COUNT_MAX) {
+                free(digests);
+                return -EFBIG;
+        }
+
+        memset(&hdr, 0x00, sizeof(hdr));
+        hdr.magic = DIGEST_INDEX_MAGIC;
+        hdr.version = DIGEST_INDEX_VERSION;
+        hdr.count = u;
+        hdr.bucket_bits = digest_index_bucket_bits(u);
+        hdr.digest_len = DIGEST_INDEX_DIGEST_LEN;
+
+        nb = 1UL << hdr.bucket_bits;
+        hdr.buckets_off = align_up(sizeof(hdr), DIGEST_INDEX_ALIGN);
+        hdr.keys_off = align_up(hdr.buckets_off + (nb + 1) * sizeof(uint32_t),
+                                DIGEST_INDEX_ALIGN);
+        hdr.digests_off = align_up(hdr.keys_off +
+                                   (u + DIGEST_INDEX_KEYS_PAD) * sizeof(uint64_t),
+                                   DIGEST_INDEX_ALIGN);
+        hdr.sig_off = hdr.digests_off + u * DIGEST_INDEX_DIGEST_LEN;
+        hdr.sig_len = (uint32_t)((key->key_len + 7) / 8);
+
+        /* bucket start offsets, prefix sum of bucket sizes */
+        buckets = calloc(nb + 1, sizeof(uint32_t));
+        sig = calloc(1, hdr.sig_len);
+        if (!buckets || !sig) {
+                ret = -ENOMEM;
+                goto free_buf;
+        }
+
+        for (i = 0; i < u; ++i)
+                buckets[(digest_key(digests + i * DIGEST_INDEX_DIGEST_LEN) >>
+                         (64 - hdr.bucket_bits)) + 1]++;
+
+        for (i = 0; i < nb; ++i)
+                buckets[i + 1] += buckets[i];
+
+        if (asprintf(&tmp_path, "%s.tmp", path) < 0) {
+                ret = -ENOMEM;
+                goto free_buf;
+        }
+
+        memset(&w, 0x00, sizeof(w));
+        sha512_ctx_init(&w.ctx);
+
+        w.f = fopen(tmp_path, "w");
+        if (!w.f) {
+                ret = -errno;
+                goto free_path;
+        }
+
+        digest_index_emit(&w, &hdr, sizeof(hdr));
+        digest_index_pad(&w, hdr.buckets_off);
+        digest_index_emit(&w, buckets, (nb + 1) * sizeof(uint32_t));
+        digest_index_pad(&w, hdr.keys_off);
+
+        for (i = 0; i < u + DIGEST_INDEX_KEYS_PAD; ++i) {
+                uint64_t k = i < u ? digest_key(digests + i * DIGEST_INDEX_DIGEST_LEN) : 0;
+
+                digest_index_emit(&w, &k, sizeof(k));
+        }
+
+        digest_index_pad(&w, hdr.digests_off);
+        digest_index_emit(&w, digests, u * DIGEST_INDEX_DIGEST_LEN);
+
+        sha512_ctx_conclude(&w.ctx);
+        sha512_ctx_digest(&w.ctx, md);
+
+        mpz_init(s);
+
+        ret = rsa_private_key_sign(key, s, md, sizeof(md));
+        if (!ret) {
+                /* fixed length, leading zero octets kept */
+                sig_cnt = (mpz_sizeinbase(s, 2) + 7) / 8;
+                if (sig_cnt > hdr.sig_len) {
+                        ret = -ERANGE;
+                } else {
+                        mpz_export(sig + hdr.sig_len - sig_cnt, NULL, 1, 1, 1, 0, s);
+
+                        if (fwrite(sig, 1, hdr.sig_len, w.f) != hdr.sig_len)
+                                w.err = -EIO;
+                }
+        }
+
+        mpz_clear(s);
+
+        if (!ret)
+                ret = w.err;
+
+        if (!ret && (fflush(w.f) || fsync(fileno(w.f))))
+                ret = -errno;
+
+        if (fclose(w.f) && !ret)
+                ret = -errno;
+
+        if (!ret && rename(tmp_path, path))
+                ret = -errno;
+
+        if (ret)
+                unlink(tmp_path);
+        else if (count)
+                *count = u;
+
+free_path:
+        free(tmp_path);
+free_buf:
+        free(sig);
+        free(buckets);
+        free(digests);
+
+        return (int)ret;
+}
+
+/* one pass over the mapping, the only time every page is touched */
+static int digest_index_verify(const struct digest_index *idx, struct rsa_public *key)
+{
+        uint8_t md[DIGEST_INDEX_DIGEST_LEN];
+        const struct digest_index_hdr *hdr = idx->hdr;
+        struct sha512_ctx ctx;
+        int ret;
+        mpz_t s;
+
+        if (hdr->sig_len != (key->key_len + 7) / 8)
+                return -EBADMSG;
+
+        madvise(idx->map, idx->map_size, MADV_SEQUENTIAL);
+
+        sha512_ctx_init(&ctx);
+        sha512_ctx_update(&ctx, idx->map, hdr->sig_off);
+        sha512_ctx_conclude(&ctx);
+        sha512_ctx_digest(&ctx, md);
+
+        mpz_init(s);
+        mpz_import(s, hdr->sig_len, 1, 1, 1, 0, (const uint8_t *)idx->map + hdr->sig_off);
+
+        ret = rsa_public_key_verify(key, s, md, sizeof(md));
+
+        mpz_clear(s);
+
+        return ret;
+}
+
+/* @off .. @off + @len inside a file of @size octets, no wrap around */
+static inline int digest_index_span(uint64_t off, uint64_t len, uint64_t size)
+{
+        return off <= size && len <= size - off;
+}
+
+/**
+ * digest_index_open() - map index file, verify signature
+ *
+ * @param idx: pointer to index
+ * @param path: index file
+ * @param key: public key to verify with, NULL to trust the file
+ * @return 0 on success, -EBADMSG on bad signature or layout, -EPERM if
+ *         others could modify the file under the mapping
+ */
+int digest_index_open(struct digest_index *idx, const char *path,
+                      struct rsa_public *key)
+{
+        const struct digest_index_hdr *hdr;
+        uint64_t buckets_len, keys_len, digests_len;
+        struct stat st;
+        uint64_t nb;
+        int fd, ret;
+
+        if (!idx || !path)
+                return -EINVAL;
+
+        memset(idx, 0x00, sizeof(struct digest_index));
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st)) {
+                ret = -errno;
+                goto close_fd;
+        }
+
+        /* verified once, then mapped: only trusted users may write it */
+        if (!S_ISREG(st.st_mode) || (st.st_uid && st.st_uid != geteuid()) ||
+            (st.st_mode & (S_IWGRP | S_IWOTH))) {
+                ret = -EPERM;
+                goto close_fd;
+        }
+
+        if ((uint64_t)st.st_size < sizeof(struct digest_index_hdr)) {
+                ret = -EBADMSG;
+                goto close_fd;
+        }
+
+        idx->map_size = (size_t)st.st_size;
+        idx->map = mmap(NULL, idx->map_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (idx->map == MAP_FAILED) {
+                idx->map = NULL;
+                ret = -errno;
+                goto close_fd;
+        }
+
+        hdr = idx->hdr = idx->map;
+        nb = hdr->bucket_bits && hdr->bucket_bits <= 32 ? 1UL << hdr->bucket_bits : 0;
+
+        if (hdr->magic != DIGEST_INDEX_MAGIC ||
+            hdr->version != DIGEST_INDEX_VERSION ||
+            hdr->digest_len != DIGEST_INDEX_DIGEST_LEN ||
+            hdr->count > DIGEST_INDEX_COUNT_MAX || !nb) {
+                ret = -EBADMSG;
+                goto unmap;
+        }
+
+        buckets_len = (nb + 1) * sizeof(uint32_t);
+        keys_len = (hdr->count + DIGEST_INDEX_KEYS_PAD) * sizeof(uint64_t);
+        digests_len = hdr->count * DIGEST_INDEX_DIGEST_LEN;
+
+        /*
+         * every section inside the file, in order; lengths are bounded by
+         * count and bucket_bits, the spans keep offsets from wrapping
+         */
+        if (hdr->buckets_off < sizeof(*hdr) || hdr->buckets_off % DIGEST_INDEX_ALIGN ||
+            !digest_index_span(hdr->buckets_off, buckets_len, idx->map_size) ||
+            hdr->keys_off < hdr->buckets_off + buckets_len ||
+            hdr->keys_off % DIGEST_INDEX_ALIGN ||
+            !digest_index_span(hdr->keys_off, keys_len, idx->map_size) ||
+            hdr->digests_off < hdr->keys_off + keys_len ||
+            !digest_index_span(hdr->digests_off, digests_len, idx->map_size) ||
+            hdr->sig_off != hdr->digests_off + digests_len ||
+            !digest_index_span(hdr->sig_off, hdr->sig_len, idx->map_size) ||
+            hdr->sig_off + hdr->sig_len != idx->map_size) {
+                ret = -EBADMSG;
+                goto unmap;
+        }
+
+        if (key) {
+                ret = digest_index_verify(idx, key);
+                if (ret)
+                        goto unmap;
+        }
+
+        madvise(idx->map, idx->map_size, MADV_RANDOM);
+
+        idx->buckets = (const uint32_t *)((const uint8_t *)idx->map + hdr->buckets_off);
+        idx->keys = (const uint64_t *)((const uint8_t *)idx->map + hdr->keys_off);
+        idx->digests = (const uint8_t *)idx->map + hdr->digests_off;
+        idx->count = hdr->count;
+        idx->shift = 64 - hdr->bucket_bits;
+
+        close(fd);
+
+        return 0;
+
+unmap:
+        munmap(idx->map, idx->map_size);
+        idx->map = NULL;
+close_fd:
+        close(fd);
+
+        return ret;
+}
+
+void digest_index_close(struct digest_index *idx)
+{
+        if (!idx || !idx->map)
+                return;
+
+        munmap(idx->map, idx->map_size);
+        memset(idx, 0x00, sizeof(struct digest_index));
+}
+
+/* bit 0: keys[0] == key, bit 1: keys[1] == key */
+static inline uint32_t digest_index_keys_match(const uint64_t *keys, uint64_t key)
+{
+#ifdef __SSE2__
+        __m128i v = _mm_loadu_si128((const __m128i *)keys);
+        __m128i k = _mm_set1_epi64x((long long)key);
+        uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi32(v, k));
+
+        return ((m & 0xff) == 0xff) | (((m >> 8) == 0xff) << 1);
+#else
+        return (keys[0] == key) | ((keys[1] == key) << 1);
+#endif
+}
+
+static inline int digest_index_digest_eq(const uint8_t *a, const uint8_t *b)
+{
+#ifdef __SSE2__
+        __m128i eq = _mm_set1_epi8(-1);
+
+        for (int i = 0; i < DIGEST_INDEX_DIGEST_LEN; i += 16)
+                eq = _mm_and_si128(eq, _mm_cmpeq_epi8(
+                                _mm_loadu_si128((const __m128i *)(a + i)),
+                                _mm_loadu_si128((const __m128i *)(b + i))));
+
+        return _mm_movemask_epi8(eq) == 0xffff;
+#else
+        return !memcmp(a, b, DIGEST_INDEX_DIGEST_LEN);
+#endif
+}
+
+/**
+ * digest_index_lookup() - whether @digest is in the set
+ *
+ * @param idx: pointer to open index
+ * @param digest: DIGEST_INDEX_DIGEST_LEN octets, standard SHA-512 order
+ * @return 1 if present, 0 if not
+ */
+int digest_index_lookup(const struct digest_index *idx, const uint8_t *digest)
+{
+        uint64_t key = digest_key(digest);
+        uint64_t b = key >> idx->shift;
+        uint64_t i = idx->buckets[b];
+        uint64_t end = idx->buckets[b + 1];
+        uint32_t m;
+
+        /* unverified files must not send us out of bounds */
+        if (end > idx->count)
+                end = idx->count;
+
+        for (; i < end; i += 2) {
+                m = digest_index_keys_match(&idx->keys[i], key);
+
+                while (m) {
+                        uint64_t j = i + __builtin_ctz(m);
+
+                        if (j < end && digest_index_digest_eq(
+                                    idx->digests + j * DIGEST_INDEX_DIGEST_LEN, digest))
+                                return 1;
+
+                        m &= m - 1;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * digest_index_lookup_batch() - look up @n digests, pipelined
+ *
+ * Bucket heads are prefetched DIGEST_INDEX_PREFETCH lookups ahead,
+ * keys and digests of the bucket half of that, so the three cache
+ * misses of a lookup overlap with the ones of its neighbours.
+ *
+ * @param idx: pointer to open index
+ * @param digests: @n digests back to back
+ * @param n: digest count
+ * @param found: @n results, 1 if present
+ */
+void digest_index_lookup_batch(const struct digest_index *idx,
+                               const uint8_t *digests, uint64_t n, uint8_t *found)
+{
+        const uint64_t near = DIGEST_INDEX_PREFETCH / 2;
+        uint64_t i, b, first;
+
+        for (i = 0; i < n; ++i) {
+                if (i + DIGEST_INDEX_PREFETCH < n) {
+                        b = digest_key(digests + (i + DIGEST_INDEX_PREFETCH) *
+                                                 DIGEST_INDEX_DIGEST_LEN) >> idx->shift;
+                        __builtin_prefetch(&idx->buckets[b]);
+                }
+
+                if (i + near < n) {
+                        b = digest_key(digests + (i + near) * DIGEST_INDEX_DIGEST_LEN) >>
+                            idx->shift;
+                        first = idx->buckets[b];
+
+                        if (first < idx->count) {
+                                __builtin_prefetch(&idx->keys[first]);
+                                __builtin_prefetch(idx->digests +
+                                                   first * DIGEST_INDEX_DIGEST_LEN);
+                        }
+                }
+
+                found[i] = (uint8_t)digest_index_lookup(idx, digests +
+                                                        i * DIGEST_INDEX_DIGEST_LEN);
+        }
+}
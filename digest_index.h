@@ -0,0 +1,90 @@
+/**
+ * digest_index.h - Signed, mmap'd SHA-512 digest set for membership checks
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_DIGEST_INDEX_H
+#define SIMPLERSADIGEST_DIGEST_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "rsa.h"
+#include "sha512.h"
+
+/**
+ * Structure of index file, host byte order, sections 64 octets aligned
+ *
+ *    hdr || buckets || keys || digests || signature
+ *
+ * Digests are sorted and unique. Bucket b holds the digests whose top
+ * bucket_bits bits are b: buckets[b] .. buckets[b + 1] - 1, about two
+ * to four of them. keys[i] is the first 8 digest octets as big-endian
+ * integer, the bucket is scanned on keys (SIMD, two per compare) and
+ * only a key hit touches the 64 octet digest.
+ *
+ * The signature covers every octet before it (SHA-512, BT_01 digest
+ * signature), so the file is used as mapped, nothing is parsed.
+ *
+ * Lookups read the shared mapping, not a copy made at open: writes to
+ * the file after verification change what they see, truncation raises
+ * SIGBUS. An index must be replaced by rename, never rewritten, and
+ * digest_index_open() only accepts a regular file owned by root or the
+ * caller that no one else can write.
+ */
+struct digest_index_hdr {
+        uint32_t        magic;
+        uint32_t        version;
+        uint64_t        count;
+        uint32_t        bucket_bits;
+        uint32_t        digest_len;
+        uint64_t        buckets_off;    /* uint32_t[(1 << bucket_bits) + 1] */
+        uint64_t        keys_off;       /* uint64_t[count + pad] */
+        uint64_t        digests_off;    /* uint8_t[count][digest_len] */
+        uint64_t        sig_off;
+        uint32_t        sig_len;
+        uint32_t        reserved;
+};
+
+#define DIGEST_INDEX_MAGIC              (0x58445352U)   /* "RSDX" */
+#define DIGEST_INDEX_VERSION            (1)
+#define DIGEST_INDEX_DIGEST_LEN         (SHA512_HASH_BITS / 8)
+#define DIGEST_INDEX_COUNT_MAX          (UINT32_MAX - 1)
+#define DIGEST_INDEX_ALIGN              (64)
+#define DIGEST_INDEX_KEYS_PAD           (2)     /* SIMD reads past last key */
+
+struct digest_index {
+        void                            *map;
+        size_t                          map_size;
+        const struct digest_index_hdr   *hdr;
+        const uint32_t                  *buckets;
+        const uint64_t                  *keys;
+        const uint8_t                   *digests;
+        uint64_t                        count;
+        uint32_t                        shift;  /* 64 - bucket_bits */
+};
+
+int digest_index_build(FILE *list, const char *path, struct rsa_private *key,
+                       uint64_t *count);
+
+int digest_index_open(struct digest_index *idx, const char *path,
+                      struct rsa_public *key);
+void digest_index_close(struct digest_index *idx);
+
+int digest_index_lookup(const struct digest_index *idx, const uint8_t *digest);
+void digest_index_lookup_batch(const struct digest_index *idx,
+                               const uint8_t *digests, uint64_t n, uint8_t *found);
+
+#endif //SIMPLERSADIGEST_DIGEST_INDEX_H
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <gmp.h>
 
@@ -135,4 +136,19 @@ int mpz_check_binlen(const mpz_t src, uint64_t len)
         mpz_clears(t, NULL);
 
         return res;
-}
\ No newline at end of file
+}
+
+/**
+ * mpz_wipe() - overwrite all allocated limbs with zero
+ *
+ * Use before mpz_clear() on secrets, freed limbs are not scrubbed.
+ *
+ * @param   x: number to wipe, value becomes 0
+ */
+void mpz_wipe(mpz_t x)
+{
+        if (x->_mp_d && x->_mp_alloc > 0)
+                explicit_bzero(x->_mp_d, (size_t)x->_mp_alloc * sizeof(mp_limb_t));
+
+        x->_mp_size = 0;
+}
@@ -28,4 +28,6 @@ void __mpz_urandomm(mpz_t rop, const mpz_t n);
 int mpz_rand_bitlen(mpz_t rop, uint64_t len);
 int mpz_check_binlen(const mpz_t src, uint64_t len);
 
+void mpz_wipe(mpz_t x);
+
 #endif //SIMPLERSADIGEST_GMP_HELPER_H
@@ -0,0 +1,111 @@
+/**
+ * histogram.c - Log-linear latency histogram
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "histogram.h"
+
+/**
+ * hist_reset() - drop all recorded values
+ *
+ * @param h: pointer to histogram
+ */
+void hist_reset(struct lat_hist *h)
+{
+        memset(h, 0x00, sizeof(struct lat_hist));
+}
+
+/**
+ * hist_record() - record one value
+ *
+ * @param h: pointer to histogram
+ * @param v: value, usually nanoseconds
+ */
+void hist_record(struct lat_hist *h, uint64_t v)
+{
+        h->count[hist_bucket_index(v)]++;
+        h->total++;
+        h->sum += v;
+
+        if (v > h->max)
+                h->max = v;
+}
+
+/**
+ * hist_merge() - add all values of @src into @dst
+ *
+ * @param dst: pointer to destination histogram
+ * @param src: pointer to source histogram
+ */
+void hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+        for (uint32_t i = 0; i < HIST_BUCKETS; ++i)
+                dst->count[i] += src->count[i];
+
+        dst->total += src->total;
+        dst->sum += src->sum;
+
+        if (src->max > dst->max)
+                dst->max = src->max;
+}
+
+/**
+ * hist_percentile() - value at given percentile
+ *
+ * @param h: pointer to histogram
+ * @param pct: percentile in range [0, 100]
+ * @return highest equivalent value of the bucket, 0 if empty
+ */
+uint64_t hist_percentile(const struct lat_hist *h, double pct)
+{
+        uint64_t rank;
+        uint64_t seen;
+
+        if (!h->total)
+                return 0;
+
+        rank = (uint64_t)((pct / 100.0) * (double)h->total + 0.5);
+        if (rank < 1)
+                rank = 1;
+        if (rank > h->total)
+                rank = h->total;
+
+        seen = 0;
+        for (uint32_t i = 0; i < HIST_BUCKETS; ++i) {
+                seen += h->count[i];
+                if (seen >= rank)
+                        return hist_bucket_value(i) < h->max ?
+                               hist_bucket_value(i) : h->max;
+        }
+
+        return h->max;
+}
+
+/**
+ * hist_mean() - arithmetic mean of recorded values
+ *
+ * @param h: pointer to histogram
+ * @return mean, 0 if empty
+ */
+uint64_t hist_mean(const struct lat_hist *h)
+{
+        if (!h->total)
+                return 0;
+
+        return h->sum / h->total;
+}
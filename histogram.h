@@ -0,0 +1,73 @@
+/**
+ * histogram.h - Log-linear latency histogram
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_HISTOGRAM_H
+#define SIMPLERSADIGEST_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Every power of two is split into (1 << HIST_SUB_BITS) linear buckets,
+ * values below (1 << HIST_SUB_BITS) get an exact bucket each.
+ * Relative error of a recorded value is bounded by 1 / 8.
+ */
+#define HIST_SUB_BITS                   (3)
+#define HIST_SUB_COUNT                  (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS                    ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct lat_hist {
+        uint64_t        count[HIST_BUCKETS];
+        uint64_t        total;          /* recorded values */
+        uint64_t        sum;            /* sum of recorded values */
+        uint64_t        max;
+};
+
+static inline uint32_t hist_bucket_index(uint64_t v)
+{
+        uint32_t msb;
+
+        if (v < HIST_SUB_COUNT)
+                return (uint32_t)v;
+
+        msb = 63 - __builtin_clzll(v);
+
+        return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+               (uint32_t)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/* Highest value that maps into bucket @idx */
+static inline uint64_t hist_bucket_value(uint32_t idx)
+{
+        uint32_t shift;
+        uint64_t sub;
+
+        if (idx < HIST_SUB_COUNT)
+                return idx;
+
+        shift = (idx >> HIST_SUB_BITS) - 1;
+        sub = idx & (HIST_SUB_COUNT - 1);
+
+        return ((HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void hist_reset(struct lat_hist *h);
+void hist_record(struct lat_hist *h, uint64_t v);
+void hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+uint64_t hist_percentile(const struct lat_hist *h, double pct);
+uint64_t hist_mean(const struct lat_hist *h);
+
+#endif //SIMPLERSADIGEST_HISTOGRAM_H
@@ -0,0 +1,231 @@
+/**
+ * index_tool.c - Build and query signed digest allowlist indexes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "digest_index.h"
+#include "cas.h"
+
+static int key_file_load(const char *path, struct rsa_private *priv,
+                         struct rsa_public *pub)
+{
+        FILE *f;
+        int ret;
+
+        f = fopen(path, "r");
+        if (!f)
+                return -errno;
+
+        ret = priv ? rsa_private_key_load(priv, f) : rsa_public_key_load(pub, f);
+        fclose(f);
+
+        return ret;
+}
+
+static int index_cmd_build(const char *key_file, const char *list, const char *path)
+{
+        struct rsa_private priv;
+        uint64_t count, t0;
+        FILE *f;
+        int ret;
+
+        if (!key_file)
+                return -EINVAL;
+
+        rsa_private_key_init(&priv);
+
+        ret = key_file_load(key_file, &priv, NULL);
+        if (ret) {
+                fprintf(stderr, "failed to load %s: %s\n", key_file, strerror(-ret));
+                goto clean_key;
+        }
+
+        f = list ? fopen(list, "r") : stdin;
+        if (!f) {
+                ret = -errno;
+                fprintf(stderr, "failed to open %s: %s\n", list, strerror(-ret));
+                goto clean_key;
+        }
+
+        t0 = clock_ns();
+        ret = digest_index_build(f, path, &priv, &count);
+
+        if (f != stdin)
+                fclose(f);
+
+        if (ret)
+                fprintf(stderr, "failed to build %s: %s\n", path, strerror(-ret));
+        else
+                fprintf(stdout, "%lu digests in %s, %.1f ms\n", count, path,
+                        (clock_ns() - t0) / 1e6);
+
+clean_key:
+        rsa_private_key_clean(&priv);
+
+        return ret;
+}
+
+/**
+ * index_cmd_check() - check sha512sum style list against index
+ *
+ * Prints lines not in the index, returns -ENOENT if there were any
+ */
+static int index_cmd_check(const char *key_file, const char *list, const char *path,
+                           int trust)
+{
+        uint8_t digest[DIGEST_INDEX_DIGEST_LEN];
+        uint64_t t0, t_open, t_lookup = 0, n = 0, missing = 0;
+        struct digest_index idx;
+        struct rsa_public pub;
+        char *line = NULL;
+        size_t line_cap = 0;
+        ssize_t len;
+        FILE *f = NULL;
+        int ret, hit;
+
+        /* an unsigned allowlist is only used when asked for */
+        if (!key_file && !trust)
+                return -EINVAL;
+
+        rsa_public_key_init(&pub);
+
+        if (key_file) {
+                ret = key_file_load(key_file, NULL, &pub);
+                if (ret) {
+                        fprintf(stderr, "failed to load %s: %s\n", key_file, strerror(-ret));
+                        goto clean_key;
+                }
+        }
+
+        t0 = clock_ns();
+        ret = digest_index_open(&idx, path, key_file ? &pub : NULL);
+        t_open = clock_ns() - t0;
+
+        if (ret) {
+                fprintf(stderr, "failed to open %s: %s\n", path, strerror(-ret));
+                goto clean_key;
+        }
+
+        f = list ? fopen(list, "r") : stdin;
+        if (!f) {
+                ret = -errno;
+                goto close_idx;
+        }
+
+        while ((len = getline(&line, &line_cap, f)) > 0) {
+                if (len < CAS_HEX_LEN || cas_hex_digest(line, digest)) {
+                        ret = -EINVAL;
+                        break;
+                }
+
+                t0 = clock_ns();
+                hit = digest_index_lookup(&idx, digest);
+                t_lookup += clock_ns() - t0;
+                n++;
+
+                if (!hit) {
+                        fprintf(stdout, "NOT ALLOWED: %s", line);
+                        missing++;
+                }
+        }
+
+        free(line);
+
+        if (f != stdin)
+                fclose(f);
+
+        fprintf(stderr, "%lu entries, open%s %.2f ms, %lu lookups %.0f ns avg, "
+                        "%lu not allowed\n",
+                idx.count, key_file ? " + verify" : "", t_open / 1e6, n,
+                n ? (double)t_lookup / n : 0.0, missing);
+
+        if (!ret && missing)
+                ret = -ENOENT;
+
+close_idx:
+        digest_index_close(&idx);
+clean_key:
+        rsa_public_key_clean(&pub);
+
+        return ret;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s -k priv.key [-l list] build index\n"
+                "       %s -k pub.key | -T [-l list] check index\n"
+                "  -k file      key to sign with (build) or verify with (check)\n"
+                "  -T           check against the index unverified, trusting\n"
+                "               the file\n"
+                "  -l list      sha512sum output (default stdin)\n",
+                prog, prog);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *key_file = NULL;
+        const char *list = NULL;
+        const char *cmd;
+        int trust = 0;
+        int ret, c;
+
+        while ((c = getopt(argc, argv, "k:l:Th")) != -1) {
+                switch (c) {
+                        case 'k':
+                                key_file = optarg;
+                                break;
+
+                        case 'l':
+                                list = optarg;
+                                break;
+
+                        case 'T':
+                                trust = 1;
+                                break;
+
+                        default:
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
+                }
+        }
+
+        if (optind + 2 != argc) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        cmd = argv[optind];
+
+        if (!strcmp(cmd, "build"))
+                ret = index_cmd_build(key_file, list, argv[optind + 1]);
+        else if (!strcmp(cmd, "check"))
+                ret = index_cmd_check(key_file, list, argv[optind + 1], trust);
+        else
+                ret = -EINVAL;
+
+        if (ret == -EINVAL)
+                usage(argv[0]);
+
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
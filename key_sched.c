@@ -0,0 +1,556 @@
+/**
+ * key_sched.c - Key affinity scheduler for mixed-key sign/verify requests
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "key_sched.h"
+
+/* one entry per request of a round, sorted into buckets */
+struct key_sched_slot {
+        uint64_t                rank;           /* 0 = running key, ~0 = cold */
+        uint64_t                key_id;
+        uint32_t                seq;            /* arrival order */
+        uint32_t                op;
+        struct key_sched_req    *req;
+};
+
+static inline uint64_t key_sched_hash(uint64_t key)
+{
+        key ^= key >> 33;
+        key *= 0x9e3779b97f4a7c15UL;
+        key ^= key >> 29;
+
+        return key;
+}
+
+static void timespec_from_ns(struct timespec *ts, uint64_t ns)
+{
+        ts->tv_sec = (time_t)(ns / 1000000000UL);
+        ts->tv_nsec = (long)(ns % 1000000000UL);
+}
+
+static struct key_sched_warmth *key_sched_warmth(struct key_sched_worker *w,
+                                                 uint64_t key_id)
+{
+        return &w->warm[key_sched_hash(key_id) & (KEY_SCHED_WARM_SLOTS - 1)];
+}
+
+/**
+ * key_sched_rank() - how recently @key_id ran on this worker
+ *
+ * @return  keys run since, UINT64_MAX if not warm
+ */
+static uint64_t key_sched_rank(struct key_sched_worker *w, uint64_t key_id)
+{
+        struct key_sched_warmth *wm = key_sched_warmth(w, key_id);
+        uint64_t since;
+
+        if (!w->gen || wm->key_id != key_id || !wm->gen)
+                return UINT64_MAX;
+
+        since = w->gen - wm->gen;
+        if (since >= w->sched->opts.warm_keys)
+                return UINT64_MAX;
+
+        return since;
+}
+
+static int key_sched_slot_cmp(const void *a, const void *b)
+{
+        const struct key_sched_slot *x = a, *y = b;
+
+        if (x->rank != y->rank)
+                return x->rank < y->rank ? -1 : 1;
+
+        if (x->key_id != y->key_id)
+                return x->key_id < y->key_id ? -1 : 1;
+
+        if (x->op != y->op)
+                return x->op < y->op ? -1 : 1;
+
+        return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/**
+ * key_sched_run_bucket() - run requests of one key and op as one batch
+ */
+static void key_sched_run_bucket(struct key_sched_slot *slot, uint32_t n,
+                                 const void **digest, mpz_ptr *sig, int *status)
+{
+        struct key_sched_req *first = slot[0].req;
+
+        for (uint32_t i = 0; i < n; ++i) {
+                digest[i] = slot[i].req->digest;
+                sig[i] = slot[i].req->sig;
+        }
+
+        if (slot[0].op == KEY_SCHED_SIGN)
+                rsa_private_key_sign_batch(first->priv, sig, digest, first->len,
+                                           n, status);
+        else
+                rsa_public_key_verify_batch(first->pub, (mpz_srcptr *)sig, digest,
+                                            first->len, n, status);
+
+        for (uint32_t i = 0; i < n; ++i)
+                slot[i].req->ret = status[i];
+}
+
+/**
+ * key_sched_round() - bucket and run one gathered list of requests
+ *
+ * A bucket needs same key, op and digest length. Requests are run
+ * warmest key first, arrival order kept within a bucket. A FIFO
+ * config (no affinity, no window) keeps arrival order throughout.
+ */
+static void key_sched_round(struct key_sched_worker *w, struct key_sched_req *list,
+                            struct key_sched_slot *slot, const void **digest,
+                            mpz_ptr *sig, int *status)
+{
+        struct key_sched_stats stats = { 0 };
+        struct key_sched_warmth *wm;
+        struct key_sched_req *req, *next;
+        uint32_t n = 0, i, j;
+        int fifo = !w->sched->opts.window_us &&
+                   !(w->sched->opts.flags & KEY_SCHED_AFFINITY);
+
+        for (req = list; req; req = req->next) {
+                slot[n].rank = req->key_id == w->last_key && w->gen ?
+                               0 : key_sched_rank(w, req->key_id);
+                slot[n].key_id = req->key_id;
+                slot[n].seq = n;
+                slot[n].op = req->op;
+                slot[n].req = req;
+                n++;
+        }
+
+        if (n > 1 && !fifo)
+                qsort(slot, n, sizeof(*slot), key_sched_slot_cmp);
+
+        for (i = 0; i < n; i = j) {
+                for (j = i + 1; j < n; ++j) {
+                        if (slot[j].key_id != slot[i].key_id ||
+                            slot[j].op != slot[i].op ||
+                            slot[j].req->len != slot[i].req->len)
+                                break;
+                }
+
+                if (!w->gen || slot[i].key_id != w->last_key) {
+                        stats.switches++;
+                        w->gen++;
+                        w->last_key = slot[i].key_id;
+                }
+
+                stats.warm += slot[i].rank != UINT64_MAX;
+                stats.buckets++;
+
+                wm = key_sched_warmth(w, slot[i].key_id);
+                wm->key_id = slot[i].key_id;
+                wm->gen = w->gen;
+
+                key_sched_run_bucket(&slot[i], j - i, digest, sig, status);
+        }
+
+        /* completion may free or reuse the request */
+        for (req = list; req; req = next) {
+                next = req->next;
+
+                if (req->done)
+                        req->done(req);
+        }
+
+        stats.requests = n;
+        stats.rounds = 1;
+
+        pthread_mutex_lock(&w->lock);
+        w->stats.requests += stats.requests;
+        w->stats.rounds += stats.rounds;
+        w->stats.buckets += stats.buckets;
+        w->stats.switches += stats.switches;
+        w->stats.warm += stats.warm;
+        pthread_mutex_unlock(&w->lock);
+}
+
+static void key_sched_pin(struct key_sched_worker *w)
+{
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+
+        if (cpus < 1)
+                return;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->idx % (uint32_t)cpus, &set);
+
+        /* best effort, cpusets may forbid it */
+        pthread_setaffinity_np(w->tid, sizeof(set), &set);
+}
+
+/**
+ * key_sched_worker_run() - gather requests, bucket, run
+ *
+ * Waits up to window_us after the first request arrived (or until
+ * batch_max are queued), then takes the whole queue.
+ */
+static void *key_sched_worker_run(void *data)
+{
+        struct key_sched_worker *w = data;
+        struct key_sched *sched = w->sched;
+        uint32_t cap = sched->opts.batch_max;
+        struct key_sched_req *list, *req;
+        struct timespec ts;
+        uint64_t deadline;
+
+        if (sched->opts.flags & KEY_SCHED_PIN)
+                key_sched_pin(w);
+
+        pthread_mutex_lock(&w->lock);
+
+        while (1) {
+                while (!w->head && !sched->stop)
+                        pthread_cond_wait(&w->cv, &w->lock);
+
+                if (!w->head && sched->stop)
+                        break;
+
+                deadline = w->first_ns + sched->opts.window_us * 1000UL;
+                timespec_from_ns(&ts, deadline);
+
+                while (w->queued < cap && !sched->stop && clock_ns() < deadline) {
+                        if (pthread_cond_timedwait(&w->cv, &w->lock, &ts) == ETIMEDOUT)
+                                break;
+                }
+
+                /* take up to cap requests, the rest opens the next round */
+                list = w->head;
+                req = list;
+                for (uint32_t i = 1; i < cap && req->next; ++i)
+                        req = req->next;
+
+                w->head = req->next;
+                req->next = NULL;
+
+                if (!w->head) {
+                        w->tail = &w->head;
+                        w->queued = 0;
+                } else {
+                        w->queued = w->queued > cap ? w->queued - cap : 0;
+                        w->first_ns = clock_ns();
+                }
+
+                pthread_mutex_unlock(&w->lock);
+
+                key_sched_round(w, list, w->slot, w->digest, w->sig, w->status);
+
+                pthread_mutex_lock(&w->lock);
+        }
+
+        pthread_mutex_unlock(&w->lock);
+
+        return NULL;
+}
+
+/* worker thread joined or never started */
+static void key_sched_worker_free(struct key_sched_worker *w)
+{
+        free(w->status);
+        free(w->sig);
+        free(w->digest);
+        free(w->slot);
+        pthread_cond_destroy(&w->cv);
+        pthread_mutex_destroy(&w->lock);
+}
+
+/**
+ * key_sched_init() - start workers
+ *
+ * @param   sched: scheduler to init
+ * @param   opts: options, NULL or zero fields for defaults
+ * @return  0 on success
+ */
+int key_sched_init(struct key_sched *sched, const struct key_sched_opts *opts)
+{
+        pthread_condattr_t cattr;
+        uint32_t i;
+        int ret;
+
+        if (!sched)
+                return -EINVAL;
+
+        memset(sched, 0x00, sizeof(*sched));
+
+        if (opts)
+                sched->opts = *opts;
+
+        if (!sched->opts.workers)
+                sched->opts.workers = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+        if (!sched->opts.workers)
+                sched->opts.workers = 1;
+        if (!sched->opts.batch_max)
+                sched->opts.batch_max = KEY_SCHED_BATCH_MAX_DEFAULT;
+        if (!sched->opts.warm_keys)
+                sched->opts.warm_keys = KEY_SCHED_WARM_KEYS_DEFAULT;
+
+        if (sched->opts.workers > KEY_SCHED_WORKERS_MAX)
+                return -EINVAL;
+
+        sched->workers = aligned_alloc(KEY_SCHED_CACHELINE,
+                                       sizeof(*sched->workers) * sched->opts.workers);
+        if (!sched->workers)
+                return -ENOMEM;
+
+        memset(sched->workers, 0x00, sizeof(*sched->workers) * sched->opts.workers);
+
+        /* deadlines come from clock_ns(), CLOCK_MONOTONIC */
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+
+        for (i = 0; i < sched->opts.workers; ++i) {
+                struct key_sched_worker *w = &sched->workers[i];
+                uint32_t cap = sched->opts.batch_max;
+
+                w->sched = sched;
+                w->idx = i;
+                w->tail = &w->head;
+                pthread_mutex_init(&w->lock, NULL);
+                pthread_cond_init(&w->cv, &cattr);
+
+                w->slot = calloc(cap, sizeof(*w->slot));
+                w->digest = calloc(cap, sizeof(*w->digest));
+                w->sig = calloc(cap, sizeof(*w->sig));
+                w->status = calloc(cap, sizeof(*w->status));
+                if (!w->slot || !w->digest || !w->sig || !w->status) {
+                        for (uint32_t j = 0; j <= i; ++j)
+                                key_sched_worker_free(&sched->workers[j]);
+
+                        pthread_condattr_destroy(&cattr);
+                        free(sched->workers);
+                        sched->workers = NULL;
+                        return -ENOMEM;
+                }
+        }
+
+        pthread_condattr_destroy(&cattr);
+
+        for (i = 0; i < sched->opts.workers; ++i) {
+                ret = -pthread_create(&sched->workers[i].tid, NULL,
+                                      key_sched_worker_run, &sched->workers[i]);
+                if (ret) {
+                        /* workers without a thread are not joined by exit */
+                        for (uint32_t j = i; j < sched->opts.workers; ++j)
+                                key_sched_worker_free(&sched->workers[j]);
+
+                        sched->opts.workers = i;
+                        key_sched_exit(sched);
+                        return ret;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * key_sched_exit() - run what is queued, stop and join workers
+ */
+void key_sched_exit(struct key_sched *sched)
+{
+        uint32_t i;
+
+        if (!sched || !sched->workers)
+                return;
+
+        for (i = 0; i < sched->opts.workers; ++i) {
+                pthread_mutex_lock(&sched->workers[i].lock);
+                sched->stop = 1;
+                pthread_cond_signal(&sched->workers[i].cv);
+                pthread_mutex_unlock(&sched->workers[i].lock);
+        }
+
+        for (i = 0; i < sched->opts.workers; ++i) {
+                pthread_join(sched->workers[i].tid, NULL);
+                key_sched_worker_free(&sched->workers[i]);
+        }
+
+        free(sched->workers);
+        sched->workers = NULL;
+}
+
+/**
+ * key_sched_submit() - queue request, returns at once
+ *
+ * @param   sched: scheduler
+ * @param   req: request, owned by scheduler until req->done() is called
+ * @return  0 on success
+ */
+int key_sched_submit(struct key_sched *sched, struct key_sched_req *req)
+{
+        struct key_sched_worker *w;
+        uint32_t idx;
+
+        if (!sched || !req || !req->digest || !req->sig || req->op >= NUM_KEY_SCHED_OPS)
+                return -EINVAL;
+
+        if ((req->op == KEY_SCHED_SIGN && !req->priv) ||
+            (req->op == KEY_SCHED_VERIFY && !req->pub))
+                return -EINVAL;
+
+        if (sched->opts.flags & KEY_SCHED_AFFINITY)
+                idx = (uint32_t)(key_sched_hash(req->key_id) % sched->opts.workers);
+        else
+                idx = atomic_fetch_add_explicit(&sched->rr, 1, memory_order_relaxed) %
+                      sched->opts.workers;
+
+        w = &sched->workers[idx];
+        req->next = NULL;
+
+        pthread_mutex_lock(&w->lock);
+
+        if (sched->stop) {
+                pthread_mutex_unlock(&w->lock);
+                return -ESHUTDOWN;
+        }
+
+        if (!w->head)
+                w->first_ns = clock_ns();
+
+        *w->tail = req;
+        w->tail = &req->next;
+        w->queued++;
+
+        /* worker only needs waking for the first one or a full batch */
+        if (w->queued == 1 || w->queued >= sched->opts.batch_max)
+                pthread_cond_signal(&w->cv);
+
+        pthread_mutex_unlock(&w->lock);
+
+        return 0;
+}
+
+struct key_sched_wait {
+        pthread_mutex_t         lock;
+        pthread_cond_t          cv;
+        int                     done;
+};
+
+static void key_sched_wait_done(struct key_sched_req *req)
+{
+        struct key_sched_wait *wait = req->data;
+
+        pthread_mutex_lock(&wait->lock);
+        wait->done = 1;
+        pthread_cond_signal(&wait->cv);
+        pthread_mutex_unlock(&wait->lock);
+}
+
+static int key_sched_call(struct key_sched *sched, struct key_sched_req *req)
+{
+        struct key_sched_wait wait = {
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .cv = PTHREAD_COND_INITIALIZER,
+        };
+        int ret;
+
+        req->done = key_sched_wait_done;
+        req->data = &wait;
+
+        ret = key_sched_submit(sched, req);
+        if (ret)
+                return ret;
+
+        pthread_mutex_lock(&wait.lock);
+        while (!wait.done)
+                pthread_cond_wait(&wait.cv, &wait.lock);
+        pthread_mutex_unlock(&wait.lock);
+
+        return req->ret;
+}
+
+/**
+ * key_sched_sign() - sign through scheduler, wait for result
+ *
+ * @param   sched: scheduler
+ * @param   key_id: caller's key identifier, same id for same key
+ * @param   key: private key
+ * @param   digest: message digest octets
+ * @param   len: digest length in octets
+ * @param   s: signature to write
+ * @return  0 on success
+ */
+int key_sched_sign(struct key_sched *sched, uint64_t key_id,
+                   struct rsa_private *key, const void *digest, uint64_t len,
+                   mpz_t s)
+{
+        struct key_sched_req req = {
+                .key_id = key_id,
+                .op     = KEY_SCHED_SIGN,
+                .priv   = key,
+                .digest = digest,
+                .len    = len,
+                .sig    = s,
+        };
+
+        return key_sched_call(sched, &req);
+}
+
+/**
+ * key_sched_verify() - verify through scheduler, wait for result
+ *
+ * @return  0 on valid signature, -EBADMSG on mismatch
+ */
+int key_sched_verify(struct key_sched *sched, uint64_t key_id,
+                     struct rsa_public *key, const void *digest, uint64_t len,
+                     const mpz_t s)
+{
+        struct key_sched_req req = {
+                .key_id = key_id,
+                .op     = KEY_SCHED_VERIFY,
+                .pub    = key,
+                .digest = digest,
+                .len    = len,
+                .sig    = (mpz_ptr)s,
+        };
+
+        return key_sched_call(sched, &req);
+}
+
+/**
+ * key_sched_stats() - sum of worker counters
+ */
+void key_sched_stats(struct key_sched *sched, struct key_sched_stats *stats)
+{
+        memset(stats, 0x00, sizeof(*stats));
+
+        for (uint32_t i = 0; i < sched->opts.workers; ++i) {
+                struct key_sched_worker *w = &sched->workers[i];
+
+                pthread_mutex_lock(&w->lock);
+                stats->requests += w->stats.requests;
+                stats->rounds += w->stats.rounds;
+                stats->buckets += w->stats.buckets;
+                stats->switches += w->stats.switches;
+                stats->warm += w->stats.warm;
+                pthread_mutex_unlock(&w->lock);
+        }
+}
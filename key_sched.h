@@ -0,0 +1,148 @@
+/**
+ * key_sched.h - Key affinity scheduler for mixed-key sign/verify requests
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_KEY_SCHED_H
+#define SIMPLERSADIGEST_KEY_SCHED_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "rsa.h"
+
+/**
+ * Every key is owned by one worker (hash of key id), the worker is
+ * pinned to one CPU. A worker gathers requests for up to window_us
+ * after the first one arrives, buckets them by key and runs each
+ * bucket through the batch sign/verify path back to back.
+ *
+ * Buckets of keys that ran recently go first: a key is considered
+ * warm while fewer than warm_keys other keys ran on the worker since,
+ * i.e. its limbs are likely still in that core's cache.
+ *
+ * Without KEY_SCHED_AFFINITY and with window_us = 0 requests run in
+ * arrival order, adjacent ones of the same key still share a batch
+ * call. With batch_max = 1 as well it is a plain FIFO thread pool, the
+ * baseline to compare against.
+ */
+
+#define KEY_SCHED_WORKERS_MAX           (256)
+#define KEY_SCHED_WINDOW_US_DEFAULT     (100)
+#define KEY_SCHED_BATCH_MAX_DEFAULT     (256)
+#define KEY_SCHED_WARM_KEYS_DEFAULT     (16)
+#define KEY_SCHED_WARM_SLOTS            (1024)          /* power of 2 */
+
+#define KEY_SCHED_CACHELINE             (64)
+
+enum {
+        KEY_SCHED_SIGN = 0,
+        KEY_SCHED_VERIFY,
+        NUM_KEY_SCHED_OPS,
+};
+
+enum {
+        KEY_SCHED_AFFINITY      = (1 << 0),     /* key always on same worker */
+        KEY_SCHED_PIN           = (1 << 1),     /* worker pinned to a CPU */
+};
+
+struct key_sched_opts {
+        uint32_t        workers;
+        uint32_t        window_us;      /* gather window, 0 runs at once */
+        uint32_t        batch_max;      /* requests taken per round */
+        uint32_t        warm_keys;      /* keys a core keeps warm */
+        uint32_t        flags;          /* KEY_SCHED_* */
+};
+
+struct key_sched_req {
+        struct key_sched_req    *next;
+        uint64_t                key_id;
+        uint32_t                op;             /* KEY_SCHED_SIGN/VERIFY */
+        int32_t                 ret;            /* 0 or -errno when done */
+        struct rsa_private      *priv;          /* sign */
+        struct rsa_public       *pub;           /* verify */
+        const void              *digest;
+        uint64_t                len;
+        mpz_ptr                 sig;            /* out for sign, in for verify */
+
+        /* called on worker thread once ret is set */
+        void                    (*done)(struct key_sched_req *req);
+        void                    *data;
+};
+
+struct key_sched_stats {
+        uint64_t        requests;
+        uint64_t        rounds;         /* gather windows run */
+        uint64_t        buckets;        /* batch calls */
+        uint64_t        switches;       /* key changes on a worker */
+        uint64_t        warm;           /* buckets of a warm key */
+};
+
+struct key_sched_warmth {
+        uint64_t        key_id;
+        uint64_t        gen;            /* worker generation of last run */
+};
+
+struct key_sched;
+struct key_sched_slot;
+
+struct key_sched_worker {
+        pthread_t               tid;
+        struct key_sched        *sched;
+        uint32_t                idx;
+
+        pthread_mutex_t         lock;
+        pthread_cond_t          cv;
+        struct key_sched_req    *head;
+        struct key_sched_req    **tail;
+        uint32_t                queued;
+        uint64_t                first_ns;       /* arrival of oldest queued */
+
+        /* worker thread only */
+        uint64_t                gen;            /* bumped on key switch */
+        uint64_t                last_key;
+        struct key_sched_warmth warm[KEY_SCHED_WARM_SLOTS];
+        struct key_sched_stats  stats;
+
+        /* round scratch, batch_max entries each */
+        struct key_sched_slot   *slot;
+        const void              **digest;
+        mpz_ptr                 *sig;
+        int                     *status;
+} __attribute__((aligned(KEY_SCHED_CACHELINE)));
+
+struct key_sched {
+        struct key_sched_worker *workers;
+        struct key_sched_opts   opts;
+        _Atomic uint32_t        rr;             /* next worker without affinity */
+        int                     stop;
+};
+
+int key_sched_init(struct key_sched *sched, const struct key_sched_opts *opts);
+void key_sched_exit(struct key_sched *sched);
+
+int key_sched_submit(struct key_sched *sched, struct key_sched_req *req);
+
+int key_sched_sign(struct key_sched *sched, uint64_t key_id,
+                   struct rsa_private *key, const void *digest, uint64_t len,
+                   mpz_t s);
+int key_sched_verify(struct key_sched *sched, uint64_t key_id,
+                     struct rsa_public *key, const void *digest, uint64_t len,
+                     const mpz_t s);
+
+void key_sched_stats(struct key_sched *sched, struct key_sched_stats *stats);
+
+#endif //SIMPLERSADIGEST_KEY_SCHED_H
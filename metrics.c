@@ -0,0 +1,358 @@
+/**
+ * metrics.c - Live operation metrics in a shared memory segment
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "metrics.h"
+#include "trace.h"
+
+_Atomic uint32_t metrics_hooks;
+struct metrics_region *metrics_region;
+
+const char *const metrics_op_name[NUM_METRIC_OPS] = {
+        [METRIC_HASH]           = "hash",
+        [METRIC_SIGN]           = "sign",
+        [METRIC_VERIFY]         = "verify",
+        [METRIC_KEYGEN]         = "keygen",
+        [METRIC_ENCRYPT]        = "encrypt",
+        [METRIC_DECRYPT]        = "decrypt",
+};
+
+static char metrics_name[64];
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+static int metrics_key_err;
+
+/*
+ * Slot of the thread and the region it was claimed in. Regions are never
+ * unmapped, so the address tells one metrics_init() from the next.
+ */
+static __thread struct metrics_slot *metrics_self;
+static __thread struct metrics_region *metrics_self_region;
+
+/**
+ * metrics_slot_release() - hand slot of an exiting thread back
+ *
+ * Counters are left as they are, the next owner keeps adding to them
+ *
+ * @param data: slot of the thread
+ */
+static void metrics_slot_release(void *data)
+{
+        struct metrics_slot *slot = data;
+
+        atomic_store_explicit(&slot->owner, 0, memory_order_release);
+}
+
+/**
+ * metrics_key_create() - thread exit hook, once per process
+ */
+static void metrics_key_create(void)
+{
+        metrics_key_err = pthread_key_create(&metrics_key, metrics_slot_release);
+}
+
+/**
+ * metrics_init() - create segment and start recording
+ *
+ * A segment left by a process that is gone is replaced, one of a live
+ * process is not: RSADIGEST_METRICS is inherited by every tool started
+ * from the same environment, the first one keeps the name. A segment
+ * without magic yet may be one still being set up, it is given
+ * METRICS_INIT_TRIES / 2 rounds before it is taken as abandoned.
+ *
+ * @param name: shm object name, NULL for METRICS_NAME_DEFAULT
+ * @return 0 on success, -EBUSY if already running or @name is in use
+ */
+int metrics_init(const char *name)
+{
+        struct metrics_region *r;
+        int fd, alive, ret;
+
+        if (metrics_region)
+                return -EBUSY;
+
+        if (pthread_once(&metrics_key_once, metrics_key_create) || metrics_key_err)
+                return -EAGAIN;
+
+        snprintf(metrics_name, sizeof(metrics_name), "%s",
+                 name ? name : METRICS_NAME_DEFAULT);
+
+        for (int tries = 0; ; ++tries) {
+                fd = shm_open(metrics_name, O_RDWR | O_CREAT | O_EXCL, 0640);
+                if (fd >= 0 || errno != EEXIST || tries == METRICS_INIT_TRIES)
+                        break;
+
+                ret = metrics_attach(&r, metrics_name);
+                if (!ret) {
+                        alive = pid_alive((int64_t)r->pid);
+                        metrics_detach(r);
+
+                        if (alive)
+                                return -EBUSY;
+
+                        /* left over by a process that did not exit cleanly */
+                        shm_unlink(metrics_name);
+                } else if (ret == -EPROTO && tries < METRICS_INIT_TRIES / 2) {
+                        /* creator may not have published its magic yet */
+                        usleep(METRICS_INIT_WAIT_US);
+                } else if (ret != -ENOENT) {
+                        /* still no magic, its creator died half way */
+                        shm_unlink(metrics_name);
+                }
+        }
+
+        if (fd < 0)
+                return errno == EEXIST ? -EBUSY : -errno;
+
+        if (ftruncate(fd, sizeof(struct metrics_region))) {
+                close(fd);
+                shm_unlink(metrics_name);
+                return -errno;
+        }
+
+        r = mmap(NULL, sizeof(struct metrics_region),
+                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (r == MAP_FAILED) {
+                shm_unlink(metrics_name);
+                return -errno;
+        }
+
+        r->version = METRICS_VERSION;
+        r->slots = METRICS_SLOTS;
+        r->pid = (uint64_t)getpid();
+        r->start_ns = clock_ns();
+
+        /* Publish magic last, readers check it on attach */
+        atomic_thread_fence(memory_order_release);
+        r->magic = METRICS_MAGIC;
+
+        metrics_region = r;
+        atomic_fetch_or(&metrics_hooks, METRICS_HOOK_SHM);
+
+        return 0;
+}
+
+/**
+ * metrics_exit() - stop recording and remove segment name
+ *
+ * The mapping stays, other threads may still be inside
+ * __metrics_record() and readers keep their own mapping anyway
+ */
+void metrics_exit(void)
+{
+        if (!metrics_region)
+                return;
+
+        atomic_fetch_and(&metrics_hooks, ~METRICS_HOOK_SHM);
+        metrics_region = NULL;
+        shm_unlink(metrics_name);
+}
+
+/**
+ * metrics_slot_get() - slot of calling thread, claim one on first use
+ *
+ * @param r: pointer to region
+ * @return slot, NULL if all slots are taken
+ */
+static struct metrics_slot *metrics_slot_get(struct metrics_region *r)
+{
+        uint32_t tid;
+
+        /* a slot claimed before metrics_exit() belongs to the old region */
+        if (metrics_self && metrics_self_region == r)
+                return metrics_self;
+
+        tid = (uint32_t)syscall(SYS_gettid);
+
+        for (uint32_t i = 0; i < METRICS_SLOTS; ++i) {
+                struct metrics_slot *slot = &r->slot[i];
+                uint32_t none = 0;
+
+                if (atomic_load_explicit(&slot->owner, memory_order_relaxed))
+                        continue;
+
+                if (!atomic_compare_exchange_strong_explicit(&slot->owner,
+                                                             &none, tid,
+                                                             memory_order_acquire,
+                                                             memory_order_relaxed))
+                        continue;
+
+                pthread_setspecific(metrics_key, slot);
+                metrics_self = slot;
+                metrics_self_region = r;
+
+                return slot;
+        }
+
+        return NULL;
+}
+
+/**
+ * __metrics_record() - account @n calls, use metrics_record() instead
+ *
+ * @param op: METRIC_*
+ * @param t0: clock_ns() before the calls
+ * @param key: modulus of key used, NULL for hash
+ * @param n: number of calls
+ * @param bytes: octets processed by all calls
+ * @param errors: failed calls
+ */
+void __metrics_record(uint32_t op, uint64_t t0, mpz_srcptr key, uint64_t n,
+                      uint64_t bytes, uint64_t errors)
+{
+        struct metrics_region *r = metrics_region;
+        struct metrics_slot *slot;
+        struct metrics_op *m;
+        uint64_t elapsed, v;
+
+        if (op >= NUM_METRIC_OPS)
+                return;
+
+        if (atomic_load_explicit(&metrics_hooks, memory_order_relaxed) &
+            METRICS_HOOK_TRACE)
+                trace_record(op, t0, key, n, bytes, errors);
+
+        if (!r)
+                return;
+
+        elapsed = clock_ns() - t0;
+
+        slot = metrics_slot_get(r);
+        if (!slot) {
+                atomic_fetch_add_explicit(&r->dropped, n, memory_order_relaxed);
+                return;
+        }
+
+        m = &slot->op[op];
+        m->ops += n;
+        m->bytes += bytes;
+        m->errors += errors;
+
+        /* Single writer, same as hist_record() for n calls of equal length */
+        v = elapsed / n;
+        m->lat.count[hist_bucket_index(v)] += n;
+        m->lat.total += n;
+        m->lat.sum += elapsed;
+        if (v > m->lat.max)
+                m->lat.max = v;
+}
+
+/**
+ * metrics_attach() - map a segment read-only
+ *
+ * @param r: pointer to save mapping
+ * @param name: shm object name, NULL for METRICS_NAME_DEFAULT
+ * @return 0 on success, -EPROTO if it is not a metrics segment
+ */
+int metrics_attach(struct metrics_region **r, const char *name)
+{
+        struct metrics_region *m;
+        struct stat st;
+        int fd;
+
+        if (!r)
+                return -EINVAL;
+
+        fd = shm_open(name ? name : METRICS_NAME_DEFAULT, O_RDONLY, 0);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st)) {
+                close(fd);
+                return -errno;
+        }
+
+        if ((uint64_t)st.st_size < sizeof(struct metrics_region)) {
+                close(fd);
+                return -EPROTO;
+        }
+
+        m = mmap(NULL, sizeof(struct metrics_region), PROT_READ, MAP_SHARED,
+                 fd, 0);
+        close(fd);
+
+        if (m == MAP_FAILED)
+                return -errno;
+
+        if (m->magic != METRICS_MAGIC || m->version != METRICS_VERSION ||
+            m->slots != METRICS_SLOTS) {
+                munmap(m, sizeof(struct metrics_region));
+                return -EPROTO;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        *r = m;
+
+        return 0;
+}
+
+/**
+ * metrics_detach() - unmap a segment mapped by metrics_attach()
+ *
+ * @param r: mapping
+ */
+void metrics_detach(struct metrics_region *r)
+{
+        if (r)
+                munmap(r, sizeof(struct metrics_region));
+}
+
+/**
+ * metrics_env_init() - start recording if RSADIGEST_METRICS is set
+ *
+ * Lets existing binaries export metrics without code changes, e.g.
+ * RSADIGEST_METRICS=/rsadigest-metrics rsadigest-signer -k priv.key
+ */
+static void __attribute__((constructor)) metrics_env_init(void)
+{
+        const char *name = getenv(METRICS_ENV);
+        int ret;
+
+        if (!name || !name[0])
+                return;
+
+        /* readers inherit the variable too, the name is not theirs */
+        if (&metrics_reader && metrics_reader)
+                return;
+
+        ret = metrics_init(name);
+        if (ret == -EBUSY) {
+                fprintf(stderr, "metrics: %s is in use by another process\n", name);
+                return;
+        }
+
+        if (ret) {
+                fprintf(stderr, "metrics: failed to create %s: %s\n",
+                        name, strerror(-ret));
+                return;
+        }
+
+        atexit(metrics_exit);
+}
@@ -0,0 +1,157 @@
+/**
+ * metrics.h - Live operation metrics in a shared memory segment
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_METRICS_H
+#define SIMPLERSADIGEST_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <gmp.h>
+
+#include "histogram.h"
+#include "misc_helper.h"
+
+/**
+ * Off unless metrics_init() is called or RSADIGEST_METRICS names a shm
+ * object at startup, then every hash, sign, verify, keygen and
+ * en/decryption lands in a segment other processes can map read-only.
+ *
+ * Each thread owns one slot and is its only writer, so recording is
+ * plain stores into memory no other thread writes: no locks, no atomic
+ * read-modify-write, no shared cache lines. Readers sum all slots and
+ * may see a counter one update ahead of its histogram, which is fine
+ * for rates. Slots of exited threads are handed to new threads and
+ * keep counting, totals never go backwards.
+ *
+ * The same hooks feed trace capture (trace.h), each one is a single
+ * load of metrics_hooks while both are off.
+ */
+
+#define METRICS_MAGIC                   (0x5253444d45545231ULL)        /* RSDMETR1 */
+#define METRICS_VERSION                 (1)
+#define METRICS_SLOTS                   (64)
+#define METRICS_NAME_DEFAULT            "/rsadigest-metrics"
+#define METRICS_ENV                     "RSADIGEST_METRICS"
+#define METRICS_INIT_TRIES              (100)   /* create/attach rounds */
+#define METRICS_INIT_WAIT_US            (1000)  /* for a creator to finish */
+
+enum {
+        METRICS_HOOK_SHM        = (1 << 0),     /* metrics_init() */
+        METRICS_HOOK_TRACE      = (1 << 1),     /* trace_init() */
+};
+
+enum {
+        METRIC_HASH = 0,
+        METRIC_SIGN,
+        METRIC_VERIFY,
+        METRIC_KEYGEN,
+        METRIC_ENCRYPT,
+        METRIC_DECRYPT,
+        NUM_METRIC_OPS,
+};
+
+struct metrics_op {
+        uint64_t                ops;
+        uint64_t                bytes;          /* payload, digest or key octets */
+        uint64_t                errors;
+        struct lat_hist         lat;            /* nanoseconds per call */
+};
+
+struct metrics_slot {
+        _Atomic uint32_t        owner;          /* tid, 0 if free */
+        uint32_t                reserved;
+        struct metrics_op       op[NUM_METRIC_OPS];
+} __attribute__((aligned(64)));
+
+struct metrics_region {
+        uint64_t                magic;          /* written last */
+        uint32_t                version;
+        uint32_t                slots;
+        uint64_t                pid;
+        uint64_t                start_ns;       /* clock_ns() at init */
+        _Atomic uint64_t        dropped;        /* calls without a free slot */
+        struct metrics_slot     slot[METRICS_SLOTS];
+};
+
+extern _Atomic uint32_t metrics_hooks;
+extern struct metrics_region *metrics_region;
+
+extern const char *const metrics_op_name[NUM_METRIC_OPS];
+
+/*
+ * Defined non-zero by tools that only read segments, keeps the
+ * RSADIGEST_METRICS hook from creating one in their own process
+ */
+extern const int metrics_reader __attribute__((weak));
+
+int metrics_init(const char *name);
+void metrics_exit(void);
+
+void __metrics_record(uint32_t op, uint64_t t0, mpz_srcptr key, uint64_t n,
+                      uint64_t bytes, uint64_t errors);
+
+int metrics_attach(struct metrics_region **r, const char *name);
+void metrics_detach(struct metrics_region *r);
+
+/**
+ * metrics_start() - timestamp for metrics_record()
+ *
+ * @return  clock_ns(), 0 if metrics and trace are off
+ */
+static inline uint64_t metrics_start(void)
+{
+        return atomic_load_explicit(&metrics_hooks, memory_order_relaxed) ?
+               clock_ns() : 0;
+}
+
+/**
+ * metrics_record() - account one call started at @t0
+ *
+ * @param   op: METRIC_*
+ * @param   t0: metrics_start() before the call, 0 records nothing
+ * @param   key: modulus of key used, NULL for hash
+ * @param   bytes: octets processed
+ * @param   err: return value of the call
+ */
+static inline void metrics_record(uint32_t op, uint64_t t0, mpz_srcptr key,
+                                  uint64_t bytes, int err)
+{
+        if (t0)
+                __metrics_record(op, t0, key, 1, bytes, err != 0);
+}
+
+/**
+ * metrics_record_n() - account a batch of @n calls started at @t0
+ *
+ * Latency recorded is per call, the batch time divided by @n
+ *
+ * @param   op: METRIC_*
+ * @param   t0: metrics_start() before the batch, 0 records nothing
+ * @param   key: modulus of key used, NULL for hash
+ * @param   n: calls in the batch
+ * @param   bytes: octets processed by the whole batch
+ * @param   errors: failed calls in the batch
+ */
+static inline void metrics_record_n(uint32_t op, uint64_t t0, mpz_srcptr key,
+                                    uint64_t n, uint64_t bytes, uint64_t errors)
+{
+        if (t0 && n)
+                __metrics_record(op, t0, key, n, bytes, errors);
+}
+
+#endif //SIMPLERSADIGEST_METRICS_H
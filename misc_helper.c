@@ -21,6 +21,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 
 #include "misc_helper.h"
 
@@ -74,4 +76,66 @@ void memdump_byte(void *blk, size_t size, FILE *stream)
 
 #undef COUNT_MAKE_SPACE
 #undef COUNT_RETURN_LINE
-}
\ No newline at end of file
+}
+
+/**
+ * clock_ns() - monotonic clock reading
+ *
+ * @return  nanoseconds since an unspecified point
+ */
+uint64_t clock_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+
+/**
+ * crc32_update() - CRC-32 (IEEE 802.3) of memory block
+ *
+ * Nibble table version, small and good enough for record checksums
+ *
+ * @param crc: crc of previous data, 0 to start
+ * @param buf: pointer to memory block
+ * @param len: memory block in bytes
+ * @return  updated crc
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+        static const uint32_t nibble[16] = {
+                0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+                0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+                0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+                0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+        };
+        const uint8_t *b = buf;
+
+        crc = ~crc;
+
+        for (size_t i = 0; i < len; ++i) {
+                crc = (crc >> 4) ^ nibble[(crc ^ b[i]) & 0x0f];
+                crc = (crc >> 4) ^ nibble[(crc ^ (b[i] >> 4)) & 0x0f];
+        }
+
+        return ~crc;
+}
+
+/**
+ * pid_alive() - whether a process still exists
+ *
+ * A process of another user counts as alive, it can not be signalled
+ * but the pid is taken
+ *
+ * @param pid: process id, <= 0 never alive
+ * @return  1 if alive, 0 otherwise
+ */
+int pid_alive(int64_t pid)
+{
+        if (pid <= 0)
+                return 0;
+
+        return !kill((pid_t)pid, 0) || errno != ESRCH;
+}
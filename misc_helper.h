@@ -21,10 +21,26 @@
 #define SIMPLERSADIGEST_MISC_HELPER_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 #define ARRAY_SIZE(arr)                 (sizeof(arr) / sizeof((arr)[0]))
 
+/* Busy-wait hint for spin loops */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield" ::: "memory");
+#else
+        __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
 uint64_t urandom_read(void);
 void memdump_byte(void *blk, size_t size, FILE *stream);
+uint64_t clock_ns(void);
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+int pid_alive(int64_t pid);
 
 #endif //SIMPLERSADIGEST_MISC_HELPER_H
@@ -0,0 +1,545 @@
+/**
+ * replay_tool.c - Drive the library with a captured workload trace
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "rsa.h"
+#include "sha512.h"
+#include "metrics.h"
+#include "trace.h"
+#include "histogram.h"
+#include "thread_pool.h"
+
+const int trace_reader = 1;
+
+/* largest payload hashed in one call, longer ones are fed in pieces */
+#define REPLAY_PAYLOAD_MAX              (16UL << 20)
+
+struct replay_key {
+        uint64_t                key_id;
+        uint64_t                key_len;
+        struct rsa_private      priv;
+        struct rsa_public       pub;
+        uint8_t                 digest[SHA512_HASH_BITS / 8];
+        mpz_t                   sig;            /* of digest, for verify */
+        mpz_t                   ct;             /* OAEP of digest, for decrypt */
+};
+
+struct replay_req {
+        struct thread_pool_work work;
+        const struct trace_rec  *rec;
+        struct replay_key       *key;           /* NULL for hash */
+        struct thread_pool_group *group;
+        uint64_t                due_ns;         /* scheduled start */
+        uint64_t                done_ns;
+        int                     ret;
+};
+
+static uint8_t *replay_payload;
+
+static int replay_key_cmp(const void *a, const void *b)
+{
+        const struct replay_key *x = a;
+        const struct replay_key *y = b;
+
+        if (x->key_len != y->key_len)
+                return (x->key_len > y->key_len) - (x->key_len < y->key_len);
+
+        return (x->key_id > y->key_id) - (x->key_id < y->key_id);
+}
+
+/* modulus bits as captured, rounded up to what keygen produces */
+static uint64_t replay_key_len(const struct trace_rec *rec)
+{
+        return ((uint64_t)rec->key_bits + 63) & ~63UL;
+}
+
+/**
+ * replay_key_find() - key standing in for a captured key id
+ */
+static struct replay_key *replay_key_find(struct replay_key *keys, uint32_t n,
+                                          const struct trace_rec *rec)
+{
+        struct replay_key k = { .key_id = rec->key_id, .key_len = replay_key_len(rec) };
+
+        return bsearch(&k, keys, n, sizeof(*keys), replay_key_cmp);
+}
+
+/**
+ * replay_keys_collect() - distinct (key id, length) pairs of the trace
+ *
+ * @return number of keys, sorted, keys array in @out
+ */
+static uint32_t replay_keys_collect(const struct trace_rec *recs, uint64_t count,
+                                    struct replay_key **out)
+{
+        struct replay_key *keys = NULL;
+        uint32_t n = 0, cap = 0;
+
+        for (uint64_t i = 0; i < count; ++i) {
+                const struct trace_rec *rec = &recs[i];
+
+                if (rec->op == METRIC_HASH || rec->op == METRIC_KEYGEN ||
+                    !rec->key_bits)
+                        continue;
+
+                if (n && replay_key_find(keys, n, rec))
+                        continue;
+
+                if (n == cap) {
+                        struct replay_key *k;
+
+                        cap = cap ? cap * 2 : 64;
+                        k = realloc(keys, cap * sizeof(*keys));
+                        if (!k) {
+                                free(keys);
+                                *out = NULL;
+                                return 0;
+                        }
+
+                        keys = k;
+                }
+
+                memset(&keys[n], 0x00, sizeof(keys[n]));
+                keys[n].key_id = rec->key_id;
+                keys[n].key_len = replay_key_len(rec);
+                n++;
+
+                /* keep sorted for bsearch, few distinct keys in practice */
+                qsort(keys, n, sizeof(*keys), replay_key_cmp);
+        }
+
+        *out = keys;
+
+        return n;
+}
+
+/**
+ * replay_keys_generate() - real keys of the captured lengths
+ *
+ * Keys of one length come from pairs of a small prime pool, as in
+ * bench affinity mode: distinct moduli is what matters for cache
+ * behaviour, m primes give m * (m - 1) / 2 keys
+ */
+static int replay_keys_generate(struct replay_key *keys, uint32_t n)
+{
+        uint32_t first = 0;
+        int ret = 0;
+
+        while (first < n) {
+                uint64_t key_len = keys[first].key_len;
+                uint64_t bits = key_len / 2;
+                uint32_t last = first, want, m = 2, i, j, k;
+                mpz_t *primes;
+
+                while (last < n && keys[last].key_len == key_len)
+                        last++;
+
+                want = last - first;
+                while (m * (m - 1) / 2 < want + 2)
+                        m++;
+
+                primes = calloc(m, sizeof(*primes));
+                if (!primes)
+                        return -ENOMEM;
+
+                for (i = 0; i < m; ++i) {
+                        mpz_init(primes[i]);
+
+                        do {
+                                mpz_rand_bitlen(primes[i], bits);
+                                mpz_setbit(primes[i], bits - 1);
+                                mpz_setbit(primes[i], bits - 2);
+                                mpz_nextprime(primes[i], primes[i]);
+                        } while (mpz_sizeinbase(primes[i], 2) != bits);
+                }
+
+                k = first;
+                for (i = 0; i < m && k < last; ++i) {
+                        for (j = i + 1; j < m && k < last; ++j) {
+                                struct replay_key *key = &keys[k];
+
+                                if (rsa_private_key_from_primes(&key->priv, primes[i],
+                                                                primes[j]))
+                                        continue;
+
+                                ret = rsa_public_key_generate(&key->pub, &key->priv);
+                                if (ret)
+                                        goto clean_primes;
+
+                                sha512_buffer_process(&key->key_id, sizeof(key->key_id),
+                                                      key->digest);
+
+                                ret = rsa_private_key_sign(&key->priv, key->sig,
+                                                           key->digest, sizeof(key->digest));
+                                if (ret)
+                                        goto clean_primes;
+
+                                /* OAEP needs 2 * 64 + 2 octets, short keys skip decrypt */
+                                if (key_len / 8 >= 2 * sizeof(key->digest) + 2 + 32)
+                                        rsa_public_key_encrypt_oaep(&key->pub, key->ct,
+                                                                    key->digest, 32, NULL, 0,
+                                                                    SHA512_HASH_BITS);
+
+                                k++;
+                        }
+                }
+
+                if (k < last)
+                        ret = -EAGAIN;
+
+clean_primes:
+                for (i = 0; i < m; ++i)
+                        mpz_clear(primes[i]);
+
+                free(primes);
+
+                if (ret)
+                        return ret;
+
+                first = last;
+        }
+
+        return 0;
+}
+
+/**
+ * replay_hash() - hash captured length of payload
+ */
+static int replay_hash(uint64_t len)
+{
+        uint8_t md[SHA512_HASH_BITS / 8];
+        struct sha512_ctx ctx;
+
+        if (len <= REPLAY_PAYLOAD_MAX)
+                return sha512_buffer_process(replay_payload, len, md);
+
+        sha512_ctx_init(&ctx);
+
+        while (len) {
+                uint64_t n = len < REPLAY_PAYLOAD_MAX ? len : REPLAY_PAYLOAD_MAX;
+
+                sha512_ctx_update(&ctx, replay_payload, n);
+                len -= n;
+        }
+
+        sha512_ctx_conclude(&ctx);
+
+        return 0;
+}
+
+/**
+ * replay_run() - one captured call, on a pool worker
+ *
+ * Digests are SHA-512 whatever was captured, the digest length does
+ * not change the cost of the exponentiation
+ */
+static void replay_run(struct thread_pool_work *work)
+{
+        struct replay_req *req = (struct replay_req *)work;
+        const struct trace_rec *rec = req->rec;
+        struct replay_key *key = req->key;
+        uint8_t msg[SHA512_HASH_BITS / 8];
+        uint64_t len = sizeof(msg);
+        struct rsa_private tmp;
+        mpz_t out;
+
+        mpz_init(out);
+
+        switch (rec->op) {
+                case METRIC_HASH:
+                        req->ret = replay_hash(rec->bytes);
+                        break;
+
+                case METRIC_SIGN:
+                        req->ret = rsa_private_key_sign(&key->priv, out, key->digest,
+                                                        sizeof(key->digest));
+                        break;
+
+                case METRIC_VERIFY:
+                        req->ret = rsa_public_key_verify(&key->pub, key->sig, key->digest,
+                                                         sizeof(key->digest));
+                        break;
+
+                case METRIC_KEYGEN:
+                        rsa_private_key_init(&tmp);
+                        req->ret = rsa_private_key_generate(&tmp, replay_key_len(rec));
+                        rsa_private_key_clean(&tmp);
+                        break;
+
+                case METRIC_ENCRYPT:
+                        len = rec->bytes < 32 ? rec->bytes : 32;
+                        req->ret = rsa_public_key_encrypt_oaep(&key->pub, out, key->digest,
+                                                               len, NULL, 0,
+                                                               SHA512_HASH_BITS);
+                        break;
+
+                case METRIC_DECRYPT:
+                        req->ret = rsa_private_key_decrypt_oaep(&key->priv, msg, &len,
+                                                                key->ct, NULL, 0,
+                                                                SHA512_HASH_BITS);
+                        break;
+
+                default:
+                        req->ret = -EINVAL;
+                        break;
+        }
+
+        mpz_clear(out);
+
+        req->done_ns = clock_ns();
+        thread_pool_group_done(req->group);
+}
+
+static void replay_sleep_until(uint64_t ns)
+{
+        struct timespec ts = {
+                .tv_sec  = (time_t)(ns / 1000000000UL),
+                .tv_nsec = (long)(ns % 1000000000UL),
+        };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+}
+
+static void replay_report(const struct replay_req *reqs, uint64_t count,
+                          uint64_t t_start, double speed, uint64_t lag_max)
+{
+        struct lat_hist *hist;
+        uint64_t ops[NUM_METRIC_OPS] = { 0 };
+        uint64_t errors[NUM_METRIC_OPS] = { 0 };
+        uint64_t t_end = t_start;
+        double sec;
+
+        hist = calloc(NUM_METRIC_OPS, sizeof(*hist));
+        if (!hist)
+                return;
+
+        for (uint64_t i = 0; i < count; ++i) {
+                const struct replay_req *r = &reqs[i];
+                uint32_t op = r->rec->op;
+
+                if (op >= NUM_METRIC_OPS)
+                        continue;
+
+                /* from scheduled start, queueing behind slow calls counts */
+                hist_record(&hist[op], r->done_ns - r->due_ns);
+                ops[op]++;
+                if (r->ret)
+                        errors[op]++;
+
+                if (r->done_ns > t_end)
+                        t_end = r->done_ns;
+        }
+
+        sec = (t_end - t_start) / 1e9;
+
+        fprintf(stdout, "%lu calls in %.2f s at %.1fx, %.0f calls/s, "
+                        "dispatch lag max %.1f us\n",
+                count, sec, speed, sec > 0 ? count / sec : 0.0, lag_max / 1e3);
+        fprintf(stdout, "%-8s %10s %12s %10s %10s %10s %10s %8s\n",
+                "op", "calls", "calls/s", "p50 us", "p99 us", "p99.9 us",
+                "max us", "errors");
+
+        for (uint32_t k = 0; k < NUM_METRIC_OPS; ++k) {
+                if (!ops[k])
+                        continue;
+
+                fprintf(stdout, "%-8s %10lu %12.1f %10.1f %10.1f %10.1f %10.1f %8lu\n",
+                        metrics_op_name[k], ops[k], sec > 0 ? ops[k] / sec : 0.0,
+                        hist_percentile(&hist[k], 50.0) / 1e3,
+                        hist_percentile(&hist[k], 99.0) / 1e3,
+                        hist_percentile(&hist[k], 99.9) / 1e3,
+                        hist[k].max / 1e3, errors[k]);
+        }
+
+        free(hist);
+}
+
+/**
+ * replay() - replay trace open loop
+ *
+ * Every call is started at its captured offset divided by @speed no
+ * matter how far behind the pool is, so latency includes the queueing
+ * a slower library would cause under the same arrivals
+ */
+static int replay(const char *path, double speed, uint32_t threads)
+{
+        struct thread_pool_group group;
+        struct thread_pool pool;
+        struct replay_key *keys = NULL;
+        struct replay_req *reqs = NULL;
+        struct trace_rec *recs = NULL;
+        struct trace_hdr hdr;
+        uint64_t count, payload = 0, t_start, lag, lag_max = 0;
+        uint32_t n_keys = 0, i;
+        int ret;
+
+        ret = trace_load(path, &hdr, &recs, &count);
+        if (ret) {
+                fprintf(stderr, "failed to load %s: %s\n", path, strerror(-ret));
+                return ret;
+        }
+
+        if (!count) {
+                fprintf(stderr, "%s: empty trace\n", path);
+                ret = -ENODATA;
+                goto free_recs;
+        }
+
+        for (uint64_t j = 0; j < count; ++j)
+                if (recs[j].op == METRIC_HASH && recs[j].bytes > payload)
+                        payload = recs[j].bytes;
+
+        if (payload > REPLAY_PAYLOAD_MAX)
+                payload = REPLAY_PAYLOAD_MAX;
+
+        replay_payload = malloc(payload + 1);
+        reqs = calloc(count, sizeof(*reqs));
+        if (!replay_payload || !reqs) {
+                ret = -ENOMEM;
+                goto free_reqs;
+        }
+
+        memset(replay_payload, 0x5a, payload + 1);
+
+        n_keys = replay_keys_collect(recs, count, &keys);
+        for (i = 0; i < n_keys; ++i) {
+                rsa_private_key_init(&keys[i].priv);
+                rsa_public_key_init(&keys[i].pub);
+                mpz_inits(keys[i].sig, keys[i].ct, NULL);
+        }
+
+        fprintf(stdout, "%s: pid %lu, %lu calls over %.2f s, generating %u keys...\n",
+                path, hdr.pid, count, recs[count - 1].t_ns / 1e9, n_keys);
+        fflush(stdout);
+
+        ret = replay_keys_generate(keys, n_keys);
+        if (ret) {
+                fprintf(stderr, "key generation failed: %d\n", ret);
+                goto clean_keys;
+        }
+
+        for (uint64_t j = 0; j < count; ++j) {
+                reqs[j].rec = &recs[j];
+                reqs[j].work.fn = replay_run;
+                reqs[j].group = &group;
+
+                if (recs[j].op == METRIC_HASH || recs[j].op == METRIC_KEYGEN)
+                        continue;
+
+                reqs[j].key = replay_key_find(keys, n_keys, &recs[j]);
+                if (!reqs[j].key) {
+                        ret = -EPROTO;
+                        goto clean_keys;
+                }
+        }
+
+        ret = thread_pool_init(&pool, threads);
+        if (ret)
+                goto clean_keys;
+
+        thread_pool_group_init(&group);
+
+        t_start = clock_ns();
+
+        for (uint64_t j = 0; j < count; ++j) {
+                struct replay_req *r = &reqs[j];
+
+                r->due_ns = t_start + (uint64_t)((recs[j].t_ns - recs[0].t_ns) / speed);
+
+                if (clock_ns() < r->due_ns)
+                        replay_sleep_until(r->due_ns);
+
+                lag = clock_ns() - r->due_ns;
+                if (lag > lag_max)
+                        lag_max = lag;
+
+                thread_pool_group_add(&group);
+                thread_pool_queue(&pool, &r->work);
+        }
+
+        thread_pool_group_wait(&group);
+        thread_pool_group_clean(&group);
+        thread_pool_exit(&pool);
+
+        replay_report(reqs, count, t_start, speed, lag_max);
+
+clean_keys:
+        for (i = 0; i < n_keys; ++i) {
+                mpz_clears(keys[i].sig, keys[i].ct, NULL);
+                rsa_public_key_clean(&keys[i].pub);
+                rsa_private_key_clean(&keys[i].priv);
+        }
+
+        free(keys);
+free_reqs:
+        free(reqs);
+        free(replay_payload);
+free_recs:
+        free(recs);
+
+        return ret;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [-s speed] [-t threads] trace\n"
+                "  -s speed     time scale, 1 = as captured, 10 = ten times\n"
+                "               the arrival rate (default 1)\n"
+                "  -t threads   library threads (default online CPUs)\n"
+                "capture a trace by running any tool with %s=file\n",
+                prog, TRACE_ENV);
+}
+
+int main(int argc, char *argv[])
+{
+        double speed = 1.0;
+        uint32_t threads = 0;
+        int c;
+
+        while ((c = getopt(argc, argv, "s:t:h")) != -1) {
+                switch (c) {
+                        case 's':
+                                speed = strtod(optarg, NULL);
+                                break;
+
+                        case 't':
+                                threads = (uint32_t)strtoul(optarg, NULL, 10);
+                                break;
+
+                        default:
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
+                }
+        }
+
+        if (optind != argc - 1 || !(speed > 0.0)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        return replay(argv[optind], speed, threads) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
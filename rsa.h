@@ -32,6 +32,12 @@ enum {
         NUM_PRIME,
 };
 
+enum {
+        PRIMALITY_SOLOVAY_STRASSEN = 0, /* PRIMALITY_TEST_ACCURACY rounds */
+        PRIMALITY_BAILLIE_PSW,
+        NUM_PRIMALITY_MODES,
+};
+
 struct rsa_private {
         uint64_t        key_len;        /* key bit length */
         uint64_t        version;        /* RSA version */
@@ -64,7 +70,20 @@ int rsa_private_key_save(struct rsa_private *key, FILE *stream);
 int rsa_public_key_dump(struct rsa_public *key, FILE *stream);
 int rsa_public_key_save(struct rsa_public *key, FILE *stream);
 
+int rsa_private_key_load(struct rsa_private *key, FILE *stream);
+int rsa_public_key_load(struct rsa_public *key, FILE *stream);
+
+int primality_test(const mpz_t n, uint64_t k);
+int primality_test_bpsw(const mpz_t n);
+int primality_check(const mpz_t n);
+int primality_mode_set(int mode);
+
 int rsa_private_key_generate(struct rsa_private *key, uint64_t length);
+int rsa_private_key_from_primes(struct rsa_private *key, const mpz_t p,
+                                const mpz_t q);
+uint64_t rsa_rebalanced_exp_bits_min(uint64_t length);
+int rsa_private_key_generate_rebalanced(struct rsa_private *key, uint64_t length,
+                                        uint64_t exp_bits);
 int rsa_public_key_generate(struct rsa_public *pub, struct rsa_private *priv);
 
 /**
@@ -126,4 +145,45 @@ int rsa_public_key_encrypt(struct rsa_public *key,FILE *stream_encrypted,
 int rsa_public_key_decrypt(struct rsa_public *key,FILE *stream_decrypt,
                            FILE *stream_encrypt);
 
+/**
+ * Digest signature, whole digest in one BT_01 encryption block
+ *
+ *    EB = 00 || 01 || FF ... FF || 00 || digest
+ *
+ * Requires k >= len + 11, e.g. 1024-bit key or larger for SHA-512
+ */
+int rsa_private_key_sign(struct rsa_private *key, mpz_t s,
+                         const void *digest, uint64_t len);
+int rsa_public_key_verify(struct rsa_public *key, const mpz_t s,
+                          const void *digest, uint64_t len);
+
+struct sha512_midstate;
+
+int rsa_private_key_sign_midstate(struct rsa_private *key, mpz_t s,
+                                  const struct sha512_midstate *ms, int bits,
+                                  void *digest);
+
+int rsa_private_key_sign_batch(struct rsa_private *key, mpz_ptr *s,
+                               const void *const *digest, uint64_t len,
+                               uint32_t n, int *status);
+int rsa_public_key_verify_batch(struct rsa_public *key, mpz_srcptr *s,
+                                const void *const *digest, uint64_t len,
+                                uint32_t n, int *status);
+
+/**
+ * RSAES-OAEP (RFC8017#section-7.1), SHA-384/512 and MGF1 of same hash
+ *
+ *    DB = lHash || PS || 01 || M
+ *    EM = 00 || seed ^ MGF(maskedDB) || DB ^ MGF(seed)
+ *
+ * Message up to k - 2 * hLen - 2 octets, e.g. 126 octets with a
+ * 2048-bit key and SHA-512. bits selects hash, SHA384/512_HASH_BITS.
+ */
+int rsa_public_key_encrypt_oaep(struct rsa_public *key, mpz_t c,
+                                const void *msg, uint64_t len,
+                                const void *label, uint64_t label_len, int bits);
+int rsa_private_key_decrypt_oaep(struct rsa_private *key, void *msg,
+                                 uint64_t *len, const mpz_t c,
+                                 const void *label, uint64_t label_len, int bits);
+
 #endif //SIMPLERSADIGEST_RSA_DIGEST_H
@@ -24,8 +24,11 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/random.h>
 
 #include "rsa.h"
+#include "sha512.h"
+#include "metrics.h"
 
 const static uint8_t BT_encrypt_key[NUM_BT_TYPE] = {
         [BT_TYPE_00] = RSA_KEY_TYPE_PRIVATE,
@@ -441,6 +444,8 @@ int rsa_encrypt_file(FILE *stream_encrypted,
         mpz_t                           data_plain;
         mpz_t                           x;      /* Integer encryption block */
         mpz_t                           y;      /* Encrypted integer block */
+        uint64_t                        t0 = metrics_start();
+        uint64_t                        total = 0;
         int32_t                         ret = 0;
         int32_t                         read;   /* fgetc() returns int32_t */
         uint8_t                         ch;     /* char reads from file */
@@ -482,6 +487,7 @@ int rsa_encrypt_file(FILE *stream_encrypted,
                 gmp_printf("encrypt: [%#04Zx][%c] -> [%s]\n", data_plain, ch, str_encrypt);
 
                 fprintf(stream_encrypted, "%s\n", str_encrypt);
+                total++;
         } while (!feof(stream_plain));
 
         free(str_encrypt);
@@ -490,6 +496,8 @@ free_EB:
         rsa_encrypt_block_free(&ED);
         mpz_clears(data_encrypt, data_plain, x, y, NULL);
 
+        metrics_record(METRIC_ENCRYPT, t0, n, total, ret);
+
         return ret;
 }
 
@@ -517,6 +525,8 @@ int rsa_decrypt_file(FILE *stream_decrypt,
         size_t                          str_len;
         mpz_t                           x;      /* Decrypted integer block */
         mpz_t                           y;      /* Encrypted integer block */
+        uint64_t                        t0 = metrics_start();
+        uint64_t                        total = 0;
         int32_t                         ret = 0;
         int32_t                         read;
         uint32_t                        count;  /* String iterator */
@@ -554,6 +564,7 @@ int rsa_decrypt_file(FILE *stream_decrypt,
                                 goto err_read;
 
                         fputc(D, stream_decrypt);
+                        total++;
 
                         printf("decrypt: [%s] -> [%#04x][%c]\n", str_encrypt, D, D);
 
@@ -579,6 +590,8 @@ err_read:
 
         free(str_encrypt);
 
+        metrics_record(METRIC_DECRYPT, t0, n, total, ret);
+
         return ret;
 }
 
@@ -626,4 +639,634 @@ int rsa_public_key_decrypt(struct rsa_public *key,FILE *stream_decrypt,
                                 key->n,
                                 key->key_len,
                                 RSA_KEY_TYPE_PUBLIC);
-}
\ No newline at end of file
+}
+
+/**
+ * rsa_encrypt_block_encode_digest() - put whole digest into BT_01 EB
+ *
+ * @param   EB: pointer to encryption block
+ * @param   D: digest octets
+ * @param   len: digest length in octets
+ * @return  0 on success
+ */
+static int rsa_encrypt_block_encode_digest(struct rsa_encrypt_block *EB,
+                                           const uint8_t *D, uint64_t len)
+{
+        uint64_t octet_pad;
+        uint64_t idx;
+
+        /* RFC2313: PS shall be at least eight octets long */
+        if (EB->k < len + 3 + 8)
+                return -E2BIG;
+
+        octet_pad = EB->k - 3 - len;
+        idx = 0;
+
+        EB->octet[idx++] = 0x00;                /* 00 */
+        EB->octet[idx++] = BT_TYPE_01;          /* BT */
+
+        memset(&EB->octet[idx], 0xFF, octet_pad);
+        idx += octet_pad;                       /* PS */
+
+        EB->octet[idx++] = 0x00;                /* 00 */
+        memcpy(&EB->octet[idx], D, len);        /* D */
+
+        return 0;
+}
+
+/**
+ * rsa_encrypt_block_export() - write integer into EB, big-endian, zero padded
+ *
+ * @param   EB: pointer to encryption block
+ * @param   y: integer, must fit in k octets
+ * @return  0 on success
+ */
+static int rsa_encrypt_block_export(struct rsa_encrypt_block *EB, const mpz_t y)
+{
+        size_t count = (mpz_sizeinbase(y, 2) + 7) / 8;
+
+        if (count > EB->k)
+                return -E2BIG;
+
+        memset(EB->octet, 0x00, EB->k);
+        mpz_export(&EB->octet[EB->k - count], NULL, 1, 1, 1, 0, y);
+
+        return 0;
+}
+
+/**
+ * rsa_crt_computation() - private key operation with CRT factors
+ *
+ * y = m2 + q * (coeff * (m1 - m2) mod p)
+ *
+ * @param   y: output data
+ * @param   x: input data
+ * @param   key: pointer to private key
+ */
+static void rsa_crt_computation_tmp(mpz_t y, const mpz_t x, struct rsa_private *key,
+                                    mpz_t m1, mpz_t m2)
+{
+        mpz_powm(m1, x, key->exp1, key->p);     /* m1 = x^exp1 mod p */
+        mpz_powm(m2, x, key->exp2, key->q);     /* m2 = x^exp2 mod q */
+
+        mpz_sub(m1, m1, m2);
+        mpz_mul(m1, m1, key->coeff);
+        mpz_mod(m1, m1, key->p);                /* h = coeff * (m1 - m2) mod p */
+
+        mpz_mul(m1, m1, key->q);
+        mpz_add(y, m2, m1);                     /* y = m2 + h * q */
+}
+
+static void rsa_crt_computation(mpz_t y, const mpz_t x, struct rsa_private *key)
+{
+        mpz_t m1;
+        mpz_t m2;
+
+        mpz_inits(m1, m2, NULL);
+
+        rsa_crt_computation_tmp(y, x, key, m1, m2);
+
+        mpz_clears(m1, m2, NULL);
+}
+
+/**
+ * rsa_private_key_sign() - sign a message digest with private key
+ *
+ * @param   key: pointer to private key
+ * @param   s: signature to write
+ * @param   digest: message digest octets
+ * @param   len: digest length in octets
+ * @return  0 on success
+ */
+int rsa_private_key_sign(struct rsa_private *key, mpz_t s,
+                         const void *digest, uint64_t len)
+{
+        struct rsa_encrypt_block EB;
+        uint64_t t0 = metrics_start();
+        mpz_t x;
+        int ret;
+
+        if (!key || !digest)
+                return -EINVAL;
+
+        ret = rsa_encrypt_block_init(&EB, (key->key_len + 7) / 8);
+        if (ret)
+                goto out;
+
+        ret = rsa_encrypt_block_encode_digest(&EB, digest, len);
+        if (ret)
+                goto free_EB;
+
+        mpz_init(x);
+        mpz_import(x, EB.k, 1, 1, 1, 0, EB.octet);
+
+        rsa_crt_computation(s, x, key);
+
+        mpz_clear(x);
+free_EB:
+        rsa_encrypt_block_free(&EB);
+out:
+        metrics_record(METRIC_SIGN, t0, key->n, len, ret);
+
+        return ret;
+}
+
+/**
+ * rsa_private_key_sign_midstate() - finish client's hash and sign it
+ *
+ * The payload never reaches the signer, only its SHA-384/512 midstate,
+ * so the cost does not depend on payload length: one or two final
+ * blocks plus the exponentiation.
+ *
+ * @param   key: pointer to private key
+ * @param   s: signature to write
+ * @param   ms: midstate from sha512_ctx_export(), untrusted
+ * @param   bits: SHA384_HASH_BITS or SHA512_HASH_BITS
+ * @param   digest: optional, bits / 8 octets, standard order digest signed
+ * @return  0 on success, -EINVAL on malformed midstate
+ */
+int rsa_private_key_sign_midstate(struct rsa_private *key, mpz_t s,
+                                  const struct sha512_midstate *ms, int bits,
+                                  void *digest)
+{
+        uint8_t md[SHA512_HASH_BITS / 8];
+        struct sha512_ctx ctx;
+        int ret;
+
+        if (!key || (bits != SHA384_HASH_BITS && bits != SHA512_HASH_BITS))
+                return -EINVAL;
+
+        ret = sha512_ctx_import(&ctx, ms);
+        if (ret)
+                return ret;
+
+        sha512_ctx_conclude(&ctx);
+
+        if (bits == SHA384_HASH_BITS)
+                sha384_ctx_digest(&ctx, md);
+        else
+                sha512_ctx_digest(&ctx, md);
+
+        if (digest)
+                memcpy(digest, md, bits / 8);
+
+        return rsa_private_key_sign(key, s, md, bits / 8);
+}
+
+/**
+ * rsa_public_key_verify() - verify a digest signature with public key
+ *
+ * @param   key: pointer to public key
+ * @param   s: signature
+ * @param   digest: expected message digest octets
+ * @param   len: digest length in octets
+ * @return  0 on valid signature, -EBADMSG on mismatch
+ */
+int rsa_public_key_verify(struct rsa_public *key, const mpz_t s,
+                          const void *digest, uint64_t len)
+{
+        struct rsa_encrypt_block EB;    /* Expected block */
+        struct rsa_encrypt_block ED;    /* Recovered block */
+        uint64_t t0 = metrics_start();
+        mpz_t y;
+        int ret;
+
+        if (!key || !digest)
+                return -EINVAL;
+
+        if (mpz_sgn(s) < 0 || mpz_cmp(s, key->n) >= 0) {
+                ret = -EBADMSG;
+                goto out;
+        }
+
+        ret = rsa_encrypt_block_init(&EB, (key->key_len + 7) / 8);
+        if (ret)
+                goto out;
+
+        ret = rsa_encrypt_block_init(&ED, (key->key_len + 7) / 8);
+        if (ret)
+                goto free_EB;
+
+        ret = rsa_encrypt_block_encode_digest(&EB, digest, len);
+        if (ret)
+                goto free_ED;
+
+        mpz_init(y);
+        rsa_computation(y, s, key->e, key->n);
+
+        if (rsa_encrypt_block_export(&ED, y) ||
+            memcmp(EB.octet, ED.octet, EB.k))
+                ret = -EBADMSG;
+
+        mpz_clear(y);
+free_ED:
+        rsa_encrypt_block_free(&ED);
+free_EB:
+        rsa_encrypt_block_free(&EB);
+out:
+        metrics_record(METRIC_VERIFY, t0, key->n, len, ret);
+
+        return ret;
+}
+
+/**
+ * rsa_oaep_hash_len() - octets of OAEP hash
+ *
+ * @param   bits: SHA384_HASH_BITS or SHA512_HASH_BITS
+ * @return  digest octets, 0 if hash is not supported
+ */
+static uint64_t rsa_oaep_hash_len(int bits)
+{
+        if (bits != SHA384_HASH_BITS && bits != SHA512_HASH_BITS)
+                return 0;
+
+        return bits / 8;
+}
+
+static int rsa_oaep_mgf1(const void *seed, size_t seed_len, void *mask,
+                         size_t mask_len, int bits)
+{
+        if (bits == SHA384_HASH_BITS)
+                return sha384_mgf1(seed, seed_len, mask, mask_len);
+
+        return sha512_mgf1(seed, seed_len, mask, mask_len);
+}
+
+static void rsa_oaep_label_hash(const void *label, uint64_t len, uint8_t *lhash,
+                                int bits)
+{
+        struct sha512_ctx ctx;
+
+        if (bits == SHA384_HASH_BITS)
+                sha384_ctx_init(&ctx);
+        else
+                sha512_ctx_init(&ctx);
+
+        sha512_ctx_update(&ctx, label, len);
+        sha512_ctx_conclude(&ctx);
+
+        if (bits == SHA384_HASH_BITS)
+                sha384_ctx_digest(&ctx, lhash);
+        else
+                sha512_ctx_digest(&ctx, lhash);
+}
+
+/* b[i] ^= m[i] */
+static inline void rsa_oaep_xor(uint8_t *b, const uint8_t *m, uint64_t len)
+{
+        for (uint64_t i = 0; i < len; ++i)
+                b[i] ^= m[i];
+}
+
+/**
+ * rsa_public_key_encrypt_oaep() - RSAES-OAEP encryption
+ *
+ * @param   key: pointer to public key
+ * @param   c: ciphertext to write
+ * @param   msg: message octets
+ * @param   len: message length, at most k - 2 * hLen - 2
+ * @param   label: optional label, NULL for empty
+ * @param   label_len: label length in octets
+ * @param   bits: SHA384_HASH_BITS or SHA512_HASH_BITS
+ * @return  0 on success
+ */
+int rsa_public_key_encrypt_oaep(struct rsa_public *key, mpz_t c,
+                                const void *msg, uint64_t len,
+                                const void *label, uint64_t label_len, int bits)
+{
+        struct rsa_encrypt_block EB;
+        uint8_t mask[SHA512_HASH_BITS / 8];
+        uint64_t hlen = rsa_oaep_hash_len(bits);
+        uint64_t k, db_len;
+        uint8_t *seed, *db, *db_mask;
+        uint64_t t0 = metrics_start();
+        mpz_t x;
+        int ret;
+
+        if (!key || (!msg && len) || (!label && label_len) || !hlen)
+                return -EINVAL;
+
+        k = (key->key_len + 7) / 8;
+        if (k < 2 * hlen + 2 || len > k - 2 * hlen - 2) {
+                ret = -E2BIG;
+                goto out;
+        }
+
+        ret = rsa_encrypt_block_init(&EB, k);
+        if (ret)
+                goto out;
+
+        db_len = k - hlen - 1;
+        db_mask = malloc(db_len);
+        if (!db_mask) {
+                ret = -ENOMEM;
+                goto free_EB;
+        }
+
+        seed = &EB.octet[1];
+        db = &EB.octet[1 + hlen];
+
+        /* DB = lHash || PS || 01 || M, PS zeroed by init */
+        rsa_oaep_label_hash(label, label_len, db, bits);
+        db[db_len - len - 1] = 0x01;
+        memcpy(&db[db_len - len], msg, len);
+
+        if (getrandom(seed, hlen, 0) != (ssize_t)hlen) {
+                ret = -EIO;
+                goto free_mask;
+        }
+
+        /* maskedDB = DB ^ MGF(seed), maskedSeed = seed ^ MGF(maskedDB) */
+        ret = rsa_oaep_mgf1(seed, hlen, db_mask, db_len, bits);
+        if (ret)
+                goto free_mask;
+
+        rsa_oaep_xor(db, db_mask, db_len);
+
+        ret = rsa_oaep_mgf1(db, db_len, mask, hlen, bits);
+        if (ret)
+                goto free_mask;
+
+        rsa_oaep_xor(seed, mask, hlen);
+
+        /* EM = 00 || maskedSeed || maskedDB */
+        mpz_init(x);
+        mpz_import(x, EB.k, 1, 1, 1, 0, EB.octet);
+        rsa_computation(c, x, key->e, key->n);
+        mpz_clear(x);
+
+free_mask:
+        explicit_bzero(db_mask, db_len);
+        free(db_mask);
+free_EB:
+        explicit_bzero(EB.octet, EB.k);
+        rsa_encrypt_block_free(&EB);
+out:
+        metrics_record(METRIC_ENCRYPT, t0, key->n, len, ret);
+
+        return ret;
+}
+
+/**
+ * rsa_private_key_decrypt_oaep() - RSAES-OAEP decryption
+ *
+ * Every padding check is folded into one result without branching on
+ * secret data, so callers can not tell which one failed
+ *
+ * @param   key: pointer to private key
+ * @param   msg: buffer for message
+ * @param   len: in: buffer size, out: message length
+ * @param   c: ciphertext
+ * @param   label: optional label, NULL for empty
+ * @param   label_len: label length in octets
+ * @param   bits: SHA384_HASH_BITS or SHA512_HASH_BITS
+ * @return  0 on success, -EBADMSG on decryption error
+ */
+int rsa_private_key_decrypt_oaep(struct rsa_private *key, void *msg,
+                                 uint64_t *len, const mpz_t c,
+                                 const void *label, uint64_t label_len, int bits)
+{
+        struct rsa_encrypt_block EB;
+        uint8_t lhash[SHA512_HASH_BITS / 8];
+        uint8_t mask[SHA512_HASH_BITS / 8];
+        uint64_t hlen = rsa_oaep_hash_len(bits);
+        uint64_t k, db_len, idx = 0, mlen;
+        uint8_t *seed, *db, *db_mask;
+        uint8_t bad, found = 0;
+        uint64_t t0 = metrics_start();
+        mpz_t y;
+        int ret;
+
+        if (!key || !msg || !len || (!label && label_len) || !hlen)
+                return -EINVAL;
+
+        k = (key->key_len + 7) / 8;
+        if (k < 2 * hlen + 2) {
+                ret = -E2BIG;
+                goto out;
+        }
+
+        if (mpz_sgn(c) < 0 || mpz_cmp(c, key->n) >= 0) {
+                ret = -EBADMSG;
+                goto out;
+        }
+
+        ret = rsa_encrypt_block_init(&EB, k);
+        if (ret)
+                goto out;
+
+        db_len = k - hlen - 1;
+        db_mask = malloc(db_len);
+        if (!db_mask) {
+                ret = -ENOMEM;
+                goto free_EB;
+        }
+
+        mpz_init(y);
+        rsa_crt_computation(y, c, key);
+        ret = rsa_encrypt_block_export(&EB, y);
+        mpz_wipe(y);
+        mpz_clear(y);
+        if (ret) {
+                ret = -EBADMSG;
+                goto free_mask;
+        }
+
+        seed = &EB.octet[1];
+        db = &EB.octet[1 + hlen];
+
+        ret = rsa_oaep_mgf1(db, db_len, mask, hlen, bits);
+        if (ret)
+                goto free_mask;
+
+        rsa_oaep_xor(seed, mask, hlen);
+
+        ret = rsa_oaep_mgf1(seed, hlen, db_mask, db_len, bits);
+        if (ret)
+                goto free_mask;
+
+        rsa_oaep_xor(db, db_mask, db_len);
+
+        rsa_oaep_label_hash(label, label_len, lhash, bits);
+
+        /* Y must be 00 and lHash must match */
+        bad = EB.octet[0];
+        for (uint64_t i = 0; i < hlen; ++i)
+                bad |= db[i] ^ lhash[i];
+
+        /* PS is zeros up to the first 01 */
+        for (uint64_t i = hlen; i < db_len; ++i) {
+                uint8_t is_one = (uint8_t)-(db[i] == 0x01);
+                uint8_t is_zero = (uint8_t)-(db[i] == 0x00);
+
+                idx |= i & (uint64_t)(int8_t)(~found & is_one);
+                bad |= ~found & ~is_one & ~is_zero;
+                found |= is_one;
+        }
+
+        if (bad || !found) {
+                ret = -EBADMSG;
+                goto free_mask;
+        }
+
+        mlen = db_len - idx - 1;
+        if (mlen > *len) {
+                ret = -ENOSPC;
+                goto free_mask;
+        }
+
+        memcpy(msg, &db[idx + 1], mlen);
+        *len = mlen;
+
+free_mask:
+        explicit_bzero(mask, sizeof(mask));
+        explicit_bzero(db_mask, db_len);
+        free(db_mask);
+free_EB:
+        explicit_bzero(EB.octet, EB.k);
+        rsa_encrypt_block_free(&EB);
+out:
+        metrics_record(METRIC_DECRYPT, t0, key->n, ret ? 0 : *len, ret);
+
+        return ret;
+}
+
+/**
+ * rsa_private_key_sign_batch() - sign @n digests with one key
+ *
+ * Same signatures as rsa_private_key_sign() one by one. Block and
+ * temporaries are set up once and the key stays hot in cache across
+ * the whole batch.
+ *
+ * @param   key: pointer to private key
+ * @param   s: @n signatures to write
+ * @param   digest: @n message digests
+ * @param   len: digest length in octets, same for all
+ * @param   n: batch size
+ * @param   status: optional, per digest 0 or -errno
+ * @return  0 if every digest was signed, first error otherwise
+ */
+int rsa_private_key_sign_batch(struct rsa_private *key, mpz_ptr *s,
+                               const void *const *digest, uint64_t len,
+                               uint32_t n, int *status)
+{
+        struct rsa_encrypt_block EB;
+        uint64_t t0 = metrics_start();
+        uint32_t errors = 0;
+        mpz_t x, m1, m2;
+        int ret, first = 0;
+
+        if (!key || !s || !digest)
+                return -EINVAL;
+
+        ret = rsa_encrypt_block_init(&EB, (key->key_len + 7) / 8);
+        if (ret) {
+                metrics_record_n(METRIC_SIGN, t0, key->n, n, 0, n);
+                return ret;
+        }
+
+        mpz_inits(x, m1, m2, NULL);
+
+        for (uint32_t i = 0; i < n; ++i) {
+                ret = rsa_encrypt_block_encode_digest(&EB, digest[i], len);
+                if (!ret) {
+                        mpz_import(x, EB.k, 1, 1, 1, 0, EB.octet);
+                        rsa_crt_computation_tmp(s[i], x, key, m1, m2);
+                }
+
+                if (status)
+                        status[i] = ret;
+
+                if (ret)
+                        errors++;
+
+                if (ret && !first)
+                        first = ret;
+        }
+
+        mpz_wipe(m1);
+        mpz_wipe(m2);
+        mpz_clears(x, m1, m2, NULL);
+        rsa_encrypt_block_free(&EB);
+
+        metrics_record_n(METRIC_SIGN, t0, key->n, n, len * n, errors);
+
+        return first;
+}
+
+/**
+ * rsa_public_key_verify_batch() - verify @n digest signatures with one key
+ *
+ * @param   key: pointer to public key
+ * @param   s: @n signatures
+ * @param   digest: @n expected message digests
+ * @param   len: digest length in octets, same for all
+ * @param   n: batch size
+ * @param   status: optional, per digest 0, -EBADMSG or -errno
+ * @return  0 if every signature is valid, first error otherwise
+ */
+int rsa_public_key_verify_batch(struct rsa_public *key, mpz_srcptr *s,
+                                const void *const *digest, uint64_t len,
+                                uint32_t n, int *status)
+{
+        struct rsa_encrypt_block EB;    /* Expected block */
+        struct rsa_encrypt_block ED;    /* Recovered block */
+        uint64_t t0 = metrics_start();
+        uint32_t errors = 0;
+        mpz_t y;
+        int ret, first = 0;
+
+        if (!key || !s || !digest)
+                return -EINVAL;
+
+        ret = rsa_encrypt_block_init(&EB, (key->key_len + 7) / 8);
+        if (ret)
+                goto out;
+
+        ret = rsa_encrypt_block_init(&ED, (key->key_len + 7) / 8);
+        if (ret) {
+                rsa_encrypt_block_free(&EB);
+                goto out;
+        }
+
+        mpz_init(y);
+
+        for (uint32_t i = 0; i < n; ++i) {
+                ret = rsa_encrypt_block_encode_digest(&EB, digest[i], len);
+                if (ret)
+                        goto next;
+
+                if (mpz_sgn(s[i]) < 0 || mpz_cmp(s[i], key->n) >= 0) {
+                        ret = -EBADMSG;
+                        goto next;
+                }
+
+                rsa_computation(y, s[i], key->e, key->n);
+
+                if (rsa_encrypt_block_export(&ED, y) ||
+                    memcmp(EB.octet, ED.octet, EB.k))
+                        ret = -EBADMSG;
+next:
+                if (status)
+                        status[i] = ret;
+
+                if (ret)
+                        errors++;
+
+                if (ret && !first)
+                        first = ret;
+        }
+
+        mpz_clear(y);
+        rsa_encrypt_block_free(&ED);
+        rsa_encrypt_block_free(&EB);
+
+        metrics_record_n(METRIC_VERIFY, t0, key->n, n, len * n, errors);
+
+        return first;
+
+out:
+        metrics_record_n(METRIC_VERIFY, t0, key->n, n, 0, n);
+
+        return ret;
+}
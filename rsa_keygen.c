@@ -24,8 +24,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "rsa.h"
+#include "metrics.h"
 
 /**
  * rsa_key_init() - init gmp elements in key
@@ -63,7 +65,14 @@ int rsa_private_key_clean(struct rsa_private *key)
         if (!key)
                 return -EINVAL;
 
-        memset(key, 0x00, sizeof(struct rsa_private));
+        /* secrets first, limbs are not scrubbed by mpz_clear() */
+        mpz_wipe(key->p);
+        mpz_wipe(key->q);
+        mpz_wipe(key->d);
+        mpz_wipe(key->exp1);
+        mpz_wipe(key->exp2);
+        mpz_wipe(key->coeff);
+
         mpz_clears(key->n,
                    key->p,
                    key->q,
@@ -73,6 +82,7 @@ int rsa_private_key_clean(struct rsa_private *key)
                    key->exp2,
                    key->coeff,
                    NULL);
+        memset(key, 0x00, sizeof(struct rsa_private));
 
         return 0;
 }
@@ -185,6 +195,134 @@ int rsa_public_key_save(struct rsa_public *key, FILE *stream)
         return rsa_public_key_dump(key, stream);;
 }
 
+/**
+ * rsa_key_field_parse() - parse one "  name value, -- comment" line
+ *
+ * @param   line: line from key file
+ * @param   name: buffer of at least 32 chars for field name
+ * @param   val: value to write
+ * @return  0 on success
+ */
+static int rsa_key_field_parse(const char *line, char *name, mpz_t val)
+{
+        int off = 0;
+
+        if (sscanf(line, " %31[A-Za-z0-9] %n", name, &off) != 1 || !off)
+                return -EINVAL;
+
+        if (gmp_sscanf(line + off, "%Zd", val) != 1)
+                return -EINVAL;
+
+        return 0;
+}
+
+/**
+ * rsa_private_key_load() - read key saved by rsa_private_key_save()
+ *
+ * @param   key: pointer to initialized key struct
+ * @param   stream: file stream pointer
+ * @return  0 on success
+ */
+int rsa_private_key_load(struct rsa_private *key, FILE *stream)
+{
+        if (!key || !stream)
+                return -EINVAL;
+
+        struct {
+                const char      *name;
+                mpz_ptr         val;
+        } fields[] = {
+                { "modulus",            key->n          },
+                { "publicExponent",     key->e          },
+                { "privateExponent",    key->d          },
+                { "prime1",             key->p          },
+                { "prime2",             key->q          },
+                { "exponent1",          key->exp1       },
+                { "exponent2",          key->exp2       },
+                { "coefficient",        key->coeff      },
+        };
+        uint32_t found = 0;
+        char name[32];
+        char *line = NULL;
+        size_t cap = 0;
+        mpz_t t;
+
+        mpz_init(t);
+
+        while (getline(&line, &cap, stream) > 0) {
+                if (rsa_key_field_parse(line, name, t))
+                        continue;
+
+                if (!strcmp(name, "version")) {
+                        key->version = mpz_get_ui(t);
+                        continue;
+                }
+
+                for (uint32_t i = 0; i < ARRAY_SIZE(fields); ++i) {
+                        if (!strcmp(name, fields[i].name)) {
+                                mpz_set(fields[i].val, t);
+                                found |= 1U << i;
+                        }
+                }
+        }
+
+        free(line);
+        mpz_clear(t);
+
+        if (found != (1U << ARRAY_SIZE(fields)) - 1)
+                return -ENODATA;
+
+        key->key_len = mpz_sizeinbase(key->n, 2);
+
+        return 0;
+}
+
+/**
+ * rsa_public_key_load() - read key saved by rsa_public_key_save()
+ *
+ * @param   key: pointer to initialized key struct
+ * @param   stream: file stream pointer
+ * @return  0 on success
+ */
+int rsa_public_key_load(struct rsa_public *key, FILE *stream)
+{
+        uint32_t found = 0;
+        char name[32];
+        char *line = NULL;
+        size_t cap = 0;
+        mpz_t t;
+
+        if (!key || !stream)
+                return -EINVAL;
+
+        mpz_init(t);
+
+        while (getline(&line, &cap, stream) > 0) {
+                if (rsa_key_field_parse(line, name, t))
+                        continue;
+
+                if (!strcmp(name, "modulus")) {
+                        mpz_set(key->n, t);
+                        found |= 1U << 0;
+                } else if (!strcmp(name, "publicExponent")) {
+                        mpz_set(key->e, t);
+                        found |= 1U << 1;
+                }
+        }
+
+        free(line);
+        mpz_clear(t);
+
+        if (found != 0x03)
+                return -ENODATA;
+
+        key->key_len = mpz_sizeinbase(key->n, 2);
+
+        return 0;
+}
+
+static int primality_mode = PRIMALITY_SOLOVAY_STRASSEN;
+
 /**
  * primality_test() - Solovay-Strassen primality test
  *
@@ -197,18 +335,23 @@ int primality_test(const mpz_t n, uint64_t k)
         mpz_t a;
         mpz_t x;
         mpz_t t;
+        mpz_t e;
+        int ret = NUM_PRIME;
 
-        mpz_inits(t, a, x, NULL);
-
-        if (!mpz_cmp_ui(n, 1))
-                return 0;
+        if (mpz_cmp_ui(n, 2) < 0)
+                return NUM_COMPOSITE;
 
         if (!mpz_cmp_ui(n, 2))
-                return 1;
+                return NUM_PRIME;
+
+        if (mpz_even_p(n))
+                return NUM_COMPOSITE;
 
-        mpz_mod_ui(t, n, 2);
-        if (!mpz_cmp_ui(t, 0))
-                return 0;
+        mpz_inits(t, a, x, e, NULL);
+
+        /* e = (n - 1) / 2 */
+        mpz_sub_ui(e, n, 1);
+        mpz_fdiv_q_2exp(e, e, 1);
 
         /* temporary variable */
         mpz_sub_ui(t, n, 2);
@@ -217,34 +360,328 @@ int primality_test(const mpz_t n, uint64_t k)
                 __mpz_urandomm(a, t);
                 mpz_add_ui(a, a, 2);
 
-                mpz_set_ui(x, (uint64_t)mpz_jacobi(a, n));
+                /* x = (a / n) mod n, -1 is n - 1 */
+                mpz_set_si(x, mpz_jacobi(a, n));
+                if (mpz_sgn(x) < 0)
+                        mpz_add(x, x, n);
 
-                /* x == -1 */
-                if (!mpz_cmp_si(x, -1)) {
-                        mpz_set(x, n);
-                        mpz_sub_ui(x, x, 1);
+                /*
+                 * ( a^((n-1)/2) ) (mod n)
+                 */
+                if (!mpz_sgn(x)) {
+                        ret = NUM_COMPOSITE;
+                        break;
                 }
 
+                mpz_powm(a, a, e, n);
+
+                /* every round has to pass */
+                if (mpz_cmp(a, x)) {
+                        ret = NUM_COMPOSITE;
+                        break;
+                }
+        }
+
+        mpz_clears(t, a, x, e, NULL);
+
+        return ret;
+}
+
+/*
+ * Odd primes below 2^10 packed into products that fit in one limb,
+ * so trial division costs one mpz_fdiv_ui() per group
+ */
+#define TRIAL_DIVISION_LIMIT            (1024)
+
+static uint32_t trial_primes[TRIAL_DIVISION_LIMIT / 2];
+static uint32_t trial_prime_cnt;
+static uint64_t trial_group[TRIAL_DIVISION_LIMIT / 4];
+static uint32_t trial_group_end[TRIAL_DIVISION_LIMIT / 4];
+static uint32_t trial_group_cnt;
+static pthread_once_t trial_once = PTHREAD_ONCE_INIT;
+
+static void trial_division_init(void)
+{
+        uint8_t sieve[TRIAL_DIVISION_LIMIT] = { 0 };
+        uint64_t prod = 1;
+
+        for (uint32_t i = 3; i < TRIAL_DIVISION_LIMIT; i += 2) {
+                if (sieve[i])
+                        continue;
+
+                for (uint32_t j = i * i; j < TRIAL_DIVISION_LIMIT; j += 2 * i)
+                        sieve[j] = 1;
+
+                if (prod > UINT64_MAX / i) {
+                        trial_group[trial_group_cnt] = prod;
+                        trial_group_end[trial_group_cnt++] = trial_prime_cnt;
+                        prod = 1;
+                }
+
+                prod *= i;
+                trial_primes[trial_prime_cnt++] = i;
+        }
+
+        trial_group[trial_group_cnt] = prod;
+        trial_group_end[trial_group_cnt++] = trial_prime_cnt;
+}
+
+/**
+ * trial_division() - look for a small odd factor
+ *
+ * @param   n: odd value to test
+ * @return  NUM_PRIME if n is one of the small primes, NUM_COMPOSITE if
+ *          a small prime divides it, -EAGAIN if n needs a real test
+ */
+static int trial_division(const mpz_t n)
+{
+        uint32_t i = 0;
+        uint64_t r;
+
+        pthread_once(&trial_once, trial_division_init);
+
+        if (mpz_cmp_ui(n, TRIAL_DIVISION_LIMIT) < 0) {
+                for (i = 0; i < trial_prime_cnt; ++i)
+                        if (!mpz_cmp_ui(n, trial_primes[i]))
+                                return NUM_PRIME;
+
+                return NUM_COMPOSITE;
+        }
+
+        for (uint32_t g = 0; g < trial_group_cnt; ++g) {
+                r = mpz_fdiv_ui(n, trial_group[g]);
+
+                for (; i < trial_group_end[g]; ++i)
+                        if (!(r % trial_primes[i]))
+                                return NUM_COMPOSITE;
+        }
+
+        return -EAGAIN;
+}
+
+/**
+ * miller_rabin_base2() - strong probable prime test to base 2
+ *
+ * @param   n: odd value > 2 to test
+ * @return  1 on base-2 strong probable prime, 0 on composite
+ */
+static int miller_rabin_base2(const mpz_t n)
+{
+        mpz_t d, x, n1;
+        mp_bitcnt_t s;
+        int ret = NUM_COMPOSITE;
+
+        mpz_inits(d, x, n1, NULL);
+
+        /* n - 1 = d * 2^s */
+        mpz_sub_ui(n1, n, 1);
+        s = mpz_scan1(n1, 0);
+        mpz_fdiv_q_2exp(d, n1, s);
+
+        mpz_set_ui(x, 2);
+        mpz_powm(x, x, d, n);
+
+        if (!mpz_cmp_ui(x, 1) || !mpz_cmp(x, n1)) {
+                ret = NUM_PRIME;
+                goto out;
+        }
+
+        while (--s > 0) {
+                mpz_mul(x, x, x);
+                mpz_mod(x, x, n);
+
+                if (!mpz_cmp(x, n1)) {
+                        ret = NUM_PRIME;
+                        break;
+                }
+
+                if (!mpz_cmp_ui(x, 1))
+                        break;
+        }
+
+out:
+        mpz_clears(d, x, n1, NULL);
+
+        return ret;
+}
+
+/* x = x / 2 (mod n), n odd */
+static inline void mpz_half_mod(mpz_t x, const mpz_t n)
+{
+        if (mpz_odd_p(x))
+                mpz_add(x, x, n);
+
+        mpz_fdiv_q_2exp(x, x, 1);
+}
+
+/**
+ * lucas_strong_test() - strong Lucas probable prime test
+ *
+ * Parameters picked by Selfridge's method A: first D in 5, -7, 9,
+ * -11, ... with Jacobi (D / n) = -1, P = 1, Q = (1 - D) / 4.
+ *
+ * @param   n: odd value > 2, not a perfect square
+ * @return  1 on strong Lucas probable prime, 0 on composite
+ */
+static int lucas_strong_test(const mpz_t n)
+{
+        mpz_t d, u, v, qk, t, dd;
+        mp_bitcnt_t s;
+        long D = 5, Q;
+        int j, ret = NUM_COMPOSITE;
+
+        while (1) {
+                j = mpz_si_kronecker(D, n);
+                if (j == -1)
+                        break;
+
+                /* D shares a factor with n */
+                if (j == 0 && mpz_cmpabs_ui(n, (unsigned long)labs(D)))
+                        return NUM_COMPOSITE;
+
+                D = D > 0 ? -(D + 2) : -D + 2;
+        }
+
+        Q = (1 - D) / 4;
+
+        mpz_inits(d, u, v, qk, t, dd, NULL);
+
+        /* n + 1 = d * 2^s */
+        mpz_add_ui(d, n, 1);
+        s = mpz_scan1(d, 0);
+        mpz_fdiv_q_2exp(d, d, s);
+
+        mpz_set_si(dd, D);
+
+        /* U_1 = 1, V_1 = P = 1, Q^1 */
+        mpz_set_ui(u, 1);
+        mpz_set_ui(v, 1);
+        mpz_set_si(qk, Q);
+        mpz_mod(qk, qk, n);
+
+        for (mp_bitcnt_t b = mpz_sizeinbase(d, 2) - 1; b-- > 0; ) {
+                /* U_2k = U_k * V_k, V_2k = V_k^2 - 2 Q^k */
+                mpz_mul(u, u, v);
+                mpz_mod(u, u, n);
+
+                mpz_mul(v, v, v);
+                mpz_submul_ui(v, qk, 2);
+                mpz_mod(v, v, n);
+
+                mpz_mul(qk, qk, qk);
+                mpz_mod(qk, qk, n);
+
+                if (!mpz_tstbit(d, b))
+                        continue;
+
                 /*
-                 * ( a^((n-1)/2) ) (mod n)
+                 * P = 1: U_k+1 = (U_k + V_k) / 2, V_k+1 = (D U_k + V_k) / 2
                  */
-                if (mpz_cmp_ui(x, 0)) {
-                        mpz_set(t, n);
-                        mpz_sub_ui(t, t, 1);
-                        mpz_div_ui(t, t, 2);
+                mpz_add(t, u, v);
+                mpz_addmul(v, dd, u);
+                mpz_mod(v, v, n);
+                mpz_half_mod(v, n);
+
+                mpz_mod(u, t, n);
+                mpz_half_mod(u, n);
+
+                mpz_mul_si(qk, qk, Q);
+                mpz_mod(qk, qk, n);
+        }
+
+        if (!mpz_sgn(u) || !mpz_sgn(v)) {
+                ret = NUM_PRIME;
+                goto out;
+        }
 
-                        mpz_powm(a, a, t, n);
+        /* V_(d * 2^r) = 0 for some 0 < r < s */
+        while (--s > 0) {
+                mpz_mul(v, v, v);
+                mpz_submul_ui(v, qk, 2);
+                mpz_mod(v, v, n);
 
-                        if (!mpz_cmp(a, x))
-                                return 1;
+                if (!mpz_sgn(v)) {
+                        ret = NUM_PRIME;
+                        break;
                 }
+
+                mpz_mul(qk, qk, qk);
+                mpz_mod(qk, qk, n);
         }
 
-        mpz_clears(t, a, x, NULL);
+out:
+        mpz_clears(d, u, v, qk, t, dd, NULL);
+
+        return ret;
+}
+
+/**
+ * primality_test_bpsw() - Baillie-PSW primality test
+ *
+ * Trial division, strong probable prime test to base 2, then strong
+ * Lucas test. Deterministic, costs about three modular exponentiations
+ * for a prime, and no composite passing both tests is known.
+ *
+ * @param   n: a value to test
+ * @return  1 on *probably* prime, 0 on composite
+ */
+int primality_test_bpsw(const mpz_t n)
+{
+        int ret;
+
+        if (mpz_cmp_ui(n, 2) < 0)
+                return NUM_COMPOSITE;
+
+        if (!mpz_cmp_ui(n, 2))
+                return NUM_PRIME;
+
+        if (mpz_even_p(n))
+                return NUM_COMPOSITE;
+
+        ret = trial_division(n);
+        if (ret != -EAGAIN)
+                return ret;
+
+        if (miller_rabin_base2(n) == NUM_COMPOSITE)
+                return NUM_COMPOSITE;
+
+        /* Lucas parameter search never ends for squares */
+        if (mpz_perfect_square_p(n))
+                return NUM_COMPOSITE;
+
+        return lucas_strong_test(n);
+}
+
+/**
+ * primality_mode_set() - select test used by key generation
+ *
+ * @param   mode: PRIMALITY_* mode
+ * @return  0 on success
+ */
+int primality_mode_set(int mode)
+{
+        if (mode < 0 || mode >= NUM_PRIMALITY_MODES)
+                return -EINVAL;
+
+        primality_mode = mode;
 
         return 0;
 }
 
+/**
+ * primality_check() - test with selected primality mode
+ *
+ * @param   n: a value to test
+ * @return  1 on *probably* prime, 0 on composite
+ */
+int primality_check(const mpz_t n)
+{
+        if (primality_mode == PRIMALITY_BAILLIE_PSW)
+                return primality_test_bpsw(n);
+
+        return primality_test(n, PRIMALITY_TEST_ACCURACY);
+}
+
 /**
  * generate_n_p_q() - generate N P Q factors in key
  *
@@ -278,8 +715,7 @@ int generate_n_p_q(mpz_t n, mpz_t p, mpz_t q, uint64_t k)
                 while (1) {
                         mpz_rand_bitlen(p, key_len / 2);
 
-                        if (primality_test(p, PRIMALITY_TEST_ACCURACY) ==
-                            NUM_COMPOSITE)
+                        if (primality_check(p) == NUM_COMPOSITE)
                                 continue;
 
                         break;
@@ -288,8 +724,7 @@ int generate_n_p_q(mpz_t n, mpz_t p, mpz_t q, uint64_t k)
                 while (1) {
                         mpz_rand_bitlen(q, key_len / 2);
 
-                        if (primality_test(q, PRIMALITY_TEST_ACCURACY) ==
-                            NUM_COMPOSITE)
+                        if (primality_check(q) == NUM_COMPOSITE)
                                 continue;
 
                         break;
@@ -394,6 +829,9 @@ int generate_exp_coef(struct rsa_private *key)
  */
 int rsa_private_key_generate(struct rsa_private *key, uint64_t length)
 {
+        uint64_t t0 = metrics_start();
+        int ret = 0;
+
         if (!key)
                 return -EINVAL;
 
@@ -402,19 +840,272 @@ int rsa_private_key_generate(struct rsa_private *key, uint64_t length)
 
         if (generate_n_p_q(key->n, key->p, key->q, length / 8)) {
                 fprintf(stderr, "failed to generate N, P, Q elements\n");
-                return -EFAULT;
+                ret = -EFAULT;
+                goto out;
         }
 
         if (generate_e_d(key->e, key->d, key->p, key->q)) {
                 fprintf(stderr, "failed to generate E, Q elements\n");
-                return -EFAULT;
+                ret = -EFAULT;
+                goto out;
         }
 
         generate_exp_coef(key);
 
+out:
+        metrics_record(METRIC_KEYGEN, t0, key->n, length / 8, ret);
+
+        return ret;
+}
+
+/**
+ * rsa_private_key_from_primes() - build private key from given primes
+ *
+ * @param   key: pointer to private key struct
+ * @param   p: prime1
+ * @param   q: prime2
+ * @return  0 on success, -EINVAL if e = 65537 does not fit p and q
+ */
+int rsa_private_key_from_primes(struct rsa_private *key, const mpz_t p,
+                                const mpz_t q)
+{
+        mpz_t t;
+        int ret = 0;
+
+        if (!key || !mpz_cmp(p, q))
+                return -EINVAL;
+
+        mpz_init(t);
+
+        /* 65537 must be invertible mod (p - 1) and (q - 1) */
+        mpz_sub_ui(t, p, 1);
+        if (mpz_fdiv_ui(t, 65537) == 0)
+                ret = -EINVAL;
+
+        mpz_sub_ui(t, q, 1);
+        if (mpz_fdiv_ui(t, 65537) == 0)
+                ret = -EINVAL;
+
+        mpz_clear(t);
+
+        if (ret)
+                return ret;
+
+        mpz_set(key->p, p);
+        mpz_set(key->q, q);
+        mpz_mul(key->n, p, q);
+
+        key->key_len = mpz_sizeinbase(key->n, 2);
+        key->version = 0x00;    /* RFC2313 */
+
+        if (generate_e_d(key->e, key->d, key->p, key->q))
+                return -EFAULT;
+
+        return generate_exp_coef(key);
+}
+
+/**
+ * rsa_rebalanced_exp_bits_min() - shortest safe CRT exponents for a modulus
+ *
+ * Twice the security level of the modulus (SP 800-57 strength), as a
+ * square root time search finds shorter ones, and above the
+ * Jochemsz-May lattice bound of N^0.073 for small CRT exponents.
+ *
+ * @param   length: modulus length in bits
+ * @return  minimum exp1, exp2 length in bits
+ */
+uint64_t rsa_rebalanced_exp_bits_min(uint64_t length)
+{
+        uint64_t strength, lattice;
+
+        if (length <= 1024)
+                strength = 80;
+        else if (length <= 2048)
+                strength = 112;
+        else if (length <= 3072)
+                strength = 128;
+        else if (length <= 7680)
+                strength = 192;
+        else
+                strength = 256;
+
+        lattice = length * 73 / 1000 + 1;
+
+        return 2 * strength > lattice ? 2 * strength : lattice;
+}
+
+/**
+ * generate_e_d_rebalanced() - generate short CRT exponents, D and E
+ *
+ * Rebalanced RSA (Wiener): pick exp1, exp2 of @exp_bits, odd and
+ * invertible mod p-1 and q-1, join them into d by CRT and take e as
+ * the inverse of d. e ends up about as long as n.
+ *
+ * Joining needs gcd(p-1, q-1) = 2, i.e. gcd((p-1)/2, (q-1)/2) = 1.
+ *
+ * @param   e: e to write
+ * @param   d: d to write, d mod lcm(p-1, q-1)
+ * @param   exp1: d mod (p-1) to write
+ * @param   exp2: d mod (q-1) to write
+ * @param   p: p factor
+ * @param   q: q factor
+ * @param   exp_bits: CRT exponent length in bits
+ * @return  0 on success, -EAGAIN if p, q do not qualify
+ */
+int generate_e_d_rebalanced(mpz_t e, mpz_t d, mpz_t exp1, mpz_t exp2,
+                            const mpz_t p, const mpz_t q, uint64_t exp_bits)
+{
+        mpz_t p1, q1, hp, hq, lcm, t;
+        int ret = 0;
+
+        if (!e || !d || !exp1 || !exp2)
+                return -EINVAL;
+
+        if (exp_bits < rsa_rebalanced_exp_bits_min(mpz_sizeinbase(p, 2) +
+                                                   mpz_sizeinbase(q, 2)) ||
+            exp_bits >= mpz_sizeinbase(p, 2) || exp_bits >= mpz_sizeinbase(q, 2))
+                return -EINVAL;
+
+        mpz_inits(p1, q1, hp, hq, lcm, t, NULL);
+
+        mpz_sub_ui(p1, p, 1);
+        mpz_sub_ui(q1, q, 1);
+        mpz_fdiv_q_2exp(hp, p1, 1);
+        mpz_fdiv_q_2exp(hq, q1, 1);
+
+        mpz_gcd(t, hp, hq);
+        if (mpz_cmp_ui(t, 1)) {
+                ret = -EAGAIN;
+                goto out;
+        }
+
+        /* odd, so both agree mod 2, the common factor of p-1 and q-1 */
+        do {
+                mpz_rand_bitlen(exp1, exp_bits);
+                mpz_setbit(exp1, 0);
+                mpz_gcd(t, exp1, p1);
+        } while (mpz_cmp_ui(t, 1));
+
+        do {
+                mpz_rand_bitlen(exp2, exp_bits);
+                mpz_setbit(exp2, 0);
+                mpz_gcd(t, exp2, q1);
+        } while (mpz_cmp_ui(t, 1));
+
+        /*
+         * d = exp1 + (p-1) * k,
+         * k = (exp2 - exp1) / 2 * ((p-1)/2)^-1 mod (q-1)/2
+         */
+        mpz_invert(t, hp, hq);
+        mpz_sub(d, exp2, exp1);
+        mpz_divexact_ui(d, d, 2);
+        mpz_mul(d, d, t);
+        mpz_mod(d, d, hq);
+        mpz_mul(d, d, p1);
+        mpz_add(d, d, exp1);
+
+        /* lcm(p-1, q-1) = (p-1) * (q-1) / 2 */
+        mpz_mul(lcm, p1, hq);
+
+        if (!mpz_invert(e, d, lcm)) {
+                ret = -EAGAIN;
+                goto out;
+        }
+
+        /* test (e * d) % lcm = 1 and the CRT halves */
+        mpz_mul(t, e, d);
+        mpz_mod(t, t, lcm);
+        if (mpz_cmp_ui(t, 1)) {
+                fprintf(stderr, "(e * d) %% lcm = 1 failed!\n");
+                ret = -EFAULT;
+                goto out;
+        }
+
+        mpz_mod(t, d, q1);
+        if (mpz_cmp(t, exp2)) {
+                fprintf(stderr, "d %% (q - 1) = exp2 failed!\n");
+                ret = -EFAULT;
+        }
+
+out:
+        mpz_wipe(t);
+        mpz_clears(p1, q1, hp, hq, lcm, t, NULL);
+
+        return ret;
+}
+
+/**
+ * generate_exp_coef_rebalanced() - generate coefficient of rebalanced key
+ *
+ * exp1 and exp2 are chosen with d, only the coefficient is left
+ *
+ * @param   key: pointer to key struct
+ * @return  0 on success
+ */
+int generate_exp_coef_rebalanced(struct rsa_private *key)
+{
+        if (!key)
+                return -EINVAL;
+
+        if (!mpz_invert(key->coeff, key->q, key->p))
+                return -EFAULT;
+
         return 0;
 }
 
+/**
+ * rsa_private_key_generate_rebalanced() - generate key with short CRT
+ *                                         exponents
+ *
+ * Private operations cost two @exp_bits exponentiations mod p and q
+ * instead of two half-length ones; public operations pay with an e
+ * as long as n. @exp_bits below rsa_rebalanced_exp_bits_min() of
+ * @length is refused, shorter CRT exponents are open to known attacks.
+ *
+ * @param   key: pointer to private key struct
+ * @param   length: length of key in bits
+ * @param   exp_bits: length of exp1 and exp2 in bits
+ * @return  0 on success
+ */
+int rsa_private_key_generate_rebalanced(struct rsa_private *key, uint64_t length,
+                                        uint64_t exp_bits)
+{
+        uint64_t t0 = metrics_start();
+        int ret;
+
+        if (!key)
+                return -EINVAL;
+
+        if (exp_bits < rsa_rebalanced_exp_bits_min(length) || exp_bits >= length / 2)
+                return -EINVAL;
+
+        key->key_len = length;
+        key->version = 0x00;    /* RFC2313 */
+
+        do {
+                if (generate_n_p_q(key->n, key->p, key->q, length / 8)) {
+                        fprintf(stderr, "failed to generate N, P, Q elements\n");
+                        ret = -EFAULT;
+                        goto out;
+                }
+
+                ret = generate_e_d_rebalanced(key->e, key->d, key->exp1, key->exp2,
+                                              key->p, key->q, exp_bits);
+        } while (ret == -EAGAIN);
+
+        if (ret) {
+                fprintf(stderr, "failed to generate E, D elements\n");
+                goto out;
+        }
+
+        ret = generate_exp_coef_rebalanced(key);
+
+out:
+        metrics_record(METRIC_KEYGEN, t0, key->n, length / 8, ret);
+
+        return ret;
+}
+
 /**
  * rsa_public_key_generate() - generate public key from private key
  *
@@ -0,0 +1,458 @@
+/**
+ * secure_mem.c - Locked, prefaulted memory arena for latency-critical mode
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <gmp.h>
+
+#include "secure_mem.h"
+
+/*
+ * Power of two size classes from 32 bytes to 1 GiB, each with its own
+ * free list and lock, so threads allocating different sizes (GMP limbs
+ * of different operands) do not contend.
+ */
+#define SECURE_MEM_CLASS_SHIFT          (5)
+#define SECURE_MEM_CLASSES              (26)
+#define SECURE_MEM_BLOCK_MAGIC          (0x534d454dU)   /* "SMEM" */
+#define SECURE_MEM_FALLBACK_MAGIC       (0x534d4546U)   /* "SMEF" */
+
+struct secure_mem_block {
+        uint32_t        magic;
+        uint32_t        cls;            /* SECURE_MEM_CLASSES if malloc()'d */
+        uint64_t        size;           /* requested size */
+};
+
+struct secure_mem_free {
+        struct secure_mem_free *next;
+};
+
+static struct {
+        uint8_t                 *base;
+        size_t                  size;
+        int                     pages;
+        int                     gmp;
+
+        _Atomic size_t          bump;
+        _Atomic size_t          in_use;
+        _Atomic uint64_t        fallback;
+
+        pthread_mutex_t         lock[SECURE_MEM_CLASSES];
+        struct secure_mem_free  *free_list[SECURE_MEM_CLASSES];
+
+        void *(*gmp_alloc)(size_t);
+        void *(*gmp_realloc)(void *, size_t, size_t);
+        void (*gmp_free)(void *, size_t);
+} arena;
+
+static inline size_t secure_mem_class_size(uint32_t cls)
+{
+        return (size_t)1 << (cls + SECURE_MEM_CLASS_SHIFT);
+}
+
+static inline uint32_t secure_mem_class(size_t total)
+{
+        uint32_t bits;
+
+        if (total <= secure_mem_class_size(0))
+                return 0;
+
+        bits = 64 - (uint32_t)__builtin_clzll((unsigned long long)(total - 1));
+
+        return bits - SECURE_MEM_CLASS_SHIFT;
+}
+
+static inline int secure_mem_owns(const void *ptr)
+{
+        return arena.base && (const uint8_t *)ptr >= arena.base &&
+               (const uint8_t *)ptr < arena.base + arena.size;
+}
+
+/**
+ * secure_mem_carve() - take a block from the region
+ *
+ * @param size: bytes wanted
+ * @return pointer, 16 bytes aligned, NULL if the region can not serve it
+ */
+static void *secure_mem_carve(size_t size)
+{
+        struct secure_mem_block *blk;
+        struct secure_mem_free *f;
+        size_t total = size + sizeof(*blk);
+        size_t bsize, off;
+        uint32_t cls;
+
+        if (!arena.base)
+                return NULL;
+
+        cls = secure_mem_class(total);
+        if (cls >= SECURE_MEM_CLASSES)
+                return NULL;
+
+        bsize = secure_mem_class_size(cls);
+
+        pthread_mutex_lock(&arena.lock[cls]);
+        f = arena.free_list[cls];
+        if (f)
+                arena.free_list[cls] = f->next;
+        pthread_mutex_unlock(&arena.lock[cls]);
+
+        if (f) {
+                blk = (struct secure_mem_block *)((uint8_t *)f - sizeof(*blk));
+        } else {
+                /* advance only on success, a miss must not eat the region */
+                off = atomic_load(&arena.bump);
+                do {
+                        if (off + bsize > arena.size)
+                                return NULL;
+                } while (!atomic_compare_exchange_weak(&arena.bump, &off, off + bsize));
+
+                blk = (struct secure_mem_block *)(arena.base + off);
+                blk->magic = SECURE_MEM_BLOCK_MAGIC;
+                blk->cls = cls;
+        }
+
+        blk->size = size;
+        atomic_fetch_add(&arena.in_use, bsize);
+
+        return blk + 1;
+}
+
+/**
+ * secure_mem_alloc() - allocate from locked region
+ *
+ * Falls back to malloc() once the region is exhausted. Such blocks
+ * carry a header with their size too, so they are wiped on release.
+ *
+ * @param size: bytes wanted
+ * @return pointer, 16 bytes aligned
+ */
+void *secure_mem_alloc(size_t size)
+{
+        struct secure_mem_block *blk;
+        void *p;
+
+        p = secure_mem_carve(size);
+        if (p)
+                return p;
+
+        if (arena.base)
+                atomic_fetch_add(&arena.fallback, 1);
+
+        blk = malloc(sizeof(*blk) + size);
+        if (!blk)
+                return NULL;
+
+        blk->magic = SECURE_MEM_FALLBACK_MAGIC;
+        blk->cls = SECURE_MEM_CLASSES;
+        blk->size = size;
+
+        return blk + 1;
+}
+
+/**
+ * secure_mem_free() - wipe and release block
+ *
+ * @param ptr: pointer from secure_mem_alloc(), or NULL
+ */
+void secure_mem_free(void *ptr)
+{
+        struct secure_mem_block *blk;
+        struct secure_mem_free *f;
+        uint32_t cls;
+
+        if (!ptr)
+                return;
+
+        blk = (struct secure_mem_block *)ptr - 1;
+
+        if (!secure_mem_owns(ptr)) {
+                if (blk->magic != SECURE_MEM_FALLBACK_MAGIC) {
+                        fprintf(stderr, "%s: corrupted block %p\n", __func__, ptr);
+                        abort();
+                }
+
+                explicit_bzero(ptr, blk->size);
+                free(blk);
+                return;
+        }
+
+        if (blk->magic != SECURE_MEM_BLOCK_MAGIC) {
+                fprintf(stderr, "%s: corrupted block %p\n", __func__, ptr);
+                abort();
+        }
+
+        cls = blk->cls;
+        explicit_bzero(ptr, secure_mem_class_size(cls) - sizeof(*blk));
+        atomic_fetch_sub(&arena.in_use, secure_mem_class_size(cls));
+
+        f = ptr;
+
+        pthread_mutex_lock(&arena.lock[cls]);
+        f->next = arena.free_list[cls];
+        arena.free_list[cls] = f;
+        pthread_mutex_unlock(&arena.lock[cls]);
+}
+
+/**
+ * secure_mem_realloc() - resize block, old block is wiped if moved
+ *
+ * @param ptr: pointer from secure_mem_alloc(), or NULL
+ * @param size: new size in bytes
+ * @return pointer to resized block
+ */
+void *secure_mem_realloc(void *ptr, size_t size)
+{
+        struct secure_mem_block *blk;
+        void *p;
+
+        if (!ptr)
+                return secure_mem_alloc(size);
+
+        blk = (struct secure_mem_block *)ptr - 1;
+
+        /* still fits the class, nothing to move */
+        if (secure_mem_owns(ptr) &&
+            size + sizeof(*blk) <= secure_mem_class_size(blk->cls)) {
+                blk->size = size;
+                return ptr;
+        }
+
+        p = secure_mem_alloc(size);
+        if (!p)
+                return NULL;
+
+        memcpy(p, ptr, blk->size < size ? blk->size : size);
+        secure_mem_free(ptr);
+
+        return p;
+}
+
+/*
+ * GMP passes block sizes on free and realloc, its fallback blocks are
+ * plain malloc() ones: limbs allocated before secure_mem_init() carry
+ * no header either.
+ */
+static void *secure_mem_gmp_alloc(size_t size)
+{
+        void *p = secure_mem_carve(size);
+
+        if (p)
+                return p;
+
+        atomic_fetch_add(&arena.fallback, 1);
+
+        p = malloc(size);
+        if (!p)
+                abort();        /* GMP can not handle failures either */
+
+        return p;
+}
+
+static void secure_mem_gmp_free(void *ptr, size_t size)
+{
+        if (!ptr)
+                return;
+
+        if (secure_mem_owns(ptr)) {
+                secure_mem_free(ptr);
+                return;
+        }
+
+        explicit_bzero(ptr, size);
+        free(ptr);
+}
+
+static void *secure_mem_gmp_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+        struct secure_mem_block *blk = (struct secure_mem_block *)ptr - 1;
+        void *p;
+
+        if (secure_mem_owns(ptr) &&
+            new_size + sizeof(*blk) <= secure_mem_class_size(blk->cls)) {
+                blk->size = new_size;
+                return ptr;
+        }
+
+        p = secure_mem_gmp_alloc(new_size);
+        memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+        secure_mem_gmp_free(ptr, old_size);
+
+        return p;
+}
+
+/**
+ * secure_mem_map() - map region, huge pages first if asked
+ */
+static void *secure_mem_map(size_t size, uint32_t flags, int *pages)
+{
+        uint8_t *p, *aligned;
+        size_t head, tail;
+
+        if (flags & SECURE_MEM_HUGEPAGE) {
+                p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                         -1, 0);
+                if (p != MAP_FAILED) {
+                        *pages = SECURE_MEM_PAGES_HUGETLB;
+                        return p;
+                }
+        }
+
+        /* over-map to get a huge page aligned start for THP */
+        p = mmap(NULL, size + SECURE_MEM_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+                return NULL;
+
+        aligned = (uint8_t *)(((uintptr_t)p + SECURE_MEM_HUGEPAGE_SIZE - 1) &
+                              ~(uintptr_t)(SECURE_MEM_HUGEPAGE_SIZE - 1));
+        head = (size_t)(aligned - p);
+        tail = SECURE_MEM_HUGEPAGE_SIZE - head;
+
+        if (head)
+                munmap(p, head);
+        if (tail)
+                munmap(aligned + size, tail);
+
+        *pages = SECURE_MEM_PAGES_NORMAL;
+
+        if ((flags & SECURE_MEM_HUGEPAGE) &&
+            !madvise(aligned, size, MADV_HUGEPAGE))
+                *pages = SECURE_MEM_PAGES_THP;
+
+        return aligned;
+}
+
+/**
+ * secure_mem_init() - map, lock and prefault the region
+ *
+ * @param size: region size, rounded up to huge page size
+ * @param flags: SECURE_MEM_* flags
+ * @return 0 on success, -ENOMEM/-EPERM if it can not be locked
+ *         (check RLIMIT_MEMLOCK)
+ */
+int secure_mem_init(size_t size, uint32_t flags)
+{
+        long page = sysconf(_SC_PAGESIZE);
+        uint8_t *p;
+        int pages;
+
+        if (arena.base)
+                return -EBUSY;
+
+        if (!size)
+                size = SECURE_MEM_SIZE_DEFAULT;
+
+        size = (size + SECURE_MEM_HUGEPAGE_SIZE - 1) & ~(SECURE_MEM_HUGEPAGE_SIZE - 1);
+
+        p = secure_mem_map(size, flags, &pages);
+        if (!p)
+                return -errno;
+
+        /* keep secrets out of core dumps */
+        madvise(p, size, MADV_DONTDUMP);
+
+        if (mlock(p, size)) {
+                int err = errno;
+
+                munmap(p, size);
+                return -err;
+        }
+
+        /* touch every page now rather than on the hot path */
+        for (size_t off = 0; off < size; off += (size_t)page)
+                ((volatile uint8_t *)p)[off] = 0;
+
+        for (uint32_t i = 0; i < SECURE_MEM_CLASSES; ++i) {
+                pthread_mutex_init(&arena.lock[i], NULL);
+                arena.free_list[i] = NULL;
+        }
+
+        atomic_store(&arena.bump, 0);
+        atomic_store(&arena.in_use, 0);
+        atomic_store(&arena.fallback, 0);
+
+        arena.size = size;
+        arena.pages = pages;
+        arena.base = p;
+
+        if (flags & SECURE_MEM_GMP) {
+                mp_get_memory_functions(&arena.gmp_alloc, &arena.gmp_realloc,
+                                        &arena.gmp_free);
+                mp_set_memory_functions(secure_mem_gmp_alloc,
+                                        secure_mem_gmp_realloc,
+                                        secure_mem_gmp_free);
+                arena.gmp = 1;
+        }
+
+        return 0;
+}
+
+/**
+ * secure_mem_exit() - wipe and unmap the region
+ *
+ * Every GMP object living in the region must be cleared before.
+ */
+void secure_mem_exit(void)
+{
+        size_t used;
+
+        if (!arena.base)
+                return;
+
+        if (arena.gmp) {
+                mp_set_memory_functions(arena.gmp_alloc, arena.gmp_realloc,
+                                        arena.gmp_free);
+                arena.gmp = 0;
+        }
+
+        used = atomic_load(&arena.bump);
+        explicit_bzero(arena.base, used < arena.size ? used : arena.size);
+
+        munlock(arena.base, arena.size);
+        munmap(arena.base, arena.size);
+
+        for (uint32_t i = 0; i < SECURE_MEM_CLASSES; ++i)
+                pthread_mutex_destroy(&arena.lock[i]);
+
+        arena.base = NULL;
+        arena.size = 0;
+}
+
+int secure_mem_active(void)
+{
+        return arena.base != NULL;
+}
+
+void secure_mem_stats(struct secure_mem_stats *stats)
+{
+        size_t used = atomic_load(&arena.bump);
+
+        stats->size = arena.size;
+        stats->used = used < arena.size ? used : arena.size;
+        stats->in_use = atomic_load(&arena.in_use);
+        stats->fallback = atomic_load(&arena.fallback);
+        stats->pages = arena.pages;
+}
@@ -0,0 +1,67 @@
+/**
+ * secure_mem.h - Locked, prefaulted memory arena for latency-critical mode
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_SECURE_MEM_H
+#define SIMPLERSADIGEST_SECURE_MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * One region, mapped once, backed by huge pages if possible, locked
+ * with mlock() and touched up front. No page faults and no swap-out
+ * on the hot path afterwards. Blocks are wiped when freed, the whole
+ * region is wiped when released.
+ *
+ * With SECURE_MEM_GMP every GMP allocation (key limbs, powm
+ * workspaces) is served from the region. Call secure_mem_init() before
+ * any key is initialized.
+ */
+
+#define SECURE_MEM_SIZE_DEFAULT         (64UL << 20)
+#define SECURE_MEM_HUGEPAGE_SIZE        (2UL << 20)
+
+enum {
+        SECURE_MEM_HUGEPAGE     = (1 << 0),     /* prefer huge pages */
+        SECURE_MEM_GMP          = (1 << 1),     /* route GMP allocations */
+};
+
+enum {
+        SECURE_MEM_PAGES_NORMAL = 0,
+        SECURE_MEM_PAGES_THP,                   /* transparent, advised */
+        SECURE_MEM_PAGES_HUGETLB,               /* explicit MAP_HUGETLB */
+};
+
+struct secure_mem_stats {
+        size_t          size;           /* region size */
+        size_t          used;           /* carved from region */
+        size_t          in_use;         /* allocated, not freed */
+        uint64_t        fallback;       /* served by libc, region full */
+        int             pages;          /* SECURE_MEM_PAGES_* */
+};
+
+int secure_mem_init(size_t size, uint32_t flags);
+void secure_mem_exit(void);
+int secure_mem_active(void);
+
+void *secure_mem_alloc(size_t size);
+void *secure_mem_realloc(void *ptr, size_t size);
+void secure_mem_free(void *ptr);
+
+void secure_mem_stats(struct secure_mem_stats *stats);
+
+#endif //SIMPLERSADIGEST_SECURE_MEM_H
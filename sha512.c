@@ -27,7 +27,9 @@
 #include <errno.h>
 
 #include "sha512.h"
+#include "metrics.h"
 #include "misc_helper.h"
+#include "secure_mem.h"
 
 #ifndef UINT64_MAX
 #warning the code may break on system lacking 64bit native support
@@ -82,6 +84,9 @@ typedef uint64_t u64;
 
 #define PROCESS_BLOCK_SIZE              (BYTES(128))
 
+/* Most message bytes fitting one final block with padding and length */
+#define MAX_L_1024BLK_BYTES             (PROCESS_BLOCK_SIZE - 1 - 16)
+
 /*
  * This is the [1] and K[0] padding block
  * before the 128-bit whole message length block
@@ -427,14 +432,43 @@ void sha512_ctx_conclude(struct sha512_ctx *ctx)
         /* Fill [1] + K[0] into padding block */
         memcpy(&((u8 *)ctx->buf)[bytes], padding_blk, (idx - 2) * 8 - bytes);
 
-        /* Process the last padding block */
-        sha512_block_process(ctx, ctx->buf, size);
+        /* Process the last padding block, or both of them */
+        for (size_t off = 0; off < size; off += PROCESS_BLOCK_SIZE)
+                sha512_block_process(ctx, (u8 *)ctx->buf + off, PROCESS_BLOCK_SIZE);
 
 #undef BLK_2048
 #undef BLK_1024
 #undef MAX_L_1024BLK
 }
 
+/**
+ * sha512_ctx_get() - get a context for one hash computation
+ *
+ * In latency-critical mode the context comes from the locked region
+ * and is wiped on release, otherwise the caller's stack is used.
+ *
+ * @param ctx_stack: pointer to context on caller's stack
+ * @return pointer to context
+ */
+static struct sha512_ctx *sha512_ctx_get(struct sha512_ctx *ctx_stack)
+{
+        struct sha512_ctx *ctx;
+
+        if (secure_mem_active()) {
+                ctx = secure_mem_alloc(sizeof(struct sha512_ctx));
+                if (ctx)
+                        return ctx;
+        }
+
+        return ctx_stack;
+}
+
+static void sha512_ctx_put(struct sha512_ctx *ctx, struct sha512_ctx *ctx_stack)
+{
+        if (ctx != ctx_stack)
+                secure_mem_free(ctx);
+}
+
 /**
  * sha512_stream_process() - hash a file
  *
@@ -445,19 +479,24 @@ void sha512_ctx_conclude(struct sha512_ctx *ctx)
  */
 int _sha512_stream_process(FILE *stream, void *resblk, int bits)
 {
-        struct sha512_ctx ctx;
+        struct sha512_ctx ctx_stack;
+        struct sha512_ctx *ctx;
+        uint64_t t0 = metrics_start();
+        uint64_t total = 0;
         size_t len;
         int ret = 0;
 
-        u8 *read_buf = (u8 *)malloc(PROCESS_BLOCK_SIZE + 72);
+        u8 *read_buf = (u8 *)secure_mem_alloc(PROCESS_BLOCK_SIZE + 72);
         if (!read_buf)
                 return -ENOMEM;
 
+        ctx = sha512_ctx_get(&ctx_stack);
+
         /* SHA384/512 use different init constants */
         if (bits == SHA384_HASH_BITS)
-                sha384_ctx_init(&ctx);
+                sha384_ctx_init(ctx);
         else
-                sha512_ctx_init(&ctx);
+                sha512_ctx_init(ctx);
 
         /* Iterate over whole file */
         while (1) {
@@ -491,24 +530,30 @@ int _sha512_stream_process(FILE *stream, void *resblk, int bits)
                                 goto process_partial_file;
                 }
 
-                sha512_block_process(&ctx, read_buf, len);
+                sha512_block_process(ctx, read_buf, len);
+                total += len;
         }
 
 process_partial_file:
-        if (len > 0)
-                sha512_bytes_process(&ctx, read_buf, len);
+        if (len > 0) {
+                sha512_bytes_process(ctx, read_buf, len);
+                total += len;
+        }
 
 process_empty_file:
-        sha512_ctx_conclude(&ctx);
+        sha512_ctx_conclude(ctx);
 
 process_hash_result:
         if (bits == SHA384_HASH_BITS)
-                sha384_ctx_read(&ctx, resblk);
+                sha384_ctx_read(ctx, resblk);
         else
-                sha512_ctx_read(&ctx, resblk);
+                sha512_ctx_read(ctx, resblk);
 
 free_buf:
-        free(read_buf);
+        sha512_ctx_put(ctx, &ctx_stack);
+        secure_mem_free(read_buf);
+
+        metrics_record(METRIC_HASH, t0, NULL, total, ret);
 
         return ret;
 }
@@ -523,6 +568,441 @@ int sha512_stream_process(FILE *stream, void *resblk)
         return _sha512_stream_process(stream, resblk, SHA512_HASH_BITS);
 }
 
+/**
+ * sha512_buffer_process() - hash a memory block
+ *
+ * Same result layout as sha512_stream_process(), without stdio
+ * buffering, so it is usable from concurrent workers
+ *
+ * @param buf: pointer to memory block
+ * @param len: length in byte of memory block
+ * @param resblk: pointer to hash values block
+ * @param bits: bit length of hash values
+ * @return 0 on success
+ */
+int _sha512_buffer_process(const void *buf, size_t len, void *resblk, int bits)
+{
+        struct sha512_ctx ctx_stack;
+        struct sha512_ctx *ctx;
+        uint64_t t0 = metrics_start();
+        uint64_t total = len;
+        const u8 *p = buf;
+
+        if (!buf && len)
+                return -EINVAL;
+
+        ctx = sha512_ctx_get(&ctx_stack);
+
+        if (bits == SHA384_HASH_BITS)
+                sha384_ctx_init(ctx);
+        else
+                sha512_ctx_init(ctx);
+
+        /* Whole blocks go straight to the compression function */
+        while (len >= PROCESS_BLOCK_SIZE) {
+                sha512_block_process(ctx, p, PROCESS_BLOCK_SIZE);
+                p += PROCESS_BLOCK_SIZE;
+                len -= PROCESS_BLOCK_SIZE;
+        }
+
+        if (len > 0)
+                sha512_bytes_process(ctx, p, len);
+
+        sha512_ctx_conclude(ctx);
+
+        if (bits == SHA384_HASH_BITS)
+                sha384_ctx_read(ctx, resblk);
+        else
+                sha512_ctx_read(ctx, resblk);
+
+        sha512_ctx_put(ctx, &ctx_stack);
+
+        metrics_record(METRIC_HASH, t0, NULL, total, 0);
+
+        return 0;
+}
+
+int sha384_buffer_process(const void *buf, size_t len, void *resblk)
+{
+        return _sha512_buffer_process(buf, len, resblk, SHA384_HASH_BITS);
+}
+
+int sha512_buffer_process(const void *buf, size_t len, void *resblk)
+{
+        return _sha512_buffer_process(buf, len, resblk, SHA512_HASH_BITS);
+}
+
+/**
+ * sha512_ctx_update() - feed data of any length into context
+ *
+ * Whole blocks are compressed right away, the rest waits in internal
+ * buffer for more data or sha512_ctx_conclude()
+ *
+ * @param ctx: pointer to initialized context
+ * @param buf: pointer to data
+ * @param len: length in byte of data
+ */
+void sha512_ctx_update(struct sha512_ctx *ctx, const void *buf, size_t len)
+{
+        const u8 *p = buf;
+        size_t n;
+
+        if (ctx->buf_len) {
+                n = PROCESS_BLOCK_SIZE - ctx->buf_len;
+                if (n > len)
+                        n = len;
+
+                memcpy((u8 *)ctx->buf + ctx->buf_len, p, n);
+                ctx->buf_len += n;
+                p += n;
+                len -= n;
+
+                if (ctx->buf_len < PROCESS_BLOCK_SIZE)
+                        return;
+
+                sha512_block_process(ctx, ctx->buf, PROCESS_BLOCK_SIZE);
+                ctx->buf_len = 0;
+        }
+
+        while (len >= PROCESS_BLOCK_SIZE) {
+                sha512_block_process(ctx, p, PROCESS_BLOCK_SIZE);
+                p += PROCESS_BLOCK_SIZE;
+                len -= PROCESS_BLOCK_SIZE;
+        }
+
+        if (len > 0) {
+                memcpy(ctx->buf, p, len);
+                ctx->buf_len = len;
+        }
+}
+
+/**
+ * sha512_ctx_export() - export midstate of an unfinished context
+ *
+ * sha512_ctx_update() compresses every complete block right away, so
+ * the context holds at most one partial block.
+ *
+ * @param ctx: pointer to context, updated but not concluded
+ * @param ms: pointer to midstate to write
+ * @return 0 on success
+ */
+int sha512_ctx_export(const struct sha512_ctx *ctx, struct sha512_midstate *ms)
+{
+        if (!ctx || !ms || ctx->buf_len >= PROCESS_BLOCK_SIZE)
+                return -EINVAL;
+
+        memset(ms, 0x00, sizeof(struct sha512_midstate));
+        memcpy(ms->H, ctx->H, sizeof(ms->H));
+        memcpy(ms->PC, ctx->PC, sizeof(ms->PC));
+        memcpy(ms->tail, ctx->buf, ctx->buf_len);
+        ms->tail_len = (uint32_t)ctx->buf_len;
+
+        return 0;
+}
+
+/**
+ * sha512_ctx_import() - resume context from exported midstate
+ *
+ * Whatever init (SHA-384 or SHA-512) the exporter used is carried in
+ * H, the caller only picks the digest length to read at the end.
+ *
+ * @param ctx: pointer to context to overwrite
+ * @param ms: pointer to midstate, untrusted
+ * @return 0 on success, -EINVAL on malformed midstate
+ */
+int sha512_ctx_import(struct sha512_ctx *ctx, const struct sha512_midstate *ms)
+{
+        if (!ctx || !ms || ms->tail_len >= PROCESS_BLOCK_SIZE ||
+            ms->PC[0] % PROCESS_BLOCK_SIZE)
+                return -EINVAL;
+
+        memset(ctx, 0x00, sizeof(struct sha512_ctx));
+        memcpy(ctx->H, ms->H, sizeof(ctx->H));
+        memcpy(ctx->PC, ms->PC, sizeof(ctx->PC));
+        memcpy(ctx->buf, ms->tail, ms->tail_len);
+        ctx->buf_len = ms->tail_len;
+
+        return 0;
+}
+
+static inline void u64_store_be(u8 *cp, u64 v)
+{
+#ifdef WORDS_BIGENDIAN
+        __u64_cp_u8(cp, v);
+#else
+        __u64_cp_u8(cp, u64lebe(v));
+#endif
+}
+
+static inline u64 u64_load_be(const u8 *cp)
+{
+        u64 v;
+
+        memcpy(&v, cp, sizeof(v));
+
+#ifdef WORDS_BIGENDIAN
+        return v;
+#else
+        return u64bele(v);
+#endif
+}
+
+/**
+ * sha512_ctx_digest() - copy hash values to byte block in standard
+ *                       (big-endian) octet order
+ *
+ * Unlike sha512_ctx_read(), the octets match sha512sum and what
+ * other implementations compare against, e.g. OAEP label hash
+ *
+ * @param ctx: pointer to concluded context
+ * @param md: pointer to octet buffer
+ * @param bits: length of hash
+ * @return md
+ */
+void *_sha512_ctx_digest(const struct sha512_ctx *ctx, void *md, int bits)
+{
+        u8 *r = md;
+
+        for (u64 i = 0; i < (bits / BYTE_TO_BIT(sizeof(u64))); i++)
+                u64_store_be(r + i * sizeof(u64), ctx->H[i]);
+
+        return md;
+}
+
+void *sha384_ctx_digest(const struct sha512_ctx *ctx, void *md)
+{
+        return _sha512_ctx_digest(ctx, md, SHA384_HASH_BITS);
+}
+
+void *sha512_ctx_digest(const struct sha512_ctx *ctx, void *md)
+{
+        return _sha512_ctx_digest(ctx, md, SHA512_HASH_BITS);
+}
+
+#define SHA512_LANES                    (4)
+
+/* One 64-bit word of every lane, GCC vector extension */
+typedef u64 u64xN __attribute__((vector_size(SHA512_LANES * sizeof(u64))));
+
+/**
+ * sha512_lanes_compute() - compress one block in each of SHA512_LANES
+ *                          independent states
+ *
+ * Same rounds as sha512_ctx_compute(), on vectors holding the same
+ * word of every lane. Built for AVX2 as well, picked at load time on
+ * CPUs that have it, plain SSE2 pairs otherwise.
+ *
+ * @param H: hash values of every lane, updated
+ * @param blk: one 128 bytes block per lane
+ */
+__attribute__((target_clones("avx2", "default")))
+static void sha512_lanes_compute(u64 H[SHA512_LANES][8],
+                                 const u8 *blk[SHA512_LANES])
+{
+        u64xN W[80];
+        u64xN a, b, c, d, e, f, g, h;
+        u64xN T1, T2;
+        int l;
+
+        for (u64 t = 0; t < 16; ++t)
+                for (l = 0; l < SHA512_LANES; ++l)
+                        W[t][l] = u64_load_be(blk[l] + t * sizeof(u64));
+
+        for (u64 t = 16; t < 80; ++t)
+                W[t] = SSIG1(W[t - 2]) + W[t - 7] + SSIG0(W[t - 15]) + W[t - 16];
+
+        for (l = 0; l < SHA512_LANES; ++l) {
+                a[l] = H[l][0];
+                b[l] = H[l][1];
+                c[l] = H[l][2];
+                d[l] = H[l][3];
+                e[l] = H[l][4];
+                f[l] = H[l][5];
+                g[l] = H[l][6];
+                h[l] = H[l][7];
+        }
+
+        /*
+         * Eight rounds per iteration with the variables renamed instead
+         * of shifted, so nothing but the round itself sits in the loop
+         */
+#define LANES_ROUND(a, b, c, d, e, f, g, h, t)                                  \
+        do {                                                                    \
+                T1 = h + BSIG1(e) + CH(e, f, g) + K(t) + W[t];                  \
+                T2 = BSIG0(a) + MAJ(a, b, c);                                   \
+                d += T1;                                                        \
+                h = T1 + T2;                                                    \
+        } while (0)
+
+        for (u64 t = 0; t < ARRAY_SIZE(sha512_round_constants); t += 8) {
+                LANES_ROUND(a, b, c, d, e, f, g, h, t + 0);
+                LANES_ROUND(h, a, b, c, d, e, f, g, t + 1);
+                LANES_ROUND(g, h, a, b, c, d, e, f, t + 2);
+                LANES_ROUND(f, g, h, a, b, c, d, e, t + 3);
+                LANES_ROUND(e, f, g, h, a, b, c, d, t + 4);
+                LANES_ROUND(d, e, f, g, h, a, b, c, t + 5);
+                LANES_ROUND(c, d, e, f, g, h, a, b, t + 6);
+                LANES_ROUND(b, c, d, e, f, g, h, a, t + 7);
+        }
+
+#undef LANES_ROUND
+
+        for (l = 0; l < SHA512_LANES; ++l) {
+                H[l][0] += a[l];
+                H[l][1] += b[l];
+                H[l][2] += c[l];
+                H[l][3] += d[l];
+                H[l][4] += e[l];
+                H[l][5] += f[l];
+                H[l][6] += g[l];
+                H[l][7] += h[l];
+        }
+}
+
+/**
+ * sha512_mgf1() - MGF1 mask generation (RFC8017#appendix-B.2.1)
+ *
+ *    mask = Hash(Z || C(0)) || Hash(Z || C(1)) || ...
+ *
+ * C(i) is a 32-bit big-endian counter. Whole blocks of Z are absorbed
+ * once and the midstate shared by all counters. What is left (tail of
+ * Z, counter, padding) is one or two blocks that differ in the counter
+ * only, and those are compressed SHA512_LANES counters at a time,
+ * a group of two or more counters fills the lanes it can.
+ *
+ * @param seed: Z
+ * @param seed_len: length in byte of Z
+ * @param mask: output buffer
+ * @param mask_len: mask length in byte
+ * @param bits: hash value bit length
+ * @return 0 on success
+ */
+int _sha512_mgf1(const void *seed, size_t seed_len, void *mask,
+                 size_t mask_len, int bits)
+{
+        struct sha512_ctx ctx_stack, one_stack;
+        struct sha512_ctx *ctx, *one;
+        u8 tail[SHA512_LANES][2 * PROCESS_BLOCK_SIZE];
+        u8 md[SHA512_HASH_BYTE];
+        u64 H[SHA512_LANES][8];
+        const u8 *blk[SHA512_LANES];
+        const u8 *z = seed;
+        size_t hlen = BIT_TO_BYTE(bits);
+        size_t whole, rem, tail_len, cnt, lanes, n;
+        u64 total;
+        size_t l;
+
+        if ((!seed && seed_len) || (!mask && mask_len))
+                return -EINVAL;
+
+        cnt = (mask_len + hlen - 1) / hlen;
+        if (cnt > (size_t)UINT32_MAX + 1)
+                return -EINVAL;
+
+        ctx = sha512_ctx_get(&ctx_stack);
+        one = sha512_ctx_get(&one_stack);
+
+        if (bits == SHA384_HASH_BITS)
+                sha384_ctx_init(ctx);
+        else
+                sha512_ctx_init(ctx);
+
+        /* midstate over whole blocks of Z */
+        whole = seed_len - seed_len % PROCESS_BLOCK_SIZE;
+        for (size_t off = 0; off < whole; off += PROCESS_BLOCK_SIZE)
+                sha512_block_process(ctx, z + off, PROCESS_BLOCK_SIZE);
+
+        /* rest of Z || C || 80 00 .. 00 || 128-bit length in bits */
+        rem = seed_len - whole;
+        total = (u64)seed_len + 4;
+        tail_len = (rem + 4 <= MAX_L_1024BLK_BYTES) ? PROCESS_BLOCK_SIZE :
+                                                     2 * PROCESS_BLOCK_SIZE;
+
+        memset(tail[0], 0x00, sizeof(tail[0]));
+        memcpy(tail[0], z + whole, rem);
+        tail[0][rem + 4] = 0x80;
+        u64_store_be(&tail[0][tail_len - 16], u64shr(total, 61));
+        u64_store_be(&tail[0][tail_len - 8], u64shl(total, 3));
+
+        for (l = 1; l < SHA512_LANES; ++l)
+                memcpy(tail[l], tail[0], tail_len);
+
+        for (size_t i = 0; i < cnt; i += lanes) {
+                /*
+                 * A part filled group costs as much as a full one, which
+                 * still beats two or more scalar compressions. Unused
+                 * lanes hash a stale counter that is never copied out.
+                 */
+                lanes = cnt - i >= SHA512_LANES ? SHA512_LANES : cnt - i;
+
+                for (l = 0; l < SHA512_LANES; ++l) {
+                        u32 C = (u32)(i + l);
+
+                        if (l < lanes) {
+                                tail[l][rem + 0] = (u8)(C >> 24);
+                                tail[l][rem + 1] = (u8)(C >> 16);
+                                tail[l][rem + 2] = (u8)(C >> 8);
+                                tail[l][rem + 3] = (u8)(C);
+                        }
+
+                        memcpy(H[l], ctx->H, sizeof(H[l]));
+                        blk[l] = tail[l];
+                }
+
+                if (lanes > 1) {
+                        sha512_lanes_compute(H, blk);
+
+                        if (tail_len > PROCESS_BLOCK_SIZE) {
+                                for (l = 0; l < SHA512_LANES; ++l)
+                                        blk[l] = tail[l] + PROCESS_BLOCK_SIZE;
+
+                                sha512_lanes_compute(H, blk);
+                        }
+                } else {
+                        memcpy(one->H, ctx->H, sizeof(one->H));
+
+                        for (size_t off = 0; off < tail_len; off += PROCESS_BLOCK_SIZE)
+                                sha512_block_process(one, tail[0] + off,
+                                                     PROCESS_BLOCK_SIZE);
+
+                        memcpy(H[0], one->H, sizeof(H[0]));
+                }
+
+                for (l = 0; l < lanes; ++l) {
+                        /* SHA-384 truncates below */
+                        for (u64 j = 0; j < ARRAY_SIZE(H[l]); ++j)
+                                u64_store_be(md + j * sizeof(u64), H[l][j]);
+
+                        n = mask_len - (i + l) * hlen;
+                        if (n > hlen)
+                                n = hlen;
+
+                        memcpy((u8 *)mask + (i + l) * hlen, md, n);
+                }
+        }
+
+        /* Z is the OAEP seed, keep it off the stack */
+        explicit_bzero(tail, sizeof(tail));
+        explicit_bzero(H, sizeof(H));
+        explicit_bzero(md, sizeof(md));
+        explicit_bzero(ctx, sizeof(struct sha512_ctx));
+        explicit_bzero(one, sizeof(struct sha512_ctx));
+        sha512_ctx_put(one, &one_stack);
+        sha512_ctx_put(ctx, &ctx_stack);
+
+        return 0;
+}
+
+int sha384_mgf1(const void *seed, size_t seed_len, void *mask, size_t mask_len)
+{
+        return _sha512_mgf1(seed, seed_len, mask, mask_len, SHA384_HASH_BITS);
+}
+
+int sha512_mgf1(const void *seed, size_t seed_len, void *mask, size_t mask_len)
+{
+        return _sha512_mgf1(seed, seed_len, mask, mask_len, SHA512_HASH_BITS);
+}
+
 /**
  * sha512_ctx_string() - convert hash result to string
  *
@@ -40,13 +40,48 @@ struct sha512_ctx {
 
 #define SHA384_HASH_BITS                (384)
 #define SHA512_HASH_BITS                (512)
+#define SHA512_BLOCK_BYTES              (128)
 
-int sha384_stream_process(FILE *stream, void *resblk);
-int sha512_stream_process(FILE *stream, void *resblk);
+/**
+ * Midstate of an unfinished hash: chaining value after every complete
+ * block, plus the partial block not yet compressed. Host byte order.
+ *
+ * Lets a client hash a payload locally and a signer finish the hash
+ * with sha512_ctx_import() + sha512_ctx_conclude() at constant cost.
+ */
+struct sha512_midstate {
+        uint64_t        H[8];           // Hash value after PC bytes
+        uint64_t        PC[2];          // Compressed byte count, whole blocks
+        uint32_t        tail_len;       // Bytes in tail, < SHA512_BLOCK_BYTES
+        uint32_t        reserved;
+        uint8_t         tail[SHA512_BLOCK_BYTES];
+};
+
+void sha384_ctx_init(struct sha512_ctx *ctx);
+void sha512_ctx_init(struct sha512_ctx *ctx);
+void sha512_ctx_update(struct sha512_ctx *ctx, const void *buf, size_t len);
+void sha512_ctx_conclude(struct sha512_ctx *ctx);
 
+int sha512_ctx_export(const struct sha512_ctx *ctx, struct sha512_midstate *ms);
+int sha512_ctx_import(struct sha512_ctx *ctx, const struct sha512_midstate *ms);
+
+/* Hash values in host word order, as sha512_hash_string() expects */
 void *sha384_ctx_read(const struct sha512_ctx *ctx, void *resblk);
 void *sha512_ctx_read(const struct sha512_ctx *ctx, void *resblk);
 
+/* Standard (big-endian) digest octets */
+void *sha384_ctx_digest(const struct sha512_ctx *ctx, void *md);
+void *sha512_ctx_digest(const struct sha512_ctx *ctx, void *md);
+
+int sha384_mgf1(const void *seed, size_t seed_len, void *mask, size_t mask_len);
+int sha512_mgf1(const void *seed, size_t seed_len, void *mask, size_t mask_len);
+
+int sha384_stream_process(FILE *stream, void *resblk);
+int sha512_stream_process(FILE *stream, void *resblk);
+
+int sha384_buffer_process(const void *buf, size_t len, void *resblk);
+int sha512_buffer_process(const void *buf, size_t len, void *resblk);
+
 void *sha384_ctx_string(const struct sha512_ctx *ctx, void *hash_buf);
 void *sha512_ctx_string(const struct sha512_ctx *ctx, void *hash_buf);
 
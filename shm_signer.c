@@ -0,0 +1,918 @@
+/**
+ * shm_signer.c - Shared memory ring transport to a co-located signer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_signer.h"
+
+#define REQ_MASK                        (SHM_SIGNER_REQ_SLOTS - 1)
+#define CPL_MASK                        (SHM_SIGNER_CPL_SLOTS - 1)
+
+/* Sleepers re-check liveness of the other side this often */
+#define SHM_SIGNER_WAIT_NS              (100 * 1000 * 1000UL)
+
+static int futex_wait(_Atomic uint32_t *addr, uint32_t val, uint64_t ns)
+{
+        struct timespec ts = {
+                .tv_sec  = (time_t)(ns / 1000000000UL),
+                .tv_nsec = (long)(ns % 1000000000UL),
+        };
+
+        /* Not FUTEX_PRIVATE_FLAG, the word is shared between processes */
+        return (int)syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr)
+{
+        syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * shm_spin_adapt() - adjust spin budget after a wait
+ *
+ * Work arriving while spinning means spinning pays off, grow the budget.
+ * Having to sleep means we burnt the budget for nothing, shrink it.
+ *
+ * @param spin: pointer to spin budget
+ * @param hit: whether work arrived within the budget
+ */
+static inline void shm_spin_adapt(uint32_t *spin, int hit)
+{
+        if (hit && *spin < SHM_SIGNER_SPIN_MAX)
+                *spin <<= 1;
+        else if (!hit && *spin > SHM_SIGNER_SPIN_MIN)
+                *spin >>= 1;
+}
+
+/**
+ * shm_signer_alive() - whether the signer of a region still serves
+ *
+ * @param r: pointer to region
+ * @return 1 if alive
+ */
+static int shm_signer_alive(struct shm_signer_region *r)
+{
+        return atomic_load(&r->running) && pid_alive(atomic_load(&r->pid));
+}
+
+/**
+ * shm_signer_owned() - whether an existing region belongs to a live signer
+ *
+ * @param name: shm object name
+ * @return 1 if another signer serves it
+ */
+static int shm_signer_owned(const char *name)
+{
+        struct shm_signer_region *r;
+        struct stat st;
+        int owned = 0;
+        int fd;
+
+        fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0)
+                return 0;
+
+        if (!fstat(fd, &st) && (size_t)st.st_size >= sizeof(struct shm_signer_region)) {
+                r = mmap(NULL, sizeof(struct shm_signer_region), PROT_READ,
+                         MAP_SHARED, fd, 0);
+                if (r != MAP_FAILED) {
+                        owned = r->version == SHM_SIGNER_VERSION &&
+                                pid_alive(atomic_load(&r->pid));
+                        munmap(r, sizeof(struct shm_signer_region));
+                }
+        }
+
+        close(fd);
+
+        return owned;
+}
+
+/**
+ * shm_signer_create() - create and map the shared region
+ *
+ * @param s: pointer to signer
+ * @param name: shm object name, e.g. "/rsadigest-signer"
+ * @param key_len: signing key bit length
+ * @return 0 on success, -EBUSY if a live signer serves @name
+ */
+int shm_signer_create(struct shm_signer *s, const char *name, uint64_t key_len)
+{
+        struct shm_signer_region *r;
+        int fd;
+
+        if (!s || !name || (key_len + 7) / 8 > SHM_SIGNER_SIG_MAX)
+                return -EINVAL;
+
+        memset(s, 0x00, sizeof(struct shm_signer));
+        snprintf(s->name, sizeof(s->name), "%s", name);
+
+        fd = shm_open(s->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+                if (shm_signer_owned(s->name))
+                        return -EBUSY;
+
+                /* left over by a signer that did not exit cleanly */
+                shm_unlink(s->name);
+                fd = shm_open(s->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        }
+
+        if (fd < 0)
+                return -errno;
+
+        if (ftruncate(fd, sizeof(struct shm_signer_region))) {
+                close(fd);
+                shm_unlink(s->name);
+                return -errno;
+        }
+
+        r = mmap(NULL, sizeof(struct shm_signer_region),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        close(fd);
+
+        if (r == MAP_FAILED) {
+                shm_unlink(s->name);
+                return -errno;
+        }
+
+        for (uint64_t i = 0; i < SHM_SIGNER_REQ_SLOTS; ++i)
+                atomic_store_explicit(&r->req[i].seq, i, memory_order_relaxed);
+
+        r->key_len = key_len;
+        r->version = SHM_SIGNER_VERSION;
+        atomic_store(&r->running, 1);
+        atomic_store(&r->pid, (int32_t)getpid());
+
+        /* Publish magic last, clients check it on attach */
+        atomic_thread_fence(memory_order_release);
+        r->magic = SHM_SIGNER_MAGIC;
+
+        s->r = r;
+        s->spin = SHM_SIGNER_SPIN_MIN;
+
+        return 0;
+}
+
+/**
+ * shm_signer_complete_request() - push completion into client's ring
+ *
+ * Client never has more than SHM_SIGNER_CPL_SLOTS requests in flight,
+ * so the ring can not overflow. @req is the signer's validated copy.
+ */
+static void shm_signer_complete_request(struct shm_signer_region *r,
+                                        const struct shm_request *req,
+                                        int32_t status, mpz_t sig,
+                                        const uint8_t *digest)
+{
+        struct shm_client_ring *ring = &r->client[req->client];
+        struct shm_completion *cpl;
+        uint64_t tail;
+        size_t k = (r->key_len + 7) / 8;
+        size_t count;
+
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        cpl = &ring->slot[tail & CPL_MASK];
+
+        cpl->tag = req->tag;
+        cpl->status = status;
+        cpl->sig_len = 0;
+        cpl->digest_len = 0;
+
+        if (!status && digest) {
+                cpl->digest_len = req->digest_len < SHM_SIGNER_DIGEST_MAX ?
+                                  req->digest_len : SHM_SIGNER_DIGEST_MAX;
+                memcpy(cpl->digest, digest, cpl->digest_len);
+        }
+
+        if (!status && sig) {
+                /* fixed length, big-endian, zero padded */
+                count = (mpz_sizeinbase(sig, 2) + 7) / 8;
+                if (count <= k) {
+                        memset(cpl->sig, 0x00, k - count);
+                        mpz_export(&cpl->sig[k - count], NULL, 1, 1, 1, 0, sig);
+                        cpl->sig_len = (uint32_t)k;
+                } else {
+                        cpl->status = -ERANGE;
+                }
+        }
+
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        atomic_fetch_add(&ring->futex, 1);
+
+        if (atomic_load(&ring->waiting))
+                futex_wake(&ring->futex);
+}
+
+/**
+ * shm_signer_handle() - serve one request
+ *
+ * The slot stays writable by every client while it is served, so it is
+ * copied once and only the copy is validated and used.
+ */
+static void shm_signer_handle(struct shm_signer_region *r,
+                              const struct shm_request *slot,
+                              struct rsa_private *priv,
+                              struct rsa_public *pub,
+                              mpz_t s)
+{
+        uint8_t digest[SHM_SIGNER_DIGEST_MAX];
+        struct shm_request copy;
+        const struct shm_request *req = &copy;
+        int32_t status;
+
+        memcpy(&copy, slot, sizeof(copy));
+
+        /* no re-reading the slot in place of the copy */
+        atomic_signal_fence(memory_order_seq_cst);
+
+        if (req->client >= SHM_SIGNER_CLIENTS ||
+            !atomic_load(&r->client[req->client].owner))
+                return;         /* nobody to answer */
+
+        if (req->digest_len > SHM_SIGNER_DIGEST_MAX ||
+            req->sig_len > SHM_SIGNER_SIG_MAX) {
+                shm_signer_complete_request(r, req, -EINVAL, NULL, NULL);
+                return;
+        }
+
+        switch (req->op) {
+                case SHM_OP_SIGN:
+                        status = rsa_private_key_sign(priv, s, req->digest,
+                                                      req->digest_len);
+                        shm_signer_complete_request(r, req, status, s, NULL);
+                        break;
+
+                case SHM_OP_SIGN_MIDSTATE:
+                        status = rsa_private_key_sign_midstate(priv, s, &req->midstate,
+                                                               (int)req->digest_len * 8,
+                                                               digest);
+                        shm_signer_complete_request(r, req, status, s, digest);
+                        break;
+
+                case SHM_OP_VERIFY:
+                        mpz_import(s, req->sig_len, 1, 1, 1, 0, req->sig);
+                        status = rsa_public_key_verify(pub, s, req->digest,
+                                                       req->digest_len);
+                        shm_signer_complete_request(r, req, status, NULL, NULL);
+                        break;
+
+                default:
+                        shm_signer_complete_request(r, req, -EOPNOTSUPP, NULL, NULL);
+                        break;
+        }
+}
+
+/**
+ * shm_signer_sweep() - clear reserve words dead clients left behind
+ *
+ * A client that lost the claim race, or whose slot was skipped, and
+ * died before clearing its reserve word would keep its ring from ever
+ * being reclaimed by shm_signer_client_attach(). Positions the head
+ * already passed can not be published any more.
+ *
+ * @param s: pointer to signer
+ */
+static void shm_signer_sweep(struct shm_signer *s)
+{
+        struct shm_signer_region *r = s->r;
+        struct shm_client_ring *ring;
+        uint64_t head = r->req_head;
+        uint64_t pos;
+
+        for (uint32_t i = 0; i < SHM_SIGNER_CLIENTS; ++i) {
+                ring = &r->client[i];
+                pos = atomic_load(&ring->reserve);
+
+                if (!pos || pos > head || pid_alive(atomic_load(&ring->owner)))
+                        continue;
+
+                atomic_compare_exchange_strong(&ring->reserve, &pos, 0);
+        }
+}
+
+/**
+ * shm_signer_reclaim() - skip head slot if the client reserving it died
+ *
+ * Clients announce the position in their ring's reserve word before
+ * they claim a slot and clear it after publishing, so a live reserver
+ * is always found. The slot is skipped only after stalling for a whole
+ * wait period with every announcing client gone.
+ *
+ * @param s: pointer to signer
+ * @param req: slot at req_head, not published
+ */
+static void shm_signer_reclaim(struct shm_signer *s, struct shm_request *req)
+{
+        struct shm_signer_region *r = s->r;
+        struct shm_client_ring *ring;
+        uint64_t head = r->req_head;
+        uint64_t now, pos;
+        uint32_t dead = 0;
+
+        if (atomic_load(&req->seq) != head || atomic_load(&r->req_tail) == head) {
+                s->stall_ns = 0;        /* published, or not claimed at all */
+                return;
+        }
+
+        now = clock_ns();
+        if (!s->stall_ns)
+                s->stall_ns = now;
+
+        if (now - s->stall_ns < SHM_SIGNER_WAIT_NS)
+                return;
+
+        for (uint32_t i = 0; i < SHM_SIGNER_CLIENTS; ++i) {
+                ring = &r->client[i];
+                pos = atomic_load(&ring->reserve);
+
+                if (pos != head + 1)
+                        continue;
+
+                if (pid_alive(atomic_load(&ring->owner)))
+                        return;                 /* slow, not dead */
+
+                dead++;
+                atomic_compare_exchange_strong(&ring->reserve, &pos, 0);
+        }
+
+        if (!dead)
+                return;
+
+        atomic_store_explicit(&req->seq, head + SHM_SIGNER_REQ_SLOTS,
+                              memory_order_release);
+        r->req_head++;
+        s->reclaimed++;
+        s->stall_ns = 0;
+}
+
+/**
+ * shm_signer_serve() - serve requests until shm_signer_stop()
+ *
+ * Keys are only referenced from this address space.
+ *
+ * @param s: pointer to signer
+ * @param priv: signing key
+ * @param pub: verification key
+ * @return 0 on success
+ */
+int shm_signer_serve(struct shm_signer *s, struct rsa_private *priv,
+                     struct rsa_public *pub)
+{
+        struct shm_signer_region *r;
+        struct shm_request *req;
+        uint64_t seq;
+        uint32_t v, i;
+        mpz_t sig;
+
+        if (!s || !s->r || !priv || !pub)
+                return -EINVAL;
+
+        r = s->r;
+        mpz_init(sig);
+
+        while (atomic_load_explicit(&r->running, memory_order_relaxed)) {
+                req = &r->req[r->req_head & REQ_MASK];
+                seq = atomic_load_explicit(&req->seq, memory_order_acquire);
+
+                if (seq == r->req_head + 1) {
+                        shm_signer_handle(r, req, priv, pub, sig);
+
+                        /* hand the slot back to producers, one lap ahead */
+                        atomic_store_explicit(&req->seq,
+                                              r->req_head + SHM_SIGNER_REQ_SLOTS,
+                                              memory_order_release);
+                        r->req_head++;
+                        s->served++;
+                        s->stall_ns = 0;
+
+                        /* never idle long enough to sweep otherwise */
+                        if (!(s->served & (SHM_SIGNER_REQ_SLOTS - 1)))
+                                shm_signer_sweep(s);
+                        continue;
+                }
+
+                for (i = 0; i < s->spin; ++i) {
+                        cpu_relax();
+
+                        seq = atomic_load_explicit(&req->seq, memory_order_acquire);
+                        if (seq == r->req_head + 1)
+                                break;
+                }
+
+                shm_spin_adapt(&s->spin, i < s->spin);
+                if (i < s->spin)
+                        continue;
+
+                atomic_store(&r->req_sleeping, 1);
+                v = atomic_load(&r->req_futex);
+
+                seq = atomic_load(&req->seq);
+                if (seq != r->req_head + 1 && atomic_load(&r->running))
+                        futex_wait(&r->req_futex, v, SHM_SIGNER_WAIT_NS);
+
+                atomic_store(&r->req_sleeping, 0);
+
+                shm_signer_sweep(s);
+                shm_signer_reclaim(s, req);
+        }
+
+        /* let blocked clients notice we are gone */
+        for (i = 0; i < SHM_SIGNER_CLIENTS; ++i) {
+                atomic_fetch_add(&r->client[i].futex, 1);
+                futex_wake(&r->client[i].futex);
+        }
+
+        mpz_clear(sig);
+
+        return 0;
+}
+
+/**
+ * shm_signer_stop() - ask serving loop to return, async-signal-safe
+ *
+ * @param s: pointer to signer
+ */
+void shm_signer_stop(struct shm_signer *s)
+{
+        if (!s || !s->r)
+                return;
+
+        atomic_store(&s->r->running, 0);
+        atomic_fetch_add(&s->r->req_futex, 1);
+        futex_wake(&s->r->req_futex);
+}
+
+/**
+ * shm_signer_destroy() - unmap and remove the shared region
+ *
+ * @param s: pointer to signer
+ */
+void shm_signer_destroy(struct shm_signer *s)
+{
+        if (!s || !s->r)
+                return;
+
+        munmap(s->r, sizeof(struct shm_signer_region));
+        shm_unlink(s->name);
+        s->r = NULL;
+}
+
+/**
+ * shm_signer_client_attach() - map signer region and claim a ring
+ *
+ * @param c: pointer to client
+ * @param name: shm object name of the signer
+ * @return 0 on success
+ */
+int shm_signer_client_attach(struct shm_signer_client *c, const char *name)
+{
+        struct shm_signer_region *r;
+        struct stat st;
+        int32_t owner;
+        int32_t pid = (int32_t)getpid();
+        int fd;
+
+        if (!c || !name)
+                return -EINVAL;
+
+        memset(c, 0x00, sizeof(struct shm_signer_client));
+
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct shm_signer_region)) {
+                close(fd);
+                return -EPROTO;
+        }
+
+        r = mmap(NULL, sizeof(struct shm_signer_region),
+                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (r == MAP_FAILED)
+                return -errno;
+
+        if (r->magic != SHM_SIGNER_MAGIC || r->version != SHM_SIGNER_VERSION) {
+                munmap(r, sizeof(struct shm_signer_region));
+                return -EPROTO;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+
+        if (!shm_signer_alive(r)) {
+                munmap(r, sizeof(struct shm_signer_region));
+                return -EPIPE;
+        }
+
+        for (uint32_t i = 0; i < SHM_SIGNER_CLIENTS; ++i) {
+                owner = atomic_load(&r->client[i].owner);
+
+                /*
+                 * reclaim rings of clients that died attached, unless the
+                 * signer still has to skip a slot they reserved
+                 */
+                if (owner && !pid_alive(owner) &&
+                    !atomic_load(&r->client[i].reserve)) {
+                        if (!atomic_compare_exchange_strong(&r->client[i].owner,
+                                                            &owner, 0))
+                                continue;
+                        owner = 0;
+                }
+
+                if (owner || !atomic_compare_exchange_strong(&r->client[i].owner,
+                                                             &owner, pid))
+                        continue;
+
+                c->r = r;
+                c->id = i;
+                c->ring = &r->client[i];
+                c->head = atomic_load(&c->ring->tail);
+                c->spin = SHM_SIGNER_SPIN_MIN;
+
+                return 0;
+        }
+
+        munmap(r, sizeof(struct shm_signer_region));
+
+        return -EBUSY;
+}
+
+/**
+ * shm_signer_client_detach() - release ring and unmap region
+ *
+ * @param c: pointer to client
+ */
+void shm_signer_client_detach(struct shm_signer_client *c)
+{
+        if (!c || !c->r)
+                return;
+
+        atomic_store(&c->ring->owner, 0);
+        munmap(c->r, sizeof(struct shm_signer_region));
+        c->r = NULL;
+        c->ring = NULL;
+}
+
+/**
+ * shm_signer_reserve() - claim next request slot
+ *
+ * Bounded MPMC queue by D. Vyukov, used with a single consumer. The
+ * slot is handed to the signer by shm_signer_publish().
+ */
+static int shm_signer_reserve(struct shm_signer_client *c,
+                              struct shm_request **slot, uint64_t *slot_pos)
+{
+        struct shm_signer_region *r = c->r;
+        struct shm_request *req;
+        uint64_t pos, seq;
+        int64_t diff;
+
+        if (c->inflight >= SHM_SIGNER_CPL_SLOTS)
+                return -EBUSY;
+
+        pos = atomic_load_explicit(&r->req_tail, memory_order_relaxed);
+
+        while (1) {
+                if (!atomic_load_explicit(&r->running, memory_order_relaxed)) {
+                        atomic_store(&c->ring->reserve, 0);
+                        return -EPIPE;
+                }
+
+                req = &r->req[pos & REQ_MASK];
+                seq = atomic_load_explicit(&req->seq, memory_order_acquire);
+                diff = (int64_t)(seq - pos);
+
+                if (diff == 0) {
+                        /* announced before the claim, see shm_signer_reclaim() */
+                        atomic_store(&c->ring->reserve, pos + 1);
+
+                        if (atomic_compare_exchange_weak(&r->req_tail, &pos, pos + 1))
+                                break;
+                } else if (diff < 0) {
+                        /* ring full, signer is behind */
+                        if (!shm_signer_alive(r)) {
+                                atomic_store(&c->ring->reserve, 0);
+                                return -EPIPE;
+                        }
+
+                        sched_yield();
+                        pos = atomic_load_explicit(&r->req_tail, memory_order_relaxed);
+                } else {
+                        pos = atomic_load_explicit(&r->req_tail, memory_order_relaxed);
+                }
+        }
+
+        *slot = req;
+        *slot_pos = pos;
+
+        return 0;
+}
+
+static void shm_signer_publish(struct shm_signer_client *c, struct shm_request *req,
+                               uint64_t pos, uint64_t *tag)
+{
+        struct shm_signer_region *r = c->r;
+
+        req->client = c->id;
+        req->tag = c->next_tag++;
+
+        if (tag)
+                *tag = req->tag;
+
+        atomic_store_explicit(&req->seq, pos + 1, memory_order_release);
+        atomic_store(&c->ring->reserve, 0);
+        c->inflight++;
+
+        atomic_fetch_add(&r->req_futex, 1);
+        if (atomic_load(&r->req_sleeping))
+                futex_wake(&r->req_futex);
+}
+
+/**
+ * shm_signer_submit() - enqueue a request without waiting
+ *
+ * @param c: pointer to client
+ * @param op: SHM_OP_SIGN or SHM_OP_VERIFY
+ * @param digest: message digest
+ * @param digest_len: digest length in octets
+ * @param sig: signature for SHM_OP_VERIFY, NULL otherwise
+ * @param sig_len: signature length in octets
+ * @param tag: returns tag to match the completion, may be NULL
+ * @return 0 on success, -EBUSY if too many requests are in flight
+ */
+int shm_signer_submit(struct shm_signer_client *c, uint32_t op,
+                      const void *digest, uint32_t digest_len,
+                      const void *sig, uint32_t sig_len, uint64_t *tag)
+{
+        struct shm_request *req;
+        uint64_t pos;
+        int ret;
+
+        if (!c || !c->r || !digest || op >= NUM_SHM_OPS || op == SHM_OP_SIGN_MIDSTATE)
+                return -EINVAL;
+
+        if (digest_len > SHM_SIGNER_DIGEST_MAX || sig_len > SHM_SIGNER_SIG_MAX)
+                return -E2BIG;
+
+        if (op == SHM_OP_VERIFY && !sig)
+                return -EINVAL;
+
+        ret = shm_signer_reserve(c, &req, &pos);
+        if (ret)
+                return ret;
+
+        req->op = op;
+        req->digest_len = digest_len;
+        req->sig_len = op == SHM_OP_VERIFY ? sig_len : 0;
+        memcpy(req->digest, digest, digest_len);
+        if (op == SHM_OP_VERIFY)
+                memcpy(req->sig, sig, sig_len);
+
+        shm_signer_publish(c, req, pos, tag);
+
+        return 0;
+}
+
+/**
+ * shm_signer_submit_midstate() - queue SHM_OP_SIGN_MIDSTATE, returns at once
+ *
+ * @param c: pointer to client
+ * @param ms: midstate of the payload hash, see sha512_ctx_export()
+ * @param bits: SHA384_HASH_BITS or SHA512_HASH_BITS
+ * @param tag: returns tag to match the completion, may be NULL
+ * @return 0 on success, -EBUSY if too many requests are in flight
+ */
+int shm_signer_submit_midstate(struct shm_signer_client *c,
+                               const struct sha512_midstate *ms, int bits,
+                               uint64_t *tag)
+{
+        struct shm_request *req;
+        uint64_t pos;
+        int ret;
+
+        if (!c || !c->r || !ms || (bits != SHA384_HASH_BITS && bits != SHA512_HASH_BITS))
+                return -EINVAL;
+
+        ret = shm_signer_reserve(c, &req, &pos);
+        if (ret)
+                return ret;
+
+        req->op = SHM_OP_SIGN_MIDSTATE;
+        req->digest_len = (uint32_t)bits / 8;
+        req->sig_len = 0;
+        memcpy(&req->midstate, ms, sizeof(req->midstate));
+
+        shm_signer_publish(c, req, pos, tag);
+
+        return 0;
+}
+
+/**
+ * shm_signer_complete() - wait for the next completion
+ *
+ * Spins for an adaptive budget, then sleeps on the ring futex
+ *
+ * @param c: pointer to client
+ * @param cpl: completion to write
+ * @return 0 on success, -ENOENT if nothing in flight, -EPIPE if signer is gone
+ */
+int shm_signer_complete(struct shm_signer_client *c, struct shm_completion *cpl)
+{
+        struct shm_client_ring *ring;
+        uint64_t tail;
+        uint32_t v, i;
+
+        if (!c || !c->r || !cpl)
+                return -EINVAL;
+
+        if (!c->inflight)
+                return -ENOENT;
+
+        ring = c->ring;
+
+        while (1) {
+                tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+                if (tail != c->head) {
+                        memcpy(cpl, &ring->slot[c->head & CPL_MASK], sizeof(*cpl));
+                        c->head++;
+                        c->inflight--;
+
+                        return 0;
+                }
+
+                for (i = 0; i < c->spin; ++i) {
+                        cpu_relax();
+
+                        if (atomic_load_explicit(&ring->tail,
+                                                 memory_order_relaxed) != c->head)
+                                break;
+                }
+
+                shm_spin_adapt(&c->spin, i < c->spin);
+                if (i < c->spin)
+                        continue;
+
+                atomic_store(&ring->waiting, 1);
+                v = atomic_load(&ring->futex);
+
+                if (atomic_load(&ring->tail) == c->head) {
+                        if (!shm_signer_alive(c->r)) {
+                                atomic_store(&ring->waiting, 0);
+                                return -EPIPE;
+                        }
+
+                        futex_wait(&ring->futex, v, SHM_SIGNER_WAIT_NS);
+                }
+
+                atomic_store(&ring->waiting, 0);
+        }
+}
+
+static int shm_signer_call(struct shm_signer_client *c, uint32_t op,
+                           const void *digest, uint32_t digest_len,
+                           const void *sig, uint32_t sig_len,
+                           struct shm_completion *cpl)
+{
+        uint64_t tag;
+        int ret;
+
+        /* synchronous helpers do not mix with pipelined submissions */
+        if (c->inflight)
+                return -EBUSY;
+
+        ret = shm_signer_submit(c, op, digest, digest_len, sig, sig_len, &tag);
+        if (ret)
+                return ret;
+
+        ret = shm_signer_complete(c, cpl);
+        if (ret)
+                return ret;
+
+        return cpl->tag == tag ? cpl->status : -EPROTO;
+}
+
+/**
+ * shm_signer_sign() - sign digest through signer, synchronous
+ *
+ * @param c: pointer to client
+ * @param digest: message digest
+ * @param digest_len: digest length in octets
+ * @param sig: buffer of SHM_SIGNER_SIG_MAX octets
+ * @param sig_len: returns signature length in octets
+ * @return 0 on success
+ */
+int shm_signer_sign(struct shm_signer_client *c, const void *digest,
+                    uint32_t digest_len, void *sig, uint32_t *sig_len)
+{
+        struct shm_completion cpl;
+        int ret;
+
+        if (!c || !sig || !sig_len)
+                return -EINVAL;
+
+        ret = shm_signer_call(c, SHM_OP_SIGN, digest, digest_len, NULL, 0, &cpl);
+        if (ret)
+                return ret;
+
+        memcpy(sig, cpl.sig, cpl.sig_len);
+        *sig_len = cpl.sig_len;
+
+        return 0;
+}
+
+/**
+ * shm_signer_sign_midstate() - sign payload by its midstate, synchronous
+ *
+ * @param c: pointer to client
+ * @param ms: midstate of the payload hash, see sha512_ctx_export()
+ * @param bits: SHA384_HASH_BITS or SHA512_HASH_BITS
+ * @param digest: optional, bits / 8 octets, digest the signer signed
+ * @param sig: buffer of SHM_SIGNER_SIG_MAX octets
+ * @param sig_len: returns signature length in octets
+ * @return 0 on success
+ */
+int shm_signer_sign_midstate(struct shm_signer_client *c,
+                             const struct sha512_midstate *ms, int bits,
+                             void *digest, void *sig, uint32_t *sig_len)
+{
+        struct shm_completion cpl;
+        uint64_t tag;
+        int ret;
+
+        if (!c || !sig || !sig_len)
+                return -EINVAL;
+
+        if (c->inflight)
+                return -EBUSY;
+
+        ret = shm_signer_submit_midstate(c, ms, bits, &tag);
+        if (ret)
+                return ret;
+
+        ret = shm_signer_complete(c, &cpl);
+        if (ret)
+                return ret;
+
+        if (cpl.tag != tag)
+                return -EPROTO;
+
+        if (cpl.status)
+                return cpl.status;
+
+        if (digest)
+                memcpy(digest, cpl.digest, cpl.digest_len);
+
+        memcpy(sig, cpl.sig, cpl.sig_len);
+        *sig_len = cpl.sig_len;
+
+        return 0;
+}
+
+/**
+ * shm_signer_verify() - verify signature through signer, synchronous
+ *
+ * @param c: pointer to client
+ * @param digest: message digest
+ * @param digest_len: digest length in octets
+ * @param sig: signature
+ * @param sig_len: signature length in octets
+ * @return 0 on valid signature, -EBADMSG on mismatch
+ */
+int shm_signer_verify(struct shm_signer_client *c, const void *digest,
+                      uint32_t digest_len, const void *sig, uint32_t sig_len)
+{
+        struct shm_completion cpl;
+
+        if (!c)
+                return -EINVAL;
+
+        return shm_signer_call(c, SHM_OP_VERIFY, digest, digest_len,
+                               sig, sig_len, &cpl);
+}
@@ -0,0 +1,165 @@
+/**
+ * shm_signer.h - Shared memory ring transport to a co-located signer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_SHM_SIGNER_H
+#define SIMPLERSADIGEST_SHM_SIGNER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "rsa.h"
+#include "sha512.h"
+
+/**
+ * Layout of the shared region
+ *
+ *    header | request ring (MPSC) | completion ring 0 | ... | ring N-1
+ *
+ * Clients push requests into the shared request ring, the signer
+ * answers into the completion ring owned by the client. Key material
+ * never enters the region, only digests and signatures do.
+ *
+ * SHM_OP_SIGN_MIDSTATE carries a SHA-384/512 midstate instead of a
+ * digest: the client hashed every complete block of the payload, the
+ * signer concludes, signs and returns the digest with the signature.
+ *
+ * Either side may be killed at any point. Clients give up with -EPIPE
+ * once the signer pid is gone. A request slot reserved by a client that
+ * died before publishing it would block the ring, the signer skips it
+ * once no live client announces it in its ring's reserve word.
+ */
+
+#define SHM_SIGNER_NAME_DEFAULT         "/rsadigest-signer"
+#define SHM_SIGNER_MAGIC                (0x52534153U)   /* "RSAS" */
+#define SHM_SIGNER_VERSION              (3)
+
+#define SHM_SIGNER_CLIENTS              (64)
+#define SHM_SIGNER_REQ_SLOTS            (1024)          /* power of 2 */
+#define SHM_SIGNER_CPL_SLOTS            (64)            /* power of 2 */
+
+#define SHM_SIGNER_DIGEST_MAX           (64)
+#define SHM_SIGNER_SIG_MAX              (512)           /* 4096-bit key */
+
+#define SHM_SIGNER_SPIN_MIN             (64)
+#define SHM_SIGNER_SPIN_MAX             (16384)
+
+#define SHM_CACHELINE                   (64)
+
+enum {
+        SHM_OP_SIGN = 0,
+        SHM_OP_VERIFY,
+        SHM_OP_SIGN_MIDSTATE,
+        NUM_SHM_OPS,
+};
+
+struct shm_request {
+        _Atomic uint64_t        seq;            /* ring sequence, see enqueue */
+        uint32_t                client;
+        uint32_t                op;
+        uint64_t                tag;            /* echoed in completion */
+        uint32_t                digest_len;     /* wanted length for midstate */
+        uint32_t                sig_len;
+        uint8_t                 digest[SHM_SIGNER_DIGEST_MAX];
+        union {
+                uint8_t                 sig[SHM_SIGNER_SIG_MAX];
+                struct sha512_midstate  midstate;
+        };
+} __attribute__((aligned(SHM_CACHELINE)));
+
+struct shm_completion {
+        uint64_t                tag;
+        int32_t                 status;         /* 0 or -errno */
+        uint32_t                sig_len;
+        uint32_t                digest_len;     /* SHM_OP_SIGN_MIDSTATE */
+        uint8_t                 digest[SHM_SIGNER_DIGEST_MAX];
+        uint8_t                 sig[SHM_SIGNER_SIG_MAX];
+} __attribute__((aligned(SHM_CACHELINE)));
+
+struct shm_client_ring {
+        _Atomic int32_t         owner;          /* pid, 0 if free */
+        _Atomic uint32_t        waiting;        /* client sleeps on futex */
+        _Atomic uint32_t        futex;          /* bumped on every completion */
+        _Atomic uint64_t        reserve;        /* request pos + 1 being claimed */
+
+        _Atomic uint64_t        tail __attribute__((aligned(SHM_CACHELINE)));
+        struct shm_completion   slot[SHM_SIGNER_CPL_SLOTS];
+} __attribute__((aligned(SHM_CACHELINE)));
+
+struct shm_signer_region {
+        uint32_t                magic;
+        uint32_t                version;
+        uint64_t                key_len;
+        _Atomic int32_t         running;
+        _Atomic int32_t         pid;            /* of the signer */
+
+        /* producer side, written by clients */
+        _Atomic uint64_t        req_tail __attribute__((aligned(SHM_CACHELINE)));
+
+        /* consumer side, written by signer */
+        uint64_t                req_head __attribute__((aligned(SHM_CACHELINE)));
+        _Atomic uint32_t        req_sleeping;
+        _Atomic uint32_t        req_futex;
+
+        struct shm_request      req[SHM_SIGNER_REQ_SLOTS];
+        struct shm_client_ring  client[SHM_SIGNER_CLIENTS];
+};
+
+struct shm_signer {
+        struct shm_signer_region *r;
+        char                    name[64];
+        uint32_t                spin;           /* adaptive spin budget */
+        uint64_t                served;
+        uint64_t                stall_ns;       /* head slot reserved, unpublished since */
+        uint64_t                reclaimed;      /* slots of dead clients skipped */
+};
+
+struct shm_signer_client {
+        struct shm_signer_region *r;
+        struct shm_client_ring  *ring;
+        uint32_t                id;
+        uint64_t                head;           /* next completion to read */
+        uint32_t                inflight;
+        uint32_t                spin;           /* adaptive spin budget */
+        uint64_t                next_tag;
+};
+
+int shm_signer_create(struct shm_signer *s, const char *name, uint64_t key_len);
+int shm_signer_serve(struct shm_signer *s, struct rsa_private *priv,
+                     struct rsa_public *pub);
+void shm_signer_stop(struct shm_signer *s);
+void shm_signer_destroy(struct shm_signer *s);
+
+int shm_signer_client_attach(struct shm_signer_client *c, const char *name);
+void shm_signer_client_detach(struct shm_signer_client *c);
+
+int shm_signer_submit(struct shm_signer_client *c, uint32_t op,
+                      const void *digest, uint32_t digest_len,
+                      const void *sig, uint32_t sig_len, uint64_t *tag);
+int shm_signer_submit_midstate(struct shm_signer_client *c,
+                               const struct sha512_midstate *ms, int bits,
+                               uint64_t *tag);
+int shm_signer_complete(struct shm_signer_client *c, struct shm_completion *cpl);
+
+int shm_signer_sign(struct shm_signer_client *c, const void *digest,
+                    uint32_t digest_len, void *sig, uint32_t *sig_len);
+int shm_signer_sign_midstate(struct shm_signer_client *c,
+                             const struct sha512_midstate *ms, int bits,
+                             void *digest, void *sig, uint32_t *sig_len);
+int shm_signer_verify(struct shm_signer_client *c, const void *digest,
+                      uint32_t digest_len, const void *sig, uint32_t sig_len);
+
+#endif //SIMPLERSADIGEST_SHM_SIGNER_H
@@ -0,0 +1,331 @@
+/**
+ * signer.c - Signing service for co-located processes over shared memory
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "rsa.h"
+#include "sha512.h"
+#include "histogram.h"
+#include "shm_signer.h"
+#include "secure_mem.h"
+
+#define SIGNER_KEY_LENGTH_DEFAULT       (2048)
+#define SIGNER_REQUESTS_DEFAULT         (10000)
+
+static struct shm_signer signer;
+
+static void signer_sig_handler(int sig)
+{
+        (void)sig;
+
+        shm_signer_stop(&signer);
+}
+
+static int signer_key_prepare(struct rsa_private *priv, struct rsa_public *pub,
+                              const char *key_file, uint64_t key_len)
+{
+        FILE *f;
+        int ret;
+
+        if (key_file) {
+                f = fopen(key_file, "r");
+                if (!f)
+                        return -errno;
+
+                ret = rsa_private_key_load(priv, f);
+                fclose(f);
+        } else {
+                fprintf(stdout, "generating %lu-bit RSA key pair...\n", key_len);
+                ret = rsa_private_key_generate(priv, key_len);
+        }
+
+        if (ret)
+                return ret;
+
+        return rsa_public_key_generate(pub, priv);
+}
+
+static const char *secure_mem_pages_name[] = {
+        [SECURE_MEM_PAGES_NORMAL]       = "normal",
+        [SECURE_MEM_PAGES_THP]          = "transparent huge",
+        [SECURE_MEM_PAGES_HUGETLB]      = "huge",
+};
+
+static int signer_serve(const char *name, const char *key_file, uint64_t key_len,
+                        int locked)
+{
+        struct secure_mem_stats stats;
+        struct rsa_private priv;
+        struct rsa_public pub;
+        struct sigaction sa;
+        int ret;
+
+        /* before any key limb is allocated */
+        if (locked) {
+                ret = secure_mem_init(SECURE_MEM_SIZE_DEFAULT,
+                                      SECURE_MEM_HUGEPAGE | SECURE_MEM_GMP);
+                if (ret) {
+                        fprintf(stderr, "failed to lock memory: %s\n", strerror(-ret));
+                        return ret;
+                }
+
+                secure_mem_stats(&stats);
+                fprintf(stdout, "locked %zu MiB on %s pages\n", stats.size >> 20,
+                        secure_mem_pages_name[stats.pages]);
+        }
+
+        rsa_private_key_init(&priv);
+        rsa_public_key_init(&pub);
+
+        ret = signer_key_prepare(&priv, &pub, key_file, key_len);
+        if (ret) {
+                fprintf(stderr, "failed to prepare key: %s\n", strerror(-ret));
+                goto clean_keys;
+        }
+
+        ret = shm_signer_create(&signer, name, priv.key_len);
+        if (ret) {
+                fprintf(stderr, "failed to create %s: %s\n", name, strerror(-ret));
+                goto clean_keys;
+        }
+
+        memset(&sa, 0x00, sizeof(sa));
+        sa.sa_handler = signer_sig_handler;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        fprintf(stdout, "serving %lu-bit key on %s\n", priv.key_len, name);
+
+        ret = shm_signer_serve(&signer, &priv, &pub);
+
+        fprintf(stdout, "served %lu requests\n", signer.served);
+        if (signer.reclaimed)
+                fprintf(stdout, "skipped %lu requests of dead clients\n",
+                        signer.reclaimed);
+
+        shm_signer_destroy(&signer);
+clean_keys:
+        rsa_public_key_clean(&pub);
+        rsa_private_key_clean(&priv);
+
+        if (locked) {
+                secure_mem_stats(&stats);
+                if (stats.fallback)
+                        fprintf(stderr, "%lu allocations did not fit locked region\n",
+                                stats.fallback);
+
+                secure_mem_exit();
+        }
+
+        return ret;
+}
+
+/**
+ * signer_request_sign() - sign request @i, digest of request in @digest
+ *
+ * Without a payload the digest itself is sent. With one, the client
+ * hashes all complete blocks of it and only ships the midstate.
+ */
+static int signer_request_sign(struct shm_signer_client *c, uint64_t i,
+                               uint8_t *payload, uint64_t payload_len,
+                               uint8_t *digest, uint8_t *sig, uint32_t *sig_len)
+{
+        uint8_t local[SHA512_HASH_BITS / 8];
+        struct sha512_midstate ms;
+        struct sha512_ctx ctx;
+        int ret;
+
+        if (!payload) {
+                sha512_buffer_process(&i, sizeof(i), digest);
+
+                return shm_signer_sign(c, digest, SHA512_HASH_BITS / 8, sig, sig_len);
+        }
+
+        memcpy(payload, &i, sizeof(i));
+
+        sha512_ctx_init(&ctx);
+        sha512_ctx_update(&ctx, payload, payload_len);
+        sha512_ctx_export(&ctx, &ms);
+
+        ret = shm_signer_sign_midstate(c, &ms, SHA512_HASH_BITS, digest, sig, sig_len);
+        if (ret)
+                return ret;
+
+        /* signer must have signed the hash of exactly this payload */
+        sha512_ctx_conclude(&ctx);
+        sha512_ctx_digest(&ctx, local);
+
+        return memcmp(local, digest, sizeof(local)) ? -EPROTO : 0;
+}
+
+/**
+ * signer_client() - sign and verify @count digests, report latency
+ */
+static int signer_client(const char *name, uint64_t count, uint64_t payload_len)
+{
+        struct shm_signer_client c;
+        struct lat_hist sign_hist, verify_hist;
+        uint8_t digest[SHA512_HASH_BITS / 8];
+        uint8_t sig[SHM_SIGNER_SIG_MAX];
+        uint8_t *payload = NULL;
+        uint32_t sig_len;
+        uint64_t t0, t1, bad = 0;
+        int ret;
+
+        if (payload_len) {
+                payload = calloc(1, payload_len < sizeof(uint64_t) ?
+                                    sizeof(uint64_t) : payload_len);
+                if (!payload)
+                        return -ENOMEM;
+
+                if (payload_len < sizeof(uint64_t))
+                        payload_len = sizeof(uint64_t);
+        }
+
+        ret = shm_signer_client_attach(&c, name);
+        if (ret) {
+                fprintf(stderr, "failed to attach %s: %s\n", name, strerror(-ret));
+                free(payload);
+                return ret;
+        }
+
+        hist_reset(&sign_hist);
+        hist_reset(&verify_hist);
+
+        for (uint64_t i = 0; i < count; ++i) {
+                t0 = clock_ns();
+                ret = signer_request_sign(&c, i, payload, payload_len, digest,
+                                          sig, &sig_len);
+                t1 = clock_ns();
+                if (ret)
+                        break;
+
+                hist_record(&sign_hist, t1 - t0);
+
+                t0 = clock_ns();
+                ret = shm_signer_verify(&c, digest, sizeof(digest), sig, sig_len);
+                t1 = clock_ns();
+                if (ret && ret != -EBADMSG)
+                        break;
+
+                bad += ret == -EBADMSG;
+                ret = 0;
+
+                hist_record(&verify_hist, t1 - t0);
+        }
+
+        shm_signer_client_detach(&c);
+        free(payload);
+
+        if (ret) {
+                fprintf(stderr, "request failed: %s\n", strerror(-ret));
+                return ret;
+        }
+
+        if (payload)
+                fprintf(stdout, "%lu octets payload, midstate signing\n", payload_len);
+
+        fprintf(stdout, "%-8s %10s %10s %10s %10s\n",
+                "op", "count", "p50 us", "p99 us", "max us");
+        fprintf(stdout, "%-8s %10lu %10.1f %10.1f %10.1f\n", "sign",
+                sign_hist.total, hist_percentile(&sign_hist, 50.0) / 1e3,
+                hist_percentile(&sign_hist, 99.0) / 1e3, sign_hist.max / 1e3);
+        fprintf(stdout, "%-8s %10lu %10.1f %10.1f %10.1f\n", "verify",
+                verify_hist.total, hist_percentile(&verify_hist, 50.0) / 1e3,
+                hist_percentile(&verify_hist, 99.0) / 1e3, verify_hist.max / 1e3);
+
+        if (bad)
+                fprintf(stdout, "%lu signatures failed to verify\n", bad);
+
+        return bad ? -EBADMSG : 0;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [options]\n"
+                "  -n name      shm object name (default %s)\n"
+                "  -k file      private key file to serve\n"
+                "  -g bits      generate key of given length (default %d)\n"
+                "  -L           latency-critical mode: keys and GMP workspace in\n"
+                "               locked, prefaulted, huge page backed memory\n"
+                "  -c count     act as client: sign and verify count digests\n"
+                "  -p bytes     client signs payloads of given size, shipping\n"
+                "               only their SHA-512 midstate to the signer\n",
+                prog, SHM_SIGNER_NAME_DEFAULT, SIGNER_KEY_LENGTH_DEFAULT);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *name = SHM_SIGNER_NAME_DEFAULT;
+        const char *key_file = NULL;
+        uint64_t key_len = SIGNER_KEY_LENGTH_DEFAULT;
+        uint64_t count = 0, payload_len = 0;
+        int locked = 0;
+        int c;
+
+        while ((c = getopt(argc, argv, "n:k:g:c:p:Lh")) != -1) {
+                switch (c) {
+                        case 'n':
+                                name = optarg;
+                                break;
+
+                        case 'k':
+                                key_file = optarg;
+                                break;
+
+                        case 'g':
+                                key_len = strtoull(optarg, NULL, 0);
+                                break;
+
+                        case 'L':
+                                locked = 1;
+                                break;
+
+                        case 'p':
+                                payload_len = strtoull(optarg, NULL, 0);
+                                break;
+
+                        case 'c':
+                                count = strtoull(optarg, NULL, 0);
+                                if (!count)
+                                        count = SIGNER_REQUESTS_DEFAULT;
+                                break;
+
+                        default:
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
+                }
+        }
+
+        if (count)
+                return signer_client(name, count, payload_len) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+        if (key_len % 16) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        return signer_serve(name, key_file, key_len, locked) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
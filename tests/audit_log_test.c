@@ -0,0 +1,260 @@
+/**
+ * audit_log_test.c - Recovery of the audit log after torn batches
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../audit_log.h"
+
+#define TEST_SINGLE                     (5)     /* one record per batch */
+#define TEST_GROUP                      (8)     /* records of last batch */
+#define TEST_DIGEST_LEN                 (64)
+#define TEST_SIG_LEN                    (256)
+#define TEST_RECORD_LEN                 (sizeof(struct audit_record_hdr) + \
+                                         TEST_DIGEST_LEN + TEST_SIG_LEN)
+
+static char dir[] = "/tmp/audit-log-XXXXXX";
+static char path[256], idx_path[256];
+
+struct appender {
+        struct audit_log        *log;
+        int                     i;
+        int                     ret;
+};
+
+static void digest_of(int i, uint8_t *digest)
+{
+        memset(digest, i + 1, TEST_DIGEST_LEN);
+}
+
+static int append_one(struct audit_log *log, int i)
+{
+        uint8_t digest[TEST_DIGEST_LEN], sig[TEST_SIG_LEN];
+
+        digest_of(i, digest);
+        memset(sig, 0x5a ^ i, sizeof(sig));
+
+        return audit_log_append(log, 1, digest, sizeof(digest), sig, sizeof(sig), NULL);
+}
+
+static void *appender_fn(void *data)
+{
+        struct appender *a = data;
+
+        a->ret = append_one(a->log, a->i);
+
+        return NULL;
+}
+
+/**
+ * log_fill() - @TEST_SINGLE batches of one record, then one batch of
+ * @TEST_GROUP records gathered within a long budget
+ */
+static int log_fill(void)
+{
+        struct audit_log_opts opts = { .budget_us = 200000 };
+        struct appender a[TEST_GROUP];
+        pthread_t t[TEST_GROUP];
+        struct audit_log log;
+        int ret;
+
+        ret = audit_log_open(&log, path, NULL);
+        if (ret)
+                return ret;
+
+        for (int i = 0; i < TEST_SINGLE && !ret; ++i)
+                ret = append_one(&log, i);
+
+        if (audit_log_close(&log) && !ret)
+                ret = -EIO;
+        if (ret)
+                return ret;
+
+        ret = audit_log_open(&log, path, &opts);
+        if (ret)
+                return ret;
+
+        for (int i = 0; i < TEST_GROUP; ++i) {
+                a[i].log = &log;
+                a[i].i = TEST_SINGLE + i;
+                pthread_create(&t[i], NULL, appender_fn, &a[i]);
+        }
+
+        for (int i = 0; i < TEST_GROUP; ++i) {
+                pthread_join(t[i], NULL);
+                if (a[i].ret && !ret)
+                        ret = a[i].ret;
+        }
+
+        if (audit_log_close(&log) && !ret)
+                ret = -EIO;
+
+        return ret;
+}
+
+static int file_write(const char *p, const uint8_t *data, size_t len)
+{
+        int fd, ret = 0;
+
+        fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+                return -errno;
+
+        if (write(fd, data, len) != (ssize_t)len)
+                ret = -EIO;
+
+        close(fd);
+        unlink(idx_path);
+
+        return ret;
+}
+
+/**
+ * log_check() - open log, expect @found of all records to be there
+ *
+ * @return 0 on success, open error as is
+ */
+static int log_check(int found, uint64_t size)
+{
+        uint8_t digest[TEST_DIGEST_LEN];
+        struct audit_record rec;
+        struct audit_log log;
+        struct stat st;
+        int ret;
+
+        ret = audit_log_open(&log, path, NULL);
+        if (ret)
+                return ret;
+
+        for (int i = 0; i < TEST_SINGLE + TEST_GROUP; ++i) {
+                digest_of(i, digest);
+                if (!audit_log_lookup(&log, digest, sizeof(digest), &rec) != (i < found)) {
+                        fprintf(stderr, "record %d %s\n", i, i < found ? "lost" : "kept");
+                        ret = -EINVAL;
+                }
+        }
+
+        if (stat(path, &st) || (uint64_t)st.st_size != size) {
+                fprintf(stderr, "log not truncated to %lu\n", size);
+                ret = -EINVAL;
+        }
+
+        /* the log goes on after recovery */
+        if (!ret)
+                ret = append_one(&log, found);
+
+        if (audit_log_close(&log) && !ret)
+                ret = -EIO;
+
+        return ret;
+}
+
+int main(void)
+{
+        struct audit_commit c;
+        struct stat st;
+        uint8_t *ref = NULL, *img = NULL;
+        uint64_t size, committed, hole;
+        int fd, ret = 1;
+
+        if (!mkdtemp(dir)) {
+                perror("mkdtemp");
+                return 1;
+        }
+
+        snprintf(path, sizeof(path), "%s/log", dir);
+        snprintf(idx_path, sizeof(idx_path), "%s/log.idx", dir);
+
+        if (log_fill()) {
+                fprintf(stderr, "failed to fill log\n");
+                goto out;
+        }
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st))
+                goto out;
+
+        size = (uint64_t)st.st_size;
+        ref = malloc(size);
+        img = malloc(size);
+        if (!ref || !img || read(fd, ref, size) != (ssize_t)size) {
+                close(fd);
+                goto out;
+        }
+        close(fd);
+
+        memcpy(&c, ref + size - sizeof(c), sizeof(c));
+        if (c.magic != AUDIT_COMMIT_MAGIC || c.batch_len < 4 * TEST_RECORD_LEN) {
+                fprintf(stderr, "last batch is not a group of records\n");
+                goto out;
+        }
+
+        committed = size - sizeof(c) - c.batch_len;
+
+        /* an early page of the last batch lost, later ones made it */
+        memcpy(img, ref, size);
+        hole = committed + 2 * TEST_RECORD_LEN + 20;
+        memset(img + hole, 0x00, 50);
+        if (file_write(path, img, size) || log_check(TEST_SINGLE, committed)) {
+                fprintf(stderr, "hole in last batch not recovered\n");
+                goto out;
+        }
+
+        /* crash while the last batch was written */
+        if (file_write(path, ref, committed + 100) || log_check(TEST_SINGLE, committed)) {
+                fprintf(stderr, "truncated tail not recovered\n");
+                goto out;
+        }
+
+        /* records written, commit record not */
+        if (file_write(path, ref, size - sizeof(c)) || log_check(TEST_SINGLE, committed)) {
+                fprintf(stderr, "batch without commit record kept\n");
+                goto out;
+        }
+
+        /* the whole log is fine */
+        if (file_write(path, ref, size) || log_check(TEST_SINGLE + TEST_GROUP, size)) {
+                fprintf(stderr, "intact log not accepted\n");
+                goto out;
+        }
+
+        /* damage to a committed batch followed by committed batches */
+        memcpy(img, ref, size);
+        memset(img + TEST_RECORD_LEN + sizeof(c) + 20, 0x00, 50);
+        if (file_write(path, img, size) || log_check(TEST_SINGLE, size) != -EBADMSG) {
+                fprintf(stderr, "damaged committed batch accepted\n");
+                goto out;
+        }
+
+        ret = 0;
+out:
+        free(ref);
+        free(img);
+        unlink(path);
+        unlink(idx_path);
+        rmdir(dir);
+
+        fprintf(stderr, "%s\n", ret ? "FAIL" : "PASS");
+
+        return ret;
+}
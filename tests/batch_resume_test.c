@@ -0,0 +1,310 @@
+/**
+ * batch_resume_test.c - Resume of a batch job from its journal
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../batch_job.h"
+#include "../misc_helper.h"
+#include "../rsa.h"
+#include "../cas.h"
+
+#define TEST_ITEMS                      (50)
+#define TEST_WINDOW                     (4)
+#define TEST_KEY_LENGTH                 (1024)
+#define TEST_TIMEOUT_SEC                (60)
+#define TEST_SIG_LEN                    (TEST_KEY_LENGTH / 8)
+#define TEST_FAILED                     (3)     /* item taken away */
+
+static char dir[] = "/tmp/batch-resume-XXXXXX";
+
+static const char *const outputs[] = { "list", "out", "out.sig", "out.journal" };
+
+static int file_slurp(const char *path, char **data, size_t *len)
+{
+        struct stat st;
+        FILE *f;
+
+        f = fopen(path, "r");
+        if (!f)
+                return -errno;
+
+        if (fstat(fileno(f), &st) || !(*data = malloc(st.st_size + 1))) {
+                fclose(f);
+                return -ENOMEM;
+        }
+
+        *len = fread(*data, 1, st.st_size, f);
+        fclose(f);
+
+        return *len == (size_t)st.st_size ? 0 : -EIO;
+}
+
+static int file_same(const char *path, const char *data, size_t len)
+{
+        char *now;
+        size_t now_len;
+        int same;
+
+        if (file_slurp(path, &now, &now_len))
+                return 0;
+
+        same = now_len == len && !memcmp(now, data, len);
+        free(now);
+
+        return same;
+}
+
+/**
+ * outputs_failed() - manifest line and signature slot of @idx are the
+ * placeholders of a failed item, every other item has its line
+ */
+static int outputs_failed(const char *out, const char *sig, int idx)
+{
+        char *manifest, *sigs, *line;
+        size_t manifest_len, sigs_len;
+        int lines = 0, ok = 0;
+
+        if (file_slurp(out, &manifest, &manifest_len))
+                return 0;
+
+        if (file_slurp(sig, &sigs, &sigs_len))
+                goto free_manifest;
+
+        manifest[manifest_len] = '\0';
+        for (line = manifest; *line; line = strchr(line, '\n') + 1, ++lines) {
+                if (lines == idx && strspn(line, "0") != CAS_HEX_LEN)
+                        goto free_sigs;
+        }
+
+        if (lines != TEST_ITEMS || sigs_len != TEST_ITEMS * TEST_SIG_LEN)
+                goto free_sigs;
+
+        ok = 1;
+        for (int i = 0; i < TEST_SIG_LEN; ++i)
+                ok &= !sigs[idx * TEST_SIG_LEN + i];
+
+free_sigs:
+        free(sigs);
+free_manifest:
+        free(manifest);
+
+        return ok;
+}
+
+/**
+ * journal_drop_ckpt() - cut the final checkpoint record off the journal
+ *
+ * Looks like a kill -9 right after the last item records were written,
+ * every item of the run is then taken over on resume.
+ */
+static int journal_drop_ckpt(const char *path)
+{
+        struct batch_journal_rec rec;
+        struct stat st;
+        FILE *f;
+        int ret = 0;
+
+        f = fopen(path, "r");
+        if (!f)
+                return -errno;
+
+        if (fstat(fileno(f), &st) ||
+            st.st_size < (off_t)(sizeof(struct batch_journal_hdr) + sizeof(rec)) ||
+            fseeko(f, st.st_size - sizeof(rec), SEEK_SET) ||
+            fread(&rec, sizeof(rec), 1, f) != 1 ||
+            rec.type != BATCH_REC_CKPT)
+                ret = -EBADMSG;
+
+        fclose(f);
+
+        if (!ret && truncate(path, st.st_size - sizeof(rec)))
+                ret = -errno;
+
+        return ret;
+}
+
+int main(void)
+{
+        struct batch_job_opts opts = { 0 };
+        struct batch_job_stats stats = { 0 };
+        struct thread_pool stopped;
+        struct rsa_private key;
+        char path[512], lst[512], out[512], sig[512], jnl[512], away[512];
+        char *manifest, *sigs;
+        size_t manifest_len, sigs_len;
+        FILE *list, *f;
+        int ret = 1;
+
+        /* a hang is the bug this test is about, fail instead */
+        alarm(TEST_TIMEOUT_SEC);
+
+        if (!mkdtemp(dir)) {
+                perror("mkdtemp");
+                return 1;
+        }
+
+        rsa_private_key_init(&key);
+        if (rsa_private_key_generate(&key, TEST_KEY_LENGTH)) {
+                fprintf(stderr, "failed to generate key\n");
+                goto clean;
+        }
+
+        snprintf(lst, sizeof(lst), "%s/list", dir);
+        list = fopen(lst, "w");
+        if (!list)
+                goto clean;
+
+        for (int i = 0; i < TEST_ITEMS; ++i) {
+                snprintf(path, sizeof(path), "%s/item-%d", dir, i);
+                f = fopen(path, "w");
+                if (!f)
+                        break;
+
+                fprintf(f, "item %d\n", i);
+                fclose(f);
+                fprintf(list, "%s\n", path);
+        }
+        fclose(list);
+
+        snprintf(out, sizeof(out), "%s/out", dir);
+        snprintf(sig, sizeof(sig), "%s/out.sig", dir);
+
+        opts.list = lst;
+        opts.out = out;
+        opts.key = &key;
+        opts.window = TEST_WINDOW;
+        opts.ckpt_items = 1000000;
+        opts.ckpt_ms = 3600000;
+
+        if (batch_job_run(&opts, &stats) || stats.hashed != TEST_ITEMS) {
+                fprintf(stderr, "first run: %lu of %d hashed\n", stats.hashed, TEST_ITEMS);
+                goto clean;
+        }
+
+        if (file_slurp(out, &manifest, &manifest_len))
+                goto clean;
+
+        if (file_slurp(sig, &sigs, &sigs_len))
+                goto free_manifest;
+
+        snprintf(jnl, sizeof(jnl), "%s/out.journal", dir);
+        if (journal_drop_ckpt(jnl)) {
+                fprintf(stderr, "journal does not end with a checkpoint\n");
+                goto free_sigs;
+        }
+
+        /* more than a window of items in a row taken over from the journal */
+        memset(&stats, 0, sizeof(stats));
+
+        if (batch_job_run(&opts, &stats)) {
+                fprintf(stderr, "resumed run failed\n");
+                goto free_sigs;
+        }
+
+        if (stats.resumed != TEST_ITEMS || stats.hashed || stats.redone) {
+                fprintf(stderr, "resumed run: %lu resumed, %lu hashed, %lu redone\n",
+                        stats.resumed, stats.hashed, stats.redone);
+                goto free_sigs;
+        }
+
+        if (!file_same(out, manifest, manifest_len) || !file_same(sig, sigs, sigs_len)) {
+                fprintf(stderr, "resumed run changed outputs\n");
+                goto free_sigs;
+        }
+
+        /* an item taken over on resume fails when it is redone */
+        snprintf(path, sizeof(path), "%s/item-%d", dir, TEST_FAILED);
+        snprintf(away, sizeof(away), "%s/away", dir);
+
+        if (journal_drop_ckpt(jnl) || rename(path, away)) {
+                fprintf(stderr, "failed to take item away\n");
+                goto free_sigs;
+        }
+
+        if (batch_job_run(&opts, &stats) || stats.failed != 1 ||
+            !outputs_failed(out, sig, TEST_FAILED)) {
+                fprintf(stderr, "failed item: %lu failed, line or slot not cleared\n",
+                        stats.failed);
+                rename(away, path);
+                goto free_sigs;
+        }
+
+        /* back again, a rerun retries it and patches its line */
+        if (rename(away, path))
+                goto free_sigs;
+
+        if (batch_job_run(&opts, &stats) || stats.retried != 1 || stats.hashed != 1 ||
+            stats.failed || stats.resumed != TEST_ITEMS - 1) {
+                fprintf(stderr, "rerun: %lu retried, %lu hashed, %lu failed\n",
+                        stats.retried, stats.hashed, stats.failed);
+                goto free_sigs;
+        }
+
+        if (!file_same(out, manifest, manifest_len) || !file_same(sig, sigs, sigs_len)) {
+                fprintf(stderr, "retried item not patched in place\n");
+                goto free_sigs;
+        }
+
+        /* a pool that does not take work fails items, never hangs */
+        if (thread_pool_init(&stopped, 1))
+                goto free_sigs;
+
+        pthread_mutex_lock(&stopped.lock);
+        stopped.stop = 1;
+        pthread_mutex_unlock(&stopped.lock);
+
+        opts.pool = &stopped;
+        opts.flags = BATCH_JOB_FRESH;
+
+        if (batch_job_run(&opts, &stats) || stats.failed != TEST_ITEMS ||
+            !outputs_failed(out, sig, TEST_FAILED)) {
+                fprintf(stderr, "stopped pool: %lu of %d failed\n", stats.failed, TEST_ITEMS);
+                thread_pool_exit(&stopped);
+                goto free_sigs;
+        }
+
+        thread_pool_exit(&stopped);
+
+        ret = 0;
+
+free_sigs:
+        free(sigs);
+free_manifest:
+        free(manifest);
+clean:
+        rsa_private_key_clean(&key);
+
+        for (int i = 0; i < TEST_ITEMS; ++i) {
+                snprintf(path, sizeof(path), "%s/item-%d", dir, i);
+                unlink(path);
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(outputs); ++i) {
+                snprintf(path, sizeof(path), "%s/%s", dir, outputs[i]);
+                unlink(path);
+        }
+        rmdir(dir);
+
+        fprintf(stderr, "%s\n", ret ? "FAIL" : "PASS");
+
+        return ret;
+}
@@ -0,0 +1,195 @@
+/**
+ * rsa_odd_key_test.c - Block sizes of keys with odd modulus bit length
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <gmp.h>
+
+#include "../rsa.h"
+#include "../sha512.h"
+
+#define TEST_KEY_LENGTH                 (2047)
+#define TEST_K                          ((TEST_KEY_LENGTH + 7) / 8)
+#define TEST_DIGEST_LEN                 (SHA512_HASH_BITS / 8)
+
+/**
+ * key_from_primes() - 2047-bit key, fixed seed
+ */
+static int key_from_primes(struct rsa_private *key)
+{
+        gmp_randstate_t rs;
+        mpz_t p, q, n;
+        int ret;
+
+        gmp_randinit_default(rs);
+        gmp_randseed_ui(rs, 2047);
+        mpz_inits(p, q, n, NULL);
+
+        do {
+                mpz_urandomb(p, rs, 1024);
+                mpz_setbit(p, 1023);
+                mpz_nextprime(p, p);
+
+                mpz_urandomb(q, rs, 1023);
+                mpz_setbit(q, 1022);
+                mpz_nextprime(q, q);
+
+                mpz_mul(n, p, q);
+        } while (mpz_sizeinbase(n, 2) != TEST_KEY_LENGTH);
+
+        ret = rsa_private_key_from_primes(key, p, q);
+
+        mpz_clears(p, q, n, NULL);
+        gmp_randclear(rs);
+
+        return ret;
+}
+
+/**
+ * sign_check() - signature must recover a k octet RFC2313 BT_01 block
+ */
+static int sign_check(struct rsa_private *priv, struct rsa_public *pub)
+{
+        uint8_t digest[TEST_DIGEST_LEN], eb[TEST_K], want[TEST_K];
+        size_t count;
+        mpz_t s, x;
+        int ret = -1;
+
+        for (size_t i = 0; i < sizeof(digest); ++i)
+                digest[i] = (uint8_t)(i * 7 + 1);
+
+        /* EB = 00 || 01 || FF ... FF || 00 || digest */
+        memset(want, 0xff, sizeof(want));
+        want[0] = 0x00;
+        want[1] = 0x01;
+        want[TEST_K - TEST_DIGEST_LEN - 1] = 0x00;
+        memcpy(&want[TEST_K - TEST_DIGEST_LEN], digest, TEST_DIGEST_LEN);
+
+        mpz_inits(s, x, NULL);
+
+        if (rsa_private_key_sign(priv, s, digest, sizeof(digest)) ||
+            rsa_public_key_verify(pub, s, digest, sizeof(digest))) {
+                fprintf(stderr, "sign/verify failed\n");
+                goto out;
+        }
+
+        mpz_powm(x, s, pub->e, pub->n);
+        count = (mpz_sizeinbase(x, 2) + 7) / 8;
+        memset(eb, 0x00, sizeof(eb));
+        mpz_export(&eb[TEST_K - count], NULL, 1, 1, 1, 0, x);
+
+        if (memcmp(eb, want, TEST_K)) {
+                fprintf(stderr, "signature block is not %d octets\n", TEST_K);
+                goto out;
+        }
+
+        ret = 0;
+out:
+        mpz_clears(s, x, NULL);
+
+        return ret;
+}
+
+/**
+ * oaep_check() - decrypt an RFC8017 SHA-512 ciphertext built by hand,
+ * then round trip through encrypt and decrypt
+ */
+static int oaep_check(struct rsa_private *priv, struct rsa_public *pub)
+{
+        static const char msg[] = "odd modulus length";
+        uint8_t em[TEST_K], mask[TEST_K], out[TEST_K];
+        struct sha512_ctx ctx;
+        uint8_t *seed = &em[1], *db = &em[1 + TEST_DIGEST_LEN];
+        uint64_t db_len = TEST_K - TEST_DIGEST_LEN - 1;
+        uint64_t len;
+        mpz_t c, x;
+        int ret = -1;
+
+        /* DB = lHash || PS || 01 || M, empty label */
+        memset(em, 0x00, sizeof(em));
+        sha512_ctx_init(&ctx);
+        sha512_ctx_conclude(&ctx);
+        sha512_ctx_digest(&ctx, db);
+
+        db[db_len - sizeof(msg) - 1] = 0x01;
+        memcpy(&db[db_len - sizeof(msg)], msg, sizeof(msg));
+
+        for (int i = 0; i < TEST_DIGEST_LEN; ++i)
+                seed[i] = (uint8_t)(0xa5 ^ i);
+
+        sha512_mgf1(seed, TEST_DIGEST_LEN, mask, db_len);
+        for (uint64_t i = 0; i < db_len; ++i)
+                db[i] ^= mask[i];
+
+        sha512_mgf1(db, db_len, mask, TEST_DIGEST_LEN);
+        for (int i = 0; i < TEST_DIGEST_LEN; ++i)
+                seed[i] ^= mask[i];
+
+        mpz_inits(c, x, NULL);
+        mpz_import(x, TEST_K, 1, 1, 1, 0, em);
+        mpz_powm(c, x, pub->e, pub->n);
+
+        len = sizeof(out);
+        if (rsa_private_key_decrypt_oaep(priv, out, &len, c, NULL, 0, SHA512_HASH_BITS) ||
+            len != sizeof(msg) || memcmp(out, msg, len)) {
+                fprintf(stderr, "RFC8017 ciphertext rejected\n");
+                goto out;
+        }
+
+        len = sizeof(out);
+        if (rsa_public_key_encrypt_oaep(pub, c, msg, sizeof(msg), NULL, 0, SHA512_HASH_BITS) ||
+            rsa_private_key_decrypt_oaep(priv, out, &len, c, NULL, 0, SHA512_HASH_BITS) ||
+            len != sizeof(msg) || memcmp(out, msg, len)) {
+                fprintf(stderr, "OAEP round trip failed\n");
+                goto out;
+        }
+
+        ret = 0;
+out:
+        mpz_clears(c, x, NULL);
+
+        return ret;
+}
+
+int main(void)
+{
+        struct rsa_private priv;
+        struct rsa_public pub;
+        int ret = 1;
+
+        rsa_private_key_init(&priv);
+        rsa_public_key_init(&pub);
+
+        if (key_from_primes(&priv) || rsa_public_key_generate(&pub, &priv)) {
+                fprintf(stderr, "failed to build key\n");
+                goto out;
+        }
+
+        if (sign_check(&priv, &pub) || oaep_check(&priv, &pub))
+                goto out;
+
+        ret = 0;
+out:
+        rsa_public_key_clean(&pub);
+        rsa_private_key_clean(&priv);
+
+        fprintf(stderr, "%s\n", ret ? "FAIL" : "PASS");
+
+        return ret;
+}
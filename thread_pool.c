@@ -0,0 +1,217 @@
+/**
+ * thread_pool.c - Shared worker pool for independent jobs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+static struct thread_pool shared_pool;
+static pthread_once_t shared_once = PTHREAD_ONCE_INIT;
+static int shared_ret;
+
+static void *thread_pool_worker(void *data)
+{
+        struct thread_pool *pool = data;
+        struct thread_pool_work *work;
+
+        pthread_mutex_lock(&pool->lock);
+
+        while (1) {
+                while (!pool->head && !pool->stop)
+                        pthread_cond_wait(&pool->cv, &pool->lock);
+
+                work = pool->head;
+                if (!work)
+                        break;
+
+                pool->head = work->next;
+                if (!pool->head)
+                        pool->tail = &pool->head;
+
+                pthread_mutex_unlock(&pool->lock);
+
+                /* work may be freed by fn() */
+                work->fn(work);
+
+                pthread_mutex_lock(&pool->lock);
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        return NULL;
+}
+
+/**
+ * thread_pool_init() - start workers
+ *
+ * @param pool: pointer to pool
+ * @param threads: worker count, 0 for online CPUs
+ * @return 0 on success
+ */
+int thread_pool_init(struct thread_pool *pool, uint32_t threads)
+{
+        uint32_t i;
+        int ret;
+
+        if (!pool || threads > THREAD_POOL_THREADS_MAX)
+                return -EINVAL;
+
+        memset(pool, 0x00, sizeof(struct thread_pool));
+
+        if (!threads)
+                threads = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+        if (!threads)
+                threads = 1;
+
+        pool->tids = calloc(threads, sizeof(pthread_t));
+        if (!pool->tids)
+                return -ENOMEM;
+
+        pool->tail = &pool->head;
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->cv, NULL);
+
+        for (i = 0; i < threads; ++i) {
+                ret = -pthread_create(&pool->tids[i], NULL, thread_pool_worker, pool);
+                if (ret) {
+                        pool->threads = i;
+                        thread_pool_exit(pool);
+                        return ret;
+                }
+        }
+
+        pool->threads = threads;
+
+        return 0;
+}
+
+/**
+ * thread_pool_exit() - run queued jobs, stop and join workers
+ *
+ * @param pool: pointer to pool
+ */
+void thread_pool_exit(struct thread_pool *pool)
+{
+        if (!pool || !pool->tids)
+                return;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->cv);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (uint32_t i = 0; i < pool->threads; ++i)
+                pthread_join(pool->tids[i], NULL);
+
+        pthread_cond_destroy(&pool->cv);
+        pthread_mutex_destroy(&pool->lock);
+
+        free(pool->tids);
+        pool->tids = NULL;
+}
+
+/**
+ * thread_pool_queue() - queue job, returns at once
+ *
+ * @param pool: pointer to pool
+ * @param work: job, owned by pool until work->fn() is called
+ * @return 0 on success
+ */
+int thread_pool_queue(struct thread_pool *pool, struct thread_pool_work *work)
+{
+        if (!pool || !work || !work->fn)
+                return -EINVAL;
+
+        work->next = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+
+        if (pool->stop) {
+                pthread_mutex_unlock(&pool->lock);
+                return -ESHUTDOWN;
+        }
+
+        *pool->tail = work;
+        pool->tail = &work->next;
+
+        pthread_cond_signal(&pool->cv);
+        pthread_mutex_unlock(&pool->lock);
+
+        return 0;
+}
+
+static void thread_pool_shared_init(void)
+{
+        shared_ret = thread_pool_init(&shared_pool, 0);
+}
+
+/**
+ * thread_pool_shared() - process wide pool, one worker per online CPU
+ *
+ * Started on first use and left running for the process lifetime,
+ * so library users do not each spawn their own set of threads.
+ *
+ * @return pointer to pool, NULL if it failed to start
+ */
+struct thread_pool *thread_pool_shared(void)
+{
+        pthread_once(&shared_once, thread_pool_shared_init);
+
+        return shared_ret ? NULL : &shared_pool;
+}
+
+void thread_pool_group_init(struct thread_pool_group *group)
+{
+        pthread_mutex_init(&group->lock, NULL);
+        pthread_cond_init(&group->cv, NULL);
+        group->pending = 0;
+}
+
+/* before queueing a job of the group */
+void thread_pool_group_add(struct thread_pool_group *group)
+{
+        pthread_mutex_lock(&group->lock);
+        group->pending++;
+        pthread_mutex_unlock(&group->lock);
+}
+
+/* last thing a job of the group does */
+void thread_pool_group_done(struct thread_pool_group *group)
+{
+        pthread_mutex_lock(&group->lock);
+        if (!--group->pending)
+                pthread_cond_broadcast(&group->cv);
+        pthread_mutex_unlock(&group->lock);
+}
+
+void thread_pool_group_wait(struct thread_pool_group *group)
+{
+        pthread_mutex_lock(&group->lock);
+        while (group->pending)
+                pthread_cond_wait(&group->cv, &group->lock);
+        pthread_mutex_unlock(&group->lock);
+}
+
+void thread_pool_group_clean(struct thread_pool_group *group)
+{
+        pthread_cond_destroy(&group->cv);
+        pthread_mutex_destroy(&group->lock);
+}
@@ -0,0 +1,67 @@
+/**
+ * thread_pool.h - Shared worker pool for independent jobs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_THREAD_POOL_H
+#define SIMPLERSADIGEST_THREAD_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Jobs are embedded in the caller's own struct and run FIFO on any
+ * worker. The pool never allocates per job; completion is up to the
+ * caller, see struct thread_pool_group for the usual wait-for-all.
+ */
+
+#define THREAD_POOL_THREADS_MAX         (256)
+
+struct thread_pool_work {
+        struct thread_pool_work *next;
+        void                    (*fn)(struct thread_pool_work *work);
+};
+
+struct thread_pool {
+        pthread_t               *tids;
+        uint32_t                threads;
+
+        pthread_mutex_t         lock;
+        pthread_cond_t          cv;
+        struct thread_pool_work *head;
+        struct thread_pool_work **tail;
+        int                     stop;
+};
+
+/* counts jobs of one submitter, thread_pool_group_wait() until all ran */
+struct thread_pool_group {
+        pthread_mutex_t         lock;
+        pthread_cond_t          cv;
+        uint64_t                pending;
+};
+
+int thread_pool_init(struct thread_pool *pool, uint32_t threads);
+void thread_pool_exit(struct thread_pool *pool);
+int thread_pool_queue(struct thread_pool *pool, struct thread_pool_work *work);
+
+struct thread_pool *thread_pool_shared(void);
+
+void thread_pool_group_init(struct thread_pool_group *group);
+void thread_pool_group_add(struct thread_pool_group *group);
+void thread_pool_group_done(struct thread_pool_group *group);
+void thread_pool_group_wait(struct thread_pool_group *group);
+void thread_pool_group_clean(struct thread_pool_group *group);
+
+#endif //SIMPLERSADIGEST_THREAD_POOL_H
@@ -0,0 +1,221 @@
+/**
+ * top_tool.c - Live view of a metrics segment
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "metrics.h"
+
+const int metrics_reader = 1;
+
+struct top_snapshot {
+        uint64_t        ns;
+        uint64_t        slots;          /* owned slots */
+        uint64_t        dropped;
+        struct metrics_op op[NUM_METRIC_OPS];
+};
+
+/**
+ * top_snapshot_take() - sum all slots of the segment
+ *
+ * Slots are written concurrently, each counter is read once with a
+ * plain load, a slot may be one update ahead in some of them
+ *
+ * @param r: read-only mapping
+ * @param snap: snapshot to fill
+ */
+static void top_snapshot_take(const struct metrics_region *r,
+                              struct top_snapshot *snap)
+{
+        memset(snap, 0x00, sizeof(struct top_snapshot));
+
+        snap->ns = clock_ns();
+        snap->dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+
+        for (uint32_t i = 0; i < METRICS_SLOTS; ++i) {
+                const struct metrics_slot *slot = &r->slot[i];
+
+                if (atomic_load_explicit(&slot->owner, memory_order_relaxed))
+                        snap->slots++;
+
+                for (uint32_t k = 0; k < NUM_METRIC_OPS; ++k) {
+                        struct metrics_op *m = &snap->op[k];
+
+                        m->ops += slot->op[k].ops;
+                        m->bytes += slot->op[k].bytes;
+                        m->errors += slot->op[k].errors;
+                        hist_merge(&m->lat, &slot->op[k].lat);
+                }
+        }
+}
+
+/**
+ * top_hist_delta() - values recorded between two snapshots
+ *
+ * Max is the top of highest bucket that moved, capped by overall max
+ *
+ * @param d: histogram of interval
+ * @param cur: later histogram
+ * @param prev: earlier histogram
+ */
+static void top_hist_delta(struct lat_hist *d, const struct lat_hist *cur,
+                           const struct lat_hist *prev)
+{
+        hist_reset(d);
+
+        for (uint32_t i = 0; i < HIST_BUCKETS; ++i) {
+                if (cur->count[i] <= prev->count[i])
+                        continue;
+
+                d->count[i] = cur->count[i] - prev->count[i];
+                d->total += d->count[i];
+                d->max = hist_bucket_value(i);
+        }
+
+        d->sum = cur->sum - prev->sum;
+
+        if (d->max > cur->max)
+                d->max = cur->max;
+}
+
+static void top_print(const struct metrics_region *r, const struct top_snapshot *cur,
+                      const struct top_snapshot *prev, int clear)
+{
+        struct lat_hist d;
+        double sec = (cur->ns - prev->ns) / 1e9;
+
+        if (clear)
+                fprintf(stdout, "\033[H\033[2J");
+
+        fprintf(stdout, "pid %lu, up %.1f s, %lu/%u threads, %lu dropped\n\n",
+                r->pid, (cur->ns - r->start_ns) / 1e9, cur->slots,
+                METRICS_SLOTS, cur->dropped);
+
+        fprintf(stdout, "%-8s %12s %10s %8s %10s %10s %10s %14s\n",
+                "op", "ops/s", "MB/s", "err/s", "p50 us", "p99 us", "max us",
+                "total");
+
+        for (uint32_t k = 0; k < NUM_METRIC_OPS; ++k) {
+                const struct metrics_op *c = &cur->op[k];
+                const struct metrics_op *p = &prev->op[k];
+
+                top_hist_delta(&d, &c->lat, &p->lat);
+
+                fprintf(stdout, "%-8s %12.1f %10.2f %8.1f %10.1f %10.1f %10.1f %14lu\n",
+                        metrics_op_name[k],
+                        (c->ops - p->ops) / sec,
+                        (c->bytes - p->bytes) / sec / 1e6,
+                        (c->errors - p->errors) / sec,
+                        hist_percentile(&d, 50.0) / 1e3,
+                        hist_percentile(&d, 99.0) / 1e3,
+                        d.max / 1e3,
+                        c->ops);
+        }
+
+        fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [-s name] [-i ms] [-n count] [-b]\n"
+                "  -s name      shm object of the process (default %s),\n"
+                "               the one given in %s\n"
+                "  -i ms        refresh interval (default 1000)\n"
+                "  -n count     exit after count refreshes\n"
+                "  -b           batch output, do not clear screen\n",
+                prog, METRICS_NAME_DEFAULT, METRICS_ENV);
+}
+
+int main(int argc, char *argv[])
+{
+        static struct top_snapshot snap[2];
+        struct metrics_region *r;
+        const char *name = METRICS_NAME_DEFAULT;
+        struct timespec ts;
+        uint64_t interval_ms = 1000;
+        uint64_t count = 0;
+        int batch = 0;
+        int ret, c;
+
+        while ((c = getopt(argc, argv, "s:i:n:bh")) != -1) {
+                switch (c) {
+                        case 's':
+                                name = optarg;
+                                break;
+
+                        case 'i':
+                                interval_ms = strtoull(optarg, NULL, 10);
+                                break;
+
+                        case 'n':
+                                count = strtoull(optarg, NULL, 10);
+                                break;
+
+                        case 'b':
+                                batch = 1;
+                                break;
+
+                        default:
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
+                }
+        }
+
+        if (!interval_ms) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        ret = metrics_attach(&r, name);
+        if (ret) {
+                fprintf(stderr, "failed to attach %s: %s\n", name, strerror(-ret));
+                return EXIT_FAILURE;
+        }
+
+        ts.tv_sec = interval_ms / 1000;
+        ts.tv_nsec = (interval_ms % 1000) * 1000000;
+
+        top_snapshot_take(r, &snap[0]);
+
+        for (uint64_t i = 0; !count || i < count; ++i) {
+                struct top_snapshot *prev = &snap[i & 1];
+                struct top_snapshot *cur = &snap[(i + 1) & 1];
+
+                nanosleep(&ts, NULL);
+
+                top_snapshot_take(r, cur);
+                top_print(r, cur, prev, !batch);
+
+                /* Segment outlives its process as long as we map it */
+                if (kill((pid_t)r->pid, 0) && errno == ESRCH) {
+                        fprintf(stdout, "process %lu exited\n", r->pid);
+                        break;
+                }
+        }
+
+        metrics_detach(r);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,449 @@
+/**
+ * trace.c - Workload trace capture
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "metrics.h"
+
+struct trace_buf {
+        struct trace_buf        *next;
+        struct trace_buf        **pprev;
+        uint32_t                len;
+        struct trace_rec        rec[TRACE_BUF_RECS];
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf *trace_bufs;            /* every thread's buffer */
+static FILE *trace_file;
+static uint64_t trace_start_ns;
+static uint64_t trace_dropped;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static int trace_key_err;
+
+static __thread struct trace_buf *trace_self;
+
+/**
+ * trace_buf_flush() - append buffered records to file
+ *
+ * Caller holds trace_lock
+ *
+ * @param buf: pointer to buffer
+ */
+static void trace_buf_flush(struct trace_buf *buf)
+{
+        if (!buf->len)
+                return;
+
+        if (!trace_file ||
+            fwrite(buf->rec, sizeof(struct trace_rec), buf->len, trace_file) != buf->len)
+                trace_dropped += buf->len;
+
+        buf->len = 0;
+}
+
+/**
+ * trace_buf_release() - flush and free buffer of an exiting thread
+ *
+ * @param data: buffer of the thread
+ */
+static void trace_buf_release(void *data)
+{
+        struct trace_buf *buf = data;
+
+        pthread_mutex_lock(&trace_lock);
+
+        trace_buf_flush(buf);
+
+        *buf->pprev = buf->next;
+        if (buf->next)
+                buf->next->pprev = buf->pprev;
+
+        pthread_mutex_unlock(&trace_lock);
+
+        free(buf);
+}
+
+/**
+ * trace_buf_get() - buffer of calling thread, allocate on first use
+ *
+ * @return buffer, NULL on allocation failure
+ */
+static struct trace_buf *trace_buf_get(void)
+{
+        struct trace_buf *buf = trace_self;
+
+        if (buf)
+                return buf;
+
+        buf = malloc(sizeof(struct trace_buf));
+        if (!buf)
+                return NULL;
+
+        buf->len = 0;
+
+        pthread_mutex_lock(&trace_lock);
+        buf->next = trace_bufs;
+        buf->pprev = &trace_bufs;
+        if (trace_bufs)
+                trace_bufs->pprev = &buf->next;
+        trace_bufs = buf;
+        pthread_mutex_unlock(&trace_lock);
+
+        pthread_setspecific(trace_key, buf);
+        trace_self = buf;
+
+        return buf;
+}
+
+/**
+ * trace_key_create() - thread exit hook, once per process
+ */
+static void trace_key_create(void)
+{
+        trace_key_err = pthread_key_create(&trace_key, trace_buf_release);
+}
+
+/**
+ * trace_file_create() - create @path, replacing a trace of a dead process
+ *
+ * RSADIGEST_TRACE is inherited by every tool started from the same
+ * environment, the first one keeps the file. The header goes out with
+ * write() right away so others can tell whose file it is; an empty one
+ * is given TRACE_INIT_TRIES / 2 rounds before it is taken as abandoned.
+ *
+ * @param path: trace file
+ * @return fd on success, -EBUSY if a live process writes it,
+ *         -EEXIST if it is not a trace file
+ */
+static int trace_file_create(const char *path)
+{
+        struct trace_hdr old;
+        ssize_t len;
+        int fd;
+
+        for (int tries = 0; ; ++tries) {
+                fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+                if (fd >= 0 || errno != EEXIST || tries == TRACE_INIT_TRIES)
+                        break;
+
+                fd = open(path, O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                        if (errno == ENOENT)
+                                continue;
+
+                        return -errno;
+                }
+
+                len = read(fd, &old, sizeof(old));
+                close(fd);
+
+                if (!len && tries < TRACE_INIT_TRIES / 2) {
+                        /* creator may not have written its header yet */
+                        usleep(TRACE_INIT_WAIT_US);
+                        continue;
+                }
+
+                if (len && (len != (ssize_t)sizeof(old) || old.magic != TRACE_MAGIC))
+                        return -EEXIST;
+
+                if (len && old.pid != (uint64_t)getpid() && pid_alive((int64_t)old.pid))
+                        return -EBUSY;
+
+                /* left by an earlier run, replaced */
+                unlink(path);
+        }
+
+        if (fd < 0)
+                return errno == EEXIST ? -EBUSY : -errno;
+
+        return fd;
+}
+
+/**
+ * trace_init() - create trace file and start capture
+ *
+ * @param path: trace file, an old trace of a process that is gone is
+ *              replaced
+ * @return 0 on success, -EBUSY if already capturing or a live process
+ *         captures to @path, -EEXIST if @path is not a trace file
+ */
+int trace_init(const char *path)
+{
+        struct trace_hdr hdr = { 0 };
+        struct timespec ts;
+        FILE *f;
+        int fd, ret = 0;
+
+        if (!path)
+                return -EINVAL;
+
+        pthread_mutex_lock(&trace_lock);
+
+        if (trace_file) {
+                ret = -EBUSY;
+                goto unlock;
+        }
+
+        if (pthread_once(&trace_key_once, trace_key_create) || trace_key_err) {
+                ret = -EAGAIN;
+                goto unlock;
+        }
+
+        fd = trace_file_create(path);
+        if (fd < 0) {
+                ret = fd;
+                goto unlock;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        trace_start_ns = clock_ns();
+
+        hdr.magic = TRACE_MAGIC;
+        hdr.version = TRACE_VERSION;
+        hdr.rec_size = sizeof(struct trace_rec);
+        hdr.pid = (uint64_t)getpid();
+        hdr.realtime_ns = (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+
+        if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+                ret = -EIO;
+                goto remove_file;
+        }
+
+        f = fdopen(fd, "wb");
+        if (!f) {
+                ret = -errno;
+                goto remove_file;
+        }
+
+        /* a big stdio buffer, each flush is one write() */
+        setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+        trace_file = f;
+        trace_dropped = 0;
+        atomic_fetch_or(&metrics_hooks, METRICS_HOOK_TRACE);
+
+        pthread_mutex_unlock(&trace_lock);
+
+        return 0;
+
+remove_file:
+        close(fd);
+        unlink(path);
+unlock:
+        pthread_mutex_unlock(&trace_lock);
+
+        return ret;
+}
+
+/**
+ * trace_exit() - stop capture, flush every thread's buffer and close
+ *
+ * Threads still inside the library may lose their last few records
+ */
+void trace_exit(void)
+{
+        atomic_fetch_and(&metrics_hooks, ~METRICS_HOOK_TRACE);
+
+        pthread_mutex_lock(&trace_lock);
+
+        if (!trace_file)
+                goto unlock;
+
+        for (struct trace_buf *buf = trace_bufs; buf; buf = buf->next)
+                trace_buf_flush(buf);
+
+        if (trace_dropped)
+                fprintf(stderr, "trace: %lu records dropped\n", trace_dropped);
+
+        fclose(trace_file);
+        trace_file = NULL;
+
+unlock:
+        pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * trace_key_id() - public identity of a key
+ *
+ * Low limb of the modulus: free to compute, and as good as random for
+ * moduli of distinct keys
+ *
+ * @param n: modulus
+ * @return key id, 0 for NULL
+ */
+uint64_t trace_key_id(mpz_srcptr n)
+{
+        if (!n || !mpz_size(n))
+                return 0;
+
+        return (uint64_t)mpz_getlimbn(n, 0);
+}
+
+/**
+ * trace_record() - capture @n calls started at @t0, from metrics hook
+ *
+ * A batch becomes @n records with the same start, the first @errors
+ * of them flagged failed
+ *
+ * @param op: METRIC_*
+ * @param t0: clock_ns() before the calls
+ * @param key: modulus of key used, NULL for hash
+ * @param n: number of calls
+ * @param bytes: octets processed by all calls
+ * @param errors: failed calls
+ */
+void trace_record(uint32_t op, uint64_t t0, mpz_srcptr key, uint64_t n,
+                  uint64_t bytes, uint64_t errors)
+{
+        struct trace_buf *buf = trace_buf_get();
+        struct trace_rec *rec;
+        uint64_t key_id = trace_key_id(key);
+        uint16_t key_bits = key ? (uint16_t)mpz_sizeinbase(key, 2) : 0;
+
+        if (!buf)
+                return;
+
+        for (uint64_t i = 0; i < n; ++i) {
+                if (buf->len == TRACE_BUF_RECS) {
+                        pthread_mutex_lock(&trace_lock);
+                        trace_buf_flush(buf);
+                        pthread_mutex_unlock(&trace_lock);
+                }
+
+                rec = &buf->rec[buf->len++];
+                rec->t_ns = t0 > trace_start_ns ? t0 - trace_start_ns : 0;
+                rec->key_id = key_id;
+                rec->bytes = (uint32_t)(bytes / n);
+                rec->key_bits = key_bits;
+                rec->op = (uint8_t)op;
+                rec->flags = i < errors ? TRACE_ERR : 0;
+        }
+}
+
+static int trace_rec_cmp(const void *a, const void *b)
+{
+        const struct trace_rec *x = a;
+        const struct trace_rec *y = b;
+
+        return (x->t_ns > y->t_ns) - (x->t_ns < y->t_ns);
+}
+
+/**
+ * trace_load() - read a whole trace, sorted by start time
+ *
+ * @param path: trace file
+ * @param hdr: header to fill
+ * @param recs: pointer to save record array, free() by caller
+ * @param count: pointer to save record count
+ * @return 0 on success, -EPROTO if it is not a trace file
+ */
+int trace_load(const char *path, struct trace_hdr *hdr, struct trace_rec **recs,
+               uint64_t *count)
+{
+        struct trace_rec *r;
+        struct stat st;
+        uint64_t n;
+        FILE *f;
+        int ret = 0;
+
+        if (!path || !hdr || !recs || !count)
+                return -EINVAL;
+
+        f = fopen(path, "rb");
+        if (!f)
+                return -errno;
+
+        if (fstat(fileno(f), &st)) {
+                ret = -errno;
+                goto close_file;
+        }
+
+        if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != TRACE_MAGIC ||
+            hdr->version != TRACE_VERSION ||
+            hdr->rec_size != sizeof(struct trace_rec)) {
+                ret = -EPROTO;
+                goto close_file;
+        }
+
+        /* a torn last record of a crashed process is left out */
+        n = ((uint64_t)st.st_size - sizeof(*hdr)) / sizeof(struct trace_rec);
+
+        r = malloc((n ? n : 1) * sizeof(struct trace_rec));
+        if (!r) {
+                ret = -ENOMEM;
+                goto close_file;
+        }
+
+        if (fread(r, sizeof(struct trace_rec), n, f) != n) {
+                free(r);
+                ret = -EIO;
+                goto close_file;
+        }
+
+        qsort(r, n, sizeof(struct trace_rec), trace_rec_cmp);
+
+        *recs = r;
+        *count = n;
+
+close_file:
+        fclose(f);
+
+        return ret;
+}
+
+/**
+ * trace_env_init() - start capture if RSADIGEST_TRACE is set
+ *
+ * e.g. RSADIGEST_TRACE=signer.trace rsadigest-signer -k priv.key
+ */
+static void __attribute__((constructor)) trace_env_init(void)
+{
+        const char *path = getenv(TRACE_ENV);
+        int ret;
+
+        if (!path || !path[0])
+                return;
+
+        /* readers inherit the variable too, the file is their input */
+        if (&trace_reader && trace_reader)
+                return;
+
+        ret = trace_init(path);
+        if (ret == -EBUSY) {
+                fprintf(stderr, "trace: %s is in use by another process\n", path);
+                return;
+        }
+
+        if (ret) {
+                fprintf(stderr, "trace: failed to create %s: %s\n",
+                        path, strerror(-ret));
+                return;
+        }
+
+        atexit(trace_exit);
+}
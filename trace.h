@@ -0,0 +1,85 @@
+/**
+ * trace.h - Workload trace capture
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMPLERSADIGEST_TRACE_H
+#define SIMPLERSADIGEST_TRACE_H
+
+#include <stdint.h>
+#include <gmp.h>
+
+/**
+ * Off unless trace_init() is called or RSADIGEST_TRACE names a file at
+ * startup, then every call seen by the metrics hooks (metrics.h) is
+ * appended as one fixed size record: what ran, on which key, how many
+ * octets and when it started. Nothing secret is kept, a key is known
+ * by the low 64 bits of its public modulus.
+ *
+ * Records go to a per-thread buffer first, the file lock is taken once
+ * per TRACE_BUF_RECS calls. Blocks of different threads interleave in
+ * the file, trace_load() puts records back in start order.
+ *
+ * File: struct trace_hdr, then struct trace_rec until EOF.
+ */
+
+#define TRACE_MAGIC                     (0x4543415254445352ULL)        /* RSDTRACE */
+#define TRACE_VERSION                   (1)
+#define TRACE_ENV                       "RSADIGEST_TRACE"
+#define TRACE_BUF_RECS                  (4096)
+#define TRACE_INIT_TRIES                (100)   /* create/inspect rounds */
+#define TRACE_INIT_WAIT_US              (1000)  /* for a creator's header */
+
+enum {
+        TRACE_ERR               = (1 << 0),     /* call failed */
+};
+
+struct trace_hdr {
+        uint64_t        magic;
+        uint32_t        version;
+        uint32_t        rec_size;
+        uint64_t        pid;
+        uint64_t        realtime_ns;    /* wall clock at t_ns 0 */
+};
+
+struct trace_rec {
+        uint64_t        t_ns;           /* start, since trace_init() */
+        uint64_t        key_id;         /* trace_key_id(), 0 for hash */
+        uint32_t        bytes;          /* payload, digest or key octets */
+        uint16_t        key_bits;       /* modulus bits, 0 for hash */
+        uint8_t         op;             /* METRIC_* */
+        uint8_t         flags;          /* TRACE_* */
+};
+
+_Static_assert(sizeof(struct trace_hdr) == 32, "trace header layout");
+_Static_assert(sizeof(struct trace_rec) == 24, "trace record layout");
+
+/*
+ * Defined non-zero by tools that read traces, keeps the RSADIGEST_TRACE
+ * hook from overwriting the file they are about to load
+ */
+extern const int trace_reader __attribute__((weak));
+
+int trace_init(const char *path);
+void trace_exit(void);
+
+uint64_t trace_key_id(mpz_srcptr n);
+void trace_record(uint32_t op, uint64_t t0, mpz_srcptr key, uint64_t n,
+                  uint64_t bytes, uint64_t errors);
+
+int trace_load(const char *path, struct trace_hdr *hdr, struct trace_rec **recs,
+               uint64_t *count);
+
+#endif //SIMPLERSADIGEST_TRACE_H